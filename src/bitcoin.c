@@ -9,6 +9,7 @@
 
 #include "config.h"
 
+#include <ctype.h>
 #include <string.h>
 
 #include "ckpool.h"
@@ -92,12 +93,273 @@ out:
 	return ret;
 }
 
+/* Decode a span of hex that isn't null terminated where the binary ends */
+static bool hexspan2bin(uchar *p, const char *hex, int len)
+{
+	while (len--) {
+		int nibble1 = hex2bin_tbl[(uchar)*hex++];
+		int nibble2 = hex2bin_tbl[(uchar)*hex++];
+
+		if (unlikely(nibble1 < 0 || nibble2 < 0))
+			return false;
+		*p++ = (nibble1 << 4) | nibble2;
+	}
+	return true;
+}
+
+/* Append a transaction to the binary forms stored in the gbtbase, decoding
+ * it from spans of the hex in a larger buffer. The txid and hash are 64
+ * characters of hex, either of which may stand in for the other when
+ * missing. */
+static bool add_gbt_txn(gbtbase_t *gbt, const char *data, const int datalen, const char *txid,
+			const char *hash)
+{
+	int n = gbt->txns, ofs, len = datalen / 2;
+	uchar binswap[32];
+
+	if (!txid)
+		txid = hash;
+	if (!hash)
+		hash = txid;
+	if (unlikely(!data || !txid || datalen % 2)) {
+		LOGWARNING("Missing data or txid for transaction %d in template", n);
+		return false;
+	}
+	if (n + 1 >= gbt->txn_slots) {
+		gbt->txn_slots = gbt->txn_slots ? gbt->txn_slots * 2 : 256;
+		gbt->txn_hashes = realloc(gbt->txn_hashes, gbt->txn_slots * 65 + 1);
+		gbt->txidbin = realloc(gbt->txidbin, gbt->txn_slots * 32);
+		gbt->wtxidbin = realloc(gbt->wtxidbin, gbt->txn_slots * 32);
+		gbt->txn_ofs = realloc(gbt->txn_ofs, (gbt->txn_slots + 1) * sizeof(int));
+		if (unlikely(!gbt->txn_hashes || !gbt->txidbin || !gbt->wtxidbin || !gbt->txn_ofs))
+			quit(1, "Failed to realloc template for %d transactions", gbt->txn_slots);
+		if (!n)
+			gbt->txn_ofs[0] = 0;
+	}
+	ofs = gbt->txn_ofs[n];
+	if (ofs + len > gbt->txn_datasize) {
+		while (ofs + len > gbt->txn_datasize)
+			gbt->txn_datasize = gbt->txn_datasize ? gbt->txn_datasize * 2 : PAGESIZE;
+		gbt->txn_data = realloc(gbt->txn_data, gbt->txn_datasize);
+		if (unlikely(!gbt->txn_data))
+			quit(1, "Failed to realloc template data of size %d", gbt->txn_datasize);
+	}
+
+	if (unlikely(!hexspan2bin(binswap, txid, 32))) {
+		LOGWARNING("Failed to decode txid of transaction %d in template", n);
+		return false;
+	}
+	bswap_256(gbt->txidbin + n * 32, binswap);
+	memcpy(gbt->txn_hashes + n * 65, txid, 64);
+	gbt->txn_hashes[n * 65 + 64] = ' ';
+	gbt->txn_hashes[n * 65 + 65] = '\0';
+
+	if (unlikely(!hexspan2bin(binswap, hash, 32))) {
+		LOGWARNING("Failed to decode hash of transaction %d in template", n);
+		return false;
+	}
+	bswap_256(gbt->wtxidbin + n * 32, binswap);
+
+	if (unlikely(!hexspan2bin(gbt->txn_data + ofs, data, len))) {
+		LOGWARNING("Failed to decode data of transaction %d in template", n);
+		return false;
+	}
+	gbt->txn_ofs[n + 1] = ofs + len;
+	gbt->txns++;
+	return true;
+}
+
+void clear_gbt_txns(gbtbase_t *gbt)
+{
+	dealloc(gbt->txn_data);
+	dealloc(gbt->txn_hashes);
+	dealloc(gbt->txidbin);
+	dealloc(gbt->wtxidbin);
+	dealloc(gbt->txn_ofs);
+	gbt->txns = gbt->txn_slots = gbt->txn_datasize = 0;
+}
+
+/* State for decoding the transactions of a getblocktemplate response while it
+ * is still arriving, kept as offsets since the buffer may move between calls */
+typedef struct gbt_stream {
+	gbtbase_t *gbt;
+	int ofs; // How far into the body we've decoded
+	int start; // Where the transactions array contents start
+	bool found; // Found the transactions array
+	bool done; // Decoded the whole array
+	bool failed;
+} gbt_stream_t;
+
+static const char *skip_space(const char *p, const char *end)
+{
+	while (p < end && isspace(*p))
+		p++;
+	return p;
+}
+
+/* Find the end of the json value starting at p, returning a pointer past its
+ * closing quote or bracket, or to the delimiter following a plain value, or
+ * NULL if it isn't all in the buffer yet. */
+static const char *value_end(const char *p, const char *end)
+{
+	bool instring = false;
+	int depth = 0;
+
+	if (*p != '"' && *p != '{' && *p != '[') {
+		while (p < end && *p != ',' && *p != '}' && *p != ']' && !isspace(*p))
+			p++;
+		return p < end ? p : NULL;
+	}
+	for (; p < end; p++) {
+		if (instring) {
+			if (*p == '\\')
+				p++;
+			else if (*p == '"') {
+				instring = false;
+				if (!depth)
+					return p + 1;
+			}
+		} else if (*p == '"')
+			instring = true;
+		else if (*p == '{' || *p == '[')
+			depth++;
+		else if ((*p == '}' || *p == ']') && !--depth)
+			return p + 1;
+	}
+	return NULL;
+}
+
+/* Decode one complete transaction object, only looking at its data, txid and
+ * hash members */
+static bool decode_txn(gbtbase_t *gbt, const char *p, const char *end)
+{
+	const char *data = NULL, *txid = NULL, *hash = NULL;
+	int datalen = 0;
+
+	p++;
+	while (42) {
+		const char *key, *val, *valend;
+		int keylen;
+
+		p = skip_space(p, end);
+		if (*p == '}')
+			break;
+		if (*p == ',') {
+			p++;
+			continue;
+		}
+		if (*p != '"')
+			return false;
+		key = p + 1;
+		p = value_end(p, end);
+		if (!p)
+			return false;
+		keylen = p - 1 - key;
+		p = skip_space(p, end);
+		if (*p++ != ':')
+			return false;
+		val = skip_space(p, end);
+		valend = value_end(val, end);
+		if (!valend)
+			return false;
+		p = valend;
+		if (*val != '"')
+			continue;
+		if (keylen == 4 && !memcmp(key, "data", 4)) {
+			data = val + 1;
+			datalen = valend - 1 - data;
+		} else if (valend - val - 2 != 64)
+			continue;
+		else if (keylen == 4 && !memcmp(key, "txid", 4))
+			txid = val + 1;
+		else if (keylen == 4 && !memcmp(key, "hash", 4))
+			hash = val + 1;
+	}
+	return add_gbt_txn(gbt, data, datalen, txid, hash);
+}
+
+/* Decode transactions out of the response as they arrive, so that work on the
+ * largest part of the template overlaps receiving it. Once the response is
+ * complete the array contents are cut out so the json decoder never sees them. */
+static void gbt_stream(void *arg, char *body, const int len, const bool complete)
+{
+	gbt_stream_t *gs = arg;
+	const char *end = body + len, *p;
+
+	if (gs->done || gs->failed)
+		goto out;
+	if (!gs->found) {
+		p = memmem(body + gs->ofs, len - gs->ofs, "\"transactions\"", 14);
+		if (!p) {
+			/* The key may be split across reads */
+			if (len - gs->ofs > 14)
+				gs->ofs = len - 14;
+			goto out;
+		}
+		gs->ofs = p - body;
+		p = skip_space(p + 14, end);
+		if (p == end)
+			goto out;
+		if (*p++ != ':') {
+			gs->failed = true;
+			goto out;
+		}
+		p = skip_space(p, end);
+		if (p == end)
+			goto out;
+		if (*p++ != '[') {
+			gs->failed = true;
+			goto out;
+		}
+		gs->found = true;
+		gs->ofs = gs->start = p - body;
+	}
+	while (42) {
+		const char *txnend;
+
+		p = skip_space(body + gs->ofs, end);
+		if (p < end && *p == ',')
+			p = skip_space(p + 1, end);
+		gs->ofs = p - body;
+		if (p == end)
+			break;
+		if (*p == ']') {
+			gs->done = true;
+			break;
+		}
+		if (*p != '{') {
+			gs->failed = true;
+			break;
+		}
+		txnend = value_end(p, end);
+		if (!txnend)
+			break;
+		if (!decode_txn(gs->gbt, p, txnend)) {
+			gs->failed = true;
+			break;
+		}
+		gs->ofs = txnend - body;
+	}
+out:
+	if (!complete)
+		return;
+	/* Cut the decoded transactions out, leaving an empty array */
+	if (gs->done && gs->found)
+		memmove(body + gs->start, body + gs->ofs, len - gs->ofs + 1);
+	/* A template without a transactions array has none */
+	else if (!gs->found && !gs->failed)
+		gs->done = true;
+}
+
 static const char *gbt_req = "{\"method\": \"getblocktemplate\", \"params\": [{\"capabilities\": [\"coinbasetxn\", \"workid\", \"coinbase/append\"], \"rules\" : [\"segwit\"]}]}\n";
 
-/* Request getblocktemplate from bitcoind already connected with a connsock_t
- * and then summarise the information to the most efficient set of data
- * required to assemble a mining template, storing it in a gbtbase_t structure */
-bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
+/* Issue a getblocktemplate request to bitcoind, decoding the transactions as
+ * they stream in, and then summarise the information to the most efficient
+ * set of data required to assemble a mining template, storing it in a
+ * gbtbase_t structure. A long poll is given a timeout and only logs failures
+ * as information since it is expected to time out. */
+static bool decode_gbtbase(connsock_t *cs, const char *rpc_req, const float timeout,
+			   gbtbase_t *gbt)
 {
 	json_t *rules_array, *coinbase_aux, *res_val, *val;
 	const char *previousblockhash;
@@ -106,6 +368,7 @@ bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 	const char *target;
 	const char *flags;
 	const char *bits;
+	gbt_stream_t gs = {};
 	const char *rule;
 	int version;
 	int curtime;
@@ -113,10 +376,22 @@ bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 	int i;
 	bool ret = false;
 
-	val = json_rpc_call(cs, gbt_req);
+	gs.gbt = gbt;
+	if (timeout)
+		val = json_rpc_longpoll(cs, rpc_req, timeout, gbt_stream, &gs);
+	else
+		val = json_rpc_stream(cs, rpc_req, gbt_stream, &gs);
 	if (!val) {
-		LOGWARNING("%s:%s Failed to get valid json response to getblocktemplate", cs->url, cs->port);
-		return ret;
+		if (timeout) {
+			LOGINFO("%s:%s Failed to get valid json response to getblocktemplate long poll",
+				cs->url, cs->port);
+		} else
+			LOGWARNING("%s:%s Failed to get valid json response to getblocktemplate", cs->url, cs->port);
+		goto out;
+	}
+	if (unlikely(gs.failed || !gs.done)) {
+		LOGWARNING("Failed to decode transactions in getblocktemplate");
+		goto out;
 	}
 	res_val = json_object_get(val, "result");
 	if (!res_val) {
@@ -188,15 +463,29 @@ bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 
 	gbt->flags = strdup(flags);
 
+	if (!gbt->txns)
+		gbt->txn_hashes = ckzalloc(1);
+
 	ret = true;
 out:
-	json_decref(val);
+	if (!ret)
+		clear_gbt_txns(gbt);
+	if (val)
+		json_decref(val);
 	return ret;
 }
 
+/* Request getblocktemplate from bitcoind already connected with a connsock_t
+ * and summarise it in a gbtbase_t structure */
+bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
+{
+	return decode_gbtbase(cs, gbt_req, 0, gbt);
+}
+
 void clear_gbtbase(gbtbase_t *gbt)
 {
 	free(gbt->flags);
+	clear_gbt_txns(gbt);
 	if (gbt->json)
 		json_decref(gbt->json);
 	memset(gbt, 0, sizeof(gbtbase_t));
@@ -227,6 +516,60 @@ out:
 	return ret;
 }
 
+/* Request getblockheader from bitcoind for hash, returning the height of the
+ * block or -1 if the call fails. */
+int get_blockheight(connsock_t *cs, const char *hash)
+{
+	json_t *val, *res_val;
+	char rpc_req[128];
+	int ret = -1;
+
+	sprintf(rpc_req, "{\"method\": \"getblockheader\", \"params\": [\"%.64s\"]}\n", hash);
+	val = json_rpc_call(cs, rpc_req);
+	if (!val) {
+		LOGWARNING("%s:%s Failed to get valid json response to getblockheader", cs->url, cs->port);
+		return ret;
+	}
+	res_val = json_object_get(json_object_get(val, "result"), "height");
+	if (!json_is_integer(res_val)) {
+		LOGWARNING("Failed to get height in json response to getblockheader");
+		goto out;
+	}
+	ret = json_integer_value(res_val);
+out:
+	json_decref(val);
+	return ret;
+}
+
+static const char *blockchaininfo_req = "{\"method\": \"getblockchaininfo\"}\n";
+
+/* Request getblockchaininfo from bitcoind, writing the name of the network it
+ * is on, eg main, test or regtest, into *chain which should be at least 16
+ * bytes long. */
+bool get_chain(connsock_t *cs, char *chain)
+{
+	json_t *val, *res_val;
+	const char *res_ret;
+	bool ret = false;
+
+	val = json_rpc_call(cs, blockchaininfo_req);
+	if (!val) {
+		LOGWARNING("%s:%s Failed to get valid json response to getblockchaininfo", cs->url, cs->port);
+		return ret;
+	}
+	res_val = json_object_get(json_object_get(val, "result"), "chain");
+	res_ret = json_string_value(res_val);
+	if (!res_ret || !strlen(res_ret)) {
+		LOGWARNING("Failed to get chain in json response to getblockchaininfo");
+		goto out;
+	}
+	snprintf(chain, 16, "%s", res_ret);
+	ret = true;
+out:
+	json_decref(val);
+	return ret;
+}
+
 /* Request getblockhash from bitcoind for height, writing the value into *hash
  * which should be at least 65 bytes long since the hash is 64 chars. */
 bool get_blockhash(connsock_t *cs, int height, char *hash)
@@ -259,6 +602,39 @@ out:
 	return ret;
 }
 
+/* Issue a getblocktemplate long poll to bitcoind which only returns once the
+ * template has changed from the one longpollid refers to, or at once with an
+ * empty longpollid. The template it returns is summarised in gbt the same way
+ * gen_gbtbase does so it can be used as is on a new block, and the new
+ * longpollid is stored. */
+bool get_longpoll(connsock_t *cs, char *longpollid, gbtbase_t *gbt)
+{
+	const char *res_ret;
+	char rpc_req[512];
+
+	snprintf(rpc_req, 512, "{\"method\": \"getblocktemplate\", \"params\": [{\"capabilities\": "
+		 "[\"coinbasetxn\", \"workid\", \"coinbase/append\", \"longpoll\"], \"rules\" : "
+		 "[\"segwit\"]%s%s%s}]}\n", *longpollid ? ", \"longpollid\": \"" : "",
+		 longpollid, *longpollid ? "\"" : "");
+	if (!decode_gbtbase(cs, rpc_req, LONGPOLL_TIMEOUT, gbt))
+		return false;
+	res_ret = json_string_value(json_object_get(gbt->json, "longpollid"));
+	if (!res_ret || !strlen(res_ret) || strlen(res_ret) >= LONGPOLLID_LEN) {
+		LOGWARNING("No valid longpollid in getblocktemplate, bitcoind does not support long polls");
+		goto out_clear;
+	}
+	strcpy(longpollid, res_ret);
+	res_ret = json_string_value(json_object_get(gbt->json, "previousblockhash"));
+	if (!res_ret || strlen(res_ret) != 64) {
+		LOGWARNING("No valid previousblockhash in getblocktemplate long poll");
+		goto out_clear;
+	}
+	return true;
+out_clear:
+	clear_gbtbase(gbt);
+	return false;
+}
+
 static const char *bestblockhash_req = "{\"method\": \"getbestblockhash\"}\n";
 
 /* Request getbestblockhash from bitcoind. bitcoind 0.9+ only */
@@ -12,12 +12,18 @@
 
 typedef struct genwork gbtbase_t;
 
+#define LONGPOLLID_LEN 128
+
 bool validate_address(connsock_t *cs, const char *address);
+void clear_gbt_txns(gbtbase_t *gbt);
 bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt);
 void clear_gbtbase(gbtbase_t *gbt);
 int get_blockcount(connsock_t *cs);
 bool get_blockhash(connsock_t *cs, int height, char *hash);
+int get_blockheight(connsock_t *cs, const char *hash);
+bool get_chain(connsock_t *cs, char *chain);
 bool get_bestblockhash(connsock_t *cs, char *hash);
+bool get_longpoll(connsock_t *cs, char *longpollid, gbtbase_t *gbt);
 bool submit_block(connsock_t *cs, const char *params);
 void precious_block(connsock_t *cs, const char *params);
 void submit_txn(connsock_t *cs, const char *params);
@@ -425,6 +425,8 @@ static double sock_us[MAXSOCK], sock_recv_us[MAXSOCK];
 static double sock_lock_wq_us[MAXSOCK], sock_lock_br_us[MAXSOCK];
 static uint64_t sock_proc_early[MAXSOCK], sock_processed[MAXSOCK];
 static uint64_t sock_acc[MAXSOCK], sock_recv[MAXSOCK];
+static uint64_t sock_batches[MAXSOCK], sock_batched[MAXSOCK];
+static uint64_t sock_batch_dups[MAXSOCK];
 // breaker() summarised
 static tv_t break_reload_stt, break_cmd_stt, break_reload_fin;
 static uint64_t break_reload_processed, break_cmd_processed;
@@ -962,6 +964,9 @@ static char *listener_base = "listener";
 static char *process_name = "main";
 static char logname_db[512];
 static char logname_io[512];
+// Only the logger thread writes to these, so they don't need flock
+static rotating_file_t *logfile_db;
+static rotating_file_t *logfile_io;
 static char *dbcode;
 static bool no_data_log = false;
 
@@ -1253,29 +1258,6 @@ static char *hour_filename(const char *path, const char *name, time_t when)
 	return filename;
 }
 
-// low spec version of rotating_log() - no locking
-static bool rotating_log_nolock(char *msg, char *prefix)
-{
-	char *filename;
-	FILE *fp;
-	bool ok = false;
-
-	filename = rotating_filename(prefix, time(NULL));
-	fp = fopen(filename, "a+e");
-	if (unlikely(!fp)) {
-		LOGERR("Failed to fopen %s in rotating_log!", filename);
-		goto stageleft;
-	}
-	fprintf(fp, "%s\n", msg);
-	fclose(fp);
-	ok = true;
-
-stageleft:
-	free(filename);
-
-	return ok;
-}
-
 static void log_queue_message(char *msg, bool db)
 {
 	K_ITEM *lq_item;
@@ -1392,7 +1374,8 @@ void status_report(tv_t *now, bool showseq)
 		LOGWARNING(" %s sock: t%fs sock t%fs/t%"PRIu64"/av%fs"
 			   " recv t%fs/t%"PRIu64"/av%fs"
 			   " lckw t%fs/t%"PRIu64"/av%fs"
-			   " lckb t%fs/t%"PRIu64"/av%fs",
+			   " lckb t%fs/t%"PRIu64"/av%fs"
+			   " batch t%"PRIu64"/t%"PRIu64"/d%"PRIu64,
 			   SOCKNAME(i), tvdiff(now, &(sock_stt[i])),
 			   sock_us[i]/1000000, sock_acc[i],
 			   (sock_us[i]/count1)/1000000,
@@ -1401,7 +1384,9 @@ void status_report(tv_t *now, bool showseq)
 			   sock_lock_wq_us[i]/1000000, sock_proc_early[i],
 			   (sock_lock_wq_us[i]/count3)/1000000,
 			   sock_lock_br_us[i]/1000000, sock_processed[i],
-			   (sock_lock_br_us[i]/count4)/1000000);
+			   (sock_lock_br_us[i]/count4)/1000000,
+			   sock_batches[i], sock_batched[i],
+			   sock_batch_dups[i]);
 	}
 
 	if (!break_reload_stt.tv_sec)
@@ -1585,6 +1570,118 @@ tamanee:
 	}
 }
 
+/* A persistent connection from ckpool that sends batches of messages as
+ *  frames, each starting with a CKDB_BATCH header line followed by one
+ *  message per line
+ * It stays open until ckpool closes it and every batch has been replied to */
+typedef struct poolchan {
+	int sockd;
+	int refs;
+	mutex_t lock;
+} POOLCHAN;
+
+/* The replies to a batch frame, sent back as one frame with the same header
+ *  line and one reply per line once every message in it has been replied to
+ * Replies are in the order they complete, not the order of the messages */
+typedef struct poolbatch {
+	POOLCHAN *chan;
+	char *reply;
+	size_t len, siz;
+	int remaining;
+} POOLBATCH;
+
+#define MAX_POOLCHANS 8
+
+/* The last batch sequence seen from each pool by name on each socket
+ * ckpool starts its sequences from its start time so they only ever rise,
+ *  and resends every unreplied batch when it reconnects, so a batch at or
+ *  below the last one seen has already been queued and is only replied to */
+typedef struct poolseq {
+	char name[64];
+	int64_t seq;
+} POOLSEQ;
+
+#define MAX_POOLSEQS 16
+
+static POOLSEQ pool_seqs[MAXSOCK][MAX_POOLSEQS];
+static int pool_seqs_count[MAXSOCK];
+
+// Only called by the sockrun thread of thissock
+static bool batch_seen(int thissock, char *header)
+{
+	POOLSEQ *ps = NULL;
+	const char *name;
+	int64_t seq;
+	int ofs = 0, i;
+
+	if (sscanf(header, CKDB_BATCH "%"SCNd64".%n", &seq, &ofs) < 1)
+		return false;
+	name = ofs ? header + ofs : EMPTY;
+	for (i = 0; i < pool_seqs_count[thissock]; i++) {
+		if (strncmp(pool_seqs[thissock][i].name, name,
+			    sizeof(pool_seqs[thissock][i].name) - 1) == 0) {
+			ps = &(pool_seqs[thissock][i]);
+			break;
+		}
+	}
+	if (!ps) {
+		if (pool_seqs_count[thissock] >= MAX_POOLSEQS) {
+			LOGERR("%s() Too many pools to track batches from '%s'",
+			       __func__, name);
+			return false;
+		}
+		ps = &(pool_seqs[thissock][pool_seqs_count[thissock]++]);
+		STRNCPY(ps->name, name);
+	} else if (seq <= ps->seq)
+		return true;
+	ps->seq = seq;
+	return false;
+}
+
+static void poolchan_put(POOLCHAN *chan)
+{
+	int refs;
+
+	mutex_lock(&(chan->lock));
+	refs = --(chan->refs);
+	mutex_unlock(&(chan->lock));
+	if (refs == 0) {
+		close(chan->sockd);
+		mutex_destroy(&(chan->lock));
+		free(chan);
+	}
+}
+
+static void _batch_reply(POOLBATCH *batch, char *msg, bool dup, WHERE_FFL_ARGS)
+{
+	POOLCHAN *chan = batch->chan;
+	size_t len = strlen(msg);
+	bool done;
+
+	mutex_lock(&(chan->lock));
+	if (batch->len + len + 2 > batch->siz) {
+		batch->siz = batch->len + len + 2 + 4096;
+		batch->reply = realloc(batch->reply, batch->siz);
+		if (!batch->reply)
+			quithere(1, "realloc (%d) OOM", (int)(batch->siz));
+	}
+	batch->reply[batch->len++] = '\n';
+	memcpy(batch->reply + batch->len, msg, len + 1);
+	batch->len += len;
+	done = (--(batch->remaining) == 0);
+	if (done)
+		_ckdb_unix_send(chan->sockd, batch->reply, WHERE_FFL_PASS);
+	mutex_unlock(&(chan->lock));
+
+	if (!dup)
+		free(msg);
+	if (done) {
+		free(batch->reply);
+		free(batch);
+		poolchan_put(chan);
+	}
+}
+
 #define ckdb_unix_msg(_typ, _sockd, _msg, _ml, _dup) \
 	_ckdb_unix_msg(_typ, _sockd, _msg, _ml, _dup, WHERE_FFL_HERE)
 
@@ -1598,6 +1695,14 @@ static void _ckdb_unix_msg(enum reply_type reply_typ, int sockd, char *msg,
 	char *ptr;
 	tv_t now;
 
+	// Messages from a batch reply as part of the batch's reply frame
+	// The last reply frees the batch so don't leave ml pointing at it
+	if (ml && ml->batch) {
+		_batch_reply(ml->batch, msg, dup, WHERE_FFL_PASS);
+		ml->batch = NULL;
+		return;
+	}
+
 	switch(reply_typ) {
 		case REPLIER_POOL:
 			reply_root = replies_pool_root;
@@ -4794,6 +4899,7 @@ static void *breaker(void *arg)
 		DATA_MSGLINE(msgline, bq->ml_item);
 		setnow(&(msgline->broken));
 		copy_tv(&(msgline->accepted), &(bq->accepted));
+		msgline->batch = bq->batch;
 		if (SEQALL_LOG) {
 			K_ITEM *seqall;
 			if (bq->ml_item) {
@@ -5873,8 +5979,8 @@ static void *logger(__maybe_unused void *arg)
 	setnow(&now);
 	snprintf(buf, sizeof(buf), "logstart.%ld,%ld",
 				   now.tv_sec, now.tv_usec);
-	LOGFILE(buf, logname_db);
-	LOGFILE(buf, logname_io);
+	LOGFILE(buf, logfile_db);
+	LOGFILE(buf, logfile_io);
 
 	while (!everyone_die) {
 		K_WLOCK(logqueue_free);
@@ -5884,9 +5990,9 @@ static void *logger(__maybe_unused void *arg)
 			DATA_LOGQUEUE(lq, lq_item);
 			if (lq->db) {
 				if (db_logger)
-					LOGFILE(lq->msg, logname_db);
+					LOGFILE(lq->msg, logfile_db);
 			} else
-				LOGFILE(lq->msg, logname_io);
+				LOGFILE(lq->msg, logfile_io);
 			FREENULL(lq->msg);
 
 			K_WLOCK(logqueue_free);
@@ -5897,6 +6003,9 @@ static void *logger(__maybe_unused void *arg)
 				lq_item = NULL;
 			K_WUNLOCK(logqueue_free);
 		}
+		// Everything queued goes out in one write per file
+		rotating_file_flush(logfile_db);
+		rotating_file_flush(logfile_io);
 		cksleep_ms(42);
 	}
 
@@ -5905,8 +6014,8 @@ static void *logger(__maybe_unused void *arg)
 	setnow(&now);
 	snprintf(buf, sizeof(buf), "logstopping.%d.%ld,%ld",
 				   count, now.tv_sec, now.tv_usec);
-	LOGFILE(buf, logname_db);
-	LOGFILE(buf, logname_io);
+	LOGFILE(buf, logfile_db);
+	LOGFILE(buf, logfile_io);
 	if (count)
 		LOGERR("%s", buf);
 	lq_item = STORE_WHEAD(logqueue_store);
@@ -5914,9 +6023,9 @@ static void *logger(__maybe_unused void *arg)
 	while (lq_item) {
 		DATA_LOGQUEUE(lq, lq_item);
 		if (lq->db)
-			LOGFILE(lq->msg, logname_db);
+			LOGFILE(lq->msg, logfile_db);
 		else
-			LOGFILE(lq->msg, logname_io);
+			LOGFILE(lq->msg, logfile_io);
 		FREENULL(lq->msg);
 		count--;
 		setnow(&now);
@@ -5928,14 +6037,18 @@ static void *logger(__maybe_unused void *arg)
 		lq_item = lq_item->next;
 	}
 	K_WUNLOCK(logqueue_free);
+	rotating_file_flush(logfile_db);
+	rotating_file_flush(logfile_io);
 
 	logger_using_data = false;
 
 	setnow(&now);
 	snprintf(buf, sizeof(buf), "logstop.%ld,%ld",
 				   now.tv_sec, now.tv_usec);
-	LOGFILE(buf, logname_db);
-	LOGFILE(buf, logname_io);
+	LOGFILE(buf, logfile_db);
+	LOGFILE(buf, logfile_io);
+	rotating_file_flush(logfile_db);
+	rotating_file_flush(logfile_io);
 	LOGWARNING("%s", buf);
 
 	return NULL;
@@ -6135,9 +6248,12 @@ static void process_sockd(PGconn *conn, K_ITEM *wq_item, enum reply_type reply_t
 		 msgline->now.tv_sec, ans);
 	setnow(&(msgline->processed));
 	ckdb_unix_msg(reply_typ, msgline->sockd, rep, msgline, false);
-	K_WLOCK(breakqueue_free);
-	sockd_count--;
-	K_WUNLOCK(breakqueue_free);
+	// Batched messages have no sockd and weren't counted in sockd_count
+	if (msgline->sockd >= 0) {
+		K_WLOCK(breakqueue_free);
+		sockd_count--;
+		K_WUNLOCK(breakqueue_free);
+	}
 	FREENULL(ans);
 
 	free_msgline_data(ml_item, true);
@@ -6873,18 +6989,147 @@ skippy:
 	return NULL;
 }
 
+// Queue a message read from a socket for breakdown
+static void sock_queue(ckpool_t *this, int thissock, char *buf, int sockd,
+			POOLBATCH *batch, tv_t *nowacc, tv_t *now)
+{
+	K_ITEM *bq_item = NULL;
+	BREAKQUEUE *bq = NULL;
+	tv_t now1, now2;
+	int seqentryflags = SE_SOCKET;
+
+	// Flag all work for pool0 until the reload completes
+	if (prereload || reloading) {
+		seqentryflags = SE_EARLYSOCK;
+		setnow(&now1);
+		K_WLOCK(workqueue_free);
+		earlysock_left++;
+		K_WUNLOCK(workqueue_free);
+		setnow(&now2);
+		sock_proc_early[thissock]++;
+		sock_lock_wq_us[thissock] += us_tvdiff(&now2, &now1);
+	}
+
+	if (SEQALL_LOG) {
+		char *pos, *col, *com;
+		pos = strstr(buf, SEQALL);
+		if (pos) {
+			col = strchr(pos, JSON_VALUE);
+			if (col) {
+				com = strchr(col, JSON_SEP);
+				if (!com)
+					com = strchr(col, JSON_END);
+				if (com) {
+					LOGNOTICE("%s() SEQALL %s %.*s",
+						  __func__,
+						  seqentryflags == SE_SOCKET
+						   ? "S" : "ES",
+						  (int)(com-col-1),
+						  col+1);
+				}
+			}
+		}
+	}
+
+	sock_processed[thissock]++;
+	// Don't limit the speed filling up cmd_breakqueue_store
+	setnow(&now1);
+	K_WLOCK(breakqueue_free);
+	bq_item = k_unlink_head(breakqueue_free);
+	K_WUNLOCK(breakqueue_free);
+	DATA_BREAKQUEUE(bq, bq_item);
+	bq->buf = buf;
+	bq->bufsiz = strlen(buf)+1;
+	bq->source = (char *)(this->gdata);
+	bq->access = *(int *)(this->cdata);
+	copy_tv(&(bq->accepted), nowacc);
+	copy_tv(&(bq->now), now);
+	bq->seqentryflags = seqentryflags;
+	bq->sockd = sockd;
+	bq->batch = batch;
+	K_WLOCK(breakqueue_free);
+	if (sockd >= 0 && max_sockd_count < ++sockd_count)
+		max_sockd_count = sockd_count;
+	k_add_tail(cmd_breakqueue_store, bq_item);
+	breakqueue_free->ram += bq->bufsiz;
+	K_WUNLOCK(breakqueue_free);
+	setnow(&now2);
+	sock_lock_br_us[thissock] += us_tvdiff(&now2, &now1);
+
+	mutex_lock(&bq_cmd_waitlock);
+	bq_cmd_signals++;
+	pthread_cond_signal(&bq_cmd_waitcond);
+	mutex_unlock(&bq_cmd_waitlock);
+}
+
+/* Split a batch frame into its messages and queue each of them to reply
+ *  via the batch */
+static void sock_batch(ckpool_t *this, int thissock, POOLCHAN *chan, char *buf,
+			tv_t *nowacc, tv_t *now)
+{
+	POOLBATCH *batch;
+	char *line, *next;
+	int count = 0;
+
+	next = strchr(buf, '\n');
+	if (next) {
+		*(next++) = '\0';
+		for (count = 1, line = next; (line = strchr(line, '\n')); line++)
+			count++;
+	}
+
+	// A resent batch is only replied to so it isn't processed twice
+	if (count && batch_seen(thissock, buf)) {
+		LOGNOTICE("%s() Dropping resent %s of %d messages",
+			  __func__, buf, count);
+		sock_batch_dups[thissock]++;
+		count = 0;
+	}
+
+	batch = calloc(1, sizeof(*batch));
+	if (!batch)
+		quithere(1, "calloc (%d) OOM", (int)sizeof(*batch));
+	batch->chan = chan;
+	batch->reply = strdup(buf);
+	batch->len = strlen(buf);
+	batch->siz = batch->len + 1;
+	batch->remaining = count;
+	mutex_lock(&(chan->lock));
+	chan->refs++;
+	if (!count)
+		_ckdb_unix_send(chan->sockd, batch->reply, WHERE_FFL_HERE);
+	mutex_unlock(&(chan->lock));
+	if (!count) {
+		free(batch->reply);
+		free(batch);
+		poolchan_put(chan);
+		return;
+	}
+
+	sock_batches[thissock]++;
+	sock_batched[thissock] += count;
+	while (next) {
+		line = next;
+		next = strchr(line, '\n');
+		if (next)
+			*(next++) = '\0';
+		// Empty lines must still reply to complete the batch
+		sock_queue(this, thissock, strdup(*line ? line : "?"), -1, batch,
+			   nowacc, now);
+	}
+}
+
 static void *sockrun(void *arg)
 {
 	ckpool_t *this = (ckpool_t *)arg;
 	unixsock_t *us = &(this->main.us);
+	POOLCHAN *chans[MAX_POOLCHANS], *chan;
 	char *end, *buf = NULL;
-	K_ITEM *bq_item = NULL;
-	BREAKQUEUE *bq = NULL;
-	int ret, sockd, thissock;
+	int ret, sockd, thissock, maxfd, nchans = 0, i;
 	fd_set rfds;
 	char *name = (char *)(this->gdata);
 	char nbuf[64];
-	tv_t now, nowacc, now1, now2, tmo;
+	tv_t now, nowacc, now1, tmo;
 
 	thissock = SOCKNUM(name);
 	if (thissock == MAXSOCK) {
@@ -6903,9 +7148,15 @@ static void *sockrun(void *arg)
 		while (!everyone_die) {
 			FD_ZERO(&rfds);
 			FD_SET(us->sockd, &rfds);
+			maxfd = us->sockd;
+			for (i = 0; i < nchans; i++) {
+				FD_SET(chans[i]->sockd, &rfds);
+				if (maxfd < chans[i]->sockd)
+					maxfd = chans[i]->sockd;
+			}
 			tmo.tv_sec = 1;
 			tmo.tv_usec = 0;
-			ret = select(us->sockd + 1, &rfds, NULL, NULL, &tmo);
+			ret = select(maxfd + 1, &rfds, NULL, NULL, &tmo);
 			if (ret > 0)
 				break;
 			if (ret < 0) {
@@ -6923,6 +7174,37 @@ static void *sockrun(void *arg)
 		if (everyone_die)
 			break;
 
+		// Frames on persistent pool connections
+		for (i = 0; i < nchans; ) {
+			chan = chans[i];
+			if (!FD_ISSET(chan->sockd, &rfds)) {
+				i++;
+				continue;
+			}
+			buf = recv_unix_frame_tmo2(chan->sockd, RECV_UNIX_TIMEOUT1,
+						   RECV_UNIX_TIMEOUT2);
+			if (!buf || strncmp(buf, CKDB_BATCH, strlen(CKDB_BATCH))) {
+				if (buf) {
+					LOGWARNING("%s() Invalid %s batch frame",
+						   __func__, name);
+					free(buf);
+				}
+				// Closed once all its batches have replied
+				shutdown(chan->sockd, SHUT_RD);
+				poolchan_put(chan);
+				chans[i] = chans[--nchans];
+				continue;
+			}
+			setnow(&now);
+			sock_recv[thissock]++;
+			sock_batch(this, thissock, chan, buf, &now, &now);
+			free(buf);
+			i++;
+		}
+
+		if (!FD_ISSET(us->sockd, &rfds))
+			continue;
+
 		sockd = accept(us->sockd, NULL, NULL);
 		if (sockd < 0) {
 			int e = errno;
@@ -6935,11 +7217,34 @@ static void *sockrun(void *arg)
 		sock_acc[thissock]++;
 
 		setnow(&now1);
-		buf = recv_unix_msg_tmo2(sockd, RECV_UNIX_TIMEOUT1, RECV_UNIX_TIMEOUT2);
+		buf = recv_unix_frame_tmo2(sockd, RECV_UNIX_TIMEOUT1, RECV_UNIX_TIMEOUT2);
 		// Once we've read the message
 		setnow(&now);
 		sock_recv_us[thissock] += us_tvdiff(&now, &now1);
 		sock_recv[thissock]++;
+
+		// A batch keeps the connection open for further batches
+		if (buf && strncmp(buf, CKDB_BATCH, strlen(CKDB_BATCH)) == 0) {
+			if (nchans >= MAX_POOLCHANS) {
+				LOGERR("%s() Too many %s batch connections",
+				       __func__, name);
+				free(buf);
+				close(sockd);
+				continue;
+			}
+			chan = calloc(1, sizeof(*chan));
+			if (!chan)
+				quithere(1, "calloc (%d) OOM", (int)sizeof(*chan));
+			chan->sockd = sockd;
+			chan->refs = 1;
+			mutex_init(&(chan->lock));
+			chans[nchans++] = chan;
+			sock_batch(this, thissock, chan, buf, &nowacc, &now);
+			free(buf);
+			continue;
+		}
+		shutdown(sockd, SHUT_RD);
+
 		if (buf) {
 			end = buf + strlen(buf) - 1;
 			// strip trailing \n and \r
@@ -6956,72 +7261,13 @@ static void *sockrun(void *arg)
 					   __func__, name);
 				free(buf);
 			}
-		} else {
-			int seqentryflags = SE_SOCKET;
-			// Flag all work for pool0 until the reload completes
-			if (prereload || reloading) {
-				seqentryflags = SE_EARLYSOCK;
-				setnow(&now1);
-				K_WLOCK(workqueue_free);
-				earlysock_left++;
-				K_WUNLOCK(workqueue_free);
-				setnow(&now2);
-				sock_proc_early[thissock]++;
-				sock_lock_wq_us[thissock] += us_tvdiff(&now2, &now1);
-			}
-
-			if (SEQALL_LOG) {
-				char *pos, *col, *com;
-				pos = strstr(buf, SEQALL);
-				if (pos) {
-					col = strchr(pos, JSON_VALUE);
-					if (col) {
-						com = strchr(col, JSON_SEP);
-						if (!com)
-							com = strchr(col, JSON_END);
-						if (com) {
-							LOGNOTICE("%s() SEQALL %s %.*s",
-								  __func__,
-								  seqentryflags == SE_SOCKET
-								   ? "S" : "ES",
-								  (int)(com-col-1),
-								  col+1);
-						}
-					}
-				}
-			}
-
-			sock_processed[thissock]++;
-			// Don't limit the speed filling up cmd_breakqueue_store
-			setnow(&now1);
-			K_WLOCK(breakqueue_free);
-			bq_item = k_unlink_head(breakqueue_free);
-			K_WUNLOCK(breakqueue_free);
-			DATA_BREAKQUEUE(bq, bq_item);
-			bq->buf = buf;
-			bq->bufsiz = strlen(buf)+1;
-			bq->source = (char *)(this->gdata);
-			bq->access = *(int *)(this->cdata);
-			copy_tv(&(bq->accepted), &nowacc);
-			copy_tv(&(bq->now), &now);
-			bq->seqentryflags = seqentryflags;
-			bq->sockd = sockd;
-			K_WLOCK(breakqueue_free);
-			if (max_sockd_count < ++sockd_count)
-				max_sockd_count = sockd_count;
-			k_add_tail(cmd_breakqueue_store, bq_item);
-			breakqueue_free->ram += bq->bufsiz;
-			K_WUNLOCK(breakqueue_free);
-			setnow(&now2);
-			sock_lock_br_us[thissock] += us_tvdiff(&now2, &now1);
-
-			mutex_lock(&bq_cmd_waitlock);
-			bq_cmd_signals++;
-			pthread_cond_signal(&bq_cmd_waitcond);
-			mutex_unlock(&bq_cmd_waitlock);
-		}
+		} else
+			sock_queue(this, thissock, buf, sockd, NULL, &nowacc, &now);
 	}
 
+	for (i = 0; i < nchans; i++)
+		poolchan_put(chans[i]);
+
 	close_unix_socket(us->sockd, us->path);
 
 	LOGWARNING("%s() %s exiting: early=%"PRIu64" after=%"PRIu64
@@ -7461,6 +7707,7 @@ static void reload_line(char *filename, char *buf, uint64_t count)
 		copy_tv(&(bq->now), &now);
 		bq->seqentryflags = SE_RELOAD;
 		bq->sockd = -1;
+		bq->batch = NULL;
 		bq->count = count;
 		bq->filename = filename;
 
@@ -9641,6 +9888,8 @@ int main(int argc, char **argv)
 	// -io is everything else
 	snprintf(logname_io, sizeof(logname_io), "%s%s-io%s-",
 				ckp.logdir, ckp.name, dbcode);
+	logfile_db = create_rotating_file(logname_db, false);
+	logfile_io = create_rotating_file(logname_io, false);
 
 	setnow(&now);
 	srandom((unsigned int)(now.tv_usec * 4096 + now.tv_sec % 4096));
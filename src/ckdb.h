@@ -842,7 +842,7 @@ extern void _io_msg(bool stamp, char *msg, bool alloc, int errn, bool logfd,
 		    WHERE_FFL_ARGS);
 
 #define LOGQUE(_msg, _db) log_queue_message(_msg, _db)
-#define LOGFILE(_msg, _prefix) rotating_log_nolock(_msg, _prefix)
+#define LOGFILE(_msg, _file) rotating_file_add(_file, _msg, time(NULL))
 #define LOGDUP "dup."
 
 // ***
@@ -1432,6 +1432,7 @@ typedef struct msgline {
 	K_TREE *trf_root;
 	K_STORE *trf_store;
 	int sockd;
+	struct poolbatch *batch; // copied from breakqueue
 } MSGLINE;
 
 #define ALLOC_MSGLINE 8192
@@ -1454,6 +1455,7 @@ typedef struct breakqueue {
 	tv_t now; // msg read or line read
 	int seqentryflags;
 	int sockd;
+	struct poolbatch *batch; // reply via a batch instead of sockd
 	enum cmd_values cmdnum;
 	K_ITEM *ml_item;
 	uint64_t count;
@@ -13,12 +13,14 @@
 #include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <ctype.h>
 #include <fenv.h>
 #include <getopt.h>
 #include <grp.h>
+#include <linux/futex.h>
 #include <jansson.h>
 #include <signal.h>
 #include <stdio.h>
@@ -145,82 +147,273 @@ out:
 	free(buf);
 }
 
+/* Try to add data to the ring, returning false if it is full */
+static bool ring_push(ckmsgq_t *ckmsgq, void *data)
+{
+	int64_t pos = __atomic_load_n(&ckmsgq->enqueue_pos, __ATOMIC_RELAXED);
+	ckmsgq_cell_t *cell;
+
+	while (42) {
+		int64_t seq;
+
+		cell = &ckmsgq->cells[pos & (CKMSGQ_RING - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&ckmsgq->enqueue_pos, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (seq < pos)
+			return false;
+		else
+			pos = __atomic_load_n(&ckmsgq->enqueue_pos, __ATOMIC_RELAXED);
+	}
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Take the oldest data from the ring, returning NULL if it is empty */
+static void *ring_pop(ckmsgq_t *ckmsgq)
+{
+	int64_t pos = __atomic_load_n(&ckmsgq->dequeue_pos, __ATOMIC_RELAXED);
+	ckmsgq_cell_t *cell;
+	void *data;
+
+	while (42) {
+		int64_t seq;
+
+		cell = &ckmsgq->cells[pos & (CKMSGQ_RING - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos + 1) {
+			if (__atomic_compare_exchange_n(&ckmsgq->dequeue_pos, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (seq < pos + 1)
+			return NULL;
+		else
+			pos = __atomic_load_n(&ckmsgq->dequeue_pos, __ATOMIC_RELAXED);
+	}
+	data = cell->data;
+	__atomic_store_n(&cell->seq, pos + CKMSGQ_RING, __ATOMIC_RELEASE);
+	return data;
+}
+
+static void futex_wait(int *uaddr, const int val, const int ms)
+{
+	ts_t ts = {ms / 1000, (ms % 1000) * 1000000};
+
+	syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+static void futex_wake(int *uaddr, const int count)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/* Wake one sleeping processing thread, only making a syscall if any of them
+ * are actually asleep and, if one is waiting for a batch to fill, enough
+ * messages are queued. The full barrier pairs with the one in ckmsgq_wait so
+ * either the sleeper sees the new message or we see the sleeper. */
+static void ckmsgq_wake(ckmsgq_t *ckmsgq)
+{
+	__sync_synchronize();
+	if (!__atomic_load_n(&ckmsgq->waiters, __ATOMIC_RELAXED))
+		return;
+	if (ckmsgq_count(ckmsgq) < __atomic_load_n(&ckmsgq->fill, __ATOMIC_RELAXED))
+		return;
+	__sync_add_and_fetch(&ckmsgq->wakeups, 1);
+	futex_wake(&ckmsgq->wakeups, 1);
+}
+
+/* Sleep for up to a second unless messages are queued */
+static void ckmsgq_wait(ckmsgq_t *ckmsgq)
+{
+	int wakeups = __atomic_load_n(&ckmsgq->wakeups, __ATOMIC_ACQUIRE);
+
+	__sync_add_and_fetch(&ckmsgq->waiters, 1);
+	if (!ckmsgq_count(ckmsgq))
+		futex_wait(&ckmsgq->wakeups, wakeups, 1000);
+	__sync_sub_and_fetch(&ckmsgq->waiters, 1);
+}
+
+/* For a batch processing function to sleep for up to ms until at least fill
+ * messages are queued, only being woken once they are */
+void ckmsgq_wait_fill(ckmsgq_t *ckmsgq, const int fill, const int ms)
+{
+	tv_t start, now;
+	int left = ms;
+
+	tv_time(&start);
+	__atomic_store_n(&ckmsgq->fill, fill, __ATOMIC_RELAXED);
+	__sync_add_and_fetch(&ckmsgq->waiters, 1);
+	while (left > 0) {
+		int wakeups = __atomic_load_n(&ckmsgq->wakeups, __ATOMIC_ACQUIRE);
+
+		__sync_synchronize();
+		if (ckmsgq_count(ckmsgq) >= fill)
+			break;
+		futex_wait(&ckmsgq->wakeups, wakeups, left);
+		tv_time(&now);
+		left = ms - ms_tvdiff(&now, &start);
+	}
+	__sync_sub_and_fetch(&ckmsgq->waiters, 1);
+	__atomic_store_n(&ckmsgq->fill, 0, __ATOMIC_RELAXED);
+}
+
+/* Take the first message off a list, decrementing its counter */
+static void *__list_pop(ckmsgq_t *ckmsgq, ckmsg_t **list, int *count)
+{
+	ckmsg_t *msg = *list;
+	void *data;
+
+	if (!msg)
+		return NULL;
+	DL_DELETE(*list, msg);
+	__atomic_store_n(count, *count - 1, __ATOMIC_RELAXED);
+	data = msg->data;
+	slab_free(ckmsgq->ckp->ckmsg_slab, msg);
+	return data;
+}
+
+/* Take up to max messages from the ckmsgq without waiting, returning how
+ * many were taken. High priority messages come first, and messages that
+ * overflowed the ring always queued after those in the ring. */
+int ckmsgq_pop(ckmsgq_t *ckmsgq, void **data, const int max)
+{
+	int count = 0;
+
+	if (unlikely(__atomic_load_n(&ckmsgq->priority, __ATOMIC_RELAXED))) {
+		mutex_lock(&ckmsgq->lock);
+		while (count < max && ckmsgq->prio)
+			data[count++] = __list_pop(ckmsgq, &ckmsgq->prio, &ckmsgq->priority);
+		mutex_unlock(&ckmsgq->lock);
+	}
+	while (count < max && (data[count] = ring_pop(ckmsgq)))
+		count++;
+	if (unlikely(count < max && __atomic_load_n(&ckmsgq->overflow, __ATOMIC_RELAXED))) {
+		mutex_lock(&ckmsgq->lock);
+		while (count < max && ckmsgq->msgs)
+			data[count++] = __list_pop(ckmsgq, &ckmsgq->msgs, &ckmsgq->overflow);
+		mutex_unlock(&ckmsgq->lock);
+	}
+	return count;
+}
+
 /* Generic function for creating a message queue receiving and parsing thread */
 static void *ckmsg_queue(void *arg)
 {
 	ckmsgq_t *ckmsgq = (ckmsgq_t *)arg;
 	ckpool_t *ckp = ckmsgq->ckp;
+	int thread;
+
+	pthread_detach(pthread_self());
+	thread = __sync_fetch_and_add(&ckmsgq->threads, 1);
+	if (thread) {
+		char name[16];
+
+		snprintf(name, 15, "%.8s%x", ckmsgq->name, thread);
+		rename_proc(name);
+	} else
+		rename_proc(ckmsgq->name);
+	ckmsgq->active = true;
+
+	while (42) {
+		void *data;
+
+		if (!ckmsgq_pop(ckmsgq, &data, 1)) {
+			ckmsgq_wait(ckmsgq);
+			continue;
+		}
+		ckmsgq->func(ckp, data);
+	}
+	return NULL;
+}
+
+/* As ckmsg_queue but hands the function every message queued at the time, up
+ * to the batch size, at once. It never waits for a batch to fill so messages
+ * are delayed no more than they would be by a single message queue. */
+static void *ckmsg_batch_queue(void *arg)
+{
+	ckmsgq_t *ckmsgq = (ckmsgq_t *)arg;
+	ckpool_t *ckp = ckmsgq->ckp;
+	void **data;
 
 	pthread_detach(pthread_self());
 	rename_proc(ckmsgq->name);
+	data = ckalloc(sizeof(void *) * ckmsgq->batch);
 	ckmsgq->active = true;
 
 	while (42) {
-		ckmsg_t *msg;
-		tv_t now;
-		ts_t abs;
+		int count = ckmsgq_pop(ckmsgq, data, ckmsgq->batch);
 
-		mutex_lock(ckmsgq->lock);
-		tv_time(&now);
-		tv_to_ts(&abs, &now);
-		abs.tv_sec++;
-		if (!ckmsgq->msgs)
-			cond_timedwait(ckmsgq->cond, ckmsgq->lock, &abs);
-		msg = ckmsgq->msgs;
-		if (msg)
-			DL_DELETE(ckmsgq->msgs, msg);
-		mutex_unlock(ckmsgq->lock);
-
-		if (!msg)
+		if (!count) {
+			ckmsgq_wait(ckmsgq);
 			continue;
-		ckmsgq->func(ckp, msg->data);
-		free(msg);
+		}
+		ckmsgq->batchfunc(ckp, data, count);
 	}
 	return NULL;
 }
 
-ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
+static ckmsgq_t *alloc_ckmsgq(ckpool_t *ckp, const char *name)
 {
-	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t));
+	ckmsgq_t *ckmsgq;
+	int64_t i;
 
+	if (unlikely(posix_memalign((void **)&ckmsgq, 64, sizeof(ckmsgq_t))))
+		quit(1, "Failed to posix_memalign ckmsgq %s", name);
+	memset(ckmsgq, 0, sizeof(ckmsgq_t));
 	strncpy(ckmsgq->name, name, 15);
-	ckmsgq->func = func;
 	ckmsgq->ckp = ckp;
-	ckmsgq->lock = ckalloc(sizeof(mutex_t));
-	ckmsgq->cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(ckmsgq->lock);
-	cond_init(ckmsgq->cond);
+	ckmsgq->cells = ckalloc(sizeof(ckmsgq_cell_t) * CKMSGQ_RING);
+	for (i = 0; i < CKMSGQ_RING; i++)
+		ckmsgq->cells[i].seq = i;
+	mutex_init(&ckmsgq->lock);
+	return ckmsgq;
+}
+
+ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
+{
+	ckmsgq_t *ckmsgq = alloc_ckmsgq(ckp, name);
+
+	ckmsgq->func = func;
 	create_pthread(&ckmsgq->pth, ckmsg_queue, ckmsgq);
 
 	return ckmsgq;
 }
 
-ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count)
+/* An array of count queues each with its own processing thread. Callers pick
+ * the queue for a message by a key such as its client id so that messages
+ * with the same key are always processed in the order they were added,
+ * which several threads sharing one queue can not guarantee. */
+ckmsgq_t **create_ckmsgq_shards(ckpool_t *ckp, const char *name, const void *func, const int count)
 {
-	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
-	mutex_t *lock;
-	pthread_cond_t *cond;
+	ckmsgq_t **ckmsgqs = ckalloc(sizeof(ckmsgq_t *) * count);
+	char qname[16];
 	int i;
 
-	lock = ckalloc(sizeof(mutex_t));
-	cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(lock);
-	cond_init(cond);
-
 	for (i = 0; i < count; i++) {
-		snprintf(ckmsgq[i].name, 15, "%.8s%x", name, i);
-		ckmsgq[i].func = func;
-		ckmsgq[i].ckp = ckp;
-		ckmsgq[i].lock = lock;
-		ckmsgq[i].cond = cond;
-		create_pthread(&ckmsgq[i].pth, ckmsg_queue, &ckmsgq[i]);
+		snprintf(qname, 15, "%.8s%x", name, i);
+		ckmsgqs[i] = create_ckmsgq(ckp, qname, func);
 	}
 
+	return ckmsgqs;
+}
+
+ckmsgq_t *create_ckmsgq_batch(ckpool_t *ckp, const char *name, const void *func, const int batch)
+{
+	ckmsgq_t *ckmsgq = alloc_ckmsgq(ckp, name);
+
+	ckmsgq->batchfunc = func;
+	ckmsgq->batch = batch;
+	create_pthread(&ckmsgq->pth, ckmsg_batch_queue, ckmsgq);
+
 	return ckmsgq;
 }
 
-/* Generic function for adding messages to a ckmsgq linked list and signal the
- * ckmsgq parsing thread(s) to wake up and process it. */
+/* Generic function for adding messages to a ckmsgq and waking a ckmsgq
+ * parsing thread to process it. Messages only go to the overflow list when
+ * the ring is full, and stay there until it drains to preserve ordering. */
 bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line)
 {
 	ckmsg_t *msg;
@@ -235,32 +428,74 @@ bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *fun
 	while (unlikely(!ckmsgq->active))
 		cksleep_ms(10);
 
-	msg = ckalloc(sizeof(ckmsg_t));
+	__sync_add_and_fetch(&ckmsgq->messages, 1);
+	if (likely(!__atomic_load_n(&ckmsgq->overflow, __ATOMIC_RELAXED) && ring_push(ckmsgq, data)))
+		goto out;
+
+	msg = slab_alloc(ckmsgq->ckp->ckmsg_slab);
 	msg->data = data;
 
-	mutex_lock(ckmsgq->lock);
-	ckmsgq->messages++;
+	mutex_lock(&ckmsgq->lock);
 	DL_APPEND(ckmsgq->msgs, msg);
-	pthread_cond_broadcast(ckmsgq->cond);
-	mutex_unlock(ckmsgq->lock);
-
+	__atomic_store_n(&ckmsgq->overflow, ckmsgq->overflow + 1, __ATOMIC_RELAXED);
+	mutex_unlock(&ckmsgq->lock);
+out:
+	ckmsgq_wake(ckmsgq);
 	return true;
 }
 
-/* Return whether there are any messages queued in the ckmsgq linked list. */
-bool ckmsgq_empty(ckmsgq_t *ckmsgq)
+/* Add a list of count messages already created to a ckmsgq in one go. High
+ * priority lists are put ahead of all queued messages. */
+void ckmsgq_add_list(ckmsgq_t *ckmsgq, ckmsg_t *msgs, const int count, const bool prio)
 {
-	bool ret = true;
+	int listed = count;
+	ckmsg_t *msg, *tmp;
 
-	if (unlikely(!ckmsgq || !ckmsgq->active))
-		goto out;
+	__sync_add_and_fetch(&ckmsgq->messages, count);
+	if (!prio && !__atomic_load_n(&ckmsgq->overflow, __ATOMIC_RELAXED)) {
+		DL_FOREACH_SAFE(msgs, msg, tmp) {
+			if (!ring_push(ckmsgq, msg->data))
+				break;
+			DL_DELETE(msgs, msg);
+			slab_free(ckmsgq->ckp->ckmsg_slab, msg);
+			listed--;
+		}
+	}
+	if (msgs) {
+		mutex_lock(&ckmsgq->lock);
+		if (prio) {
+			DL_CONCAT(msgs, ckmsgq->prio);
+			ckmsgq->prio = msgs;
+			__atomic_store_n(&ckmsgq->priority, ckmsgq->priority + listed, __ATOMIC_RELAXED);
+		} else {
+			DL_CONCAT(ckmsgq->msgs, msgs);
+			__atomic_store_n(&ckmsgq->overflow, ckmsgq->overflow + listed, __ATOMIC_RELAXED);
+		}
+		mutex_unlock(&ckmsgq->lock);
+	}
+	ckmsgq_wake(ckmsgq);
+}
 
-	mutex_lock(ckmsgq->lock);
-	if (ckmsgq->msgs)
-		ret = (ckmsgq->msgs->next == ckmsgq->msgs->prev);
-	mutex_unlock(ckmsgq->lock);
-out:
-	return ret;
+/* Approximate number of messages queued */
+int ckmsgq_count(ckmsgq_t *ckmsgq)
+{
+	int64_t count;
+
+	count = __atomic_load_n(&ckmsgq->enqueue_pos, __ATOMIC_RELAXED) -
+		__atomic_load_n(&ckmsgq->dequeue_pos, __ATOMIC_RELAXED);
+	if (count < 0)
+		count = 0;
+	count += __atomic_load_n(&ckmsgq->overflow, __ATOMIC_RELAXED);
+	count += __atomic_load_n(&ckmsgq->priority, __ATOMIC_RELAXED);
+	return count;
+}
+
+/* Return whether there are any messages queued in the ckmsgq. */
+bool ckmsgq_empty(ckmsgq_t *ckmsgq)
+{
+	if (unlikely(!ckmsgq || !ckmsgq->active))
+		return true;
+	return !ckmsgq_count(ckmsgq);
 }
 
 /* Create a standalone thread that queues received unix messages for a proc
@@ -452,6 +687,11 @@ retry:
 		msg = stratifier_stats(ckp, ckp->sdata);
 		send_unix_msg(sockd, msg);
 		dealloc(msg);
+	} else if (cmdmatch(buf, "generatorstats")) {
+		LOGDEBUG("Listener received generatorstats request");
+		msg = generator_stats(ckp, ckp->gdata);
+		send_unix_msg(sockd, msg);
+		dealloc(msg);
 	} else if (cmdmatch(buf, "connectorstats")) {
 		LOGDEBUG("Listener received connectorstats request");
 		msg = connector_stats(ckp->cdata, 0);
@@ -795,46 +1035,162 @@ static const char *rpc_method(const char *rpc_req)
 	return rpc_req;
 }
 
-/* All of these calls are made to bitcoind which prefers open/close instead
- * of persistent connections so cs->fd is always invalid. */
-static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool info_only)
+/* Claim an idle rpcconn. The caller must already hold one of the RPC_CONNS
+ * counts of cs->sem so there is always one free. */
+static rpcconn_t *get_rpcconn(connsock_t *cs)
+{
+	int i;
+
+	while (42) {
+		for (i = 0; i < RPC_CONNS; i++) {
+			rpcconn_t *rc = &cs->rpcconns[i];
+
+			if (!rc->busy && __sync_bool_compare_and_swap(&rc->busy, 0, 1))
+				return rc;
+		}
+	}
+}
+
+static void put_rpcconn(rpcconn_t *rc)
 {
-	float timeout = RPC_TIMEOUT;
-	char *http_req = NULL;
+	__sync_lock_release(&rc->busy);
+}
+
+static void close_rpcconn(rpcconn_t *rc)
+{
+	if (rc->connected)
+		Close(rc->fd);
+	rc->connected = false;
+}
+
+/* Parse the headers of an HTTP response once they're all in rc->buf,
+ * returning their length including the blank line that ends them, or zero if
+ * they're incomplete. */
+static int parse_http_headers(rpcconn_t *rc, int *contentlen, bool *keepalive)
+{
+	char *line = rc->buf, *eol;
+
+	while ((eol = strchr(line, '\n'))) {
+		if (eol == line || (eol == line + 1 && *line == '\r'))
+			return eol + 1 - rc->buf;
+		if (!strncasecmp(line, "Content-Length:", 15))
+			*contentlen = atoi(line + 15);
+		else if (!strncasecmp(line, "Connection:", 11)) {
+			const char *value = line + 11;
+
+			while (*value == ' ')
+				value++;
+			if (!strncasecmp(value, "close", 5))
+				*keepalive = false;
+		}
+		line = eol + 1;
+	}
+	return 0;
+}
+
+/* Read a whole HTTP response into rc->buf, framed by its Content-Length, or by
+ * the connection closing if it has none, passing a 200 OK body to any stream
+ * function as it arrives. Returns the offset of the body, which is null
+ * terminated, or -1 on failure. */
+static int read_http_response(rpcconn_t *rc, float *timeout, bool *keepalive,
+			      rpc_stream_fn stream, void *arg)
+{
+	int hdrlen = 0, contentlen = -1, ret;
+	tv_t start, now;
+
+	rc->buflen = 0;
+	if (unlikely(!rc->buf)) {
+		rc->buf = ckalloc(PAGESIZE);
+		rc->bufsize = PAGESIZE;
+	}
+	rc->buf[0] = '\0';
+	tv_time(&start);
+
+	while (!hdrlen || contentlen < 0 || rc->buflen < hdrlen + contentlen) {
+		if (*timeout <= 0)
+			return -1;
+		ret = wait_read_select(rc->fd, *timeout);
+		if (ret < 1)
+			return -1;
+		if (rc->bufsize - rc->buflen < PAGESIZE) {
+			rc->bufsize *= 2;
+			rc->buf = realloc(rc->buf, rc->bufsize);
+			if (unlikely(!rc->buf))
+				quit(1, "Failed to realloc rpcconn buf of size %d", rc->bufsize);
+		}
+		ret = recv(rc->fd, rc->buf + rc->buflen, rc->bufsize - rc->buflen - 1, 0);
+		if (ret < 1) {
+			/* A body without a Content-Length ends with the connection */
+			if (hdrlen && contentlen < 0) {
+				contentlen = rc->buflen - hdrlen;
+				*keepalive = false;
+				break;
+			}
+			return -1;
+		}
+		rc->buflen += ret;
+		rc->buf[rc->buflen] = '\0';
+		if (!hdrlen) {
+			hdrlen = parse_http_headers(rc, &contentlen, keepalive);
+			if (hdrlen && strncasecmp(rc->buf, "HTTP/1.1 200 OK", 15))
+				stream = NULL;
+		}
+		if (hdrlen && stream) {
+			int len = rc->buflen - hdrlen;
+
+			if (contentlen >= 0 && len > contentlen)
+				len = contentlen;
+			stream(arg, rc->buf + hdrlen, len, false);
+		}
+		tv_time(&now);
+		*timeout -= tvdiff(&now, &start);
+		copy_tv(&start, &now);
+	}
+	/* Anything beyond the body means we've lost sync with the stream */
+	if (rc->buflen > hdrlen + contentlen)
+		*keepalive = false;
+	rc->buf[hdrlen + contentlen] = '\0';
+	if (stream)
+		stream(arg, rc->buf + hdrlen, contentlen, true);
+	return hdrlen;
+}
+
+/* All of these calls are made to bitcoind over persistent HTTP connections,
+ * up to RPC_CONNS of them at once. Calls on an idle connection that bitcoind
+ * has since closed are retried once on a new connection. */
+static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, float timeout,
+			      const bool info_only, rpc_stream_fn stream, void *arg)
+{
+	bool reused, keepalive = true;
+	char *http_req = NULL, *body;
 	json_error_t err_val;
 	char *warning = NULL;
 	json_t *val = NULL;
 	tv_t stt_tv, fin_tv;
 	double elapsed;
+	rpcconn_t *rc;
 	int len, ret;
 
-	/* Serialise all calls in case we use cs from multiple threads */
-	cksem_wait(&cs->sem);
-	cs->fd = connect_socket(cs->url, cs->port);
-	if (unlikely(cs->fd < 0)) {
-		ASPRINTF(&warning, "Unable to connect socket to %s:%s in %s", cs->url, cs->port, __func__);
-		goto out;
-	}
 	if (unlikely(!cs->url)) {
 		ASPRINTF(&warning, "No URL in %s", __func__);
-		goto out;
+		goto out_nosem;
 	}
 	if (unlikely(!cs->port)) {
 		ASPRINTF(&warning, "No port in %s", __func__);
-		goto out;
+		goto out_nosem;
 	}
 	if (unlikely(!cs->auth)) {
 		ASPRINTF(&warning, "No auth in %s", __func__);
-		goto out;
+		goto out_nosem;
 	}
 	if (unlikely(!rpc_req)) {
 		ASPRINTF(&warning, "Null rpc_req passed to %s", __func__);
-		goto out;
+		goto out_nosem;
 	}
 	len = strlen(rpc_req);
 	if (unlikely(!len)) {
 		ASPRINTF(&warning, "Zero length rpc_req passed to %s", __func__);
-		goto out;
+		goto out_nosem;
 	}
 	http_req = ckalloc(len + 256); // Leave room for headers
 	sprintf(http_req,
@@ -844,70 +1200,77 @@ static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool in
 		 "Content-type: application/json\n"
 		 "Content-Length: %d\n\n%s",
 		 cs->auth, cs->url, cs->port, len, rpc_req);
-
 	len = strlen(http_req);
+
+	cksem_wait(&cs->sem);
+	rc = get_rpcconn(cs);
 	tv_time(&stt_tv);
-	ret = write_socket(cs->fd, http_req, len);
+retry:
+	reused = rc->connected;
+	if (!reused) {
+		rc->fd = connect_socket(cs->url, cs->port);
+		if (unlikely(rc->fd < 0)) {
+			ASPRINTF(&warning, "Unable to connect socket to %s:%s in %s", cs->url, cs->port, __func__);
+			goto out;
+		}
+		rc->connected = true;
+		keep_sockalive(rc->fd);
+	}
+	ret = write_socket(rc->fd, http_req, len);
 	if (ret != len) {
+		close_rpcconn(rc);
+		if (reused)
+			goto retry;
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
 		ASPRINTF(&warning, "Failed to write to socket in %s (%.10s...) %.3fs",
 			 __func__, rpc_method(rpc_req), elapsed);
-		goto out_empty;
+		goto out;
 	}
-	ret = read_socket_line(cs, &timeout);
-	if (ret < 1) {
+	ret = read_http_response(rc, &timeout, &keepalive, stream, arg);
+	if (ret < 0) {
+		close_rpcconn(rc);
+		if (reused && !rc->buflen && timeout > 0)
+			goto retry;
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
-		ASPRINTF(&warning, "Failed to read socket line in %s (%.10s...) %.3fs",
+		ASPRINTF(&warning, "Failed to read http response in %s (%.10s...) %.3fs",
 			 __func__, rpc_method(rpc_req), elapsed);
-		goto out_empty;
+		goto out;
 	}
-	if (strncasecmp(cs->buf, "HTTP/1.1 200 OK", 15)) {
-		tv_time(&fin_tv);
-		elapsed = tvdiff(&fin_tv, &stt_tv);
-		ASPRINTF(&warning, "HTTP response to (%.10s...) %.3fs not ok: %s",
-			 rpc_method(rpc_req), elapsed, cs->buf);
-		timeout = 0;
-		/* Look for a json response if there is one */
-		while (read_socket_line(cs, &timeout) > 0) {
-			timeout = 0;
-			if (*cs->buf != '{')
-				continue;
-			free(warning);
-			/* Replace the warning with the json response */
+	body = rc->buf + ret;
+	tv_time(&fin_tv);
+	elapsed = tvdiff(&fin_tv, &stt_tv);
+	if (strncasecmp(rc->buf, "HTTP/1.1 200 OK", 15)) {
+		char *eol = strchr(rc->buf, '\r');
+
+		if (eol)
+			*eol = '\0';
+		if (*body == '{') {
 			ASPRINTF(&warning, "JSON response to (%.10s...) %.3fs not ok: %s",
-				 rpc_method(rpc_req), elapsed, cs->buf);
-			break;
+				 rpc_method(rpc_req), elapsed, body);
+		} else {
+			ASPRINTF(&warning, "HTTP response to (%.10s...) %.3fs not ok: %s",
+				 rpc_method(rpc_req), elapsed, rc->buf);
 		}
-		goto out_empty;
+		goto out;
 	}
-	do {
-		ret = read_socket_line(cs, &timeout);
-		if (ret < 1) {
-			tv_time(&fin_tv);
-			elapsed = tvdiff(&fin_tv, &stt_tv);
-			ASPRINTF(&warning, "Failed to read http socket lines in %s (%.10s...) %.3fs",
-				 __func__, rpc_method(rpc_req), elapsed);
-			goto out_empty;
-		}
-	} while (strncmp(cs->buf, "{", 1));
-	tv_time(&fin_tv);
-	elapsed = tvdiff(&fin_tv, &stt_tv);
 	if (elapsed > 5.0) {
 		ASPRINTF(&warning, "HTTP socket read+write took %.3fs in %s (%.10s...)",
 			 elapsed, __func__, rpc_method(rpc_req));
 	}
 
-	val = json_loads(cs->buf, 0, &err_val);
+	val = json_loads(body, 0, &err_val);
 	if (!val) {
 		ASPRINTF(&warning, "JSON decode (%.10s...) failed(%d): %s",
 			 rpc_method(rpc_req), err_val.line, err_val.text);
 	}
-out_empty:
-	empty_socket(cs->fd);
-	empty_buffer(cs);
 out:
+	if (!keepalive)
+		close_rpcconn(rc);
+	put_rpcconn(rc);
+	cksem_post(&cs->sem);
+out_nosem:
 	if (warning) {
 		if (info_only)
 			LOGINFO("%s", warning);
@@ -915,28 +1278,41 @@ out:
 			LOGWARNING("%s", warning);
 		free(warning);
 	}
-	Close(cs->fd);
 	free(http_req);
-	dealloc(cs->buf);
-	cksem_post(&cs->sem);
 	return val;
 }
 
 json_t *json_rpc_call(connsock_t *cs, const char *rpc_req)
 {
-	return _json_rpc_call(cs, rpc_req, false);
+	return _json_rpc_call(cs, rpc_req, RPC_TIMEOUT, false, NULL, NULL);
 }
 
 json_t *json_rpc_response(connsock_t *cs, const char *rpc_req)
 {
-	return _json_rpc_call(cs, rpc_req, true);
+	return _json_rpc_call(cs, rpc_req, RPC_TIMEOUT, true, NULL, NULL);
+}
+
+/* For calls such as long polls that are expected to take a long time, and
+ * may well time out, only logging failures as information. Large responses
+ * can be decoded by a stream function as they arrive. */
+json_t *json_rpc_longpoll(connsock_t *cs, const char *rpc_req, const float timeout,
+			  rpc_stream_fn stream, void *arg)
+{
+	return _json_rpc_call(cs, rpc_req, timeout, true, stream, arg);
+}
+
+/* For large responses that are decoded by the stream function while they are
+ * still arriving. */
+json_t *json_rpc_stream(connsock_t *cs, const char *rpc_req, rpc_stream_fn stream, void *arg)
+{
+	return _json_rpc_call(cs, rpc_req, RPC_TIMEOUT, false, stream, arg);
 }
 
 /* For when we are submitting information that is not important and don't care
  * about the response. */
 void json_rpc_msg(connsock_t *cs, const char *rpc_req)
 {
-	json_t *val = _json_rpc_call(cs, rpc_req, true);
+	json_t *val = _json_rpc_call(cs, rpc_req, RPC_TIMEOUT, true, NULL, NULL);
 
 	/* We don't care about the result */
 	json_decref(val);
@@ -1466,6 +1842,10 @@ static void parse_config(ckpool_t *ckp)
 		ckp->btcsig[38] = '\0';
 	}
 	json_get_int(&ckp->blockpoll, json_conf, "blockpoll");
+	if (!json_get_bool(&ckp->longpoll, json_conf, "longpoll"))
+		ckp->longpoll = true;
+	if (!json_get_bool(&ckp->emptywork, json_conf, "emptywork"))
+		ckp->emptywork = true;
 	json_get_int(&ckp->nonce1length, json_conf, "nonce1length");
 	json_get_int(&ckp->nonce2length, json_conf, "nonce2length");
 	json_get_int(&ckp->update_interval, json_conf, "update_interval");
@@ -1488,6 +1868,11 @@ static void parse_config(ckpool_t *ckp)
 	json_get_int64(&ckp->maxdiff, json_conf, "maxdiff");
 	json_get_string(&ckp->logdir, json_conf, "logdir");
 	json_get_int(&ckp->maxclients, json_conf, "maxclients");
+	json_get_int(&ckp->receivers, json_conf, "receivers");
+	json_get_int(&ckp->proxyreceivers, json_conf, "proxyreceivers");
+	json_get_int(&ckp->standbyproxies, json_conf, "standbyproxies");
+	json_get_int(&ckp->sharelogsync, json_conf, "sharelogsync");
+	json_get_bool(&ckp->sharelogbinary, json_conf, "sharelogbinary");
 	arr_val = json_object_get(json_conf, "proxy");
 	if (arr_val && json_is_array(arr_val)) {
 		arr_size = json_array_size(arr_val);
@@ -1613,10 +1998,13 @@ int main(int argc, char **argv)
 
 	/* Make significant floating point errors fatal to avoid subtle bugs being missed */
 	feenableexcept(FE_DIVBYZERO | FE_INVALID);
-	json_set_alloc_funcs(json_ckalloc, free);
+	json_arena_init();
+	json_set_alloc_funcs(json_ckalloc, json_ckfree);
 
 	global_ckp = &ckp;
 	memset(&ckp, 0, sizeof(ckp));
+	ckp.ckmsg_slab = create_slab("ckmsg", sizeof(ckmsg_t));
+	ckp.submit_slab = create_slab("submit", sizeof(submit_t));
 	ckp.starttime = time(NULL);
 	ckp.startpid = getpid();
 	ckp.loglevel = LOG_NOTICE;
@@ -1821,6 +2209,10 @@ int main(int argc, char **argv)
 		ckp.startdiff = 42;
 	if (!ckp.logdir)
 		ckp.logdir = strdup("logs");
+	if (ckp.receivers < 1)
+		ckp.receivers = 1;
+	if (ckp.proxyreceivers < 1)
+		ckp.proxyreceivers = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
 	if (!ckp.serverurls)
 		ckp.serverurl = ckzalloc(sizeof(char *));
 	if (ckp.proxy && !ckp.proxies)
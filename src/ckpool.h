@@ -21,6 +21,13 @@
 
 #define RPC_TIMEOUT 60
 
+/* Maximum number of concurrent json rpc calls, each on its own persistent
+ * connection, to any one bitcoind */
+#define RPC_CONNS 4
+
+/* How long to wait on a getblocktemplate long poll before reissuing it */
+#define LONGPOLL_TIMEOUT 300
+
 struct ckpool_instance;
 typedef struct ckpool_instance ckpool_t;
 
@@ -41,16 +48,48 @@ struct unix_msg {
 	char *buf;
 };
 
+/* Size of the lock free ring of each ckmsgq, messages spilling over into its
+ * locked msgs list when full */
+#define CKMSGQ_RING	4096
+
+struct ckmsgq_cell {
+	int64_t seq;
+	void *data;
+};
+
+typedef struct ckmsgq_cell ckmsgq_cell_t;
+
 struct ckmsgq {
 	ckpool_t *ckp;
 	char name[16];
 	pthread_t pth;
-	mutex_t *lock;
-	pthread_cond_t *cond;
-	ckmsg_t *msgs;
 	void (*func)(ckpool_t *, void *);
 	int64_t messages;
 	bool active;
+	int threads; /* Number of threads processing this queue */
+
+	/* Set for queues that process up to batch messages at a time */
+	void (*batchfunc)(ckpool_t *, void **, int);
+	int batch;
+
+	/* Bounded multi producer multi consumer ring of message data */
+	ckmsgq_cell_t *cells;
+	int64_t enqueue_pos __attribute__((aligned(64)));
+	int64_t dequeue_pos __attribute__((aligned(64)));
+
+	/* Futex sleeping threads wait on and how many of them there are */
+	int wakeups __attribute__((aligned(64)));
+	int waiters;
+	/* Messages a thread in ckmsgq_wait_fill needs queued to be woken */
+	int fill;
+
+	/* Protects the lists of messages that did not fit in the ring and
+	 * of high priority messages, both of which are rarely used */
+	mutex_t lock;
+	ckmsg_t *msgs;
+	int overflow;
+	ckmsg_t *prio;
+	int priority;
 };
 
 typedef struct ckmsgq ckmsgq_t;
@@ -72,6 +111,24 @@ struct proc_instance {
 	pthread_cond_t rmsg_cond;
 };
 
+/* A keep-alive HTTP connection used by one json rpc call at a time */
+struct rpcconn {
+	int busy;
+	bool connected;
+	int fd;
+
+	char *buf;
+	int buflen;
+	int bufsize;
+};
+
+typedef struct rpcconn rpcconn_t;
+
+/* Called with the body of a successful json rpc response each time more of it
+ * arrives, and once more with complete set when it all has. The body may be
+ * modified in place before it is decoded. */
+typedef void (*rpc_stream_fn)(void *arg, char *body, const int len, const bool complete);
+
 struct connsock {
 	int fd;
 	char *url;
@@ -86,8 +143,10 @@ struct connsock {
 	int sendbufsiz;
 
 	ckpool_t *ckp;
-	/* Semaphore used to serialise request/responses */
+	/* Semaphore used to serialise request/responses, or to limit the
+	 * json rpc calls in flight to the number of rpcconns */
 	sem_t sem;
+	rpcconn_t rpcconns[RPC_CONNS];
 
 	bool alive;
 };
@@ -141,6 +200,10 @@ struct ckpool_instance {
 	bool killold;
 	/* Whether to log shares or not */
 	bool logshares;
+	/* Seconds between syncing share logs to disk, 0 to leave it to the OS */
+	int sharelogsync;
+	/* Write share logs in the compact binary format instead of json */
+	bool sharelogbinary;
 	/* Logging level */
 	int loglevel;
 	/* Main process name */
@@ -168,6 +231,10 @@ struct ckpool_instance {
 	bool handover;
 	/* How many clients maximum to accept before rejecting further */
 	int maxclients;
+	/* Number of connector receiver threads */
+	int receivers;
+	/* Number of generator threads receiving from upstream proxies */
+	int proxyreceivers;
 
 	/* API message queue */
 	ckmsgq_t *ckpapi;
@@ -176,6 +243,11 @@ struct ckpool_instance {
 	ckmsgq_t *logger;
 	ckmsgq_t *console_logger;
 
+	/* List entries for messages that don't fit in a ckmsgq ring */
+	slab_t *ckmsg_slab;
+	/* Submits scanned by the connector and freed by the stratifier */
+	slab_t *submit_slab;
+
 	/* Process instance data of parent/child processes */
 	proc_instance_t main;
 
@@ -231,6 +303,9 @@ struct ckpool_instance {
 	char **btcdpass;
 	bool *btcdnotify;
 	int blockpoll; // How frequently in ms to poll bitcoind for block updates
+	bool longpoll; // Use getblocktemplate long polls instead of blockpoll
+	bool emptywork; // Send work with no transactions on a new block until the template is ready
+	char chain[16]; // Network bitcoind is on, eg main or regtest, empty if unknown
 	int nonce1length; // Extranonce1 length
 	int nonce2length; // Extranonce2 length
 
@@ -260,6 +335,7 @@ struct ckpool_instance {
 	char **proxyurl;
 	char **proxyauth;
 	char **proxypass;
+	int standbyproxies; // Backup proxies kept with room for all clients
 
 	/* Passthrough redirect options */
 	int redirecturls;
@@ -335,9 +411,14 @@ static const char __maybe_unused *stratum_msgs[] = {
 void get_timestamp(char *stamp);
 
 ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func);
-ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count);
+ckmsgq_t **create_ckmsgq_shards(ckpool_t *ckp, const char *name, const void *func, const int count);
+ckmsgq_t *create_ckmsgq_batch(ckpool_t *ckp, const char *name, const void *func, const int batch);
 bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line);
 #define ckmsgq_add(ckmsgq, data) _ckmsgq_add(ckmsgq, data, __FILE__, __func__, __LINE__)
+void ckmsgq_add_list(ckmsgq_t *ckmsgq, ckmsg_t *msgs, const int count, const bool prio);
+int ckmsgq_pop(ckmsgq_t *ckmsgq, void **data, const int max);
+int ckmsgq_count(ckmsgq_t *ckmsgq);
+void ckmsgq_wait_fill(ckmsgq_t *ckmsgq, const int fill, const int ms);
 bool ckmsgq_empty(ckmsgq_t *ckmsgq);
 unix_msg_t *get_unix_msg(proc_instance_t *pi);
 
@@ -361,6 +442,9 @@ char *_ckdb_msg_call(const ckpool_t *ckp, const char *msg,  const char *file, co
 
 json_t *json_rpc_call(connsock_t *cs, const char *rpc_req);
 json_t *json_rpc_response(connsock_t *cs, const char *rpc_req);
+json_t *json_rpc_longpoll(connsock_t *cs, const char *rpc_req, const float timeout,
+			  rpc_stream_fn stream, void *arg);
+json_t *json_rpc_stream(connsock_t *cs, const char *rpc_req, rpc_stream_fn stream, void *arg);
 void json_rpc_msg(connsock_t *cs, const char *rpc_req);
 bool send_json_msg(connsock_t *cs, const json_t *json_msg);
 json_t *json_msg_result(const char *msg, json_t **res_val, json_t **err_val);
@@ -0,0 +1,197 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Converts binary share logs back to the json lines ckpool would otherwise
+ * write, optionally only for shares of one user and/or workinfoid. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "sharelog.h"
+
+struct sharelog_dict {
+	char **strings;
+	uint32_t size;
+};
+
+typedef struct sharelog_dict sharelog_dict_t;
+
+static const char *dict_string(const sharelog_dict_t *dict, const uint32_t id)
+{
+	if (!id || id >= dict->size)
+		return NULL;
+	return dict->strings[id];
+}
+
+static bool read_string(FILE *fp, sharelog_dict_t *dict)
+{
+	sharelog_string_t rec;
+	char *str;
+
+	if (fread((char *)&rec + 1, sizeof(rec) - 1, 1, fp) != 1)
+		return false;
+	str = ckalloc(rec.len + 1);
+	if (rec.len && fread(str, rec.len, 1, fp) != 1) {
+		free(str);
+		return false;
+	}
+	str[rec.len] = '\0';
+	if (rec.id >= dict->size) {
+		uint32_t size = rec.id + 1024;
+
+		dict->strings = realloc(dict->strings, sizeof(char *) * size);
+		if (unlikely(!dict->strings))
+			quit(1, "Failed to realloc dictionary of %u strings", size);
+		memset(dict->strings + dict->size, 0, sizeof(char *) * (size - dict->size));
+		dict->size = size;
+	}
+	free(dict->strings[rec.id]);
+	dict->strings[rec.id] = str;
+	return true;
+}
+
+static void set_hex(json_t *val, const char *key, const uint8_t *bin, const int len)
+{
+	char hex[68];
+
+	__bin2hex(hex, bin, len);
+	json_set_string(val, key, hex);
+}
+
+static void set_dict_string(json_t *val, const char *key, const sharelog_dict_t *dict,
+			    const uint32_t id)
+{
+	const char *str = dict_string(dict, id);
+
+	if (str)
+		json_set_string(val, key, str);
+}
+
+/* Build the json of a share in the same key order as parse_submit */
+static json_t *share_json(const sharelog_share_t *rec, const sharelog_dict_t *dict)
+{
+	json_t *val = json_object();
+	char cdfield[64];
+
+	json_set_int64(val, "workinfoid", rec->workinfoid);
+	json_set_int64(val, "clientid", rec->clientid);
+	set_hex(val, "enonce1", rec->enonce1, rec->enonce1len);
+	set_dict_string(val, "secondaryuserid", dict, rec->strings[SHARELOG_SECONDARYUSERID]);
+	set_hex(val, "nonce2", rec->nonce2, rec->nonce2len);
+	set_hex(val, "nonce", rec->nonce, 4);
+	set_hex(val, "ntime", rec->ntime, 4);
+	json_set_double(val, "diff", rec->diff);
+	json_set_double(val, "sdiff", rec->sdiff);
+	set_hex(val, "hash", rec->hash, rec->hashlen);
+	json_set_bool(val, "result", rec->result);
+	if (rec->errn)
+		json_set_string(val, "reject-reason", SHARE_ERR(rec->errn));
+	json_set_int(val, "errn", rec->errn);
+	sprintf(cdfield, "%ld,%d", (long)rec->createdate, rec->createdate_ns);
+	json_set_string(val, "createdate", cdfield);
+	json_set_string(val, "createby", "code");
+	json_set_string(val, "createcode", "parse_submit");
+	set_dict_string(val, "createinet", dict, rec->strings[SHARELOG_CREATEINET]);
+	set_dict_string(val, "workername", dict, rec->strings[SHARELOG_WORKERNAME]);
+	set_dict_string(val, "username", dict, rec->strings[SHARELOG_USERNAME]);
+	set_dict_string(val, "address", dict, rec->strings[SHARELOG_ADDRESS]);
+	set_dict_string(val, "agent", dict, rec->strings[SHARELOG_AGENT]);
+	return val;
+}
+
+static int read_sharelog(FILE *fp, const char *fname, const char *username, const int64_t wid)
+{
+	sharelog_dict_t dict = {};
+	sharelog_header_t header;
+	sharelog_share_t rec;
+	int type, ret = 1;
+	json_t *val;
+	uint32_t i;
+	char *buf;
+
+	if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != SHARELOG_MAGIC) {
+		LOGERR("%s is not a binary share log", fname);
+		goto out;
+	}
+	if (header.version != SHARELOG_VERSION) {
+		LOGERR("%s has unsupported version %u", fname, header.version);
+		goto out;
+	}
+	while ((type = fgetc(fp)) != EOF) {
+		if (type == SHARELOG_STRING) {
+			if (!read_string(fp, &dict))
+				goto out_short;
+			continue;
+		}
+		if (type != SHARELOG_SHARE) {
+			LOGERR("Invalid record type %d in %s", type, fname);
+			goto out;
+		}
+		rec.type = type;
+		if (fread((char *)&rec + 1, sizeof(rec) - 1, 1, fp) != 1)
+			goto out_short;
+		if (wid >= 0 && rec.workinfoid != wid)
+			continue;
+		if (username && safecmp(username, dict_string(&dict, rec.strings[SHARELOG_USERNAME])))
+			continue;
+		val = share_json(&rec, &dict);
+		buf = json_dumps(val, JSON_EOL);
+		fputs(buf, stdout);
+		free(buf);
+		json_decref(val);
+	}
+	ret = 0;
+	goto out;
+out_short:
+	LOGERR("Truncated record in %s", fname);
+out:
+	for (i = 0; i < dict.size; i++)
+		free(dict.strings[i]);
+	free(dict.strings);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	char *username = NULL;
+	int64_t wid = -1;
+	int c, i, ret = 0;
+
+	while ((c = getopt(argc, argv, "u:i:")) != -1) {
+		switch(c) {
+			case 'u':
+				username = strdup(optarg);
+				break;
+			case 'i':
+				wid = strtoll(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-u USER] [-i WORKINFOID] [FILE...]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (optind >= argc)
+		exit(read_sharelog(stdin, "stdin", username, wid));
+	for (i = optind; i < argc; i++) {
+		FILE *fp = fopen(argv[i], "re");
+
+		if (!fp) {
+			LOGERR("Failed to open %s", argv[i]);
+			ret = 1;
+			continue;
+		}
+		ret |= read_sharelog(fp, argv[i], username, wid);
+		fclose(fp);
+	}
+	dealloc(username);
+	exit(ret);
+}
@@ -10,6 +10,7 @@
 #include "config.h"
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
@@ -24,14 +25,21 @@
 #include "generator.h"
 
 #define MAX_MSGSIZE 1024
+#define RECEIVER_EVENTS 64
+#define SENDER_EVENTS 64
+#define CLIENT_SHARDS 64
 
 typedef struct client_instance client_instance_t;
+typedef struct receiver_instance receiver_t;
 typedef struct sender_send sender_send_t;
+typedef struct bcast bcast_t;
+typedef struct cmp_msg cmp_msg_t;
 typedef struct share share_t;
 typedef struct redirect redirect_t;
+typedef struct client_shard client_shard_t;
 
 struct client_instance {
-	/* For clients hashtable */
+	/* For clients hashtable shard */
 	UT_hash_handle hh;
 	int64_t id;
 
@@ -39,7 +47,7 @@ struct client_instance {
 	int fd;
 
 	/* Reference count for when this instance is used outside of the
-	 * connector_data lock */
+	 * connector_data lock, only modified atomically */
 	int ref;
 
 	/* Have we disabled this client to be removed when there are no refs? */
@@ -56,11 +64,22 @@ struct client_instance {
 	/* Which serverurl is this instance connected to */
 	int server;
 
+	/* Which receiver's epoll set this client is on */
+	receiver_t *receiver;
+
 	char *buf;
 	unsigned long bufofs;
 
-	/* Are we currently sending a blocked message from this client */
-	sender_send_t *sending;
+	/* Queue of pending sends to this client */
+	sender_send_t *sends;
+	/* Is a thread currently writing out this client's sends, including
+	 * while it is parked waiting for the socket to be writable */
+	bool sending;
+	/* Is this client parked on the sender epoll */
+	bool parked;
+	/* For the parked_clients list */
+	client_instance_t *parked_next;
+	client_instance_t *parked_prev;
 
 	/* Is this a trusted remote server */
 	bool remote;
@@ -91,6 +110,28 @@ struct sender_send {
 	char *buf;
 	int len;
 	int ofs;
+
+	/* The broadcast buf belongs to if it is shared */
+	bcast_t *bcast;
+};
+
+/* A message serialised once and shared by the send queues of all the clients
+ * it is broadcast to. Freed when the last reference is dropped. */
+struct bcast {
+	char *buf;
+	int len;
+	int ref;
+
+	/* The clients to broadcast to, freed once queued */
+	int64_t *client_ids;
+	int clients;
+};
+
+/* Messages for the client message processor, either a json message for one
+ * client or a broadcast */
+struct cmp_msg {
+	json_t *val;
+	bcast_t *bcast;
 };
 
 struct share {
@@ -101,6 +142,13 @@ struct share {
 	int64_t id;
 };
 
+/* The clients hashtable is split into shards by id, each with its own lock,
+ * so that lookups only ever take a shared lock on one shard. */
+struct client_shard {
+	rwlock_t lock;
+	client_instance_t *clients;
+};
+
 struct redirect {
 	UT_hash_handle hh;
 	char address_name[INET6_ADDRSTRLEN];
@@ -120,15 +168,18 @@ struct connector_data {
 	int *serverfd;
 	/* All time count of clients connected */
 	int nfds;
-	/* The epoll fd */
-	int epfd;
 
 	bool accept;
 	pthread_t pth_sender;
-	pthread_t pth_receiver;
 
-	/* For the hashtable of all clients */
-	client_instance_t *clients;
+	/* Array of receiver threads each with their own epoll set */
+	receiver_t *receivers;
+	int receiver_count;
+
+	/* For the hashtable shards of all clients */
+	client_shard_t shards[CLIENT_SHARDS];
+	/* Number of clients in the shards, only modified atomically */
+	int clients;
 	/* Linked list of dead clients no longer in use but may still have references */
 	client_instance_t *dead_clients;
 	/* Linked list of client structures we can reuse */
@@ -141,21 +192,34 @@ struct connector_data {
 
 	/* client message process queue */
 	ckmsgq_t *cmpq;
+	slab_t *cmp_slab;
 
-	/* client message event process queue */
-	ckmsgq_t *cevents;
-
-	/* For the linked list of pending sends */
-	sender_send_t *sender_sends;
+	/* Queued client sends */
+	slab_t *send_slab;
 
 	int64_t sends_generated;
 	int64_t sends_delayed;
 	int64_t sends_queued;
 	int64_t sends_size;
 
-	/* For protecting the pending sends list */
+	/* Broadcast buffers currently referenced */
+	int64_t bcasts;
+	int64_t bcasts_size;
+	int64_t bcasts_generated;
+
+	/* mining.submit lines scanned directly and those parsed as json */
+	int64_t submits_scanned;
+	int64_t submits_parsed;
+
+	/* For protecting the per client send queues and parked list */
 	mutex_t sender_lock;
-	pthread_cond_t sender_cond;
+
+	/* Linked list of clients waiting for their sockets to be writable */
+	client_instance_t *parked_clients;
+	int parked;
+
+	/* The epoll fd of parked clients */
+	int sender_epfd;
 
 	/* Hash list of all redirected IP address in redirector mode */
 	redirect_t *redirects;
@@ -169,6 +233,25 @@ struct connector_data {
 
 typedef struct connector_data cdata_t;
 
+struct receiver_instance {
+	cdata_t *cdata;
+	int id;
+	pthread_t pth;
+
+	/* The epoll fd */
+	int epfd;
+	/* Array of listening fds, one per serverurl. These are SO_REUSEPORT
+	 * copies of the connector's serverfds where possible, otherwise the
+	 * serverfds themselves shared with EPOLLEXCLUSIVE. */
+	int *serverfd;
+
+	/* Clients on this epoll set, protected by the cdata lock */
+	int clients;
+	/* Stats only modified by this receiver's thread */
+	int64_t events;
+	int64_t accepts;
+};
+
 void connector_upstream_msg(ckpool_t *ckp, char *msg)
 {
 	cdata_t *cdata = ckp->cdata;
@@ -177,30 +260,44 @@ void connector_upstream_msg(ckpool_t *ckp, char *msg)
 	ckmsgq_add(cdata->upstream_sends, msg);
 }
 
-/* Increase the reference count of instance */
-static void __inc_instance_ref(client_instance_t *client)
+/* Increase the reference count of instance. Reference counts are atomic so
+ * these need no lock. */
+static void inc_instance_ref(client_instance_t *client)
 {
-	client->ref++;
+	__sync_add_and_fetch(&client->ref, 1);
 }
 
-static void inc_instance_ref(cdata_t *cdata, client_instance_t *client)
+/* Decrease the reference count of instance */
+static void dec_instance_ref(client_instance_t *client)
 {
-	ck_wlock(&cdata->lock);
-	__inc_instance_ref(client);
-	ck_wunlock(&cdata->lock);
+	__sync_sub_and_fetch(&client->ref, 1);
 }
 
-/* Increase the reference count of instance */
-static void __dec_instance_ref(client_instance_t *client)
+static client_shard_t *client_shard(cdata_t *cdata, const int64_t id)
 {
-	client->ref--;
+	return &cdata->shards[id & (CLIENT_SHARDS - 1)];
 }
 
-static void dec_instance_ref(cdata_t *cdata, client_instance_t *client)
+/* Clients are only ever added to or removed from the shards with the cdata
+ * lock held so it is safe to iterate over them under that lock alone. */
+static void add_client_shard(cdata_t *cdata, client_instance_t *client)
 {
-	ck_wlock(&cdata->lock);
-	__dec_instance_ref(client);
-	ck_wunlock(&cdata->lock);
+	client_shard_t *shard = client_shard(cdata, client->id);
+
+	wr_lock(&shard->lock);
+	HASH_ADD_I64(shard->clients, id, client);
+	wr_unlock(&shard->lock);
+	__sync_add_and_fetch(&cdata->clients, 1);
+}
+
+static void del_client_shard(cdata_t *cdata, client_instance_t *client)
+{
+	client_shard_t *shard = client_shard(cdata, client->id);
+
+	wr_lock(&shard->lock);
+	HASH_DEL(shard->clients, client);
+	wr_unlock(&shard->lock);
+	__sync_sub_and_fetch(&cdata->clients, 1);
 }
 
 /* Recruit a client structure from a recycled one if available, creating a
@@ -259,8 +356,9 @@ int64_t connector_newclientid(ckpool_t *ckp)
 
 /* Accepts incoming connections on the server socket and generates client
  * instances */
-static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
+static int accept_client(receiver_t *receiver, const uint64_t server)
 {
+	cdata_t *cdata = receiver->cdata;
 	int fd, port, no_clients, sockd;
 	ckpool_t *ckp = cdata->ckp;
 	client_instance_t *client;
@@ -268,26 +366,25 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 	socklen_t address_len;
 	socklen_t optlen;
 
-	ck_rlock(&cdata->lock);
-	no_clients = HASH_COUNT(cdata->clients);
-	ck_runlock(&cdata->lock);
+	no_clients = cdata->clients;
 
 	if (unlikely(ckp->maxclients && no_clients >= ckp->maxclients)) {
 		LOGWARNING("Server full with %d clients", no_clients);
 		return 0;
 	}
 
-	sockd = cdata->serverfd[server];
+	sockd = receiver->serverfd[server];
 	client = recruit_client(cdata);
 	client->server = server;
 	client->address = (struct sockaddr *)&client->address_storage;
 	address_len = sizeof(client->address_storage);
 	fd = accept(sockd, client->address, &address_len);
 	if (unlikely(fd < 0)) {
-		/* Handle these errors gracefully should we ever share this
-		 * socket */
+		/* Handle these errors gracefully as the socket may be shared
+		 * with other receivers who beat us to this connection */
 		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
-			LOGERR("Recoverable error on accept in accept_client");
+			LOGDEBUG("Recoverable error on accept in accept_client");
+			recycle_client(cdata, client);
 			return 0;
 		}
 		LOGERR("Failed to accept on socket %d in acceptor", sockd);
@@ -325,14 +422,17 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 
 	ck_wlock(&cdata->lock);
 	client->id = cdata->client_ids++;
-	HASH_ADD_I64(cdata->clients, id, client);
+	add_client_shard(cdata, client);
+	client->receiver = receiver;
+	receiver->clients++;
 	cdata->nfds++;
 	ck_wunlock(&cdata->lock);
+	receiver->accepts++;
 
 	/* We increase the ref count on this client as epoll creates a pointer
 	 * to it. We drop that reference when the socket is closed which
 	 * removes it automatically from the epoll list. */
-	__inc_instance_ref(client);
+	inc_instance_ref(client);
 	client->fd = fd;
 	optlen = sizeof(client->sendbufsize);
 	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &client->sendbufsize, &optlen);
@@ -340,9 +440,9 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 
 	event.data.u64 = client->id;
 	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
+	if (unlikely(epoll_ctl(receiver->epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
 		LOGERR("Failed to epoll_ctl add in accept_client");
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 		return 0;
 	}
 
@@ -359,11 +459,13 @@ static int __drop_client(cdata_t *cdata, client_instance_t *client)
 	ret = client->fd;
 	/* Closing the fd will automatically remove it from the epoll list */
 	Close(client->fd);
-	HASH_DEL(cdata->clients, client);
+	del_client_shard(cdata, client);
+	if (likely(client->receiver))
+		client->receiver->clients--;
 	DL_APPEND(cdata->dead_clients, client);
 	/* This is the reference to this client's presence in the
 	 * epoll list. */
-	__dec_instance_ref(client);
+	dec_instance_ref(client);
 	cdata->dead_generated++;
 out:
 	return ret;
@@ -459,10 +561,13 @@ static int invalidate_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *c
 static void drop_all_clients(cdata_t *cdata)
 {
 	client_instance_t *client, *tmp;
+	int i;
 
 	ck_wlock(&cdata->lock);
-	HASH_ITER(hh, cdata->clients, client, tmp) {
-		__drop_client(cdata, client);
+	for (i = 0; i < CLIENT_SHARDS; i++) {
+		HASH_ITER(hh, cdata->shards[i].clients, client, tmp) {
+			__drop_client(cdata, client);
+		}
 	}
 	ck_wunlock(&cdata->lock);
 }
@@ -503,10 +608,172 @@ static void parse_redirector_share(cdata_t *cdata, client_instance_t *client, co
 	ck_wunlock(&cdata->lock);
 }
 
+static char *skip_ws(char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	return p;
+}
+
+/* Terminate a json string in place and return its start, or NULL if it is
+ * anything but plain printable ascii without escapes. */
+static char *scan_string(char **pp)
+{
+	char *p = *pp, *s;
+
+	if (*p != '"')
+		return NULL;
+	s = ++p;
+	while (*p != '"') {
+		if ((uchar)*p < 0x20 || (uchar)*p > 0x7e || *p == '\\')
+			return NULL;
+		p++;
+	}
+	*p++ = '\0';
+	*pp = p;
+	return s;
+}
+
+/* A json integer without fraction or exponent that fits an int64 */
+static bool scan_int(char **pp, int64_t *val)
+{
+	bool neg = false;
+	int digits = 0;
+	char *p = *pp;
+	int64_t v = 0;
+
+	if (*p == '-') {
+		neg = true;
+		p++;
+	}
+	if (*p == '0' && isdigit((uchar)p[1]))
+		return false;
+	while (isdigit((uchar)*p)) {
+		if (++digits > 18)
+			return false;
+		v = v * 10 + *p++ - '0';
+	}
+	if (!digits || *p == '.' || *p == 'e' || *p == 'E')
+		return false;
+	*val = neg ? -v : v;
+	*pp = p;
+	return true;
+}
+
+static bool scan_literal(char **pp, const char *literal)
+{
+	int len = strlen(literal);
+
+	if (strncmp(*pp, literal, len))
+		return false;
+	*pp += len;
+	return true;
+}
+
+static bool scan_id(submit_t *submit, char **pp)
+{
+	if (**pp == '"') {
+		submit->id = scan_string(pp);
+		return submit->id != NULL;
+	}
+	if (scan_literal(pp, "null")) {
+		submit->id_null = true;
+		return true;
+	}
+	return scan_int(pp, &submit->id_int);
+}
+
+/* Returns the number of string params scanned or zero on failure */
+static int scan_params(submit_t *submit, char **pp)
+{
+	const char **fields[] = { &submit->workername, &submit->job_id, &submit->nonce2,
+				  &submit->ntime, &submit->nonce, &submit->version_mask };
+	char *p = *pp, *str;
+	int params = 0;
+
+	if (*p++ != '[')
+		return 0;
+	do {
+		p = skip_ws(p);
+		if (params >= (int)(sizeof(fields) / sizeof(fields[0])) || !(str = scan_string(&p)))
+			return 0;
+		*fields[params++] = str;
+		p = skip_ws(p);
+	} while (*p++ == ',');
+	if (p[-1] != ']')
+		return 0;
+	*pp = p;
+	return params;
+}
+
+/* Shares make up the bulk of client traffic so mining.submit lines are
+ * scanned straight into a submit_t instead of being built into json. Anything
+ * that is not a simple well formed submit returns NULL and is left for the
+ * json parser to handle, including rejecting it. Submits come from a slab
+ * so scanning never touches the heap. */
+static submit_t *scan_submit(ckpool_t *ckp, const char *line, const int len)
+{
+	bool method = false, id = false;
+	submit_t *submit;
+	int params = 0;
+	int64_t dummy;
+	char *p, *key;
+
+	if (len >= SUBMIT_BUFLEN || !memmem(line, len, "mining.submit", 13))
+		return NULL;
+
+	submit = slab_alloc(ckp->submit_slab);
+	submit->id = NULL;
+	submit->id_null = false;
+	submit->version_mask = NULL;
+	submit->hashed = false;
+	memcpy(submit->buf, line, len);
+	submit->buf[len] = '\0';
+
+	p = skip_ws(submit->buf);
+	if (*p++ != '{')
+		goto out_fail;
+	do {
+		p = skip_ws(p);
+		if (!(key = scan_string(&p)))
+			goto out_fail;
+		p = skip_ws(p);
+		if (*p++ != ':')
+			goto out_fail;
+		p = skip_ws(p);
+		if (!strcmp(key, "method")) {
+			char *str = scan_string(&p);
+
+			if (method || !str || strcmp(str, "mining.submit"))
+				goto out_fail;
+			method = true;
+		} else if (!strcmp(key, "id")) {
+			if (id || !scan_id(submit, &p))
+				goto out_fail;
+			id = true;
+		} else if (!strcmp(key, "params")) {
+			if (params || !(params = scan_params(submit, &p)))
+				goto out_fail;
+		} else if (!scan_string(&p) && !scan_literal(&p, "null") &&
+			   !scan_literal(&p, "true") && !scan_literal(&p, "false") &&
+			   !scan_int(&p, &dummy))
+			goto out_fail;
+		p = skip_ws(p);
+	} while (*p++ == ',');
+	if (p[-1] != '}' || !method || !id || params < 5)
+		goto out_fail;
+	return submit;
+
+out_fail:
+	slab_free(ckp->submit_slab, submit);
+	return NULL;
+}
+
 /* Client is holding a reference count from being on the epoll list. Returns
  * true if we will still be receiving messages from this client. */
 static bool parse_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
 {
+	submit_t *submit;
 	int buflen, ret;
 	json_t *val;
 	char *eol;
@@ -542,9 +809,28 @@ reparse:
 		return false;
 	}
 
+	if (!ckp->passthrough && !ckp->node && !client->passthrough && !client->remote &&
+	    (submit = scan_submit(ckp, client->buf, buflen))) {
+		__sync_add_and_fetch(&cdata->submits_scanned, 1);
+		submit->client_id = client->id;
+		if (likely(!client->invalid))
+			stratifier_add_submit(ckp, submit);
+		else
+			slab_free(ckp->submit_slab, submit);
+		goto out_consumed;
+	}
+
+	/* Miners' messages are parsed into this thread's json arena. The
+	 * json is freed by the stratifier once it has handled the message, and
+	 * must not be kept beyond that. Remote servers' messages can be kept
+	 * so they always come from malloc. */
+	if (!client->remote)
+		json_arena_begin();
 	if (!(val = json_loads(client->buf, JSON_DISABLE_EOF_CHECK, NULL))) {
 		char *buf = strdup("Invalid JSON, disconnecting\n");
 
+		if (!client->remote)
+			json_arena_end();
 		LOGINFO("Client id %"PRId64" sent invalid json message %s", client->id, client->buf);
 		send_client(ckp, cdata, client->id, buf);
 		return false;
@@ -556,8 +842,11 @@ reparse:
 			passthrough_id = (client->id << 32) | passthrough_id;
 			json_object_set_new_nocheck(val, "client_id", json_integer(passthrough_id));
 		} else {
-			if (ckp->redirector && !client->redirected && strstr(client->buf, "mining.submit"))
-				parse_redirector_share(cdata, client, val);
+			if (strstr(client->buf, "mining.submit")) {
+				if (ckp->redirector && !client->redirected)
+					parse_redirector_share(cdata, client, val);
+				__sync_add_and_fetch(&cdata->submits_parsed, 1);
+			}
 			json_object_set_new_nocheck(val, "client_id", json_integer(client->id));
 			json_object_set_new_nocheck(val, "address", json_string(client->address_name));
 		}
@@ -575,7 +864,10 @@ reparse:
 				generator_add_send(ckp, val);
 		} else
 			json_decref(val);
+		if (!client->remote)
+			json_arena_end();
 	}
+out_consumed:
 	client->bufofs -= buflen;
 	if (client->bufofs)
 		memmove(client->buf, client->buf + buflen, client->bufofs);
@@ -588,17 +880,18 @@ reparse:
 
 static client_instance_t *ref_client_by_id(cdata_t *cdata, int64_t id)
 {
+	client_shard_t *shard = client_shard(cdata, id);
 	client_instance_t *client;
 
-	ck_wlock(&cdata->lock);
-	HASH_FIND_I64(cdata->clients, &id, client);
+	rd_lock(&shard->lock);
+	HASH_FIND_I64(shard->clients, &id, client);
 	if (client) {
 		if (!client->invalid)
-			__inc_instance_ref(client);
+			inc_instance_ref(client);
 		else
 			client = NULL;
 	}
-	ck_wunlock(&cdata->lock);
+	rd_unlock(&shard->lock);
 
 	return client;
 }
@@ -626,7 +919,7 @@ static void client_event_processor(ckpool_t *ckp, struct epoll_event *event)
 	client = ref_client_by_id(cdata, id);
 	if (unlikely(!client)) {
 		LOGNOTICE("Failed to find client by id %"PRId64" in receiver!", id);
-		goto outnoclient;
+		return;
 	}
 	/* We can have both messages and read hang ups so process the
 	 * message first. */
@@ -667,37 +960,41 @@ out:
 		/* Rearm the fd in the epoll list if it's still active */
 		event->data.u64 = id;
 		event->events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-		epoll_ctl(cdata->epfd, EPOLL_CTL_MOD, client->fd, event);
+		epoll_ctl(client->receiver->epfd, EPOLL_CTL_MOD, client->fd, event);
 	}
-	dec_instance_ref(cdata, client);
-outnoclient:
-	free(event);
+	dec_instance_ref(client);
 }
 
-/* Waits on fds ready to read on from the list stored in conn_instance and
- * handles the incoming messages */
+/* Each receiver waits on fds ready to read on from its own epoll set and
+ * handles the incoming messages directly, fetching events in batches. */
 static void *receiver(void *arg)
 {
-	cdata_t *cdata = (cdata_t *)arg;
-	struct epoll_event *event = ckzalloc(sizeof(struct epoll_event));
+	struct epoll_event events[RECEIVER_EVENTS];
+	receiver_t *receiver = (receiver_t *)arg;
+	cdata_t *cdata = receiver->cdata;
 	ckpool_t *ckp = cdata->ckp;
-	uint64_t serverfds, i;
-	int ret, epfd;
+	int ret, epfd, nevents, i;
+	uint64_t serverfds, j;
+	char buf[16];
 
-	rename_proc("creceiver");
+	sprintf(buf, "creceiver%d", receiver->id);
+	rename_proc(buf);
 
-	epfd = cdata->epfd = epoll_create1(EPOLL_CLOEXEC);
-	if (epfd < 0) {
-		LOGEMERG("FATAL: Failed to create epoll in receiver");
-		goto out;
-	}
+	epfd = receiver->epfd;
 	serverfds = ckp->serverurls;
 	/* Add all the serverfds to the epoll */
-	for (i = 0; i < serverfds; i++) {
+	for (j = 0; j < serverfds; j++) {
+		struct epoll_event event;
+
 		/* The small values will be less than the first client ids */
-		event->data.u64 = i;
-		event->events = EPOLLIN | EPOLLRDHUP;
-		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, cdata->serverfd[i], event);
+		event.data.u64 = j;
+		event.events = EPOLLIN | EPOLLRDHUP;
+#ifdef EPOLLEXCLUSIVE
+		/* Only wake one receiver for sockets shared between them */
+		if (receiver->id && receiver->serverfd[j] == cdata->serverfd[j])
+			event.events = EPOLLIN | EPOLLEXCLUSIVE;
+#endif
+		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, receiver->serverfd[j], &event);
 		if (ret < 0) {
 			LOGEMERG("FATAL: Failed to add epfd %d to epoll_ctl", epfd);
 			goto out;
@@ -709,53 +1006,119 @@ static void *receiver(void *arg)
 		cksleep_ms(10);
 
 	while (42) {
-		uint64_t edu64;
-
 		while (unlikely(!cdata->accept))
 			cksleep_ms(10);
-		ret = epoll_wait(epfd, event, 1, 1000);
-		if (unlikely(ret < 1)) {
-			if (unlikely(ret == -1)) {
+		nevents = epoll_wait(epfd, events, RECEIVER_EVENTS, 1000);
+		if (unlikely(nevents < 1)) {
+			if (unlikely(nevents == -1)) {
 				LOGEMERG("FATAL: Failed to epoll_wait in receiver");
 				break;
 			}
 			/* Nothing to service, still very unlikely */
 			continue;
 		}
-		edu64 = event->data.u64;
-		if (edu64 < serverfds) {
-			ret = accept_client(cdata, epfd, edu64);
-			if (unlikely(ret < 0)) {
-				LOGEMERG("FATAL: Failed to accept_client in receiver");
-				break;
+		receiver->events += nevents;
+		for (i = 0; i < nevents; i++) {
+			uint64_t edu64 = events[i].data.u64;
+
+			if (edu64 < serverfds) {
+				ret = accept_client(receiver, edu64);
+				if (unlikely(ret < 0)) {
+					LOGEMERG("FATAL: Failed to accept_client in receiver");
+					goto out;
+				}
+				continue;
 			}
-			continue;
+			client_event_processor(ckp, &events[i]);
 		}
-		/* Event structure is handed off to client_event_processor
-		 * here to be freed so we need to allocate a new one */
-		ckmsgq_add(cdata->cevents, event);
-		event = ckzalloc(sizeof(struct epoll_event));
 	}
 out:
 	/* We shouldn't get here unless there's an error */
 	return NULL;
 }
 
+/* Create another listening socket bound to the same address as sockd so the
+ * kernel can load balance new connections between receivers. Returns -1 if
+ * this is not possible, such as when sockd was created without SO_REUSEPORT
+ * by an older instance we took over from. */
+static int reuseport_socket(const int sockd)
+{
+	int newfd = -1;
+#ifdef SO_REUSEPORT
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	const int on = 1;
+
+	addrlen = sizeof(addr);
+	if (getsockname(sockd, (struct sockaddr *)&addr, &addrlen) < 0)
+		goto out;
+	newfd = socket(addr.ss_family, SOCK_STREAM, 0);
+	if (newfd < 0)
+		goto out;
+	setsockopt(newfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (setsockopt(newfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+	    bind(newfd, (struct sockaddr *)&addr, addrlen) < 0 ||
+	    listen(newfd, 8192) < 0) {
+		Close(newfd);
+		goto out;
+	}
+	noblock_socket(newfd);
+out:
+#endif
+	return newfd;
+}
+
+static void create_receivers(ckpool_t *ckp, cdata_t *cdata)
+{
+	int i, j, shared = 0;
+
+	cdata->receiver_count = ckp->receivers;
+	cdata->receivers = ckzalloc(sizeof(receiver_t) * cdata->receiver_count);
+	/* The listening sockets may be shared between receivers so they must
+	 * not block on accept */
+	for (j = 0; j < ckp->serverurls; j++)
+		noblock_socket(cdata->serverfd[j]);
+	for (i = 0; i < cdata->receiver_count; i++) {
+		receiver_t *receiver = &cdata->receivers[i];
+
+		receiver->cdata = cdata;
+		receiver->id = i;
+		receiver->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (receiver->epfd < 0)
+			quit(1, "FATAL: Failed to create epoll in create_receivers");
+		receiver->serverfd = ckalloc(sizeof(int) * ckp->serverurls);
+		for (j = 0; j < ckp->serverurls; j++) {
+			int sockd = -1;
+
+			/* The first receiver uses the original sockets that
+			 * can be handed over to a new instance */
+			if (i)
+				sockd = reuseport_socket(cdata->serverfd[j]);
+			if (sockd < 0) {
+				sockd = cdata->serverfd[j];
+				shared += !!i;
+			}
+			receiver->serverfd[j] = sockd;
+		}
+	}
+	if (shared)
+		LOGNOTICE("Connector receivers sharing %d listening sockets", shared);
+	for (i = 0; i < cdata->receiver_count; i++)
+		create_pthread(&cdata->receivers[i].pth, receiver, &cdata->receivers[i]);
+	LOGNOTICE("Connector started %d receiver threads", cdata->receiver_count);
+}
+
 /* Send a sender_send message and return true if we've finished sending it or
- * are unable to send any more. */
+ * are unable to send any more. Only the thread that owns sending for this
+ * client may call this. */
 static bool send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sender_send)
 {
 	client_instance_t *client = sender_send->client;
 	time_t now_t;
 
 	if (unlikely(client->invalid))
-		goto out_true;
-
-	/* Make sure we only send one message at a time to each client */
-	if (unlikely(client->sending && client->sending != sender_send))
-		return false;
+		return true;
 
-	client->sending = sender_send;
 	now_t = time(NULL);
 
 	/* Increase sendbufsize to match large messages sent to clients - this
@@ -772,7 +1135,7 @@ static bool send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sende
 				LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
 					  client->id, client->fd);
 				invalidate_client(ckp, cdata, client);
-				goto out_true;
+				return true;
 			}
 			if (errno == EAGAIN || errno == EWOULDBLOCK || !ret) {
 				if (!client->blocked_time)
@@ -782,68 +1145,231 @@ static bool send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sende
 			LOGINFO("Client id %"PRId64" fd %d disconnected with write errno %d:%s",
 				client->id, client->fd, errno, strerror(errno));
 			invalidate_client(ckp, cdata, client);
-			goto out_true;
+			return true;
 		}
 		sender_send->ofs += ret;
 		sender_send->len -= ret;
 		client->blocked_time = 0;
 	}
-out_true:
-	client->sending = NULL;
 	return true;
 }
 
+static void put_bcast(cdata_t *cdata, bcast_t *bcast)
+{
+	if (__sync_sub_and_fetch(&bcast->ref, 1))
+		return;
+	__sync_sub_and_fetch(&cdata->bcasts, 1);
+	__sync_sub_and_fetch(&cdata->bcasts_size, sizeof(bcast_t) + bcast->len + 1);
+	free(bcast->buf);
+	free(bcast);
+}
+
 static void clear_sender_send(sender_send_t *sender_send, cdata_t *cdata)
 {
-	dec_instance_ref(cdata, sender_send->client);
-	free(sender_send->buf);
-	free(sender_send);
+	dec_instance_ref(sender_send->client);
+	if (sender_send->bcast)
+		put_bcast(cdata, sender_send->bcast);
+	else
+		free(sender_send->buf);
+	slab_free(cdata->send_slab, sender_send);
+}
+
+/* Remove a sender_send from its client's queue. sender_lock must be held. */
+static void __del_sender_send(cdata_t *cdata, sender_send_t *sender_send)
+{
+	DL_DELETE(sender_send->client->sends, sender_send);
+	cdata->sends_queued--;
+	cdata->sends_size -= sizeof(sender_send_t) + sender_send->ofs + sender_send->len + 1;
+}
+
+/* Park a client whose socket would block on the sender epoll to be resumed
+ * when it is writable. The parked client retains ownership of sending.
+ * Returns false if the client was invalidated in the meantime. */
+static bool park_client(cdata_t *cdata, client_instance_t *client)
+{
+	struct epoll_event event;
+	bool ret = false;
+
+	mutex_lock(&cdata->sender_lock);
+	if (likely(!client->invalid)) {
+		client->parked = true;
+		DL_APPEND2(cdata->parked_clients, client, parked_prev, parked_next);
+		cdata->parked++;
+		cdata->sends_delayed++;
+		ret = true;
+	}
+	mutex_unlock(&cdata->sender_lock);
+
+	if (unlikely(!ret))
+		goto out;
+
+	event.data.u64 = client->id;
+	event.events = EPOLLOUT | EPOLLONESHOT;
+	if (epoll_ctl(cdata->sender_epfd, EPOLL_CTL_MOD, client->fd, &event) < 0 && errno == ENOENT)
+		epoll_ctl(cdata->sender_epfd, EPOLL_CTL_ADD, client->fd, &event);
+	/* Any failure here is from the fd being closed by an invalidation
+	 * which the sender will find when checking parked clients. */
+out:
+	return ret;
+}
+
+/* Take ownership of sending back from a parked client. sender_lock must be
+ * held. */
+static bool __unpark_client(cdata_t *cdata, client_instance_t *client)
+{
+	if (!client->parked)
+		return false;
+	client->parked = false;
+	DL_DELETE2(cdata->parked_clients, client, parked_prev, parked_next);
+	cdata->parked--;
+	return true;
+}
+
+/* Write out all queued sends for a client, parking it if its socket would
+ * block. Must only be called by the thread that owns sending for the client
+ * which must hold a reference to it. */
+static void flush_client_sends(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+{
+	sender_send_t *sender_send, *tmp, *sends = NULL;
+
+	while (42) {
+		mutex_lock(&cdata->sender_lock);
+		if (unlikely(client->invalid)) {
+			/* Discard everything still queued */
+			DL_FOREACH_SAFE(client->sends, sender_send, tmp) {
+				__del_sender_send(cdata, sender_send);
+				DL_APPEND(sends, sender_send);
+			}
+		}
+		sender_send = client->sends;
+		if (!sender_send)
+			client->sending = false;
+		mutex_unlock(&cdata->sender_lock);
+
+		if (!sender_send)
+			break;
+		if (!send_sender_send(ckp, cdata, sender_send)) {
+			if (park_client(cdata, client))
+				break;
+			continue;
+		}
+		mutex_lock(&cdata->sender_lock);
+		__del_sender_send(cdata, sender_send);
+		mutex_unlock(&cdata->sender_lock);
+		clear_sender_send(sender_send, cdata);
+	}
+
+	DL_FOREACH_SAFE(sends, sender_send, tmp) {
+		DL_DELETE(sends, sender_send);
+		clear_sender_send(sender_send, cdata);
+	}
+}
+
+/* Queue a send on the client's own list and flush it immediately from this
+ * thread unless another thread already owns sending for this client or it is
+ * parked. The reference held on the client is handed over to the
+ * sender_send. */
+static void queue_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sender_send)
+{
+	client_instance_t *client = sender_send->client;
+	bool flush = false;
+
+	mutex_lock(&cdata->sender_lock);
+	cdata->sends_generated++;
+	cdata->sends_queued++;
+	cdata->sends_size += sizeof(sender_send_t) + sender_send->len + 1;
+	DL_APPEND(client->sends, sender_send);
+	if (!client->sending) {
+		client->sending = true;
+		flush = true;
+	}
+	mutex_unlock(&cdata->sender_lock);
+
+	if (flush) {
+		/* Hold our own reference as the sender_send's reference is
+		 * dropped when it is cleared */
+		inc_instance_ref(client);
+		flush_client_sends(ckp, cdata, client);
+		dec_instance_ref(client);
+	}
+}
+
+/* Resume sending to a parked client whose socket is now writable */
+static void resume_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id)
+{
+	client_instance_t *client;
+	bool resume;
+
+	client = ref_client_by_id(cdata, id);
+	if (unlikely(!client))
+		return;
+	mutex_lock(&cdata->sender_lock);
+	resume = __unpark_client(cdata, client);
+	mutex_unlock(&cdata->sender_lock);
+	if (likely(resume))
+		flush_client_sends(ckp, cdata, client);
+	dec_instance_ref(client);
+}
+
+/* Look for parked clients that have been invalidated or have been blocked
+ * for more than 60 seconds, taking ownership of them to clear or drop them. */
+static void check_parked_clients(ckpool_t *ckp, cdata_t *cdata, const time_t now_t)
+{
+	client_instance_t *client, *tmp, *expired = NULL;
+
+	mutex_lock(&cdata->sender_lock);
+	DL_FOREACH_SAFE2(cdata->parked_clients, client, tmp, parked_next) {
+		if (client->invalid || now_t - client->blocked_time >= 60) {
+			__unpark_client(cdata, client);
+			DL_APPEND2(expired, client, parked_prev, parked_next);
+		}
+	}
+	mutex_unlock(&cdata->sender_lock);
+
+	/* The queued sends hold references to these clients */
+	DL_FOREACH_SAFE2(expired, client, tmp, parked_next) {
+		DL_DELETE2(expired, client, parked_prev, parked_next);
+		inc_instance_ref(client);
+		if (!client->invalid) {
+			LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
+				  client->id, client->fd);
+			invalidate_client(ckp, cdata, client);
+		}
+		flush_client_sends(ckp, cdata, client);
+		dec_instance_ref(client);
+	}
 }
 
-/* Use a thread to send queued messages, appending them to the sends list and
- * iterating over all of them, attempting to send them all non-blocking to
- * only send to those clients ready to receive data. */
+/* Sends are written out directly by the threads queueing them. This thread
+ * only waits on the sockets of clients that would have blocked to resume
+ * sending to them once they're writable, and drops those blocked for too
+ * long. */
 static void *sender(void *arg)
 {
+	struct epoll_event events[SENDER_EVENTS];
 	cdata_t *cdata = (cdata_t *)arg;
-	sender_send_t *sends = NULL;
 	ckpool_t *ckp = cdata->ckp;
+	time_t last_check = 0;
 
 	rename_proc("csender");
 
 	while (42) {
-		int64_t sends_queued = 0, sends_size = 0;
-		sender_send_t *sending, *tmp;
-
-		/* Check all sends to see if they can be written out */
-		DL_FOREACH_SAFE(sends, sending, tmp) {
-			if (send_sender_send(ckp, cdata, sending)) {
-				DL_DELETE(sends, sending);
-				clear_sender_send(sending, cdata);
-			} else {
-				sends_queued++;
-				sends_size += sizeof(sender_send_t) + sending->len + 1;
-			}
-		}
+		int nevents, i;
+		time_t now_t;
 
-		mutex_lock(&cdata->sender_lock);
-		cdata->sends_delayed += sends_queued;
-		cdata->sends_queued = sends_queued;
-		cdata->sends_size = sends_size;
-		/* Poll every 10ms if there are no new sends. */
-		if (!cdata->sender_sends) {
-			const ts_t polltime = {0, 10000000};
-			ts_t timeout_ts;
-
-			ts_realtime(&timeout_ts);
-			timeraddspec(&timeout_ts, &polltime);
-			cond_timedwait(&cdata->sender_cond, &cdata->sender_lock, &timeout_ts);
+		nevents = epoll_wait(cdata->sender_epfd, events, SENDER_EVENTS, 1000);
+		if (unlikely(nevents == -1 && errno != EINTR)) {
+			LOGEMERG("FATAL: Failed to epoll_wait in sender");
+			break;
 		}
-		if (cdata->sender_sends) {
-			DL_CONCAT(sends, cdata->sender_sends);
-			cdata->sender_sends = NULL;
+		for (i = 0; i < nevents; i++)
+			resume_client(ckp, cdata, events[i].data.u64);
+
+		now_t = time(NULL);
+		if (now_t != last_check) {
+			last_check = now_t;
+			check_parked_clients(ckp, cdata, now_t);
 		}
-		mutex_unlock(&cdata->sender_lock);
 	}
 	/* We shouldn't get here unless there's an error */
 	return NULL;
@@ -890,17 +1416,13 @@ static void redirect_client(ckpool_t *ckp, client_instance_t *client)
 	buf = json_dumps(val, JSON_EOL | JSON_COMPACT);
 	json_decref(val);
 
-	sender_send = ckzalloc(sizeof(sender_send_t));
+	sender_send = slab_zalloc(cdata->send_slab);
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = strlen(buf);
-	inc_instance_ref(cdata, client);
+	inc_instance_ref(client);
 
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+	queue_sender_send(ckp, cdata, sender_send);
 }
 
 /* Look for accepted shares in redirector mode to know we can redirect this
@@ -1007,7 +1529,7 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 			client = ref_client_by_id(cdata, client_id);
 			if (client) {
 				invalidate_client(ckp, cdata, client);
-				dec_instance_ref(cdata, client);
+				dec_instance_ref(client);
 			} else
 				stratifier_drop_id(ckp, id);
 			free(buf);
@@ -1032,16 +1554,12 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 		}
 	}
 
-	sender_send = ckzalloc(sizeof(sender_send_t));
+	sender_send = slab_zalloc(cdata->send_slab);
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = len;
 
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+	queue_sender_send(ckp, cdata, sender_send);
 
 	/* Redirect after sending response to shares and authorise */
 	if (unlikely(redirect))
@@ -1059,7 +1577,7 @@ static void send_client_json(ckpool_t *ckp, cdata_t *cdata, int64_t client_id, j
 		json_object_set_new_nocheck(val, "client_id", json_integer(client_id));
 		json_object_set_new_nocheck(val, "address", json_string(client->address_name));
 		json_object_set_new_nocheck(val, "server", json_integer(client->server));
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 		stratifier_add_recv(ckp, val);
 	}
 	if (ckp->passthrough && client_id)
@@ -1076,13 +1594,15 @@ static bool client_exists(cdata_t *cdata, int64_t id)
 {
 	int64_t parent_id = subclient(id);
 	client_instance_t *client;
+	client_shard_t *shard;
 
 	if (parent_id)
 		id = parent_id;
 
-	ck_rlock(&cdata->lock);
-	HASH_FIND_I64(cdata->clients, &id, client);
-	ck_runlock(&cdata->lock);
+	shard = client_shard(cdata, id);
+	rd_lock(&shard->lock);
+	HASH_FIND_I64(shard->clients, &id, client);
+	rd_unlock(&shard->lock);
 
 	return !!client;
 }
@@ -1308,12 +1828,50 @@ out:
 	return ret;
 }
 
-static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
+/* Queue a reference to the one broadcast buffer on the send queue of each
+ * client it is for. */
+static void send_bcast(ckpool_t *ckp, cdata_t *cdata, bcast_t *bcast)
 {
+	int i;
+
+	for (i = 0; i < bcast->clients; i++) {
+		const int64_t id = bcast->client_ids[i];
+		sender_send_t *sender_send;
+		client_instance_t *client;
+
+		client = ref_client_by_id(cdata, id);
+		if (unlikely(!client)) {
+			LOGINFO("Connector failed to find client id %"PRId64" to broadcast to", id);
+			stratifier_drop_id(ckp, id);
+			continue;
+		}
+		sender_send = slab_zalloc(cdata->send_slab);
+		sender_send->client = client;
+		sender_send->buf = bcast->buf;
+		sender_send->len = bcast->len;
+		sender_send->bcast = bcast;
+		__sync_add_and_fetch(&bcast->ref, 1);
+		queue_sender_send(ckp, cdata, sender_send);
+	}
+	dealloc(bcast->client_ids);
+	/* Drop the reference held while queueing */
+	put_bcast(cdata, bcast);
+}
+
+static void client_message_processor(ckpool_t *ckp, cmp_msg_t *msg)
+{
+	json_t *json_msg = msg->val;
 	cdata_t *cdata = ckp->cdata;
 	client_instance_t *client;
 	int64_t client_id;
 
+	if (msg->bcast) {
+		send_bcast(ckp, cdata, msg->bcast);
+		slab_free(cdata->cmp_slab, msg);
+		return;
+	}
+	slab_free(cdata->cmp_slab, msg);
+
 	/* Extract the client id from the json message and remove its entry */
 	client_id = json_integer_value(json_object_get(json_msg, "client_id"));
 	json_object_del(json_msg, "client_id");
@@ -1331,16 +1889,46 @@ static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
 			if (!safecmp(method, stratum_msgs[SM_AUTHRESULT]))
 				client->authorised = true;
 		}
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 	}
 	send_client_json(ckp, cdata, client_id, json_msg);
 }
 
+/* Takes ownership of val, freeing it once it has been serialised for the
+ * client. It is usually from a stratifier thread's json arena, whose region
+ * is only released when messages like this one are done with. */
 void connector_add_message(ckpool_t *ckp, json_t *val)
 {
 	cdata_t *cdata = ckp->cdata;
+	cmp_msg_t *msg;
+
+	msg = slab_zalloc(cdata->cmp_slab);
+	msg->val = val;
+	ckmsgq_add(cdata->cmpq, msg);
+}
 
-	ckmsgq_add(cdata->cmpq, val);
+/* Bulk send of the one serialised message buf to all the clients in the
+ * client_ids array, taking ownership of both. It is queued in order with
+ * messages from connector_add_message. */
+void connector_add_broadcast(ckpool_t *ckp, char *buf, int64_t *client_ids, const int clients)
+{
+	cdata_t *cdata = ckp->cdata;
+	bcast_t *bcast;
+	cmp_msg_t *msg;
+
+	bcast = ckalloc(sizeof(bcast_t));
+	bcast->buf = buf;
+	bcast->len = strlen(buf);
+	bcast->ref = 1;
+	bcast->client_ids = client_ids;
+	bcast->clients = clients;
+	__sync_add_and_fetch(&cdata->bcasts, 1);
+	__sync_add_and_fetch(&cdata->bcasts_size, sizeof(bcast_t) + bcast->len + 1);
+	__sync_add_and_fetch(&cdata->bcasts_generated, 1);
+
+	msg = slab_zalloc(cdata->cmp_slab);
+	msg->bcast = bcast;
+	ckmsgq_add(cdata->cmpq, msg);
 }
 
 /* Send the passthrough the terminate node.method */
@@ -1361,7 +1949,7 @@ char *connector_stats(void *data, const int runtime)
 {
 	json_t *val = json_object(), *subval;
 	client_instance_t *client;
-	int objects, generated;
+	int objects, generated, i;
 	cdata_t *cdata = data;
 	sender_send_t *send;
 	int64_t memsize;
@@ -1371,9 +1959,18 @@ char *connector_stats(void *data, const int runtime)
 	if (runtime)
 		json_set_int(val, "runtime", runtime);
 
+	objects = 0;
+	memsize = 0;
+	for (i = 0; i < CLIENT_SHARDS; i++) {
+		client_shard_t *shard = &cdata->shards[i];
+
+		rd_lock(&shard->lock);
+		objects += HASH_COUNT(shard->clients);
+		memsize += SAFE_HASH_OVERHEAD(shard->clients);
+		rd_unlock(&shard->lock);
+	}
+	memsize += sizeof(client_instance_t) * objects;
 	ck_rlock(&cdata->lock);
-	objects = HASH_COUNT(cdata->clients);
-	memsize = SAFE_HASH_OVERHEAD(cdata->clients) + sizeof(client_instance_t) * objects;
 	generated = cdata->clients_generated;
 	ck_runlock(&cdata->lock);
 
@@ -1393,18 +1990,50 @@ char *connector_stats(void *data, const int runtime)
 	memsize = 0;
 
 	mutex_lock(&cdata->sender_lock);
-	DL_FOREACH(cdata->sender_sends, send) {
-		objects++;
-		memsize += sizeof(sender_send_t) + send->len + 1;
-	}
-	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", cdata->sends_generated);
+	JSON_CPACK(subval, "{sI,sI,sI}", "count", cdata->sends_queued, "memory", cdata->sends_size,
+		   "generated", cdata->sends_generated);
 	json_steal_object(val, "sends", subval);
 
-	JSON_CPACK(subval, "{si,si,si}", "count", cdata->sends_queued, "memory", cdata->sends_size, "generated", cdata->sends_delayed);
+	DL_FOREACH2(cdata->parked_clients, client, parked_next) {
+		DL_FOREACH(client->sends, send) {
+			objects++;
+			memsize += sizeof(sender_send_t) + send->len + 1;
+		}
+	}
+	JSON_CPACK(subval, "{si,sI,sI,si}", "count", objects, "memory", memsize,
+		   "generated", cdata->sends_delayed, "clients", cdata->parked);
 	mutex_unlock(&cdata->sender_lock);
 
 	json_steal_object(val, "delays", subval);
 
+	subval = json_object();
+	json_object_set_new_nocheck(subval, cdata->cmp_slab->name, slab_stats(cdata->cmp_slab));
+	json_object_set_new_nocheck(subval, cdata->send_slab->name, slab_stats(cdata->send_slab));
+	json_steal_object(val, "slabs", subval);
+
+	JSON_CPACK(subval, "{sI,sI,sI}", "count", cdata->bcasts, "memory", cdata->bcasts_size,
+		   "generated", cdata->bcasts_generated);
+	json_steal_object(val, "broadcasts", subval);
+
+	JSON_CPACK(subval, "{sI,sI}", "scanned", cdata->submits_scanned,
+		   "parsed", cdata->submits_parsed);
+	json_steal_object(val, "submits", subval);
+
+	subval = json_array();
+	for (i = 0; i < cdata->receiver_count; i++) {
+		receiver_t *receiver = &cdata->receivers[i];
+		json_t *rval;
+
+		ck_rlock(&cdata->lock);
+		objects = receiver->clients;
+		ck_runlock(&cdata->lock);
+
+		JSON_CPACK(rval, "{si,sI,sI}", "clients", objects, "events", receiver->events,
+			   "accepts", receiver->accepts);
+		json_array_append_new(subval, rval);
+	}
+	json_steal_object(val, "receivers", subval);
+
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
 	if (runtime)
@@ -1464,7 +2093,7 @@ retry:
 	if (likely(buf[0] == '{')) {
 		json_t *val = json_loads(buf, JSON_DISABLE_EOF_CHECK, NULL);
 
-		ckmsgq_add(cdata->cmpq, val);
+		connector_add_message(ckp, val);
 	} else if (cmdmatch(buf, "dropclient")) {
 		client_instance_t *client;
 
@@ -1484,7 +2113,7 @@ retry:
 			goto retry;
 		}
 		ret = invalidate_client(ckp, cdata, client);
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 		if (ret >= 0)
 			LOGINFO("Connector dropped client id: %"PRId64, client_id);
 	} else if (cmdmatch(buf, "testclient")) {
@@ -1530,7 +2159,7 @@ retry:
 			goto retry;
 		}
 		passthrough_client(ckp, cdata, client);
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 	} else if (cmdmatch(buf, "remote")) {
 		client_instance_t *client;
 
@@ -1545,7 +2174,7 @@ retry:
 			goto retry;
 		}
 		remote_server(ckp, cdata, client);
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 	} else if (cmdmatch(buf, "getxfd")) {
 		int fdno = -1;
 
@@ -1562,7 +2191,7 @@ void *connector(void *arg)
 	proc_instance_t *pi = (proc_instance_t *)arg;
 	cdata_t *cdata = ckzalloc(sizeof(cdata_t));
 	char newurl[INET6_ADDRSTRLEN], newport[8];
-	int threads, sockd, i, tries = 0, ret;
+	int sockd, i, tries = 0, ret;
 	ckpool_t *ckp = pi->ckp;
 	const int on = 1;
 
@@ -1588,8 +2217,18 @@ void *connector(void *arg)
 		serv_addr.sin_family = AF_INET;
 		serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
 		serv_addr.sin_port = htons(ckp->proxy ? 3334 : 3333);
+#ifdef SO_REUSEPORT
+		if (ckp->receivers > 1)
+			setsockopt(sockd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
 		do {
-			ret = bind(sockd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
+			/* Don't share the port with another running instance */
+			if (ckp->receivers > 1 && addr_in_use((struct sockaddr *)&serv_addr,
+							      sizeof(serv_addr))) {
+				ret = -1;
+				errno = EADDRINUSE;
+			} else
+				ret = bind(sockd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
 
 			if (!ret)
 				break;
@@ -1635,7 +2274,7 @@ void *connector(void *arg)
 			do {
 				if (sockd > 0)
 					break;
-				sockd = bind_socket(newurl, newport);
+				sockd = bind_socket(newurl, newport, ckp->receivers > 1);
 				if (sockd > 0)
 					break;
 				LOGWARNING("Connector failed to bind to socket, retrying in 5s");
@@ -1658,23 +2297,29 @@ void *connector(void *arg)
 	if (tries)
 		LOGWARNING("Connector successfully bound to socket");
 
+	cdata->cmp_slab = create_slab("cmpmsg", sizeof(cmp_msg_t));
+	cdata->send_slab = create_slab("sendersend", sizeof(sender_send_t));
 	cdata->cmpq = create_ckmsgq(ckp, "cmpq", &client_message_processor);
 
 	if (ckp->remote && !setup_upstream(ckp, cdata))
 		goto out;
 
 	cklock_init(&cdata->lock);
+	for (i = 0; i < CLIENT_SHARDS; i++)
+		rwlock_init(&cdata->shards[i].lock);
 	cdata->pi = pi;
 	cdata->nfds = 0;
 	/* Set the client id to the highest serverurl count to distinguish
 	 * them from the server fds in epoll. */
 	cdata->client_ids = ckp->serverurls;
 	mutex_init(&cdata->sender_lock);
-	cond_init(&cdata->sender_cond);
+	cdata->sender_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (cdata->sender_epfd < 0) {
+		LOGEMERG("FATAL: Failed to create sender epoll");
+		goto out;
+	}
 	create_pthread(&cdata->pth_sender, sender, cdata);
-	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
-	cdata->cevents = create_ckmsgqs(ckp, "cevent", &client_event_processor, threads);
-	create_pthread(&cdata->pth_receiver, receiver, cdata);
+	create_receivers(ckp, cdata);
 	cdata->start_time = time(NULL);
 
 	ckp->connector_ready = true;
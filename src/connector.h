@@ -13,6 +13,7 @@
 int64_t connector_newclientid(ckpool_t *ckp);
 void connector_upstream_msg(ckpool_t *ckp, char *msg);
 void connector_add_message(ckpool_t *ckp, json_t *val);
+void connector_add_broadcast(ckpool_t *ckp, char *buf, int64_t *client_ids, const int clients);
 char *connector_stats(void *data, const int runtime);
 void connector_send_fd(ckpool_t *ckp, const int fdno, const int sockd);
 void *connector(void *arg);
@@ -11,6 +11,7 @@
 
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <jansson.h>
 #include <string.h>
 #include <unistd.h>
@@ -23,6 +24,8 @@
 #include "uthash.h"
 #include "utlist.h"
 
+typedef struct notify_instance notify_instance_t;
+
 struct notify_instance {
 	/* Hash table data */
 	UT_hash_handle hh;
@@ -41,33 +44,36 @@ struct notify_instance {
 	bool clean;
 
 	time_t notify_time;
+	notify_instance_t *next; /* Timer wheel slot list */
+	notify_instance_t *prev;
 };
 
-typedef struct notify_instance notify_instance_t;
-
 typedef struct proxy_instance proxy_instance_t;
 
+typedef struct share_msg share_msg_t;
+typedef struct cs_msg cs_msg_t;
+
 struct share_msg {
 	UT_hash_handle hh;
 	int id; // Our own id for submitting upstream
 
 	int64_t client_id;
 	time_t submit_time;
+	tv_t submit_tv; /* For measuring the upstream response time */
 	double diff;
+	share_msg_t *next; /* Timer wheel slot list */
+	share_msg_t *prev;
 };
 
-typedef struct share_msg share_msg_t;
-
-struct stratum_msg {
-	struct stratum_msg *next;
-	struct stratum_msg *prev;
-
-	json_t *json_msg;
-	int64_t client_id;
+/* A share queued to be written out to an upstream proxy */
+struct cs_msg {
+	cs_msg_t *next;
+	cs_msg_t *prev;
+	char *buf;
+	int len;
+	int ofs;
 };
 
-typedef struct stratum_msg stratum_msg_t;
-
 struct pass_msg {
 	proxy_instance_t *proxy;
 	connsock_t *cs;
@@ -75,7 +81,16 @@ struct pass_msg {
 };
 
 typedef struct pass_msg pass_msg_t;
-typedef struct cs_msg cs_msg_t;
+
+/* Times of one kind of request to a server in ms */
+struct srvtime {
+	int64_t count;
+	double last;
+	double total;
+	double max;
+};
+
+typedef struct srvtime srvtime_t;
 
 /* Per proxied pool instance data */
 struct proxy_instance {
@@ -102,7 +117,7 @@ struct proxy_instance {
 	int nonce1len;
 	int nonce2len;
 
-	tv_t last_message;
+	tv_t last_message; /* Last message from this proxy or any of its subproxies */
 
 	double diff;
 	double diff_accepted;
@@ -110,6 +125,8 @@ struct proxy_instance {
 	double total_accepted; /* Used only by parent proxy structures */
 	double total_rejected; /* "" */
 	tv_t last_share;
+	srvtime_t rtt; /* Share submission to result times */
+	srvtime_t total_rtt; /* Used only by parent proxy structures */
 
 	/* Diff shares per second for 1/5/60... minute rolling averages */
 	double dsps1;
@@ -133,12 +150,22 @@ struct proxy_instance {
 	bool disabled; /* Subproxy no longer to be used */
 	bool reconnect; /* We need to drop and reconnect */
 	bool reconnecting; /* Testing of parent in progress */
+	bool working; /* Parent or a subproxy was usable when last checked */
 	int64_t recruit; /* No of recruiting requests in progress */
 	bool alive;
 	bool authorised;
 
-	 /* Are we in the middle of a blocked write of this message? */
-	cs_msg_t *sending;
+	/* Outbound queue of shares to submit upstream, protected by psend_lock */
+	cs_msg_t *sends;
+	int sends_queued; /* Current depth of the queue */
+	int sends_max; /* Deepest the queue has been */
+	int64_t sends_writes; /* Writes to drain the queue */
+	int64_t sends_sent; /* Messages written in those writes */
+	bool sending; /* A thread owns writing out the queue */
+	bool parked; /* Waiting on the psend epoll for the socket to be writable */
+	time_t parked_time;
+	proxy_instance_t *parked_next; /* For the parked proxies list */
+	proxy_instance_t *parked_prev;
 
 	pthread_t pth_precv;
 
@@ -146,7 +173,7 @@ struct proxy_instance {
 
 	char_entry_t *recvd_lines; /* Linked list of unprocessed messages */
 
-	int epfd; /* Epoll fd used by the parent proxy */
+	int epfd; /* Epoll fd shared by all upstream receivers */
 
 	mutex_t proxy_lock; /* Lock protecting hashlist of proxies */
 	proxy_instance_t *parent; /* Parent proxy of subproxies */
@@ -155,6 +182,42 @@ struct proxy_instance {
 	int subproxy_count; /* Number of subproxies */
 };
 
+/* Per bitcoind block race and latency stats */
+struct server_stats {
+	char lasthash[68]; /* Last block hash reported by this server */
+	char pollhash[68]; /* Last block hash returned by a long poll */
+	int pollheight; /* and its height if known */
+	int64_t first; /* Blocks this server reported before any other */
+	srvtime_t late; /* How far behind the first server it reported blocks */
+	srvtime_t gbt; /* Block template latency */
+	srvtime_t submit; /* Block submission latency */
+	int64_t accepted; /* Blocks accepted by submitblock */
+	int getbest_fails; /* Consecutive getbestblockhash failures */
+};
+
+typedef struct server_stats server_stats_t;
+
+/* Recent block hashes seen in the race, to not mistake a lagging server's
+ * previous block for a new one */
+#define RACE_HASHES 8
+
+/* Consecutive getbestblockhash failures before a server is considered dead,
+ * so one slow or dropped call does not stop it being raced and submitted to */
+#define GETBEST_FAILS 3
+
+/* Unanswered shares and old notifies are aged on timer wheels with a slot per
+ * second, so only the slots that have come due are visited. The wheel must
+ * span more seconds than the longest expiry time. */
+#define WHEEL_SLOTS 1024
+#define SHARE_EXPIRE 120
+#define NOTIFY_EXPIRE 600
+
+/* Maximum events each upstream receiver takes from the shared epoll at once */
+#define UPSTREAM_EVENTS 64
+
+/* Most queued shares written to one proxy in a single sendmsg */
+#define PSEND_IOVS 64
+
 /* Private data for the generator */
 struct generator_data {
 	ckpool_t *ckp;
@@ -166,24 +229,42 @@ struct generator_data {
 
 	int proxy_notify_id;	// Globally increasing notify id
 	server_instance_t *si;	/* Current server instance */
-	pthread_t pth_uprecv;	// User proxy receive thread
-	pthread_t pth_psend;	// Combined proxy send thread
-
-	mutex_t psend_lock;	// Lock associated with conditional below
-	pthread_cond_t psend_cond;
-
-	stratum_msg_t *psends;
+	pthread_t pth_pwatch;	// Proxy watchdog thread
+	pthread_t pth_psend;	// Thread resuming sends to parked proxies
+	pthread_t *pth_upstream; // Upstream receiver threads
+	int epfd;		// Epoll fd of all upstream proxy connections
+
+	mutex_t psend_lock;	// Lock protecting proxy send queues
+	proxy_instance_t *parked_proxies; /* Proxies whose sends would block */
+	int psend_epfd;		// Epoll fd of parked proxy connections
 	int psends_generated;
+	int psends_queued;
+	int64_t psends_size;
+	int psends_delayed; /* Times a proxy was parked */
 
 	mutex_t notify_lock;
 	notify_instance_t *notify_instances;
+	notify_instance_t *notify_wheel[WHEEL_SLOTS]; /* Notifies by notify_time */
+	time_t notify_tick; /* Newest notify_time whose wheel slot has been aged */
 
 	mutex_t share_lock;
+	slab_t *share_slab;
 	share_msg_t *shares;
 	int64_t share_id;
+	share_msg_t *share_wheel[WHEEL_SLOTS]; /* Shares by submit_time */
+	time_t share_tick; /* Newest submit_time whose wheel slot has been aged */
+	int64_t shares_expired; /* Shares that never got an upstream result */
 
 	server_instance_t *current_si;
 
+	mutex_t race_lock; /* Lock protecting block race data and server stats */
+	char racehashes[RACE_HASHES][68];
+	int racepos; /* Position of the newest block hash in racehashes */
+	tv_t raceseen; /* When the newest block was first seen */
+	int raceheight; /* Height of the newest block if known */
+	server_instance_t *race_si; /* First server to report the newest block */
+	server_stats_t *srvstats; /* Stats of each server indexed by id */
+
 	proxy_instance_t *current_proxy;
 };
 
@@ -192,29 +273,19 @@ typedef struct generator_data gdata_t;
 /* Use a temporary fd when testing server_alive to avoid races on cs->fd */
 static bool server_alive(ckpool_t *ckp, server_instance_t *si, bool pinging)
 {
-	char *userpass = NULL;
 	bool ret = false;
 	connsock_t *cs;
 	gbtbase_t gbt;
 	int fd;
 
+	memset(&gbt, 0, sizeof(gbtbase_t));
+
 	if (si->alive)
 		return true;
 	cs = &si->cs;
-	if (!extract_sockaddr(si->url, &cs->url, &cs->port)) {
-		LOGWARNING("Failed to extract address from %s", si->url);
-		return ret;
-	}
-	userpass = strdup(si->auth);
-	realloc_strcat(&userpass, ":");
-	realloc_strcat(&userpass, si->pass);
-	dealloc(cs->auth);
-	cs->auth = http_base64(userpass);
-	dealloc(userpass);
-	if (!cs->auth) {
-		LOGWARNING("Failed to create base64 auth from %s", userpass);
+	/* Set up once in setup_servers as other threads may be using them */
+	if (unlikely(!cs->url || !cs->auth))
 		return ret;
-	}
 
 	fd = connect_socket(cs->url, cs->port);
 	if (fd < 0) {
@@ -236,6 +307,9 @@ static bool server_alive(ckpool_t *ckp, server_instance_t *si, bool pinging)
 		LOGWARNING("Invalid btcaddress: %s !", ckp->btcaddress);
 		goto out;
 	}
+	/* Only needed to know if empty work can be built so not fatal */
+	if (!ckp->chain[0] && get_chain(cs, ckp->chain))
+		LOGNOTICE("Bitcoind network: %s", ckp->chain);
 	si->alive = cs->alive = ret = true;
 	LOGNOTICE("Server alive: %s:%s", cs->url, cs->port);
 out:
@@ -311,22 +385,167 @@ static void clear_unix_msg(unix_msg_t **umsg)
 	}
 }
 
+/* Enter with the lock protecting st held */
+static void __add_srvtime(srvtime_t *st, tv_t *start)
+{
+	tv_t now;
+
+	tv_time(&now);
+	st->last = tvdiff(&now, start) * 1000;
+	st->total += st->last;
+	if (st->last > st->max)
+		st->max = st->last;
+	st->count++;
+}
+
+static void add_srvtime(gdata_t *gdata, srvtime_t *st, tv_t *start)
+{
+	mutex_lock(&gdata->race_lock);
+	__add_srvtime(st, start);
+	mutex_unlock(&gdata->race_lock);
+}
+
+typedef struct submitter {
+	pthread_t pth;
+	gdata_t *gdata;
+	server_instance_t *si;
+	const char *buf;
+	bool ret;
+} submitter_t;
+
+static void *submit_server(void *arg)
+{
+	submitter_t *sub = (submitter_t *)arg;
+	server_instance_t *si = sub->si;
+	gdata_t *gdata = sub->gdata;
+	server_stats_t *st;
+	tv_t start;
+
+	st = &gdata->srvstats[si->id];
+	tv_time(&start);
+	sub->ret = submit_block(&si->cs, sub->buf);
+	mutex_lock(&gdata->race_lock);
+	__add_srvtime(&st->submit, &start);
+	if (sub->ret)
+		st->accepted++;
+	mutex_unlock(&gdata->race_lock);
+	if (!sub->ret)
+		LOGWARNING("Block submission to %s:%s failed", si->cs.url, si->cs.port);
+	return NULL;
+}
+
+/* Submit the block to the current server and every other live server in
+ * parallel, succeeding if any of them accepts it. The current server is tried
+ * even if it has been marked dead since it may only be momentarily slow. */
 bool generator_submitblock(ckpool_t *ckp, const char *buf)
 {
 	gdata_t *gdata = ckp->gdata;
-	server_instance_t *si;
-	bool warn = false;
-	connsock_t *cs;
+	submitter_t *subs;
+	int i, servers;
+	bool warn = false, ret = false;
 
-	while (unlikely(!(si = gdata->current_si))) {
+	subs = ckalloc(sizeof(submitter_t) * ckp->btcds);
+	while (42) {
+		server_instance_t *current = gdata->current_si;
+
+		for (i = servers = 0; i < ckp->btcds; i++) {
+			server_instance_t *si = ckp->servers[i];
+
+			if (!si->alive && si != current)
+				continue;
+			subs[servers].gdata = gdata;
+			subs[servers].si = si;
+			subs[servers].buf = buf;
+			subs[servers++].ret = false;
+		}
+		if (likely(servers))
+			break;
 		if (!warn)
-			LOGWARNING("No live current server in generator_blocksubmit! Resubmitting indefinitely!");
+			LOGWARNING("No live server in generator_blocksubmit! Resubmitting indefinitely!");
 		warn = true;
 		cksleep_ms(10);
 	}
-	cs = &si->cs;
-	LOGNOTICE("Submitting block data!");
-	return submit_block(cs, buf);
+	LOGNOTICE("Submitting block data to %d bitcoind%s!", servers, servers > 1 ? "s" : "");
+	for (i = 1; i < servers; i++)
+		create_pthread(&subs[i].pth, submit_server, &subs[i]);
+	submit_server(&subs[0]);
+	ret = subs[0].ret;
+	for (i = 1; i < servers; i++) {
+		join_pthread(subs[i].pth);
+		ret |= subs[i].ret;
+	}
+	free(subs);
+	return ret;
+}
+
+/* Record server reporting hash as its best block, returning true if it was
+ * the first server to report it, or it is the first server repeating it. A
+ * lower block than the newest one is only a server lagging behind unless it
+ * comes from the server that reported the newest one. */
+bool generator_blockrace(ckpool_t *ckp, const int server, const char *hash)
+{
+	server_instance_t *si = ckp->servers[server];
+	gdata_t *gdata = ckp->gdata;
+	bool ret = false, first = false;
+	server_stats_t *st;
+	int i, height = -1;
+
+	st = &gdata->srvstats[server];
+	/* Only this server's own blockupdate thread changes its lasthash and
+	 * pollhash. Look up the height of a new block from another server than
+	 * the last winner unless its long poll already told us. */
+	if (ckp->btcds > 1 && strcmp(hash, st->lasthash)) {
+		if (!strcmp(hash, st->pollhash))
+			height = st->pollheight;
+		else if (gdata->race_si && gdata->race_si != si)
+			height = get_blockheight(&si->cs, hash);
+	}
+	mutex_lock(&gdata->race_lock);
+	if (!strcmp(hash, st->lasthash)) {
+		ret = gdata->race_si == si && !strcmp(hash, gdata->racehashes[gdata->racepos]);
+		goto out_unlock;
+	}
+	strcpy(st->lasthash, hash);
+	for (i = 0; i < RACE_HASHES; i++) {
+		if (strcmp(hash, gdata->racehashes[i]))
+			continue;
+		if (i == gdata->racepos) {
+			__add_srvtime(&st->late, &gdata->raceseen);
+			LOGINFO("Block %s from %s:%s %.1fms behind", hash, si->cs.url,
+				si->cs.port, st->late.last);
+		}
+		goto out_unlock;
+	}
+	if (height != -1 && height < gdata->raceheight && gdata->race_si != si) {
+		LOGINFO("Block %s height %d from %s:%s is behind height %d", hash, height,
+			si->cs.url, si->cs.port, gdata->raceheight);
+		goto out_unlock;
+	}
+	if (height != -1)
+		gdata->raceheight = height;
+	gdata->racepos = (gdata->racepos + 1) % RACE_HASHES;
+	strcpy(gdata->racehashes[gdata->racepos], hash);
+	tv_time(&gdata->raceseen);
+	gdata->race_si = si;
+	st->first++;
+	ret = first = true;
+out_unlock:
+	mutex_unlock(&gdata->race_lock);
+
+	if (first && ckp->btcds > 1)
+		LOGNOTICE("Block %s first seen from %s:%s", hash, si->cs.url, si->cs.port);
+	return ret;
+}
+
+/* The first server to report the newest block, falling back to the current
+ * server if it is no longer alive. */
+static server_instance_t *template_server(gdata_t *gdata)
+{
+	server_instance_t *si = gdata->race_si;
+
+	if (!si || !si->alive)
+		si = gdata->current_si;
+	return si;
 }
 
 void generator_preciousblock(ckpool_t *ckp, const char *hash)
@@ -357,6 +576,108 @@ bool generator_get_blockhash(ckpool_t *ckp, int height, char *hash)
 	return get_blockhash(cs, height, hash);
 }
 
+/* Fill in the best block hash if hash is empty and return the height of the
+ * block hash refers to, or -1 on failure */
+int generator_blockheight(ckpool_t *ckp, char *hash)
+{
+	gdata_t *gdata = ckp->gdata;
+	server_instance_t *si;
+	connsock_t *cs;
+
+	if (unlikely(!(si = template_server(gdata)))) {
+		LOGWARNING("No live current server in generator_blockheight");
+		return -1;
+	}
+	cs = &si->cs;
+	if (!*hash && !get_bestblockhash(cs, hash))
+		return -1;
+	return get_blockheight(cs, hash);
+}
+
+static json_t *srvtime_json(const srvtime_t *st)
+{
+	json_t *val;
+
+	JSON_CPACK(val, "{sI,sf,sf,sf}", "count", st->count, "last", st->last,
+		   "avg", st->count ? st->total / st->count : 0.0, "max", st->max);
+	return val;
+}
+
+/* Share results and response times of every proxy and subproxy */
+static json_t *proxies_json(gdata_t *gdata)
+{
+	proxy_instance_t *proxy, *tmp, *subproxy, *subtmp;
+	json_t *arr_val = json_array();
+
+	mutex_lock(&gdata->lock);
+	HASH_ITER(hh, gdata->proxies, proxy, tmp) {
+		mutex_lock(&proxy->proxy_lock);
+		HASH_ITER(sh, proxy->subproxies, subproxy, subtmp) {
+			json_t *subval;
+
+			JSON_CPACK(subval, "{si,si,sb,sf,sf,so,si}", "id", subproxy->id,
+				   "subid", subproxy->subid, "alive", subproxy->alive,
+				   "accepted", subproxy->diff_accepted,
+				   "rejected", subproxy->diff_rejected,
+				   "rtt", srvtime_json(&subproxy->rtt),
+				   "sendq", subproxy->sends_queued);
+			json_array_append_new(arr_val, subval);
+		}
+		mutex_unlock(&proxy->proxy_lock);
+	}
+	mutex_unlock(&gdata->lock);
+
+	return arr_val;
+}
+
+/* Block race and latency stats of each bitcoind, or share stats of each
+ * upstream proxy in proxy mode, times in ms */
+char *generator_stats(ckpool_t *ckp, void *data)
+{
+	json_t *val = json_object(), *arr_val = json_array();
+	gdata_t *gdata = data;
+	char *buf;
+	int i;
+
+	if (ckp->proxy) {
+		json_t *subval;
+
+		if (ckp->passthrough || !gdata || !ckp->generator_ready)
+			goto out;
+		subval = proxies_json(gdata);
+		json_steal_object(val, "proxies", subval);
+		mutex_lock(&gdata->share_lock);
+		JSON_CPACK(subval, "{si,sI}", "pending", HASH_COUNT(gdata->shares),
+			   "expired", gdata->shares_expired);
+		mutex_unlock(&gdata->share_lock);
+		json_steal_object(val, "shares", subval);
+		goto out;
+	}
+	if (!gdata || !gdata->srvstats)
+		goto out;
+	mutex_lock(&gdata->race_lock);
+	for (i = 0; i < ckp->btcds; i++) {
+		server_instance_t *si = ckp->servers[i];
+		server_stats_t *st = &gdata->srvstats[i];
+		json_t *subval;
+
+		JSON_CPACK(subval, "{ss,sb,sb,sb,ss,sI,so,so,so,sI}", "url", si->url,
+			   "alive", si->alive, "current", si == gdata->current_si,
+			   "template", si == template_server(gdata), "lasthash", st->lasthash,
+			   "first", st->first, "late", srvtime_json(&st->late),
+			   "getblocktemplate", srvtime_json(&st->gbt),
+			   "submitblock", srvtime_json(&st->submit), "accepted", st->accepted);
+		json_array_append_new(arr_val, subval);
+	}
+	mutex_unlock(&gdata->race_lock);
+out:
+	json_steal_object(val, "servers", arr_val);
+	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
+	json_decref(val);
+	LOGNOTICE("Generator stats: %s", buf);
+	return buf;
+}
+
 static void gen_loop(proc_instance_t *pi)
 {
 	server_instance_t *si = NULL, *old_si;
@@ -367,6 +688,8 @@ static void gen_loop(proc_instance_t *pi)
 	gbtbase_t gbt;
 	char hash[68];
 
+	memset(&gbt, 0, sizeof(gbtbase_t));
+
 reconnect:
 	clear_unix_msg(&umsg);
 	old_si = si;
@@ -406,7 +729,27 @@ retry:
 			send_unix_msg(umsg->sockd, "Failed");
 			goto reconnect;
 		} else {
-			char *s = json_dumps(gbt.json, JSON_NO_UTF8);
+			json_t *txn_array = json_array();
+			char *s;
+			int i;
+
+			/* Put back the transactions decoded out of the json */
+			for (i = 0; i < gbt.txns; i++) {
+				char *data, hash[68];
+				uchar swap[32];
+				json_t *txn_val;
+
+				data = bin2hex(gbt.txn_data + gbt.txn_ofs[i],
+					       gbt.txn_ofs[i + 1] - gbt.txn_ofs[i]);
+				bswap_256(swap, gbt.wtxidbin + i * 32);
+				__bin2hex(hash, swap, 32);
+				JSON_CPACK(txn_val, "{ss,ss%,ss}", "data", data,
+					   "txid", gbt.txn_hashes + i * 65, (size_t)64, "hash", hash);
+				json_array_append_new(txn_array, txn_val);
+				free(data);
+			}
+			json_object_set_new_nocheck(gbt.json, "transactions", txn_array);
+			s = json_dumps(gbt.json, JSON_NO_UTF8);
 
 			send_unix_msg(umsg->sockd, s);
 			free(s);
@@ -447,8 +790,7 @@ retry:
 		char blockmsg[80];
 		bool ret;
 
-		LOGNOTICE("Submitting block data!");
-		ret = submit_block(cs, buf + 12 + 64 + 1);
+		ret = generator_submitblock(ckp, buf + 12 + 64 + 1);
 		memset(buf + 12 + 64, 0, 1);
 		sprintf(blockmsg, "%sblock:%s", ret ? "" : "no", buf + 12);
 		send_proc(ckp->stratifier, blockmsg);
@@ -461,6 +803,11 @@ retry:
 		goto reconnect;
 	} else if (cmdmatch(buf, "loglevel")) {
 		sscanf(buf, "loglevel=%d", &ckp->loglevel);
+	} else if (cmdmatch(buf, "stats")) {
+		char *msg = generator_stats(ckp, ckp->gdata);
+
+		send_unix_msg(umsg->sockd, msg);
+		free(msg);
 	} else if (cmdmatch(buf, "ping")) {
 		LOGDEBUG("Generator received ping request");
 		send_unix_msg(umsg->sockd, "pong");
@@ -484,18 +831,7 @@ static bool connect_proxy(ckpool_t *ckp, connsock_t *cs, proxy_instance_t *proxy
 		return false;
 	}
 	keep_sockalive(cs->fd);
-	if (!ckp->passthrough) {
-		struct epoll_event event;
-
-		event.events = EPOLLIN | EPOLLRDHUP;
-		event.data.ptr = proxy;
-		/* Add this connsock_t to the epoll list */
-		if (unlikely(epoll_ctl(proxy->epfd, EPOLL_CTL_ADD, cs->fd, &event) == -1)) {
-			LOGERR("Failed to add fd %d to epfd %d to epoll_ctl in proxy_alive",
-				cs->fd, proxy->epfd);
-			return false;
-		}
-	} else {
+	if (ckp->passthrough) {
 		/* We want large send/recv buffers on passthroughs */
 		if (!ckp->rmem_warn)
 			cs->rcvbufsiz = set_recvbufsize(ckp, cs->fd, 1048576);
@@ -505,6 +841,24 @@ static bool connect_proxy(ckpool_t *ckp, connsock_t *cs, proxy_instance_t *proxy
 	return true;
 }
 
+/* Hand the proxy socket to the upstream receivers once it's set up. It is
+ * added oneshot so only one receiver handles a proxy at a time and it must be
+ * rearmed after each event. cs semaphore must be held */
+static bool watch_proxy(proxy_instance_t *proxy, const int op)
+{
+	connsock_t *cs = &proxy->cs;
+	struct epoll_event event;
+
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	event.data.ptr = proxy;
+	if (unlikely(epoll_ctl(proxy->epfd, op, cs->fd, &event) == -1)) {
+		LOGERR("Failed to %s fd %d in epfd %d in watch_proxy",
+		       op == EPOLL_CTL_ADD ? "add" : "rearm", cs->fd, proxy->epfd);
+		return false;
+	}
+	return true;
+}
+
 /* For some reason notify is buried at various different array depths so use
  * a reentrant function to try and find it. */
 static json_t *find_notify(json_t *val)
@@ -838,46 +1192,108 @@ struct genwork *generator_getbase(ckpool_t *ckp)
 	gbtbase_t *gbt = NULL;
 	server_instance_t *si;
 	connsock_t *cs;
+	tv_t start;
 
 	/* Use temporary variables to prevent deref while accessing */
-	si = gdata->current_si;
+	si = template_server(gdata);
 	if (unlikely(!si)) {
 		LOGWARNING("No live current server in generator_genbase");
 		goto out;
 	}
 	cs = &si->cs;
 	gbt = ckzalloc(sizeof(gbtbase_t));
+	tv_time(&start);
 	if (unlikely(!gen_gbtbase(cs, gbt))) {
 		LOGWARNING("Failed to get block template from %s:%s", cs->url, cs->port);
 		si->alive = cs->alive = false;
 		reconnect_generator(ckp);
 		dealloc(gbt);
-	}
+	} else
+		add_srvtime(gdata, &gdata->srvstats[si->id].gbt, &start);
 out:
 	return gbt;
 }
 
-int generator_getbest(ckpool_t *ckp, char *hash)
+/* Servers not alive are expected with backup bitcoinds so fail quietly */
+static server_instance_t *watched_server(ckpool_t *ckp, const int server)
+{
+	server_instance_t *si;
+
+	if (unlikely(server < 0 || server >= ckp->btcds))
+		return NULL;
+	si = ckp->servers[server];
+	if (!si->alive)
+		return NULL;
+	return si;
+}
+
+int generator_getbest(ckpool_t *ckp, const int server, char *hash)
 {
 	gdata_t *gdata = ckp->gdata;
 	int ret = GETBEST_FAILED;
 	server_instance_t *si;
+	server_stats_t *st;
 	connsock_t *cs;
 
-	si = gdata->current_si;
-	if (unlikely(!si)) {
-		LOGWARNING("No live current server in generator_getbest");
+	si = watched_server(ckp, server);
+	if (unlikely(!si))
 		goto out;
-	}
 	if (si->notify) {
 		ret = GETBEST_NOTIFY;
 		goto out;
 	}
 	cs = &si->cs;
+	/* Only this server's own blockupdate thread counts its failures */
+	st = &gdata->srvstats[server];
 	if (unlikely(!get_bestblockhash(cs, hash))) {
-		LOGWARNING("Failed to get best block hash from %s:%s", cs->url, cs->port);
+		if (++st->getbest_fails < GETBEST_FAILS) {
+			LOGINFO("Failed to get best block hash from %s:%s", cs->url, cs->port);
+			goto out;
+		}
+		/* Leave it to the server watchdog to find it alive again */
+		LOGWARNING("Failed to get best block hash from %s:%s %d times, marking dead",
+			   cs->url, cs->port, st->getbest_fails);
+		st->getbest_fails = 0;
+		si->alive = cs->alive = false;
+		goto out;
+	}
+	st->getbest_fails = 0;
+	ret = GETBEST_SUCCESS;
+out:
+	return ret;
+}
+
+/* As generator_getbest but blocks on a getblocktemplate long poll, handing
+ * back the template it returned in *base for the caller to use or free */
+int generator_longpoll(ckpool_t *ckp, const int server, char *longpollid, char *hash,
+		       struct genwork **base)
+{
+	gdata_t *gdata = ckp->gdata;
+	int ret = GETBEST_FAILED;
+	server_instance_t *si;
+	server_stats_t *st;
+	gbtbase_t *gbt;
+	connsock_t *cs;
+
+	si = watched_server(ckp, server);
+	if (unlikely(!si))
+		goto out;
+	if (si->notify) {
+		ret = GETBEST_NOTIFY;
+		goto out;
+	}
+	cs = &si->cs;
+	st = &gdata->srvstats[server];
+	gbt = ckzalloc(sizeof(gbtbase_t));
+	if (unlikely(!get_longpoll(cs, longpollid, gbt))) {
+		LOGINFO("Failed to get long poll from %s:%s", cs->url, cs->port);
+		dealloc(gbt);
 		goto out;
 	}
+	strcpy(hash, json_string_value(json_object_get(gbt->json, "previousblockhash")));
+	strcpy(st->pollhash, hash);
+	st->pollheight = gbt->height ? gbt->height - 1 : -1;
+	*base = gbt;
 	ret = GETBEST_SUCCESS;
 out:
 	return ret;
@@ -919,6 +1335,68 @@ out:
 	return ret;
 }
 
+static void clear_notify(notify_instance_t *ni)
+{
+	if (ni->jobid)
+		json_decref(ni->jobid);
+	free(ni->coinbase1);
+	free(ni->coinbase2);
+	free(ni);
+}
+
+/* Free notifies older than NOTIFY_EXPIRE seconds from the timer wheel, oldest
+ * first and always keeping the last couple. A slot is only marked aged once it
+ * has been emptied of expired notifies. Enter with notify_lock held */
+static void __age_notifies(gdata_t *gdata, const time_t now)
+{
+	time_t expiry = now - NOTIFY_EXPIRE, tick = gdata->notify_tick;
+	notify_instance_t *ni, *tmp;
+
+	/* Visiting every slot once covers any length of time */
+	if (expiry - 1 - tick > WHEEL_SLOTS)
+		tick = expiry - 1 - WHEEL_SLOTS;
+	while (tick < expiry - 1) {
+		notify_instance_t **slot = &gdata->notify_wheel[(tick + 1) % WHEEL_SLOTS];
+
+		DL_FOREACH_SAFE(*slot, ni, tmp) {
+			if (HASH_COUNT(gdata->notify_instances) < 3)
+				goto out;
+			if (ni->notify_time < expiry) {
+				DL_DELETE(*slot, ni);
+				HASH_DEL(gdata->notify_instances, ni);
+				clear_notify(ni);
+			}
+		}
+		tick++;
+	}
+out:
+	gdata->notify_tick = tick;
+}
+
+/* Free shares that have had no response for SHARE_EXPIRE seconds from the
+ * timer wheel. Enter with share_lock held */
+static void __age_shares(gdata_t *gdata, const time_t now)
+{
+	time_t expiry = now - SHARE_EXPIRE, tick = gdata->share_tick;
+	share_msg_t *share, *tmp;
+
+	if (expiry - 1 - tick > WHEEL_SLOTS)
+		tick = expiry - 1 - WHEEL_SLOTS;
+	while (tick < expiry - 1) {
+		share_msg_t **slot = &gdata->share_wheel[++tick % WHEEL_SLOTS];
+
+		DL_FOREACH_SAFE(*slot, share, tmp) {
+			if (share->submit_time < expiry) {
+				DL_DELETE(*slot, share);
+				HASH_DEL(gdata->shares, share);
+				gdata->shares_expired++;
+				slab_free(gdata->share_slab, share);
+			}
+		}
+	}
+	gdata->share_tick = tick;
+}
+
 static bool parse_notify(ckpool_t *ckp, proxy_instance_t *proxi, json_t *val)
 {
 	const char *prev_hash, *bbversion, *nbit, *ntime;
@@ -988,6 +1466,8 @@ static bool parse_notify(ckpool_t *ckp, proxy_instance_t *proxi, json_t *val)
 	mutex_lock(&gdata->notify_lock);
 	ni->id = gdata->proxy_notify_id++;
 	HASH_ADD_INT(gdata->notify_instances, id, ni);
+	DL_APPEND(gdata->notify_wheel[ni->notify_time % WHEEL_SLOTS], ni);
+	__age_notifies(gdata, ni->notify_time);
 	mutex_unlock(&gdata->notify_lock);
 
 	send_notify(ckp, proxi, ni);
@@ -1145,6 +1625,8 @@ static void close_proxy_socket(proxy_instance_t *proxy, proxy_instance_t *subpro
 	}
 }
 
+static void drop_proxy_sends(gdata_t *gdata, proxy_instance_t *proxy);
+
 /* Remove the subproxy from the proxi list and put it on the dead list.
  * Further use of the subproxy pointer may point to a new proxy but will not
  * dereference. This will only disable subproxies so parent proxies need to
@@ -1154,6 +1636,7 @@ static void disable_subproxy(gdata_t *gdata, proxy_instance_t *proxi, proxy_inst
 	subproxy->alive = false;
 	send_stratifier_deadproxy(gdata->ckp, subproxy->id, subproxy->subid);
 	close_proxy_socket(proxi, subproxy);
+	drop_proxy_sends(gdata, subproxy);
 	if (parent_proxy(subproxy))
 		return;
 
@@ -1558,11 +2041,11 @@ static void stratifier_reconnect_client(ckpool_t *ckp, const int64_t id)
 /* Add a share to the gdata share hashlist. Returns the share id */
 static int add_share(gdata_t *gdata, const int64_t client_id, const double diff)
 {
-	share_msg_t *share = ckzalloc(sizeof(share_msg_t)), *tmpshare;
-	time_t now;
+	share_msg_t *share = slab_zalloc(gdata->share_slab);
 	int ret;
 
-	share->submit_time = now = time(NULL);
+	tv_time(&share->submit_tv);
+	share->submit_time = share->submit_tv.tv_sec;
 	share->client_id = client_id;
 	share->diff = diff;
 
@@ -1570,84 +2053,268 @@ static int add_share(gdata_t *gdata, const int64_t client_id, const double diff)
 	mutex_lock(&gdata->share_lock);
 	ret = share->id = gdata->share_id++;
 	HASH_ADD_I64(gdata->shares, id, share);
-	HASH_ITER(hh, gdata->shares, share, tmpshare) {
-		if (share->submit_time < now - 120)
-			HASH_DEL(gdata->shares, share);
-	}
+	DL_APPEND(gdata->share_wheel[share->submit_time % WHEEL_SLOTS], share);
+	__age_shares(gdata, share->submit_time);
 	mutex_unlock(&gdata->share_lock);
 
 	return ret;
 }
 
-static void submit_share(gdata_t *gdata, json_t *val)
+static void clear_proxy_send(cs_msg_t *csmsg)
 {
-	proxy_instance_t *proxy, *proxi;
-	ckpool_t *ckp = gdata->ckp;
-	int id, subid, share_id;
-	bool success = false;
-	stratum_msg_t *msg;
-	int64_t client_id;
+	free(csmsg->buf);
+	free(csmsg);
+}
 
-	/* Get the client id so we can tell the stratifier to drop it if the
-	 * proxy it's bound to is not functional */
-	if (unlikely(!json_get_int64(&client_id, val, "client_id"))) {
-		LOGWARNING("Got no client_id in share");
-		goto out;
-	}
-	if (unlikely(!json_get_int(&id, val, "proxy"))) {
-		LOGWARNING("Got no proxy in share");
-		goto out;
-	}
-	if (unlikely(!json_get_int(&subid, val, "subproxy"))) {
-		LOGWARNING("Got no subproxy in share");
-		goto out;
-	}
-	proxy = proxy_by_id(gdata, id);
-	if (unlikely(!proxy)) {
-		LOGINFO("Client %"PRId64" sending shares to non existent proxy %d, dropping",
-			client_id, id);
-		stratifier_reconnect_client(ckp, client_id);
-		goto out;
-	}
-	proxi = subproxy_by_id(proxy, subid);
-	if (unlikely(!proxi)) {
-		LOGINFO("Client %"PRId64" sending shares to non existent subproxy %d:%d, dropping",
-			client_id, id, subid);
-		stratifier_reconnect_client(ckp, client_id);
-		goto out;
-	}
-	if (!proxi->alive) {
-		LOGINFO("Client %"PRId64" sending shares to dead subproxy %d:%d, dropping",
-			client_id, id, subid);
-		stratifier_reconnect_client(ckp, client_id);
-		goto out;
-	}
+/* Remove a send from its proxy's queue. psend_lock must be held. */
+static void __del_proxy_send(gdata_t *gdata, proxy_instance_t *proxy, cs_msg_t *csmsg)
+{
+	DL_DELETE(proxy->sends, csmsg);
+	proxy->sends_queued--;
+	gdata->psends_queued--;
+	gdata->psends_size -= sizeof(cs_msg_t) + csmsg->ofs + csmsg->len + 1;
+}
 
-	success = true;
-	msg = ckzalloc(sizeof(stratum_msg_t));
-	msg->json_msg = val;
-	share_id = add_share(gdata, client_id, proxi->diff);
-	json_set_int(val, "id", share_id);
+/* Park a proxy whose socket would block on the psend epoll to be resumed when
+ * it is writable. The parked proxy retains ownership of sending. Returns false
+ * if the proxy died in the meantime. */
+static bool park_proxy(gdata_t *gdata, proxy_instance_t *proxy)
+{
+	struct epoll_event event;
+	bool ret = false;
 
-	/* Add the new message to the psend list */
 	mutex_lock(&gdata->psend_lock);
-	gdata->psends_generated++;
-	DL_APPEND(gdata->psends, msg);
-	pthread_cond_signal(&gdata->psend_cond);
+	if (likely(proxy->alive)) {
+		proxy->parked = true;
+		proxy->parked_time = time(NULL);
+		DL_APPEND2(gdata->parked_proxies, proxy, parked_prev, parked_next);
+		gdata->psends_delayed++;
+		ret = true;
+	}
 	mutex_unlock(&gdata->psend_lock);
 
-out:
-	if (!success)
-		json_decref(val);
+	if (unlikely(!ret))
+		goto out;
+
+	event.data.ptr = proxy;
+	event.events = EPOLLOUT | EPOLLONESHOT;
+	if (epoll_ctl(gdata->psend_epfd, EPOLL_CTL_MOD, proxy->cs.fd, &event) < 0 && errno == ENOENT)
+		epoll_ctl(gdata->psend_epfd, EPOLL_CTL_ADD, proxy->cs.fd, &event);
+	/* Any failure here is from the socket being closed by the proxy dying
+	 * which the psend thread will find when checking parked proxies. */
+out:
+	return ret;
 }
 
-static void clear_notify(notify_instance_t *ni)
+/* Take ownership of sending back from a parked proxy. psend_lock must be
+ * held. */
+static bool __unpark_proxy(gdata_t *gdata, proxy_instance_t *proxy)
 {
-	if (ni->jobid)
-		json_decref(ni->jobid);
-	free(ni->coinbase1);
-	free(ni->coinbase2);
-	free(ni);
+	if (!proxy->parked)
+		return false;
+	proxy->parked = false;
+	DL_DELETE2(gdata->parked_proxies, proxy, parked_prev, parked_next);
+	return true;
+}
+
+/* Write out all queued sends to a proxy, coalescing as many as possible into
+ * each sendmsg, and park the proxy if its socket would block. Must only be
+ * called by the thread that owns sending to the proxy. */
+static void flush_proxy_sends(gdata_t *gdata, proxy_instance_t *proxy)
+{
+	cs_msg_t *csmsg, *tmp, *sent = NULL;
+	struct iovec iov[PSEND_IOVS];
+	struct msghdr msg;
+
+	while (42) {
+		int iovcnt = 0;
+		ssize_t ret;
+
+		mutex_lock(&gdata->psend_lock);
+		if (unlikely(!proxy->alive)) {
+			/* Discard everything still queued */
+			DL_FOREACH_SAFE(proxy->sends, csmsg, tmp) {
+				__del_proxy_send(gdata, proxy, csmsg);
+				DL_APPEND(sent, csmsg);
+			}
+		}
+		DL_FOREACH(proxy->sends, csmsg) {
+			iov[iovcnt].iov_base = csmsg->buf + csmsg->ofs;
+			iov[iovcnt].iov_len = csmsg->len;
+			if (++iovcnt == PSEND_IOVS)
+				break;
+		}
+		if (!iovcnt)
+			proxy->sending = false;
+		mutex_unlock(&gdata->psend_lock);
+
+		if (!iovcnt)
+			break;
+		/* The socket itself is blocking for the proxy's reads and
+		 * subscribe and authorise, so only this write is made
+		 * nonblocking */
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		ret = sendmsg(proxy->cs.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 1) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (!ret || errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (park_proxy(gdata, proxy))
+					break;
+				continue;
+			}
+			LOGNOTICE("Proxy %d:%d %s failed to send shares in flush_proxy_sends, dropping",
+				  proxy->id, proxy->subid, proxy->url);
+			disable_subproxy(gdata, proxy->parent, proxy);
+			continue;
+		}
+
+		/* Remove whatever was written in full, leaving a partly
+		 * written message at the head of the queue */
+		mutex_lock(&gdata->psend_lock);
+		proxy->sends_writes++;
+		DL_FOREACH_SAFE(proxy->sends, csmsg, tmp) {
+			if (ret < csmsg->len) {
+				csmsg->ofs += ret;
+				csmsg->len -= ret;
+				break;
+			}
+			ret -= csmsg->len;
+			proxy->sends_sent++;
+			__del_proxy_send(gdata, proxy, csmsg);
+			DL_APPEND(sent, csmsg);
+		}
+		mutex_unlock(&gdata->psend_lock);
+	}
+
+	DL_FOREACH_SAFE(sent, csmsg, tmp) {
+		DL_DELETE(sent, csmsg);
+		clear_proxy_send(csmsg);
+	}
+}
+
+/* Discard the sends queued to a proxy that has died if it is parked. A thread
+ * that owns sending to it otherwise discards them on finding it dead. */
+static void drop_proxy_sends(gdata_t *gdata, proxy_instance_t *proxy)
+{
+	bool drop;
+
+	mutex_lock(&gdata->psend_lock);
+	drop = __unpark_proxy(gdata, proxy);
+	mutex_unlock(&gdata->psend_lock);
+	if (drop)
+		flush_proxy_sends(gdata, proxy);
+}
+
+/* Queue a share on the proxy's own send queue and write it out immediately
+ * from this thread unless another thread already owns sending to the proxy or
+ * it is parked. */
+static void queue_proxy_send(gdata_t *gdata, proxy_instance_t *proxy, json_t *val)
+{
+	bool flush = false;
+	cs_msg_t *csmsg;
+	char *buf;
+
+	buf = json_dumps(val, JSON_ESCAPE_SLASH | JSON_EOL);
+	if (unlikely(!buf)) {
+		LOGWARNING("Failed to create json dump in queue_proxy_send");
+		return;
+	}
+	csmsg = ckzalloc(sizeof(cs_msg_t));
+	csmsg->buf = buf;
+	csmsg->len = strlen(buf);
+
+	mutex_lock(&gdata->psend_lock);
+	gdata->psends_generated++;
+	gdata->psends_queued++;
+	gdata->psends_size += sizeof(cs_msg_t) + csmsg->len + 1;
+	DL_APPEND(proxy->sends, csmsg);
+	if (++proxy->sends_queued > proxy->sends_max)
+		proxy->sends_max = proxy->sends_queued;
+	if (!proxy->sending) {
+		proxy->sending = true;
+		flush = true;
+	}
+	mutex_unlock(&gdata->psend_lock);
+
+	if (flush)
+		flush_proxy_sends(gdata, proxy);
+}
+
+static void submit_share(gdata_t *gdata, json_t *val)
+{
+	proxy_instance_t *proxy, *proxi;
+	int id, subid, share_id, jobid;
+	ckpool_t *ckp = gdata->ckp;
+	json_t *jobid_val = NULL;
+	notify_instance_t *ni;
+	int64_t client_id;
+	json_t *msg;
+
+	/* Get the client id so we can tell the stratifier to drop it if the
+	 * proxy it's bound to is not functional */
+	if (unlikely(!json_get_int64(&client_id, val, "client_id"))) {
+		LOGWARNING("Got no client_id in share");
+		goto out;
+	}
+	if (unlikely(!json_get_int(&id, val, "proxy"))) {
+		LOGWARNING("Got no proxy in share");
+		goto out;
+	}
+	if (unlikely(!json_get_int(&subid, val, "subproxy"))) {
+		LOGWARNING("Got no subproxy in share");
+		goto out;
+	}
+	if (unlikely(!json_get_int(&jobid, val, "jobid"))) {
+		LOGWARNING("Got no jobid in share");
+		goto out;
+	}
+	proxy = proxy_by_id(gdata, id);
+	if (unlikely(!proxy)) {
+		LOGINFO("Client %"PRId64" sending shares to non existent proxy %d, dropping",
+			client_id, id);
+		stratifier_reconnect_client(ckp, client_id);
+		goto out;
+	}
+	proxi = subproxy_by_id(proxy, subid);
+	if (unlikely(!proxi)) {
+		LOGINFO("Client %"PRId64" sending shares to non existent subproxy %d:%d, dropping",
+			client_id, id, subid);
+		stratifier_reconnect_client(ckp, client_id);
+		goto out;
+	}
+	if (!proxi->alive) {
+		LOGINFO("Client %"PRId64" sending shares to dead subproxy %d:%d, dropping",
+			client_id, id, subid);
+		stratifier_reconnect_client(ckp, client_id);
+		goto out;
+	}
+
+	mutex_lock(&gdata->notify_lock);
+	HASH_FIND_INT(gdata->notify_instances, &jobid, ni);
+	if (ni)
+		jobid_val = json_copy(ni->jobid);
+	mutex_unlock(&gdata->notify_lock);
+
+	if (unlikely(!jobid_val)) {
+		stratifier_reconnect_client(ckp, client_id);
+		LOGNOTICE("Proxy %d:%s failed to find matching jobid in submit_share",
+			  proxi->id, proxi->url);
+		goto out;
+	}
+
+	share_id = add_share(gdata, client_id, proxi->diff);
+	JSON_CPACK(msg, "{s[soooo]siss}", "params", proxi->auth, jobid_val,
+			json_object_dup(val, "nonce2"),
+			json_object_dup(val, "ntime"),
+			json_object_dup(val, "nonce"),
+			"id", share_id, "method", "mining.submit");
+	queue_proxy_send(gdata, proxi, msg);
+	json_decref(msg);
+out:
+	json_decref(val);
 }
 
 /* Entered with proxy_lock held */
@@ -1672,11 +2339,16 @@ static void __decay_proxy(proxy_instance_t *proxy, proxy_instance_t * parent, co
 	copy_tv(&parent->total_last_decay, &now_t);
 }
 
-static void account_shares(proxy_instance_t *proxy, const double diff, const bool result)
+static void account_shares(proxy_instance_t *proxy, const double diff, const bool result,
+			   tv_t *submitted)
 {
 	proxy_instance_t *parent = proxy->parent;
 
 	mutex_lock(&parent->proxy_lock);
+	if (submitted) {
+		__add_srvtime(&proxy->rtt, submitted);
+		__add_srvtime(&parent->total_rtt, submitted);
+	}
 	if (result) {
 		proxy->diff_accepted += diff;
 		parent->total_accepted += diff;
@@ -1717,8 +2389,10 @@ static int parse_share(gdata_t *gdata, proxy_instance_t *proxi, const char *buf)
 
 	mutex_lock(&gdata->share_lock);
 	HASH_FIND_I64(gdata->shares, &id, share);
-	if (share)
+	if (share) {
 		HASH_DEL(gdata->shares, share);
+		DL_DELETE(gdata->share_wheel[share->submit_time % WHEEL_SLOTS], share);
+	}
 	mutex_unlock(&gdata->share_lock);
 
 	if (!share) {
@@ -1726,187 +2400,91 @@ static int parse_share(gdata_t *gdata, proxy_instance_t *proxi, const char *buf)
 			proxi->id, proxi->subid, buf);
 		/* We don't know what diff these shares are so assume the
 		 * current proxy diff. */
-		account_shares(proxi, proxi->diff, result);
+		account_shares(proxi, proxi->diff, result, NULL);
 		ret = -1;
 		goto out;
 	}
 	ret = 1;
-	account_shares(proxi, share->diff, result);
+	account_shares(proxi, share->diff, result, &share->submit_tv);
 	LOGINFO("Proxy %d:%d share result %s from client %"PRId64, proxi->id, proxi->subid,
 		buf, share->client_id);
-	free(share);
+	slab_free(gdata->share_slab, share);
 out:
 	if (val)
 		json_decref(val);
 	return ret;
 }
 
-struct cs_msg {
-	cs_msg_t *next;
-	cs_msg_t *prev;
-	proxy_instance_t *proxy;
-	char *buf;
-	int len;
-	int ofs;
-};
-
-/* Sends all messages in the queue ready to be dispatched, leaving those that
- * would block to be handled next pass */
-static void send_json_msgq(gdata_t *gdata, cs_msg_t **csmsgq)
+/* Resume sending to a parked proxy whose socket is now writable */
+static void resume_proxy(gdata_t *gdata, proxy_instance_t *proxy)
 {
-	cs_msg_t *csmsg, *tmp;
-	int ret;
+	bool resume;
 
-	DL_FOREACH_SAFE(*csmsgq, csmsg, tmp) {
-		proxy_instance_t *proxy = csmsg->proxy;
+	mutex_lock(&gdata->psend_lock);
+	resume = __unpark_proxy(gdata, proxy);
+	mutex_unlock(&gdata->psend_lock);
+	if (likely(resume))
+		flush_proxy_sends(gdata, proxy);
+}
 
-		/* Only try to send one message at a time to each proxy
-		 * to avoid sending parts of different messages */
-		if (proxy->sending  && proxy->sending != csmsg)
-			continue;
-		while (csmsg->len) {
-			int fd;
+/* Look for parked proxies that have died or been blocked for more than 60
+ * seconds, taking ownership of them to clear or drop them. */
+static void check_parked_proxies(gdata_t *gdata, const time_t now)
+{
+	proxy_instance_t *proxy, *tmp, *expired = NULL;
 
-			if (unlikely(!proxy->alive)) {
-				LOGDEBUG("Dropping send message to dead proxy %d:%d in send_json_msgq",
-					 proxy->id, proxy->subid);
-				csmsg->len = 0;
-				break;
-			}
-			proxy->sending = csmsg;
-			fd = proxy->cs.fd;
-			ret = send(fd, csmsg->buf + csmsg->ofs, csmsg->len, MSG_DONTWAIT);
-			if (ret < 1) {
-				if (!ret || errno == EAGAIN || errno == EWOULDBLOCK)
-					break;
-				csmsg->len = 0;
-				LOGNOTICE("Proxy %d:%d %s failed to send msg in send_json_msgq, dropping",
-					  proxy->id, proxy->subid, proxy->url);
-				disable_subproxy(gdata, proxy->parent, proxy);
-			}
-			csmsg->ofs += ret;
-			csmsg->len -= ret;
-		}
-		if (!csmsg->len) {
-			proxy->sending = NULL;
-			DL_DELETE(*csmsgq, csmsg);
-			free(csmsg->buf);
-			free(csmsg);
+	mutex_lock(&gdata->psend_lock);
+	DL_FOREACH_SAFE2(gdata->parked_proxies, proxy, tmp, parked_next) {
+		if (!proxy->alive || now - proxy->parked_time >= 60) {
+			__unpark_proxy(gdata, proxy);
+			DL_APPEND2(expired, proxy, parked_prev, parked_next);
 		}
 	}
-}
-
-static void add_json_msgq(cs_msg_t **csmsgq, proxy_instance_t *proxy, json_t **val)
-{
-	cs_msg_t *csmsg = ckzalloc(sizeof(cs_msg_t));
+	mutex_unlock(&gdata->psend_lock);
 
-	csmsg->buf = json_dumps(*val, JSON_ESCAPE_SLASH | JSON_EOL);
-	json_decref(*val);
-	*val = NULL;
-	if (unlikely(!csmsg->buf)) {
-		LOGWARNING("Failed to create json dump in add_json_msgq");
-		return;
+	DL_FOREACH_SAFE2(expired, proxy, tmp, parked_next) {
+		DL_DELETE2(expired, proxy, parked_prev, parked_next);
+		if (proxy->alive) {
+			LOGNOTICE("Proxy %d:%d %s blocked for >60 seconds, dropping",
+				  proxy->id, proxy->subid, proxy->url);
+			disable_subproxy(gdata, proxy->parent, proxy);
+		}
+		flush_proxy_sends(gdata, proxy);
 	}
-	csmsg->len = strlen(csmsg->buf);
-	csmsg->proxy = proxy;
-	DL_APPEND(*csmsgq, csmsg);
 }
 
-/* For processing and sending shares. proxy refers to parent proxy here */
+/* Shares are written out directly by the threads submitting them. This thread
+ * only waits on the sockets of proxies that would have blocked to resume
+ * sending to them once they're writable, and drops those blocked for too
+ * long. */
 static void *proxy_send(void *arg)
 {
+	struct epoll_event events[UPSTREAM_EVENTS];
 	ckpool_t *ckp = (ckpool_t *)arg;
 	gdata_t *gdata = ckp->gdata;
-	stratum_msg_t *msg = NULL;
-	cs_msg_t *csmsgq = NULL;
+	time_t last_check = 0;
 
 	rename_proc("proxysend");
 
 	pthread_detach(pthread_self());
 
 	while (42) {
-		proxy_instance_t *proxy, *subproxy;
-		int proxyid = 0, subid = 0;
-		int64_t client_id = 0, id;
-		notify_instance_t *ni;
-		json_t *jobid = NULL;
-		json_t *val;
-
-		if (unlikely(msg)) {
-			json_decref(msg->json_msg);
-			free(msg);
-		}
-
-		mutex_lock(&gdata->psend_lock);
-		if (!gdata->psends) {
-			/* Poll every 10ms */
-			const ts_t polltime = {0, 10000000};
-			ts_t timeout_ts;
-
-			ts_realtime(&timeout_ts);
-			timeraddspec(&timeout_ts, &polltime);
-			cond_timedwait(&gdata->psend_cond, &gdata->psend_lock, &timeout_ts);
-		}
-		msg = gdata->psends;
-		if (likely(msg))
-			DL_DELETE(gdata->psends, msg);
-		mutex_unlock(&gdata->psend_lock);
-
-		if (!msg) {
-			send_json_msgq(gdata, &csmsgq);
-			continue;
-		}
+		int nevents, i;
+		time_t now;
 
-		if (unlikely(!json_get_int(&subid, msg->json_msg, "subproxy"))) {
-			LOGWARNING("Failed to find subproxy in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int64(&id, msg->json_msg, "jobid"))) {
-			LOGWARNING("Failed to find jobid in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int(&proxyid, msg->json_msg, "proxy"))) {
-			LOGWARNING("Failed to find proxy in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int64(&client_id, msg->json_msg, "client_id"))) {
-			LOGWARNING("Failed to find client_id in proxy_send msg");
-			continue;
-		}
-		proxy = proxy_by_id(gdata, proxyid);
-		if (unlikely(!proxy)) {
-			LOGWARNING("Proxysend for got message for non-existent proxy %d",
-				   proxyid);
-			continue;
-		}
-		subproxy = subproxy_by_id(proxy, subid);
-		if (unlikely(!subproxy)) {
-			LOGWARNING("Proxysend for got message for non-existent subproxy %d:%d",
-				   proxyid, subid);
-			continue;
+		nevents = epoll_wait(gdata->psend_epfd, events, UPSTREAM_EVENTS, 1000);
+		if (unlikely(nevents == -1 && errno != EINTR)) {
+			LOGEMERG("FATAL: Failed to epoll_wait in proxy_send");
+			break;
 		}
+		for (i = 0; i < nevents; i++)
+			resume_proxy(gdata, events[i].data.ptr);
 
-		mutex_lock(&gdata->notify_lock);
-		HASH_FIND_INT(gdata->notify_instances, &id, ni);
-		if (ni)
-			jobid = json_copy(ni->jobid);
-		mutex_unlock(&gdata->notify_lock);
-
-		if (unlikely(!jobid)) {
-			stratifier_reconnect_client(ckp, client_id);
-			LOGNOTICE("Proxy %d:%s failed to find matching jobid in proxysend",
-				  subproxy->id, subproxy->url);
-			continue;
+		now = time(NULL);
+		if (now != last_check) {
+			last_check = now;
+			check_parked_proxies(gdata, now);
 		}
-
-		JSON_CPACK(val, "{s[soooo]soss}", "params", subproxy->auth, jobid,
-				json_object_dup(msg->json_msg, "nonce2"),
-				json_object_dup(msg->json_msg, "ntime"),
-				json_object_dup(msg->json_msg, "nonce"),
-				"id", json_object_dup(msg->json_msg, "id"),
-				"method", "mining.submit");
-		add_json_msgq(&csmsgq, subproxy, &val);
-		send_json_msgq(gdata, &csmsgq);
 	}
 	return NULL;
 }
@@ -2033,6 +2611,9 @@ static bool proxy_alive(ckpool_t *ckp, proxy_instance_t *proxi, connsock_t *cs,
 		}
 		goto out;
 	}
+	if (!watch_proxy(proxi, EPOLL_CTL_ADD))
+		goto out;
+	tv_time(&proxi->last_message);
 	proxi->authorised = ret = true;
 out:
 	if (!ret) {
@@ -2216,288 +2797,191 @@ static bool subproxies_alive(proxy_instance_t *proxy)
 	return ret;
 }
 
-/* For receiving messages from the upstream proxy, also responsible for setting
- * up the connection and testing it's alive. */
-static void *proxy_recv(void *arg)
+/* Handle an epoll event on an upstream proxy socket, parsing every complete
+ * message buffered without waiting on partial ones, then rearming it. */
+static void proxy_event(gdata_t *gdata, proxy_instance_t *subproxy, const uint32_t events)
 {
-	proxy_instance_t *proxi = (proxy_instance_t *)arg;
-	connsock_t *cs = &proxi->cs;
-	proxy_instance_t *subproxy;
-	ckpool_t *ckp = proxi->ckp;
-	gdata_t *gdata = ckp->gdata;
-	struct epoll_event event;
-	bool alive;
-	int epfd;
+	proxy_instance_t *parent = subproxy->parent;
+	connsock_t *cs = &subproxy->cs;
+	ckpool_t *ckp = gdata->ckp;
+	float timeout = 0;
+	bool hup = false;
+	int ret = 0;
 
-	rename_proc("proxyrecv");
-	pthread_detach(pthread_self());
+	/* Serialise messages from here with the semaphore which also makes
+	 * sure any subscribe/auth on this socket has completed. */
+	cksem_wait(&cs->sem);
+	if (!subproxy->alive)
+		goto out;
 
-	proxi->epfd = epfd = epoll_create1(EPOLL_CLOEXEC);
-	if (epfd < 0){
-		LOGEMERG("FATAL: Failed to create epoll in proxyrecv");
-		return NULL;
+	/* Process any messages before checking for errors in case a message is
+	 * sent and then the socket immediately closed. */
+	if (events & EPOLLIN) {
+		ret = read_socket_line(cs, &timeout);
+		if (ret < 0) {
+			LOGNOTICE("Proxy %d:%d %s failed to read_socket_line in proxy_event",
+				  subproxy->id, subproxy->subid, subproxy->url);
+			hup = true;
+		}
+	}
+	if (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+		LOGNOTICE("Proxy %d:%d %s epoll hangup in proxy_event",
+			  subproxy->id, subproxy->subid, subproxy->url);
+		hup = true;
+	}
+	if (ret > 0)
+		tv_time(&parent->last_message);
+	while (ret > 0) {
+		/* subproxy may have been recycled here if it is not a
+		 * parent and reconnect was issued */
+		if (!parse_method(ckp, subproxy, cs->buf)) {
+			/* If it's not a method it should be a share result */
+			if (!parse_share(gdata, subproxy, cs->buf)) {
+				LOGNOTICE("Proxy %d:%d unhandled stratum message: %s",
+					  subproxy->id, subproxy->subid, cs->buf);
+			}
+		}
+		ret = read_socket_line(cs, &timeout);
 	}
 
-	if (proxy_alive(ckp, proxi, cs, false))
-		LOGWARNING("Proxy %d:%s connection established", proxi->id, proxi->url);
+	/* Process hangup only after parsing messages */
+	if (hup)
+		disable_subproxy(gdata, parent, subproxy);
+	else if (subproxy->alive && cs->fd > 0)
+		watch_proxy(subproxy, EPOLL_CTL_MOD);
+out:
+	cksem_post(&cs->sem);
+}
 
-	alive = proxi->alive;
+/* One of a fixed pool of threads receiving messages from all upstream proxies
+ * and subproxies over the one shared epoll set. */
+static void *upstream_recv(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	struct epoll_event events[UPSTREAM_EVENTS];
+	gdata_t *gdata = ckp->gdata;
+
+	rename_proc("upstreamrecv");
+	pthread_detach(pthread_self());
 
 	while (42) {
-		bool message = false, hup = false;
-		share_msg_t *share, *tmpshare;
-		notify_instance_t *ni, *tmp;
-		float timeout;
-		time_t now;
-		int ret;
+		int i, ret;
 
-		subproxy = proxi;
-		if (!proxi->alive) {
-			reconnect_proxy(proxi);
-			while (!subproxies_alive(proxi)) {
-				reconnect_proxy(proxi);
-				if (alive) {
-					reconnect_generator(ckp);
-					LOGWARNING("Proxy %d:%s failed, attempting reconnect",
-						   proxi->id, proxi->url);
-					alive = false;
-				}
-				sleep(5);
-			}
-		}
-		if (!alive) {
-			reconnect_generator(ckp);
-			LOGWARNING("Proxy %d:%s recovered", proxi->id, proxi->url);
-			alive = true;
+		ret = epoll_wait(gdata->epfd, events, UPSTREAM_EVENTS, -1);
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGEMERG("Failed to epoll_wait in upstream_recv");
+			break;
 		}
+		for (i = 0; i < ret; i++)
+			proxy_event(gdata, events[i].data.ptr, events[i].events);
+	}
+	return NULL;
+}
 
-		now = time(NULL);
-
-		/* Age old notifications older than 10 mins old */
-		mutex_lock(&gdata->notify_lock);
-		HASH_ITER(hh, gdata->notify_instances, ni, tmp) {
-			if (HASH_COUNT(gdata->notify_instances) < 3)
-				break;
-			if (ni->notify_time < now - 600) {
-				HASH_DEL(gdata->notify_instances, ni);
-				clear_notify(ni);
-			}
-		}
-		mutex_unlock(&gdata->notify_lock);
+/* Initial connection of a global proxy, verbose unlike later reconnects */
+static void *proxy_connect(void *arg)
+{
+	proxy_instance_t *proxi = (proxy_instance_t *)arg;
 
-		/* Similary with shares older than 2 mins without response */
-		mutex_lock(&gdata->share_lock);
-		HASH_ITER(hh, gdata->shares, share, tmpshare) {
-			if (share->submit_time < now - 120) {
-				HASH_DEL(gdata->shares, share);
-			}
-		}
-		mutex_unlock(&gdata->share_lock);
+	pthread_detach(pthread_self());
+	if (proxy_alive(proxi->ckp, proxi, &proxi->cs, false))
+		LOGWARNING("Proxy %d:%s connection established", proxi->id, proxi->url);
+	proxi->working = proxi->alive;
+	proxi->reconnecting = false;
+	return NULL;
+}
 
-		cs = NULL;
-		/* If we don't get an update within 10 minutes the upstream pool
-		 * has likely stopped responding. */
-		ret = epoll_wait(epfd, &event, 1, 600000);
-		if (likely(ret > 0)) {
-			subproxy = event.data.ptr;
-			cs = &subproxy->cs;
-			if (!subproxy->alive) {
-				cs = NULL;
-				continue;
-			}
+/* Reconnect a global proxy that has died and report when neither it nor any
+ * of its subproxies are usable, or they recover. */
+static void check_proxy(ckpool_t *ckp, proxy_instance_t *proxi, const time_t now)
+{
+	connsock_t *cs = &proxi->cs;
 
-			/* Serialise messages from here once we have a cs by
-			 * holding the semaphore. */
-			cksem_wait(&cs->sem);
-			/* Process any messages before checking for errors in
-			 * case a message is sent and then the socket
-			 * immediately closed.
-			 */
-			if (event.events & EPOLLIN) {
-				timeout = 30;
-				ret = read_socket_line(cs, &timeout);
-				/* If we are unable to read anything within 30
-				 * seconds at this point after EPOLLIN is set
-				 * then the socket is dead. */
-				if (ret < 1) {
-					LOGNOTICE("Proxy %d:%d %s failed to read_socket_line in proxy_recv",
-						  proxi->id, subproxy->subid, subproxy->url);
-					hup = true;
-				} else {
-					message = true;
-					timeout = 0;
-				}
-			}
-			if (event.events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
-				LOGNOTICE("Proxy %d:%d %s epoll hangup in proxy_recv",
-					  proxi->id, subproxy->subid, subproxy->url);
-				hup = true;
-			}
-		} else {
-			LOGNOTICE("Proxy %d:%d %s failed to epoll in proxy_recv",
-				  proxi->id, subproxy->subid, subproxy->url);
-			hup = true;
+	/* Leave it till the connection in progress is complete */
+	if (proxi->reconnecting)
+		return;
+	if (proxi->alive || subproxies_alive(proxi)) {
+		if (!proxi->working) {
+			reconnect_generator(ckp);
+			LOGWARNING("Proxy %d:%s recovered", proxi->id, proxi->url);
+			proxi->working = true;
 		}
-
-		/* Parse any other messages already fully buffered with a zero
-		 * timeout. This might call read_socket_line with cs == NULL
-		 * but it can gracefully handle that. */
-		while (message || read_socket_line(cs, &timeout) > 0) {
-			message = false;
-			timeout = 0;
-			/* subproxy may have been recycled here if it is not a
-			 * parent and reconnect was issued */
-			if (parse_method(ckp, subproxy, cs->buf))
-				continue;
-			/* If it's not a method it should be a share result */
-			if (!parse_share(gdata, subproxy, cs->buf)) {
-				LOGNOTICE("Proxy %d:%d unhandled stratum message: %s",
-					  subproxy->id, subproxy->subid, cs->buf);
-			}
+	} else if (proxi->working) {
+		reconnect_generator(ckp);
+		LOGWARNING("Proxy %d:%s failed, attempting reconnect", proxi->id, proxi->url);
+		proxi->working = false;
+	}
+	if (!proxi->alive) {
+		reconnect_proxy(proxi);
+		return;
+	}
+	/* If we don't get an update within 10 minutes the upstream pool has
+	 * likely stopped responding. Don't wait on a receiver using it. */
+	if (proxi->last_message.tv_sec < now - 600 && !cksem_trywait(&cs->sem)) {
+		if (proxi->alive) {
+			LOGNOTICE("Proxy %d:%d %s no messages in 10 minutes",
+				  proxi->id, proxi->subid, proxi->url);
+			disable_subproxy(ckp->gdata, proxi, proxi);
 		}
-
-		/* Process hangup only after parsing messages */
-		if (hup)
-			disable_subproxy(gdata, proxi, subproxy);
-		if (cs)
-			cksem_post(&cs->sem);
+		cksem_post(&cs->sem);
 	}
-
-	return NULL;
 }
 
-/* Thread that handles all received messages from user proxies */
-static void *userproxy_recv(void *arg)
+/* Watches over all proxies and ages shares and notifies that the upstream
+ * receivers do not get to. */
+static void *proxy_watchdog(void *arg)
 {
 	ckpool_t *ckp = (ckpool_t *)arg;
 	gdata_t *gdata = ckp->gdata;
-	struct epoll_event event;
-	int epfd;
+	int64_t loops = 0;
 
-	rename_proc("uproxyrecv");
+	rename_proc("proxywatch");
 	pthread_detach(pthread_self());
 
-	epfd = epoll_create1(EPOLL_CLOEXEC);
-	if (epfd < 0){
-		LOGEMERG("FATAL: Failed to create epoll in userproxy_recv");
-		return NULL;
-	}
-
 	while (42) {
-		proxy_instance_t *proxy, *tmpproxy;
-		bool message = false, hup = false;
-		share_msg_t *share, *tmpshare;
-		notify_instance_t *ni, *tmp;
-		connsock_t *cs;
-		float timeout;
+		proxy_instance_t *proxy, *tmp;
 		time_t now;
-		int ret;
-
-		mutex_lock(&gdata->lock);
-		HASH_ITER(hh, gdata->proxies, proxy, tmpproxy) {
-			if (!proxy->global && !proxy->alive) {
-				proxy->epfd = epfd;
-				reconnect_proxy(proxy);
-			}
-		}
-		mutex_unlock(&gdata->lock);
-
-		ret = epoll_wait(epfd, &event, 1, 1000);
-		if (ret < 1) {
-			if (likely(!ret))
-				continue;
-			LOGEMERG("Failed to epoll_wait in userproxy_recv");
-			break;
-		}
-		proxy = event.data.ptr;
-		/* Make sure we haven't popped this off before we've finished
-		 * subscribe/auth */
-		if (unlikely(!proxy->authorised))
-			continue;
 
+		sleep(1);
 		now = time(NULL);
 
 		mutex_lock(&gdata->notify_lock);
-		HASH_ITER(hh, gdata->notify_instances, ni, tmp) {
-			if (HASH_COUNT(gdata->notify_instances) < 3)
-				break;
-			if (ni->notify_time < now - 600) {
-				HASH_DEL(gdata->notify_instances, ni);
-				clear_notify(ni);
-			}
-		}
+		__age_notifies(gdata, now);
 		mutex_unlock(&gdata->notify_lock);
 
-		/* Similary with shares older than 2 mins without response */
 		mutex_lock(&gdata->share_lock);
-		HASH_ITER(hh, gdata->shares, share, tmpshare) {
-			if (share->submit_time < now - 120) {
-				HASH_DEL(gdata->shares, share);
-			}
-		}
+		__age_shares(gdata, now);
 		mutex_unlock(&gdata->share_lock);
 
-		cs = &proxy->cs;
-
-#if 0
-		/* Is this needed at all? */
-		if (!proxy->alive)
-			continue;
-#endif
-
-		if ((event.events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))) {
-			LOGNOTICE("Proxy %d:%d %s hangup in userproxy_recv", proxy->id,
-				  proxy->subid, proxy->url);
-			hup = true;
-		}
-
-		if (likely(event.events & EPOLLIN)) {
-			timeout = 30;
-
-			cksem_wait(&cs->sem);
-			ret = read_socket_line(cs, &timeout);
-			/* If we are unable to read anything within 30
-			 * seconds at this point after EPOLLIN is set
-			 * then the socket is dead. */
-			if (ret < 1) {
-				LOGNOTICE("Proxy %d:%d %s failed to read_socket_line in userproxy_recv",
-					  proxy->id, proxy->subid, proxy->url);
-				hup = true;
-			} else {
-				message = true;
-				timeout = 0;
-			}
-			while (message || (ret = read_socket_line(cs, &timeout)) > 0) {
-				message = false;
-				timeout = 0;
-				/* proxy may have been recycled here if it is not a
-				 * parent and reconnect was issued */
-				if (parse_method(ckp, proxy, cs->buf))
-					continue;
-				/* If it's not a method it should be a share result */
-				if (!parse_share(gdata, proxy, cs->buf)) {
-					LOGNOTICE("Proxy %d:%d unhandled stratum message: %s",
-						  proxy->id, proxy->subid, cs->buf);
-				}
-			}
-			cksem_post(&cs->sem);
-		}
-
-		if (hup) {
-			disable_subproxy(gdata, proxy->parent, proxy);
-			continue;
+		/* Check global proxies every 5 seconds and try to reconnect
+		 * user proxies every second. */
+		mutex_lock(&gdata->lock);
+		HASH_ITER(hh, gdata->proxies, proxy, tmp) {
+			if (proxy->global) {
+				if (!(loops % 5))
+					check_proxy(ckp, proxy, now);
+			} else if (ckp->userproxy && !proxy->alive)
+				reconnect_proxy(proxy);
 		}
+		mutex_unlock(&gdata->lock);
+		loops++;
 	}
 	return NULL;
 }
 
 static void prepare_proxy(proxy_instance_t *proxi)
 {
+	pthread_t pth;
+
 	proxi->parent = proxi;
 	mutex_init(&proxi->proxy_lock);
 	add_subproxy(proxi, proxi);
-	if (proxi->global)
-		create_pthread(&proxi->pth_precv, proxy_recv, proxi);
+	if (proxi->global) {
+		proxi->reconnecting = true;
+		create_pthread(&pth, proxy_connect, proxi);
+	}
 }
 
 static proxy_instance_t *wait_best_proxy(ckpool_t *ckp, gdata_t *gdata)
@@ -2620,6 +3104,7 @@ static proxy_instance_t *__add_userproxy(ckpool_t *ckp, gdata_t *gdata, const in
 	proxy->auth = auth;
 	proxy->pass = pass;
 	proxy->ckp = proxy->cs.ckp = ckp;
+	proxy->epfd = gdata->epfd;
 	cksem_init(&proxy->cs.sem);
 	cksem_post(&proxy->cs.sem);
 	HASH_ADD_INT(gdata->proxies, id, proxy);
@@ -2732,7 +3217,8 @@ static void delete_proxy(ckpool_t *ckp, gdata_t *gdata, proxy_instance_t *proxy)
 	mutex_lock(&gdata->lock);
 	HASH_DEL(gdata->proxies, proxy);
 	/* Disable all its threads */
-	pthread_cancel(proxy->pth_precv);
+	if (proxy->pth_precv)
+		pthread_cancel(proxy->pth_precv);
 	close_proxy_socket(proxy, proxy);
 	mutex_unlock(&gdata->lock);
 
@@ -2825,9 +3311,8 @@ static void send_stats(gdata_t *gdata, const int sockd)
 {
 	json_t *val = json_object(), *subval;
 	int total_objects, objects, generated;
+	int64_t memsize, expired;
 	proxy_instance_t *proxy;
-	stratum_msg_t *msg;
-	int64_t memsize;
 
 	mutex_lock(&gdata->lock);
 	objects = HASH_COUNT(gdata->proxies);
@@ -2867,23 +3352,44 @@ static void send_stats(gdata_t *gdata, const int sockd)
 	objects = HASH_COUNT(gdata->shares);
 	memsize = SAFE_HASH_OVERHEAD(gdata->shares) + sizeof(share_msg_t) * objects;
 	generated = gdata->share_id;
+	expired = gdata->shares_expired;
 	mutex_unlock(&gdata->share_lock);
 
-	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
+	JSON_CPACK(subval, "{si,si,si,sI}", "count", objects, "memory", memsize,
+		   "generated", generated, "expired", expired);
 	json_steal_object(val, "shares", subval);
 
+	subval = json_object();
+	json_object_set_new_nocheck(subval, gdata->share_slab->name, slab_stats(gdata->share_slab));
+	json_steal_object(val, "slabs", subval);
+
 	mutex_lock(&gdata->psend_lock);
-	DL_COUNT(gdata->psends, msg, objects);
+	objects = gdata->psends_queued;
+	memsize = gdata->psends_size;
 	generated = gdata->psends_generated;
+	DL_COUNT2(gdata->parked_proxies, proxy, total_objects, parked_next);
+	JSON_CPACK(subval, "{si,sI,si,si,si}", "count", objects, "memory", memsize,
+		   "generated", generated, "delayed", gdata->psends_delayed,
+		   "proxies", total_objects);
 	mutex_unlock(&gdata->psend_lock);
-
-	memsize = sizeof(stratum_msg_t) * objects;
-	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_steal_object(val, "psends", subval);
 
 	send_api_response(val, sockd);
 }
 
+/* Depth of a proxy's queue of shares to send and how well they coalesce */
+static json_t *sendq_json(gdata_t *gdata, proxy_instance_t *proxy)
+{
+	json_t *val;
+
+	mutex_lock(&gdata->psend_lock);
+	JSON_CPACK(val, "{si,si,sI,sI,sb}", "queued", proxy->sends_queued,
+		   "max", proxy->sends_max, "writes", proxy->sends_writes,
+		   "sent", proxy->sends_sent, "parked", proxy->parked);
+	mutex_unlock(&gdata->psend_lock);
+	return val;
+}
+
 static json_t *proxystats(proxy_instance_t *proxy)
 {
 	proxy_instance_t *parent = proxy->parent;
@@ -2912,6 +3418,7 @@ static json_t *proxystats(proxy_instance_t *proxy)
 		json_set_double(val, "tdsps5", proxy->tdsps5);
 		json_set_double(val, "tdsps60", proxy->tdsps60);
 		json_set_double(val, "tdsps1440", proxy->tdsps1440);
+		json_object_set_new(val, "total_rtt", srvtime_json(&proxy->total_rtt));
 	}
 	json_set_double(val, "dsps1", proxy->dsps1);
 	json_set_double(val, "dsps5", proxy->dsps5);
@@ -2919,6 +3426,8 @@ static json_t *proxystats(proxy_instance_t *proxy)
 	json_set_double(val, "dsps1440", proxy->dsps1440);
 	json_set_double(val, "accepted", proxy->diff_accepted);
 	json_set_double(val, "rejected", proxy->diff_rejected);
+	json_object_set_new(val, "rtt", srvtime_json(&proxy->rtt));
+	json_object_set_new(val, "sendq", sendq_json(proxy->ckp->gdata, proxy));
 	json_set_int(val, "lastshare", proxy->last_share.tv_sec);
 	json_set_bool(val, "global", proxy->global);
 	json_set_bool(val, "disabled", proxy->disabled);
@@ -3143,13 +3652,18 @@ static void *server_watchdog(void *arg)
 
 static void setup_servers(ckpool_t *ckp)
 {
+	gdata_t *gdata = ckp->gdata;
 	pthread_t pth_watchdog;
 	int i;
 
 	ckp->servers = ckalloc(sizeof(server_instance_t *) * ckp->btcds);
+	mutex_init(&gdata->race_lock);
+	gdata->srvstats = ckzalloc(sizeof(server_stats_t) * ckp->btcds);
 	for (i = 0; i < ckp->btcds; i++) {
+		char *userpass = NULL;
 		server_instance_t *si;
 		connsock_t *cs;
+		int j;
 
 		ckp->servers[i] = ckzalloc(sizeof(server_instance_t));
 		si = ckp->servers[i];
@@ -3160,8 +3674,20 @@ static void setup_servers(ckpool_t *ckp)
 		si->id = i;
 		cs = &si->cs;
 		cs->ckp = ckp;
+		/* The address and auth never change after this since every
+		 * thread calling the server may use them at any time */
+		if (!extract_sockaddr(si->url, &cs->url, &cs->port))
+			LOGWARNING("Failed to extract address from %s", si->url);
+		userpass = strdup(si->auth);
+		realloc_strcat(&userpass, ":");
+		realloc_strcat(&userpass, si->pass);
+		cs->auth = http_base64(userpass);
+		if (!cs->auth)
+			LOGWARNING("Failed to create base64 auth from %s", userpass);
+		dealloc(userpass);
 		cksem_init(&cs->sem);
-		cksem_post(&cs->sem);
+		for (j = 0; j < RPC_CONNS; j++)
+			cksem_post(&cs->sem);
 	}
 
 	create_pthread(&pth_watchdog, server_watchdog, ckp);
@@ -3169,6 +3695,7 @@ static void setup_servers(ckpool_t *ckp)
 
 static void server_mode(ckpool_t *ckp, proc_instance_t *pi)
 {
+	gdata_t *gdata = ckp->gdata;
 	int i;
 
 	setup_servers(ckp);
@@ -3182,6 +3709,7 @@ static void server_mode(ckpool_t *ckp, proc_instance_t *pi)
 		dealloc(si);
 	}
 	dealloc(ckp->servers);
+	dealloc(gdata->srvstats);
 }
 
 static proxy_instance_t *__add_proxy(ckpool_t *ckp, gdata_t *gdata, const int id)
@@ -3219,6 +3747,7 @@ static proxy_instance_t *__add_proxy(ckpool_t *ckp, gdata_t *gdata, const int id
 		}
 	}
 	proxy->ckp = proxy->cs.ckp = ckp;
+	proxy->epfd = gdata->epfd;
 	HASH_ADD_INT(gdata->proxies, id, proxy);
 	proxy->global = true;
 	cksem_init(&proxy->cs.sem);
@@ -3235,23 +3764,33 @@ static void proxy_mode(ckpool_t *ckp, proc_instance_t *pi)
 	mutex_init(&gdata->lock);
 	mutex_init(&gdata->notify_lock);
 	mutex_init(&gdata->share_lock);
+	gdata->share_slab = create_slab("shares", sizeof(share_msg_t));
+	mutex_init(&gdata->psend_lock);
 
 	if (ckp->node)
 		setup_servers(ckp);
 
 	/* Create all our proxy structures and pointers */
+	if (!ckp->passthrough) {
+		gdata->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (gdata->epfd < 0)
+			quit(1, "FATAL: Failed to create epoll in proxy_mode");
+		gdata->pth_upstream = ckalloc(sizeof(pthread_t) * ckp->proxyreceivers);
+		for (i = 0; i < ckp->proxyreceivers; i++)
+			create_pthread(&gdata->pth_upstream[i], upstream_recv, ckp);
+		create_pthread(&gdata->pth_pwatch, proxy_watchdog, ckp);
+		gdata->psend_epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (gdata->psend_epfd < 0)
+			quit(1, "FATAL: Failed to create psend epoll in proxy_mode");
+		create_pthread(&gdata->pth_psend, proxy_send, ckp);
+	}
 	for (i = 0; i < ckp->proxies; i++) {
 		proxy = __add_proxy(ckp, gdata, i);
 		if (ckp->passthrough) {
 			create_pthread(&proxy->pth_precv, passthrough_recv, proxy);
 			proxy->passsends = create_ckmsgq(ckp, "passsend", &passthrough_send);
-		} else {
+		} else
 			prepare_proxy(proxy);
-			create_pthread(&gdata->pth_uprecv, userproxy_recv, ckp);
-			mutex_init(&gdata->psend_lock);
-			cond_init(&gdata->psend_cond);
-			create_pthread(&gdata->pth_psend, proxy_send, ckp);
-		}
 	}
 
 	proxy_loop(pi);
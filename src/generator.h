@@ -18,12 +18,17 @@
 
 void generator_add_send(ckpool_t *ckp, json_t *val);
 struct genwork *generator_getbase(ckpool_t *ckp);
-int generator_getbest(ckpool_t *ckp, char *hash);
+int generator_getbest(ckpool_t *ckp, const int server, char *hash);
+int generator_longpoll(ckpool_t *ckp, const int server, char *longpollid, char *hash,
+		       struct genwork **base);
+bool generator_blockrace(ckpool_t *ckp, const int server, const char *hash);
 bool generator_checkaddr(ckpool_t *ckp, const char *addr);
 char *generator_get_txn(ckpool_t *ckp, const char *hash);
 bool generator_submitblock(ckpool_t *ckp, const char *buf);
 void generator_preciousblock(ckpool_t *ckp, const char *hash);
 bool generator_get_blockhash(ckpool_t *ckp, int height, char *hash);
+int generator_blockheight(ckpool_t *ckp, char *hash);
+char *generator_stats(ckpool_t *ckp, void *data);
 void *generator(void *arg);
 
 #endif /* GENERATOR_H */
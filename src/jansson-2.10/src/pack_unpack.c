@@ -198,9 +198,12 @@ static char *read_string(scanner_t *s, va_list *ap,
         return NULL;
     }
 
+    /* Copy out of the strbuffer as values must be allocated by jsonp_malloc */
     *out_len = strbuff.length;
     *ours = 1;
-    return strbuffer_steal_value(&strbuff);
+    str = jsonp_strndup(strbuff.value, strbuff.length);
+    strbuffer_close(&strbuff);
+    return (char *)str;
 }
 
 static json_t *pack_object(scanner_t *s, va_list *ap)
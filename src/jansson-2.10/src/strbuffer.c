@@ -20,12 +20,14 @@
 #define STRBUFFER_FACTOR    2
 #define STRBUFFER_SIZE_MAX  ((size_t)-1)
 
+/* String buffers use plain malloc as json_dumps hands them to callers to
+ * free, and they are grown with realloc */
 int strbuffer_init(strbuffer_t *strbuff)
 {
     strbuff->size = STRBUFFER_MIN_SIZE;
     strbuff->length = 0;
 
-    strbuff->value = jsonp_malloc(strbuff->size);
+    strbuff->value = malloc(strbuff->size);
     if(!strbuff->value)
         return -1;
 
@@ -37,7 +39,7 @@ int strbuffer_init(strbuffer_t *strbuff)
 void strbuffer_close(strbuffer_t *strbuff)
 {
     if(strbuff->value)
-        jsonp_free(strbuff->value);
+        free(strbuff->value);
 
     strbuff->size = 0;
     strbuff->length = 0;
@@ -675,7 +675,28 @@ void _close(int *fd, const char *file, const char *func, const int line)
 	}
 }
 
-int bind_socket(char *url, char *port)
+/* Check nothing else is listening on addr before we bind to it with
+ * SO_REUSEPORT, which would otherwise silently share the port with another
+ * instance instead of failing with EADDRINUSE. */
+bool addr_in_use(const struct sockaddr *addr, const socklen_t addrlen)
+{
+	bool ret = false;
+	const int on = 1;
+	int sockd;
+
+	sockd = socket(addr->sa_family, SOCK_STREAM, 0);
+	if (sockd < 0)
+		return ret;
+	setsockopt(sockd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(sockd, addr, addrlen) < 0 && errno == EADDRINUSE)
+		ret = true;
+	Close(sockd);
+	return ret;
+}
+
+/* Set reuseport to allow other sockets to be bound to the same address for
+ * the kernel to load balance incoming connections between them. */
+int bind_socket(char *url, char *port, const bool reuseport)
 {
 	struct addrinfo servinfobase, *servinfo, hints, *p;
 	int ret, sockd = -1;
@@ -700,6 +721,16 @@ int bind_socket(char *url, char *port)
 		goto out;
 	}
 	setsockopt(sockd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+	if (reuseport) {
+		if (addr_in_use(p->ai_addr, p->ai_addrlen)) {
+			LOGWARNING("Address %s:%s already in use", url, port);
+			Close(sockd);
+			goto out;
+		}
+		setsockopt(sockd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	}
+#endif
 	ret = bind(sockd, p->ai_addr, p->ai_addrlen);
 	if (ret < 0) {
 		LOGWARNING("Failed to bind socket for %s:%s", url, port);
@@ -1037,8 +1068,9 @@ int read_length(int sockd, void *buf, int len)
 
 /* Use a standard message across the unix sockets:
  * 4 byte length of message as little endian encoded uint32_t followed by the
- * string. Return NULL in case of failure. */
-char *_recv_unix_msg(int sockd, int timeout1, int timeout2, const char *file, const char *func, const int line)
+ * string. Return NULL in case of failure. Frames are messages on a persistent
+ * connection that is left open for further frames. */
+char *_recv_unix_frame(int sockd, int timeout1, int timeout2, const char *file, const char *func, const int line)
 {
 	char *buf = NULL;
 	uint32_t msglen;
@@ -1076,12 +1108,19 @@ char *_recv_unix_msg(int sockd, int timeout1, int timeout2, const char *file, co
 		dealloc(buf);
 	}
 out:
-	shutdown(sockd, SHUT_RD);
 	if (unlikely(!buf))
 		LOGERR("Failure in recv_unix_msg from %s %s:%d", file, func, line);
 	return buf;
 }
 
+char *_recv_unix_msg(int sockd, int timeout1, int timeout2, const char *file, const char *func, const int line)
+{
+	char *buf = _recv_unix_frame(sockd, timeout1, timeout2, file, func, line);
+
+	shutdown(sockd, SHUT_RD);
+	return buf;
+}
+
 /* Emulate a select write wait for high fds that select doesn't support */
 int wait_write_select(int sockd, float timeout)
 {
@@ -1126,7 +1165,7 @@ int _write_length(int sockd, const void *buf, int len, const char *file, const c
 	return ofs;
 }
 
-bool _send_unix_msg(int sockd, const char *buf, int timeout, const char *file, const char *func, const int line)
+bool _send_unix_frame(int sockd, const char *buf, int timeout, const char *file, const char *func, const int line)
 {
 	uint32_t msglen, len;
 	bool retval = false;
@@ -1170,12 +1209,19 @@ bool _send_unix_msg(int sockd, const char *buf, int timeout, const char *file, c
 	}
 	retval = true;
 out:
-	shutdown(sockd, SHUT_WR);
 	if (unlikely(!retval))
 		LOGERR("Failure in send_unix_msg from %s %s:%d", file, func, line);
 	return retval;
 }
 
+bool _send_unix_msg(int sockd, const char *buf, int timeout, const char *file, const char *func, const int line)
+{
+	bool retval = _send_unix_frame(sockd, buf, timeout, file, func, line);
+
+	shutdown(sockd, SHUT_WR);
+	return retval;
+}
+
 bool _send_unix_data(int sockd, const struct msghdr *msg, const char *file, const char *func, const int line)
 {
 	bool retval = false;
@@ -1384,6 +1430,102 @@ stageleft:
 	return ok;
 }
 
+/* Flush a rotating_file's buffer once it reaches this size */
+#define ROTATING_BUFSIZE 262144
+
+rotating_file_t *create_rotating_file(const char *path, const bool locked)
+{
+	rotating_file_t *rf = ckzalloc(sizeof(rotating_file_t));
+
+	rf->path = strdup(path);
+	rf->fd = -1;
+	rf->locked = locked;
+	rf->bufsize = ROTATING_BUFSIZE;
+	rf->buf = ckalloc(rf->bufsize);
+	return rf;
+}
+
+/* Write out all buffered lines at once, holding an exclusive flock if the
+ * file may be shared with other processes so lines never interleave */
+bool rotating_file_flush(rotating_file_t *rf)
+{
+	int ofs = 0;
+	bool ok = false;
+
+	if (!rf->buflen)
+		return true;
+	if (unlikely(rf->fd == -1))
+		goto out;
+	if (rf->locked && unlikely(flock(rf->fd, LOCK_EX))) {
+		LOGERR("Failed to flock %s in rotating_file_flush!", rf->filename);
+		goto out;
+	}
+	while (ofs < rf->buflen) {
+		int ret = write(rf->fd, rf->buf + ofs, rf->buflen - ofs);
+
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGERR("Failed to write to %s in rotating_file_flush!", rf->filename);
+			break;
+		}
+		ofs += ret;
+	}
+	if (rf->locked)
+		flock(rf->fd, LOCK_UN);
+	ok = ofs == rf->buflen;
+out:
+	rf->buflen = 0;
+	return ok;
+}
+
+/* Buffer a line for the hourly file of when, switching files and flushing
+ * whatever was buffered for the previous one when the hour changes */
+bool rotating_file_add(rotating_file_t *rf, const char *msg, const time_t when)
+{
+	mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+	time_t hour = when / 3600;
+	int len = strlen(msg);
+	bool ok = true;
+
+	if (unlikely(rf->fd == -1 || hour != rf->hour)) {
+		ok = rotating_file_flush(rf);
+		Close(rf->fd);
+		free(rf->filename);
+		rf->filename = rotating_filename(rf->path, when);
+		rf->hour = hour;
+		rf->fd = open(rf->filename, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, mode);
+		if (unlikely(rf->fd == -1)) {
+			LOGERR("Failed to open %s in rotating_file_add!", rf->filename);
+			return false;
+		}
+	}
+	if (rf->buflen + len + 1 > rf->bufsize) {
+		ok &= rotating_file_flush(rf);
+		/* Grow the buffer to fit lines bigger than it */
+		if (len + 1 > rf->bufsize) {
+			rf->bufsize = round_up_page(len + 1);
+			rf->buf = realloc(rf->buf, rf->bufsize);
+			if (unlikely(!rf->buf))
+				quit(1, "Failed to realloc rotating_file buf of size %d", rf->bufsize);
+		}
+	}
+	memcpy(rf->buf + rf->buflen, msg, len);
+	rf->buflen += len;
+	rf->buf[rf->buflen++] = '\n';
+	return ok;
+}
+
+void close_rotating_file(rotating_file_t *rf)
+{
+	rotating_file_flush(rf);
+	Close(rf->fd);
+	free(rf->filename);
+	free(rf->path);
+	free(rf->buf);
+	free(rf);
+}
+
 /* Align a size_t to 4 byte boundaries for fussy arches */
 void align_len(size_t *len)
 {
@@ -1458,9 +1600,89 @@ void *_ckalloc(size_t len, const char *file, const char *func, const int line)
 	return ptr;
 }
 
+#define JSON_ARENA_SIZE 4096 /* Region size, also the slab object size */
+#define JSON_ARENA_MAX 512 /* Bigger allocations always come from malloc */
+
+/* A bump allocated region for the jansson values of consecutive stratum
+ * messages handled by one thread. Each value has a header pointing to its
+ * region, or NULL when it came from malloc. The region goes back to the slab
+ * in one operation once its thread has moved on to another region and every
+ * value allocated from it has been freed, by whichever thread frees it. */
+struct json_arena {
+	int refs; /* Negative count of frees until the region is retired */
+	int allocs; /* Only touched by the owning thread */
+	int used;
+	char buf[] __attribute__((aligned(8)));
+};
+
+typedef struct json_arena json_arena_t;
+
+static slab_t *json_arena_slab;
+static __thread json_arena_t *json_arena; /* Region this thread is filling */
+static __thread int json_arena_depth;
+
+void json_arena_init(void)
+{
+	json_arena_slab = create_slab("jsonarena", JSON_ARENA_SIZE);
+}
+
+/* Have jansson allocate from this thread's arena regions until the matching
+ * json_arena_end. Values may outlive the bracket and be freed by any thread,
+ * but anything kept long term will keep its whole region allocated. */
+void json_arena_begin(void)
+{
+	json_arena_depth++;
+}
+
+void json_arena_end(void)
+{
+	json_arena_depth--;
+}
+
+static void retire_json_arena(json_arena_t *arena)
+{
+	if (!__sync_add_and_fetch(&arena->refs, arena->allocs))
+		slab_free(json_arena_slab, arena);
+}
+
 void *json_ckalloc(size_t size)
 {
-	return _ckalloc(size, __FILE__, __func__, __LINE__);
+	json_arena_t *arena = json_arena;
+	void **ptr;
+
+	size = ((size + 7) & ~(size_t)7) + sizeof(void *);
+	if (json_arena_depth && size <= JSON_ARENA_MAX) {
+		if (!arena || arena->used + size > JSON_ARENA_SIZE - sizeof(json_arena_t)) {
+			if (arena)
+				retire_json_arena(arena);
+			arena = json_arena = slab_alloc(json_arena_slab);
+			arena->refs = arena->allocs = arena->used = 0;
+		}
+		ptr = (void **)(arena->buf + arena->used);
+		arena->used += size;
+		arena->allocs++;
+		*ptr = arena;
+		return ptr + 1;
+	}
+	ptr = _ckalloc(size, __FILE__, __func__, __LINE__);
+	*ptr = NULL;
+	return ptr + 1;
+}
+
+void json_ckfree(void *ptr)
+{
+	void **hdr = (void **)ptr - 1;
+	json_arena_t *arena = *hdr;
+
+	if (!arena)
+		free(hdr);
+	else if (!__sync_sub_and_fetch(&arena->refs, 1))
+		slab_free(json_arena_slab, arena);
+}
+
+json_t *json_arena_stats(void)
+{
+	return slab_stats(json_arena_slab);
 }
 
 void *_ckzalloc(size_t len, const char *file, const char *func, const int line)
@@ -1493,6 +1715,231 @@ size_t round_up_page(size_t len)
 	return len;
 }
 
+struct magazine {
+	magazine_t *next;
+	int rounds;
+	void *objs[SLAB_MAGAZINE];
+};
+
+#define SLABS 16
+
+typedef struct slab_cache {
+	magazine_t *loaded;
+	magazine_t *prev;
+	int64_t allocs;
+	int64_t frees;
+} slab_cache_t;
+
+static slab_t *slabs[SLABS];
+static int slab_count;
+static pthread_key_t slab_key;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static __thread slab_cache_t slab_caches[SLABS];
+static __thread bool slab_thread;
+
+/* Fold a thread's counters into the slab stats. Depot lock held. */
+static void __fold_slab_stats(slab_t *slab, slab_cache_t *cache)
+{
+	int64_t inuse;
+
+	slab->allocs += cache->allocs;
+	slab->frees += cache->frees;
+	cache->allocs = cache->frees = 0;
+	inuse = slab->allocs - slab->frees;
+	if (inuse > slab->hwm)
+		slab->hwm = inuse;
+	slab->exchanges++;
+}
+
+static magazine_t *__empty_magazine(slab_t *slab)
+{
+	magazine_t *mag = slab->empty;
+
+	if (mag)
+		slab->empty = mag->next;
+	else
+		mag = ckalloc(sizeof(magazine_t));
+	mag->rounds = 0;
+	return mag;
+}
+
+static void __return_magazine(slab_t *slab, magazine_t *mag)
+{
+	if (mag->rounds) {
+		mag->next = slab->full;
+		slab->full = mag;
+		slab->depot++;
+	} else {
+		mag->next = slab->empty;
+		slab->empty = mag;
+	}
+}
+
+/* Hand the magazines of a thread that is exiting back to the depots */
+static void return_slab_caches(void *arg)
+{
+	slab_cache_t *caches = arg;
+	int i;
+
+	for (i = 0; i < __atomic_load_n(&slab_count, __ATOMIC_ACQUIRE); i++) {
+		slab_cache_t *cache = &caches[i];
+		slab_t *slab = slabs[i];
+
+		if (!cache->loaded)
+			continue;
+		mutex_lock(&slab->lock);
+		__fold_slab_stats(slab, cache);
+		__return_magazine(slab, cache->loaded);
+		__return_magazine(slab, cache->prev);
+		mutex_unlock(&slab->lock);
+		cache->loaded = cache->prev = NULL;
+	}
+}
+
+static void init_slab_key(void)
+{
+	if (unlikely(pthread_key_create(&slab_key, return_slab_caches)))
+		quit(1, "Failed to create slab key");
+}
+
+slab_t *create_slab(const char *name, size_t size)
+{
+	slab_t *slab = ckzalloc(sizeof(slab_t));
+
+	pthread_once(&slab_once, init_slab_key);
+	strncpy(slab->name, name, 15);
+	/* Keep every object in a slab pointer aligned */
+	slab->size = (size + 7) & ~(size_t)7;
+	mutex_init(&slab->lock);
+	slab->id = __sync_fetch_and_add(&slab_count, 1);
+	if (unlikely(slab->id >= SLABS))
+		quit(1, "Too many slabs creating %s", name);
+	slabs[slab->id] = slab;
+	return slab;
+}
+
+/* Get this thread's cache for a slab, loading it with empty magazines and
+ * registering the thread for returning them on exit the first time */
+static slab_cache_t *slab_cache(slab_t *slab)
+{
+	slab_cache_t *cache = &slab_caches[slab->id];
+
+	if (unlikely(!cache->loaded)) {
+		if (!slab_thread) {
+			slab_thread = true;
+			pthread_setspecific(slab_key, slab_caches);
+		}
+		mutex_lock(&slab->lock);
+		cache->loaded = __empty_magazine(slab);
+		cache->prev = __empty_magazine(slab);
+		mutex_unlock(&slab->lock);
+	}
+	return cache;
+}
+
+void *slab_alloc(slab_t *slab)
+{
+	slab_cache_t *cache = slab_cache(slab);
+	magazine_t *mag = cache->loaded;
+	char *chunk;
+	int i;
+
+	cache->allocs++;
+	if (likely(mag->rounds))
+		return mag->objs[--mag->rounds];
+	if (cache->prev->rounds) {
+		cache->loaded = cache->prev;
+		cache->prev = mag;
+		mag = cache->loaded;
+		return mag->objs[--mag->rounds];
+	}
+
+	/* Both magazines are empty so swap one for a full one in the depot */
+	mutex_lock(&slab->lock);
+	__fold_slab_stats(slab, cache);
+	mag = slab->full;
+	if (mag) {
+		slab->full = mag->next;
+		slab->depot--;
+		cache->prev->next = slab->empty;
+		slab->empty = cache->prev;
+		cache->prev = cache->loaded;
+		cache->loaded = mag;
+	}
+	mutex_unlock(&slab->lock);
+
+	if (!mag) {
+		/* Depot is empty too so carve a new slab into our magazine */
+		mag = cache->loaded;
+		chunk = ckalloc(slab->size * SLAB_MAGAZINE);
+		for (i = 0; i < SLAB_MAGAZINE; i++)
+			mag->objs[i] = chunk + slab->size * i;
+		mag->rounds = SLAB_MAGAZINE;
+		__sync_add_and_fetch(&slab->objects, SLAB_MAGAZINE);
+	}
+	return mag->objs[--mag->rounds];
+}
+
+void *slab_zalloc(slab_t *slab)
+{
+	void *ptr = slab_alloc(slab);
+
+	memset(ptr, 0, slab->size);
+	return ptr;
+}
+
+void slab_free(slab_t *slab, void *ptr)
+{
+	slab_cache_t *cache;
+	magazine_t *mag;
+
+	if (unlikely(!ptr))
+		return;
+	cache = slab_cache(slab);
+	mag = cache->loaded;
+	cache->frees++;
+	if (likely(mag->rounds < SLAB_MAGAZINE)) {
+		mag->objs[mag->rounds++] = ptr;
+		return;
+	}
+	if (cache->prev->rounds < SLAB_MAGAZINE) {
+		cache->loaded = cache->prev;
+		cache->prev = mag;
+		mag = cache->loaded;
+		mag->objs[mag->rounds++] = ptr;
+		return;
+	}
+
+	/* Both magazines are full so swap one for an empty one in the depot */
+	mutex_lock(&slab->lock);
+	__fold_slab_stats(slab, cache);
+	__return_magazine(slab, cache->prev);
+	cache->prev = cache->loaded;
+	cache->loaded = __empty_magazine(slab);
+	mutex_unlock(&slab->lock);
+
+	mag = cache->loaded;
+	mag->objs[mag->rounds++] = ptr;
+}
+
+json_t *slab_stats(slab_t *slab)
+{
+	int64_t inuse;
+	json_t *val;
+
+	mutex_lock(&slab->lock);
+	/* Frees can be folded in before the allocs they match */
+	inuse = slab->allocs - slab->frees;
+	if (inuse < 0)
+		inuse = 0;
+	JSON_CPACK(val, "{sI,sI,sI,sI,sI,sI,si}", "count", inuse,
+		   "memory", slab->objects * (int64_t)slab->size, "generated", slab->allocs,
+		   "objects", slab->objects, "hwm", slab->hwm, "exchanges", slab->exchanges,
+		   "depot", slab->depot);
+	mutex_unlock(&slab->lock);
+	return val;
+}
+
 
 
 /* Adequate size s==len*2 + 1 must be alloced to use this variant */
@@ -2147,3 +2594,107 @@ void gen_hash(uchar *data, uchar *hash, int len)
 	sha256(data, len, hash1);
 	sha256(hash1, 32, hash);
 }
+
+/* As gen_hash for count buffers of the same length hashed together */
+void gen_hash_multi(uchar **data, uchar **hash, int len, int count)
+{
+	uchar hash1[count][32], *hash1p[count];
+	int i;
+
+	for (i = 0; i < count; i++)
+		hash1p[i] = hash1[i];
+	sha256_multi((const uchar **)data, len, hash1p, count);
+	sha256_multi((const uchar **)hash1p, 32, hash, count);
+}
+
+/* Make room in level lvl of tree for len entries and the odd duplicate */
+static void merkle_level_size(merkletree_t *tree, const int lvl, const int len)
+{
+	if (len < tree->size[lvl])
+		return;
+	tree->size[lvl] = len + 1 + len / 4;
+	tree->level[lvl] = realloc(tree->level[lvl], tree->size[lvl] * 32);
+	if (unlikely(!tree->level[lvl]))
+		quit(1, "Failed to realloc merkle tree level of %d entries", tree->size[lvl]);
+}
+
+/* Update tree to the count byte swapped hashes following the coinbase slot.
+ * A node is rehashed only if it is new, either child changed, or its right
+ * child moved from or to being the duplicate of an odd last entry, so
+ * templates that gain transactions at the tail or change only a few of them
+ * cost a fraction of a full rebuild. Returns the number of nodes rehashed. */
+int merkle_update(merkletree_t *tree, const uchar *hashes, const int count)
+{
+	uchar *data[MERKLE_BATCH], *hash[MERKLE_BATCH], *below, *above, *dirty;
+	int lvl, i, j, len = count + 1, oldlen, newlen, oldnext, batch = 0, rehashed = 0;
+
+	if (unlikely(tree->dirtysize < len)) {
+		free(tree->dirty);
+		tree->dirtysize = len + len / 4;
+		tree->dirty = ckalloc(tree->dirtysize);
+	}
+	dirty = tree->dirty;
+	oldlen = tree->levels ? tree->len[0] : 0;
+	merkle_level_size(tree, 0, len);
+	below = tree->level[0];
+	memset(below, 0, 32);
+	dirty[0] = !oldlen;
+	for (i = 1; i < len; i++) {
+		uchar *leaf = below + i * 32;
+		const uchar *txid = hashes + (i - 1) * 32;
+
+		dirty[i] = i >= oldlen || memcmp(leaf, txid, 32);
+		if (dirty[i])
+			memcpy(leaf, txid, 32);
+	}
+
+	for (lvl = 0; len > 1; lvl++) {
+		tree->len[lvl] = len;
+		newlen = (len + 1) / 2;
+		oldnext = lvl + 1 < tree->levels ? tree->len[lvl + 1] : 0;
+		merkle_level_size(tree, lvl + 1, newlen);
+		above = tree->level[lvl + 1];
+		if (len % 2)
+			memcpy(below + len * 32, below + (len - 1) * 32, 32);
+		/* Flags for this level are only read before being overwritten
+		 * with those of the level above */
+		for (j = 0; j < newlen; j++) {
+			const int right = 2 * j + 1;
+
+			dirty[j] = j >= oldnext || dirty[2 * j] ||
+				   (right < len ? dirty[right] || right >= oldlen : right < oldlen);
+			if (!dirty[j])
+				continue;
+			data[batch] = below + j * 64;
+			hash[batch++] = above + j * 32;
+			if (batch == MERKLE_BATCH) {
+				gen_hash_multi(data, hash, 64, batch);
+				rehashed += batch;
+				batch = 0;
+			}
+		}
+		if (batch) {
+			gen_hash_multi(data, hash, 64, batch);
+			rehashed += batch;
+			batch = 0;
+		}
+		tree->nodes += newlen;
+		oldlen = oldnext;
+		len = newlen;
+		below = above;
+	}
+	tree->len[lvl] = len;
+	tree->levels = lvl + 1;
+	tree->rehashed += rehashed;
+	return rehashed;
+}
+
+void clear_merkletree(merkletree_t *tree)
+{
+	int i;
+
+	for (i = 0; i < MERKLE_LEVELS; i++)
+		free(tree->level[i]);
+	free(tree->dirty);
+	memset(tree, 0, sizeof(merkletree_t));
+}
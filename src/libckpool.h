@@ -242,6 +242,11 @@ void logmsg(int loglevel, const char *fmt, ...);
 #define UNIX_READ_TIMEOUT 5
 #define UNIX_WRITE_TIMEOUT 10
 
+/* Frames of newline separated ckdb messages sent over a persistent connection
+ * start with this followed by the frame's sequence number and a newline, and
+ * ckdb replies with a frame of the same header and one reply per message */
+#define CKDB_BATCH "batch."
+
 #define MIN1	60
 #define MIN5	300
 #define MIN15	900
@@ -326,6 +331,71 @@ struct unixsock {
 
 typedef struct unixsock unixsock_t;
 
+/* An hourly rotating log kept open between writes, with lines buffered until
+ * flushed or the hour changes */
+struct rotating_file {
+	char *path; /* Prefix of the hourly filenames */
+	char *filename;
+	int fd;
+	time_t hour; /* Hours since the epoch of the open file */
+	bool locked; /* flock each flush for exclusive access across processes */
+
+	char *buf;
+	int buflen;
+	int bufsize;
+};
+
+typedef struct rotating_file rotating_file_t;
+
+#define SLAB_MAGAZINE 64 /* Objects per magazine, and per slab carved out */
+
+typedef struct magazine magazine_t;
+
+/* A cache of fixed size objects for structs allocated and freed once per
+ * message. Each thread allocates and frees to its own magazines, only taking
+ * the depot lock to swap full and empty magazines once every SLAB_MAGAZINE
+ * objects, and malloc is only called to carve out a new slab of objects.
+ * Memory is never returned to malloc. */
+struct slab {
+	char name[16];
+	int id;
+	size_t size;
+
+	mutex_t lock; /* Protects the depot */
+	magazine_t *full; /* Magazines with objects */
+	magazine_t *empty;
+	int depot; /* Count of full magazines */
+
+	/* Stats, folded in from each thread whenever it visits the depot so
+	 * they lag by up to a magazine per thread */
+	int64_t allocs;
+	int64_t frees;
+	int64_t objects; /* Carved from slabs */
+	int64_t hwm; /* High water mark of objects in use */
+	int64_t exchanges; /* Magazines swapped with the depot */
+};
+
+typedef struct slab slab_t;
+
+#define MERKLE_LEVELS 32
+#define MERKLE_BATCH 64
+
+/* A merkle tree kept between template updates so that only nodes above
+ * changed, moved or added transactions are rehashed. Level 0 is the coinbase
+ * slot followed by the transaction hashes, and each level above holds the
+ * hashes of pairs from the one below. Every level has room after its last
+ * entry for the duplicate hashed with an odd last entry. */
+typedef struct merkletree {
+	uchar *level[MERKLE_LEVELS];
+	int len[MERKLE_LEVELS];
+	int size[MERKLE_LEVELS]; // Entries allocated
+	int levels;
+	uchar *dirty; // Scratch flags of nodes to rehash
+	int dirtysize;
+	int64_t nodes; // Nodes a full rebuild of every update would hash
+	int64_t rehashed; // Nodes actually rehashed
+} merkletree_t;
+
 void _json_check(json_t *val, json_error_t *err, const char *file, const char *func, const int line);
 #define json_check(VAL, ERR) _json_check(VAL, ERR,  __FILE__, __func__, __LINE__)
 
@@ -500,7 +570,8 @@ void block_socket(int fd);
 void _close(int *fd, const char *file, const char *func, const int line);
 #define _Close(FD) _close(FD, __FILE__, __func__, __LINE__)
 #define Close(FD) _close(&FD, __FILE__, __func__, __LINE__)
-int bind_socket(char *url, char *port);
+bool addr_in_use(const struct sockaddr *addr, const socklen_t addrlen);
+int bind_socket(char *url, char *port, const bool reuseport);
 int connect_socket(char *url, char *port);
 int round_trip(char *url);
 int write_socket(int fd, const void *buf, size_t nbyte);
@@ -514,6 +585,9 @@ int _open_unix_client(const char *server_path, const char *file, const char *fun
 int wait_close(int sockd, int timeout);
 int wait_read_select(int sockd, float timeout);
 int read_length(int sockd, void *buf, int len);
+char *_recv_unix_frame(int sockd, int timeout1, int timeout2, const char *file, const char *func, const int line);
+#define recv_unix_frame(sockd) _recv_unix_frame(sockd, UNIX_READ_TIMEOUT, UNIX_READ_TIMEOUT, __FILE__, __func__, __LINE__)
+#define recv_unix_frame_tmo2(sockd, tmo1, tmo2) _recv_unix_frame(sockd, tmo1, tmo2, __FILE__, __func__, __LINE__)
 char *_recv_unix_msg(int sockd, int timeout1, int timeout2, const char *file, const char *func, const int line);
 #define RECV_UNIX_TIMEOUT1 30
 #define RECV_UNIX_TIMEOUT2 5
@@ -523,6 +597,8 @@ char *_recv_unix_msg(int sockd, int timeout1, int timeout2, const char *file, co
 int wait_write_select(int sockd, float timeout);
 #define write_length(sockd, buf, len) _write_length(sockd, buf, len, __FILE__, __func__, __LINE__)
 int _write_length(int sockd, const void *buf, int len, const char *file, const char *func, const int line);
+bool _send_unix_frame(int sockd, const char *buf, int timeout, const char *file, const char *func, const int line);
+#define send_unix_frame(sockd, buf) _send_unix_frame(sockd, buf, UNIX_WRITE_TIMEOUT, __FILE__, __func__, __LINE__)
 bool _send_unix_msg(int sockd, const char *buf, int timeout, const char *file, const char *func, const int line);
 #define send_unix_msg(sockd, buf) _send_unix_msg(sockd, buf, UNIX_WRITE_TIMEOUT, __FILE__, __func__, __LINE__)
 bool _send_unix_data(int sockd, const struct msghdr *msg, const char *file, const char *func, const int line);
@@ -540,15 +616,30 @@ json_t *json_object_dup(json_t *val, const char *entry);
 
 char *rotating_filename(const char *path, time_t when);
 bool rotating_log(const char *path, const char *msg);
+rotating_file_t *create_rotating_file(const char *path, const bool locked);
+bool rotating_file_flush(rotating_file_t *rf);
+bool rotating_file_add(rotating_file_t *rf, const char *msg, const time_t when);
+void close_rotating_file(rotating_file_t *rf);
 
 void align_len(size_t *len);
 void realloc_strcat(char **ptr, const char *s);
 void trail_slash(char **buf);
 void *_ckalloc(size_t len, const char *file, const char *func, const int line);
 void *json_ckalloc(size_t size);
+void json_ckfree(void *ptr);
+void json_arena_init(void);
+void json_arena_begin(void);
+void json_arena_end(void);
+json_t *json_arena_stats(void);
 void *_ckzalloc(size_t len, const char *file, const char *func, const int line);
 size_t round_up_page(size_t len);
 
+slab_t *create_slab(const char *name, size_t size);
+void *slab_alloc(slab_t *slab);
+void *slab_zalloc(slab_t *slab);
+void slab_free(slab_t *slab, void *ptr);
+json_t *slab_stats(slab_t *slab);
+
 extern const int hex2bin_tbl[];
 void __bin2hex(void *vs, const void *vp, size_t len);
 void *bin2hex(const void *vp, size_t len);
@@ -599,5 +690,8 @@ double diff_from_nbits(char *nbits);
 void target_from_diff(uchar *target, double diff);
 
 void gen_hash(uchar *data, uchar *hash, int len);
+void gen_hash_multi(uchar **data, uchar **hash, int len, int count);
+int merkle_update(merkletree_t *tree, const uchar *hashes, const int count);
+void clear_merkletree(merkletree_t *tree);
 
 #endif /* LIBCKPOOL_H */
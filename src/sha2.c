@@ -156,6 +156,152 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
     }
 }
 #endif
+/* Multi-buffer SHA-256: hash SHA256_LANES independent messages of the same
+ * length at once with each lane of a vector register holding one message's
+ * state. Written with generic vector extensions so the compiler emits
+ * AVX-512, AVX2 or SSE2 code depending on the target. */
+
+#define VROTR(x, n)   ((x >> n) | (x << (32 - n)))
+#define VSHFR(x, n)   (x >> n)
+
+#define VSHA256_F1(x) (VROTR(x,  2) ^ VROTR(x, 13) ^ VROTR(x, 22))
+#define VSHA256_F2(x) (VROTR(x,  6) ^ VROTR(x, 11) ^ VROTR(x, 25))
+#define VSHA256_F3(x) (VROTR(x,  7) ^ VROTR(x, 18) ^ VSHFR(x,  3))
+#define VSHA256_F4(x) (VROTR(x, 17) ^ VROTR(x, 19) ^ VSHFR(x, 10))
+
+typedef uint32_t sha256_vec __attribute__ ((vector_size (SHA256_LANES * 4)));
+
+#if defined(USE_MB_AVX512)
+#define SHA256_MB_TARGET __attribute__ ((target ("avx512f")))
+#elif defined(USE_MB_AVX2)
+#define SHA256_MB_TARGET __attribute__ ((target ("avx2")))
+#else
+#define SHA256_MB_TARGET
+#endif
+
+static SHA256_MB_TARGET
+void sha256_lanes(const sha256_ctx **midstate, const unsigned char **message,
+                  unsigned int len, unsigned char **digest, int lanes)
+{
+    unsigned char pad[SHA256_LANES][2 * SHA256_BLOCK_SIZE];
+    unsigned int block_nb, full_nb, pad_ofs, i;
+    sha256_vec w[64], wv[8], h[8], t1, t2;
+    const unsigned char *sub_block;
+    uint64_t len_b = len;
+    int j, l;
+
+    if (midstate)
+        len_b += midstate[0]->tot_len;
+    len_b <<= 3;
+
+    /* Every lane has the same length so the same number of blocks, the
+     * last one or two of which are built with the padding in pad */
+    full_nb = len / SHA256_BLOCK_SIZE;
+    block_nb = (len + 9 + SHA256_BLOCK_SIZE - 1) / SHA256_BLOCK_SIZE;
+    pad_ofs = full_nb << 6;
+    for (l = 0; l < lanes; l++) {
+        memset(pad[l], 0, sizeof(pad[l]));
+        memcpy(pad[l], message[l] + pad_ofs, len - pad_ofs);
+        pad[l][len - pad_ofs] = 0x80;
+        for (j = 0; j < 8; j++)
+            pad[l][((block_nb - full_nb) << 6) - 1 - j] = len_b >> (j << 3);
+    }
+
+    for (j = 0; j < 8; j++) {
+        for (l = 0; l < SHA256_LANES; l++) {
+            int lane = l < lanes ? l : 0;
+
+            h[j][l] = midstate ? midstate[lane]->h[j] : sha256_h0[j];
+        }
+    }
+
+    for (i = 0; i < block_nb; i++) {
+        for (l = 0; l < SHA256_LANES; l++) {
+            /* Unused lanes just repeat the first message */
+            int lane = l < lanes ? l : 0;
+
+            if (i < full_nb)
+                sub_block = message[lane] + (i << 6);
+            else
+                sub_block = pad[lane] + ((i - full_nb) << 6);
+            for (j = 0; j < 16; j++) {
+                uint32_t word;
+
+                PACK32(&sub_block[j << 2], &word);
+                w[j][l] = word;
+            }
+        }
+
+        for (j = 16; j < 64; j++) {
+            w[j] =  VSHA256_F4(w[j -  2]) + w[j -  7]
+                  + VSHA256_F3(w[j - 15]) + w[j - 16];
+        }
+
+        for (j = 0; j < 8; j++) {
+            wv[j] = h[j];
+        }
+
+        for (j = 0; j < 64; j++) {
+            t1 = wv[7] + VSHA256_F2(wv[4]) + CH(wv[4], wv[5], wv[6])
+                + sha256_k[j] + w[j];
+            t2 = VSHA256_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);
+            wv[7] = wv[6];
+            wv[6] = wv[5];
+            wv[5] = wv[4];
+            wv[4] = wv[3] + t1;
+            wv[3] = wv[2];
+            wv[2] = wv[1];
+            wv[1] = wv[0];
+            wv[0] = t1 + t2;
+        }
+
+        for (j = 0; j < 8; j++) {
+            h[j] += wv[j];
+        }
+    }
+
+    for (l = 0; l < lanes; l++) {
+        for (j = 0; j < 8; j++) {
+            UNPACK32(h[j][l], &digest[l][j << 2]);
+        }
+    }
+}
+
+/* Hash count messages all of length len, falling back to the single buffer
+ * code for a lone message. */
+void sha256_multi(const unsigned char **message, unsigned int len,
+                  unsigned char **digest, int count)
+{
+    while (count > 1) {
+        int lanes = count < SHA256_LANES ? count : SHA256_LANES;
+
+        sha256_lanes(NULL, message, len, digest, lanes);
+        message += lanes;
+        digest += lanes;
+        count -= lanes;
+    }
+    if (count)
+        sha256(*message, len, *digest);
+}
+
+/* As sha256_multi but each message is the remainder of one that was hashed up
+ * to its midstate. All the midstates must cover the same length. */
+void sha256_multi_resume(const sha256_ctx **midstate, const unsigned char **message,
+                         unsigned int len, unsigned char **digest, int count)
+{
+    while (count > 1) {
+        int lanes = count < SHA256_LANES ? count : SHA256_LANES;
+
+        sha256_lanes(midstate, message, len, digest, lanes);
+        midstate += lanes;
+        message += lanes;
+        digest += lanes;
+        count -= lanes;
+    }
+    if (count)
+        sha256_resume(*midstate, *message, len, *digest);
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
@@ -165,6 +311,26 @@ void sha256(const unsigned char *message, unsigned int len, unsigned char *diges
     sha256_final(&ctx, digest);
 }
 
+/* Store the state after hashing all the complete blocks of message in ctx
+ * so that messages sharing that prefix can resume from it. The number of
+ * bytes covered is in ctx->tot_len. */
+void sha256_midstate(sha256_ctx *ctx, const unsigned char *message, unsigned int len)
+{
+    sha256_init(ctx);
+    sha256_update(ctx, message, len & ~(SHA256_BLOCK_SIZE - 1));
+}
+
+/* Finish hashing a message whose first midstate->tot_len bytes are already
+ * in the midstate, given only the remaining len bytes. */
+void sha256_resume(const sha256_ctx *midstate, const unsigned char *message,
+                   unsigned int len, unsigned char *digest)
+{
+    sha256_ctx ctx = *midstate;
+
+    sha256_update(&ctx, message, len);
+    sha256_final(&ctx, digest);
+}
+
 void sha256_init(sha256_ctx *ctx)
 {
     int i;
@@ -50,6 +50,15 @@
 #define SHA256_F3(x) (ROTR(x,  7) ^ ROTR(x, 18) ^ SHFR(x,  3))
 #define SHA256_F4(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ SHFR(x, 10))
 
+/* Number of messages hashed at once by sha256_multi */
+#if defined(USE_MB_AVX512)
+#define SHA256_LANES 16
+#elif defined(USE_MB_AVX2)
+#define SHA256_LANES 8
+#else
+#define SHA256_LANES 4
+#endif
+
 typedef struct {
     unsigned int tot_len;
     unsigned int len;
@@ -65,5 +74,13 @@ void sha256_update(sha256_ctx *ctx, const unsigned char *message,
 void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
+void sha256_midstate(sha256_ctx *ctx, const unsigned char *message,
+                     unsigned int len);
+void sha256_resume(const sha256_ctx *midstate, const unsigned char *message,
+                   unsigned int len, unsigned char *digest);
+void sha256_multi(const unsigned char **message, unsigned int len,
+                  unsigned char **digest, int count);
+void sha256_multi_resume(const sha256_ctx **midstate, const unsigned char **message,
+                         unsigned int len, unsigned char **digest, int count);
 
 #endif /* !SHA2_H */
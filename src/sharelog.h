@@ -0,0 +1,80 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef SHARELOG_H
+#define SHARELOG_H
+
+#include <stdint.h>
+
+/* Binary share logs start with a header followed by a stream of records, each
+ * starting with its type byte. All fields are little endian. Strings are
+ * interned into a per file dictionary and share records refer to them by id,
+ * with 0 meaning no string. A string record always precedes the first share
+ * using its id, and a later string record for the same id replaces the
+ * earlier one, as happens when a file is appended to after a restart. */
+
+#define SHARELOG_MAGIC		0x4c53434b /* "CKSL" */
+#define SHARELOG_VERSION	1
+
+enum sharelog_type {
+	SHARELOG_STRING = 1,
+	SHARELOG_SHARE,
+};
+
+struct sharelog_header {
+	uint32_t magic;
+	uint32_t version;
+} __attribute__((packed));
+
+/* Followed by len bytes of the string without a terminating null */
+struct sharelog_string {
+	uint8_t type;
+	uint8_t pad;
+	uint16_t len;
+	uint32_t id;
+} __attribute__((packed));
+
+/* Index of each interned string of a share */
+enum sharelog_strings {
+	SHARELOG_CREATEINET,
+	SHARELOG_WORKERNAME,
+	SHARELOG_USERNAME,
+	SHARELOG_SECONDARYUSERID,
+	SHARELOG_ADDRESS,
+	SHARELOG_AGENT,
+	SHARELOG_STRINGS
+};
+
+/* The fields of a json share log line. Hex strings are stored as binary with
+ * their lengths, and reject-reason is implied by errn. */
+struct sharelog_share {
+	uint8_t type;
+	uint8_t result;
+	int8_t errn;
+	uint8_t enonce1len;
+	uint8_t nonce2len;
+	uint8_t hashlen;
+	uint8_t pad[2];
+	int64_t workinfoid;
+	int64_t clientid;
+	uint8_t enonce1[16];
+	uint8_t nonce2[16];
+	uint8_t nonce[4];
+	uint8_t ntime[4];
+	double diff;
+	double sdiff;
+	uint8_t hash[32];
+	int64_t createdate;
+	int32_t createdate_ns;
+	uint32_t strings[SHARELOG_STRINGS];
+} __attribute__((packed));
+
+typedef struct sharelog_header sharelog_header_t;
+typedef struct sharelog_string sharelog_string_t;
+typedef struct sharelog_share sharelog_share_t;
+
+#endif /* SHARELOG_H */
@@ -14,8 +14,10 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <string.h>
 #include <unistd.h>
@@ -25,6 +27,7 @@
 #include "bitcoin.h"
 #include "sha2.h"
 #include "stratifier.h"
+#include "sharelog.h"
 #include "uthash.h"
 #include "utlist.h"
 #include "connector.h"
@@ -87,14 +90,72 @@ struct json_params {
 	json_t *params;
 	json_t *id_val;
 	int64_t client_id;
+
+	/* Set instead of params for submits scanned by the connector */
+	submit_t *submit;
 };
 
 typedef struct json_params json_params_t;
 
-/* Stratum json messages with their associated client id */
+/* A line to append to the share log of a workbase, or a request to close it
+ * once the workbase is retired if buf is NULL. Binary share logs queue a
+ * sharelog_share_t followed by its null terminated strings, with each entry
+ * of its strings array set to whether that string is present. */
+struct sharelog_msg {
+	int64_t wb_id;
+	char *fname;
+	char *buf;
+	int len;
+};
+
+typedef struct sharelog_msg sharelog_msg_t;
+
+/* A string interned in a binary share log with the record defining it */
+struct sharelog_str {
+	UT_hash_handle hh;
+	sharelog_string_t rec;
+	char str[];
+};
+
+typedef struct sharelog_str sharelog_str_t;
+
+/* The open share log of a workbase */
+struct sharelog_file {
+	UT_hash_handle hh;
+	int64_t wb_id;
+	char *fname;
+	int fd;
+	bool dirty;
+
+	/* String dictionary of binary share logs */
+	sharelog_str_t *strings;
+	uint32_t string_id;
+};
+
+typedef struct sharelog_file sharelog_file_t;
+
+/* A frame of batched messages sent to ckdb awaiting its reply */
+struct ckdb_frame {
+	struct ckdb_frame *next;
+	struct ckdb_frame *prev;
+	int64_t seq;
+	char *buf;
+};
+
+typedef struct ckdb_frame ckdb_frame_t;
+
+/* Stratum json messages with their associated client id, or a broadcast
+ * message serialised once for an array of client ids */
 struct smsg {
 	json_t *json_msg;
 	int64_t client_id;
+
+	char *buf;
+	int64_t *client_ids;
+	int clients;
+
+	/* A received mining.submit scanned by the connector */
+	submit_t *submit;
 };
 
 typedef struct smsg smsg_t;
@@ -197,6 +258,11 @@ struct stratum_instance {
 	uint64_t enonce1_64;
 	int session_id;
 
+	/* sha256 state after the complete blocks of coinb1 and enonce1 for the
+	 * workbase midstate_id, only used by the share processor */
+	sha256_ctx midstate;
+	int64_t midstate_id;
+
 	int64_t diff; /* Current diff */
 	int64_t old_diff; /* Previous diff */
 	int64_t diff_change_job_id; /* Last job_id we changed diff */
@@ -228,6 +294,8 @@ struct stratum_instance {
 	int latency; /* Latency when on a mining node */
 
 	bool reconnect; /* This client really needs to reconnect */
+	bool extranonce; /* Subscribed to extranonce changes so it can be moved
+			  * between proxies without reconnecting */
 	time_t reconnect_request; /* The time we sent a reconnect message */
 
 	user_instance_t *user_instance;
@@ -258,13 +326,29 @@ struct stratum_instance {
 	bool remote; /* Is this a remote client on a trusted remote server */
 };
 
-struct share {
+#define SHARE_SHARDS	16
+#define SHARE_SHARD_SIZE	64
+
+/* Open addressing table of share hashes with linear probing. An all zero hash
+ * marks an empty slot since no share can hash to it. */
+struct share_shard {
+	mutex_t lock;
+	uchar (*hashes)[32];
+	int size;
+	int count;
+};
+
+typedef struct share_shard share_shard_t;
+
+/* All the shares of one workbase, sharded by hash for concurrent inserts */
+struct share_table {
 	UT_hash_handle hh;
-	uchar hash[32];
 	int64_t workbase_id;
+	share_shard_t shards[SHARE_SHARDS];
+	struct share_table *next;
 };
 
-typedef struct share share_t;
+typedef struct share_table share_table_t;
 
 struct proxy_base {
 	UT_hash_handle hh;
@@ -326,13 +410,18 @@ struct session {
 
 typedef struct txntable txntable_t;
 
+/* Transactions are stored once in binary, keyed by txid, and shared by all
+ * the workbases that reference them */
 struct txntable {
 	UT_hash_handle hh;
 	int id;
 	char hash[68];
-	char *data;
+	uchar *data;
+	int len;
 	int refcount;
+	int wbrefs; // Workbases referencing this, changed atomically
 	bool seen;
+	txntable_t *next; // For lists of newly added transactions
 };
 
 #define ID_AUTH 0
@@ -374,6 +463,41 @@ static const char *ckdb_seq_names[] = {
 
 #define ID_COUNT (sizeof(ckdb_ids)/sizeof(char *))
 
+/* Steps of generating and publishing local workbases that are timed */
+#define STEP_GETBASE 0
+#define STEP_TXNREFS 1
+#define STEP_MERKLE 2
+#define STEP_COINBASE 3
+#define STEP_PUBLISH 4
+#define STEP_EMPTY 5
+#define STEP_FULL 6
+
+static const char *step_names[] = {
+	"getbase",
+	"txnrefs",
+	"merkle",
+	"coinbase",
+	"publish",
+	"empty", // From a block change being seen to its empty workbase
+	"full" // From a block change being seen to its full workbase
+};
+
+#define STEP_COUNT (sizeof(step_names)/sizeof(char *))
+
+typedef struct steptime {
+	int64_t count;
+	double total; // All times are in ms
+	double last;
+	double max;
+} steptime_t;
+
+/* A block change for the empty workbase generator, with hash being empty if
+ * the new block is not known yet */
+typedef struct blockseen {
+	char hash[68];
+	tv_t seen;
+} blockseen_t;
+
 struct stratifier_data {
 	ckpool_t *ckp;
 
@@ -388,7 +512,7 @@ struct stratifier_data {
 	/* Protects changes to unaccounted pool stats */
 	mutex_t uastats_lock;
 
-	/* Serialises sends/receives to ckdb if possible */
+	/* Serialises auth sends/receives to ckdb if possible */
 	mutex_t ckdb_lock;
 	/* Protects sequence numbers */
 	mutex_t ckdb_msg_lock;
@@ -400,6 +524,19 @@ struct stratifier_data {
 	bool ckdb_offline;
 	bool verbose;
 
+	/* Persistent connection to ckdb that batches of queued messages are
+	 * sent over as frames, with the frames still awaiting replies */
+	mutex_t ckdbchan_lock;
+	pthread_cond_t ckdbchan_cond;
+	int ckdbchan_fd;
+	bool ckdbchan_dead;
+	int64_t ckdbchan_seq;
+	ckdb_frame_t *ckdb_frames;
+	int ckdb_inflight;
+	int64_t ckdb_frames_sent;
+	int64_t ckdb_frames_resent;
+	int64_t ckdb_batched;
+
 	uint64_t enonce1_64;
 
 	/* For protecting the txntable data */
@@ -415,6 +552,19 @@ struct stratifier_data {
 	txntable_t *txns;
 	int txns_generated;
 
+	/* Merkle trees of the last local template's txids and wtxids, only
+	 * accessed by the serialised block_update */
+	merkletree_t txid_tree;
+	merkletree_t wtxid_tree;
+
+	/* Serialises publishing local workbases between the updater and the
+	 * empty workbases generated on block changes */
+	mutex_t publish_lock;
+	int empty_published;
+	bool empty_current; // The current workbase is an empty one
+	tv_t block_seen; // When the last block change was seen if not yet full
+	steptime_t step_times[STEP_COUNT];
+
 	/* Workbases from remote trusted servers */
 	workbase_t *remote_workbases;
 
@@ -433,10 +583,29 @@ struct stratifier_data {
 	char lastswaphash[68];
 
 	ckmsgq_t *updateq;	// Generator base work updates
+	ckmsgq_t *emptyq;	// Empty workbases on block changes
 	ckmsgq_t *ssends;	// Stratum sends
-	ckmsgq_t *srecvs;	// Stratum receives
+	ckmsgq_t **srecvs;	// Stratum receives, sharded by client id
+	int srecv_shards;
+	slab_t *smsg_slab;	// Stratum send and receive messages
 	ckmsgq_t *ckdbq;	// ckdb
+	ckmsgq_t *ckdblogq;	// ckdb message log writes
+	rotating_file_t *ckdblog; /* Only accessed by the ckdblogq thread */
 	ckmsgq_t *sshareq;	// Stratum share sends
+	slab_t *jp_slab;	// Json params for the share, auth and txn queues
+
+	/* Shares hashed together in batches by the share processor */
+	int64_t share_batches;
+	int64_t batched_shares;
+
+	/* Compression rounds skipped by resuming coinbase midstates */
+	int64_t midstate_blocks;
+
+	ckmsgq_t *sharelogq;	// Share log writes
+
+	/* Open share log files, only accessed by the sharelogq thread */
+	sharelog_file_t *sharelog_files;
+	time_t sharelog_synced;
 	ckmsgq_t *sauthq;	// Stratum authorisations
 	ckmsgq_t *stxnq;	// Transaction requests
 
@@ -456,8 +625,10 @@ struct stratifier_data {
 	/* Protects both stratum and user instances */
 	cklock_t instance_lock;
 
-	share_t *shares;
-	mutex_t share_lock;
+	/* Share tables hashlist by workbase id. The shards of a table may only
+	 * be accessed with share_lock held */
+	share_table_t *share_tables;
+	cklock_t share_lock;
 
 	int64_t shares_generated;
 
@@ -584,6 +755,7 @@ static void generate_coinbase(const ckpool_t *ckp, workbase_t *wb)
 
 	wb->coinb1bin[41] = len - 1; /* Set the length now */
 	__bin2hex(wb->coinb1, wb->coinb1bin, wb->coinb1len);
+	sha256_midstate(&wb->coinb1ctx, wb->coinb1bin, wb->coinb1len);
 	LOGDEBUG("Coinb1: %s", wb->coinb1);
 	/* Coinbase 1 complete */
 
@@ -647,11 +819,24 @@ static void generate_coinbase(const ckpool_t *ckp, workbase_t *wb)
 
 static void stratum_broadcast_update(sdata_t *sdata, const workbase_t *wb, bool clean);
 
+/* Drop a workbase's references to its transactions, leaving them for
+ * update_txns to purge */
+static void put_txn_refs(workbase_t *wb)
+{
+	int i;
+
+	if (!wb->txn_refs)
+		return;
+	for (i = 0; i < wb->txns; i++)
+		__sync_sub_and_fetch(&wb->txn_refs[i]->wbrefs, 1);
+	dealloc(wb->txn_refs);
+}
+
 static void clear_workbase(workbase_t *wb)
 {
 	free(wb->flags);
-	free(wb->txn_data);
-	free(wb->txn_hashes);
+	put_txn_refs(wb);
+	clear_gbt_txns(wb);
 	free(wb->logdir);
 	free(wb->coinb1bin);
 	free(wb->coinb1);
@@ -663,54 +848,349 @@ static void clear_workbase(workbase_t *wb)
 	free(wb);
 }
 
+static share_table_t *new_share_table(const int64_t wb_id)
+{
+	share_table_t *table = ckzalloc(sizeof(share_table_t));
+	int i;
+
+	table->workbase_id = wb_id;
+	for (i = 0; i < SHARE_SHARDS; i++)
+		mutex_init(&table->shards[i].lock);
+	return table;
+}
+
+/* Free a table already removed from the hashlist, returning its share count */
+static int free_share_table(share_table_t *table)
+{
+	int i, shares = 0;
+
+	for (i = 0; i < SHARE_SHARDS; i++) {
+		share_shard_t *shard = &table->shards[i];
+
+		shares += shard->count;
+		free(shard->hashes);
+		mutex_destroy(&shard->lock);
+	}
+	free(table);
+	return shares;
+}
+
 /* Remove all shares with a workbase id less than wb_id for block changes */
 static void purge_share_hashtable(sdata_t *sdata, const int64_t wb_id)
 {
-	share_t *share, *tmp;
-	int purged = 0;
+	share_table_t *table, *tmp, *purged = NULL;
+	int shares = 0;
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id < wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			purged++;
+	ck_wlock(&sdata->share_lock);
+	HASH_ITER(hh, sdata->share_tables, table, tmp) {
+		if (table->workbase_id < wb_id) {
+			HASH_DEL(sdata->share_tables, table);
+			LL_PREPEND(purged, table);
 		}
 	}
-	mutex_unlock(&sdata->share_lock);
+	ck_wunlock(&sdata->share_lock);
 
-	if (purged)
-		LOGINFO("Cleared %d shares from share hashtable", purged);
+	LL_FOREACH_SAFE(purged, table, tmp)
+		shares += free_share_table(table);
+
+	if (shares)
+		LOGINFO("Cleared %d shares from share hashtable", shares);
 }
 
 /* Remove all shares with a workbase id == wb_id being discarded */
 static void age_share_hashtable(sdata_t *sdata, const int64_t wb_id)
 {
-	share_t *share, *tmp;
+	share_table_t *table;
 	int aged = 0;
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id == wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			aged++;
-		}
-	}
-	mutex_unlock(&sdata->share_lock);
+	ck_wlock(&sdata->share_lock);
+	HASH_FIND_I64(sdata->share_tables, &wb_id, table);
+	if (table)
+		HASH_DEL(sdata->share_tables, table);
+	ck_wunlock(&sdata->share_lock);
 
+	if (table)
+		aged = free_share_table(table);
 	if (aged)
 		LOGINFO("Aged %d shares from share hashtable", aged);
 }
 
+/* Queue a record for the share logger, taking ownership of fname and buf */
+static void add_sharelog(sdata_t *sdata, const int64_t wb_id, char *fname, char *buf,
+			 const int len)
+{
+	sharelog_msg_t *msg = ckalloc(sizeof(sharelog_msg_t));
+
+	msg->wb_id = wb_id;
+	msg->fname = fname;
+	msg->buf = buf;
+	msg->len = len;
+	ckmsgq_add(sdata->sharelogq, msg);
+}
+
+static const char *sharelog_keys[SHARELOG_STRINGS] = {
+	"createinet", "workername", "username", "secondaryuserid", "address", "agent"
+};
+
+static void sharelog_hex(uint8_t *bin, uint8_t *binlen, const char *hex, const int maxlen)
+{
+	int len = hex ? strlen(hex) / 2 : 0;
+
+	if (len > maxlen)
+		len = maxlen;
+	if (len && unlikely(!hex2bin(bin, hex, len)))
+		len = 0;
+	*binlen = len;
+}
+
+static void sharelog_u32(uint8_t *bin, const char *hex)
+{
+	uint32_t val = htobe32(strtoul(hex ? hex : "0", NULL, 16));
+
+	memcpy(bin, &val, 4);
+}
+
+/* Pack the fields of a json share log line into a binary share log message,
+ * returning its length in len */
+static char *sharelog_bin(const json_t *val, const ts_t *now, int *len)
+{
+	const char *strings[SHARELOG_STRINGS];
+	sharelog_share_t *rec;
+	int i, slen = 0;
+	char *buf, *p;
+
+	for (i = 0; i < SHARELOG_STRINGS; i++) {
+		strings[i] = json_string_value(json_object_get(val, sharelog_keys[i]));
+		if (strings[i])
+			slen += strlen(strings[i]) + 1;
+	}
+	*len = sizeof(sharelog_share_t) + slen;
+	buf = ckzalloc(*len);
+	rec = (sharelog_share_t *)buf;
+	rec->type = SHARELOG_SHARE;
+	rec->result = json_is_true(json_object_get(val, "result"));
+	rec->errn = json_integer_value(json_object_get(val, "errn"));
+	rec->workinfoid = json_integer_value(json_object_get(val, "workinfoid"));
+	rec->clientid = json_integer_value(json_object_get(val, "clientid"));
+	sharelog_hex(rec->enonce1, &rec->enonce1len,
+		     json_string_value(json_object_get(val, "enonce1")), 16);
+	sharelog_hex(rec->nonce2, &rec->nonce2len,
+		     json_string_value(json_object_get(val, "nonce2")), 16);
+	sharelog_u32(rec->nonce, json_string_value(json_object_get(val, "nonce")));
+	sharelog_u32(rec->ntime, json_string_value(json_object_get(val, "ntime")));
+	rec->diff = json_real_value(json_object_get(val, "diff"));
+	rec->sdiff = json_real_value(json_object_get(val, "sdiff"));
+	sharelog_hex(rec->hash, &rec->hashlen, json_string_value(json_object_get(val, "hash")), 32);
+	rec->createdate = now->tv_sec;
+	rec->createdate_ns = now->tv_nsec;
+
+	p = buf + sizeof(sharelog_share_t);
+	for (i = 0; i < SHARELOG_STRINGS; i++) {
+		if (!strings[i])
+			continue;
+		rec->strings[i] = 1;
+		p = stpcpy(p, strings[i]) + 1;
+	}
+	return buf;
+}
+
+/* Closing goes through the same queue so it happens after any lines that are
+ * still queued for the workbase have been written */
+static void close_sharelog(sdata_t *sdata, const int64_t wb_id)
+{
+	sharelog_msg_t *msg = ckzalloc(sizeof(sharelog_msg_t));
+
+	msg->wb_id = wb_id;
+	ckmsgq_add(sdata->sharelogq, msg);
+}
+
+static void sync_sharelog(sharelog_file_t *file)
+{
+	if (!file->dirty)
+		return;
+	if (unlikely(fdatasync(file->fd)))
+		LOGERR("Failed to fdatasync %s", file->fname);
+	file->dirty = false;
+}
+
+static void write_sharelog(sharelog_file_t *file, struct iovec *iov, int iovcnt);
+
+static sharelog_file_t *open_sharelog(sdata_t *sdata, sharelog_msg_t *msg)
+{
+	sharelog_file_t *file;
+	struct stat statbuf;
+	int fd;
+
+	HASH_FIND_I64(sdata->sharelog_files, &msg->wb_id, file);
+	if (likely(file))
+		return file;
+	fd = open(msg->fname, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+	if (unlikely(fd < 0)) {
+		LOGERR("Failed to open %s", msg->fname);
+		return NULL;
+	}
+	file = ckzalloc(sizeof(sharelog_file_t));
+	file->wb_id = msg->wb_id;
+	file->fname = msg->fname;
+	msg->fname = NULL;
+	file->fd = fd;
+	HASH_ADD_I64(sdata->sharelog_files, wb_id, file);
+
+	/* Binary share logs appended to after a restart already have a
+	 * header and redefine their string ids as they're used again */
+	if (sdata->ckp->sharelogbinary && !fstat(fd, &statbuf) && !statbuf.st_size) {
+		sharelog_header_t header = { SHARELOG_MAGIC, SHARELOG_VERSION };
+		struct iovec iov = { &header, sizeof(header) };
+
+		write_sharelog(file, &iov, 1);
+	}
+	return file;
+}
+
+static void write_sharelog(sharelog_file_t *file, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t ret = writev(file->fd, iov, MIN(iovcnt, IOV_MAX));
+
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGERR("Failed to write to %s", file->fname);
+			return;
+		}
+		/* Skip over what was written in case of a short write */
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	file->dirty = true;
+}
+
+static void free_sharelog(sharelog_file_t *file)
+{
+	sharelog_str_t *str, *tmp;
+
+	HASH_ITER(hh, file->strings, str, tmp) {
+		HASH_DEL(file->strings, str);
+		free(str);
+	}
+	close(file->fd);
+	free(file->fname);
+	free(file);
+}
+
+/* Replace the present flags in the strings of a binary share record with
+ * their ids in the file's dictionary, adding records for any new strings to
+ * the iovec before the share itself. Returns the number of iovecs added. */
+static int intern_sharelog(sharelog_file_t *file, sharelog_msg_t *msg, struct iovec *iov)
+{
+	sharelog_share_t *rec = (sharelog_share_t *)msg->buf;
+	char *p = msg->buf + sizeof(sharelog_share_t);
+	sharelog_str_t *str;
+	int i, len, iovcnt = 0;
+
+	for (i = 0; i < SHARELOG_STRINGS; i++) {
+		if (!rec->strings[i])
+			continue;
+		len = strlen(p);
+		HASH_FIND_STR(file->strings, p, str);
+		if (!str) {
+			if (unlikely(len > UINT16_MAX))
+				len = UINT16_MAX;
+			str = ckalloc(sizeof(sharelog_str_t) + len + 1);
+			str->rec.type = SHARELOG_STRING;
+			str->rec.pad = 0;
+			str->rec.len = len;
+			str->rec.id = ++file->string_id;
+			memcpy(str->str, p, len);
+			str->str[len] = '\0';
+			HASH_ADD_STR(file->strings, str, str);
+			iov[iovcnt].iov_base = &str->rec;
+			iov[iovcnt++].iov_len = sizeof(sharelog_string_t) + len;
+		}
+		rec->strings[i] = str->rec.id;
+		p += strlen(p) + 1;
+	}
+	iov[iovcnt].iov_base = rec;
+	iov[iovcnt++].iov_len = sizeof(sharelog_share_t);
+	return iovcnt;
+}
+
+/* Write out a batch of share log lines, coalescing consecutive lines for the
+ * same workbase into one writev on its persistently open file. */
+static void sharelog_process(ckpool_t *ckp, sharelog_msg_t **msgs, const int count)
+{
+	sdata_t *sdata = ckp->sdata;
+	struct iovec iov[count * (SHARELOG_STRINGS + 1)];
+	sharelog_file_t *file, *tmp;
+	int i, j, iovcnt;
+	time_t now_t;
+
+	for (i = 0; i < count; i = j) {
+		sharelog_msg_t *msg = msgs[i];
+
+		if (!msg->buf) {
+			HASH_FIND_I64(sdata->sharelog_files, &msg->wb_id, file);
+			if (file) {
+				HASH_DEL(sdata->sharelog_files, file);
+				if (ckp->sharelogsync)
+					sync_sharelog(file);
+				free_sharelog(file);
+			}
+			j = i + 1;
+			continue;
+		}
+		file = open_sharelog(sdata, msg);
+		for (iovcnt = 0, j = i; j < count; j++) {
+			if (!msgs[j]->buf || msgs[j]->wb_id != msg->wb_id)
+				break;
+			if (ckp->sharelogbinary) {
+				if (likely(file))
+					iovcnt += intern_sharelog(file, msgs[j], iov + iovcnt);
+				continue;
+			}
+			iov[iovcnt].iov_base = msgs[j]->buf;
+			iov[iovcnt++].iov_len = msgs[j]->len;
+		}
+		if (likely(file))
+			write_sharelog(file, iov, iovcnt);
+	}
+
+	for (i = 0; i < count; i++) {
+		free(msgs[i]->fname);
+		free(msgs[i]->buf);
+		free(msgs[i]);
+	}
+
+	if (!ckp->sharelogsync)
+		return;
+	now_t = time(NULL);
+	if (now_t - sdata->sharelog_synced < ckp->sharelogsync)
+		return;
+	HASH_ITER(hh, sdata->sharelog_files, file, tmp) {
+		sync_sharelog(file);
+	}
+	sdata->sharelog_synced = now_t;
+}
+
 static char *status_chars = "|/-\\";
 
-/* Absorbs the json and generates a ckdb json message, logs it to the ckdb
+/* Maximum number of ckdb log lines written out at once, and the most ms to
+ * wait for that many to queue after writing fewer */
+#define CKDBLOG_BATCH 1024
+#define CKDBLOG_INTERVAL 10
+
+/* Absorbs the json and generates a ckdb json message, queues it for the ckdb
  * log and returns the malloced message. */
 static char *ckdb_msg(ckpool_t *ckp, sdata_t *sdata, json_t *val, const int idtype)
 {
 	char *json_msg;
-	char logname[512];
 	char *ret = NULL;
 	uint64_t seqall;
 
@@ -728,13 +1208,30 @@ static char *ckdb_msg(ckpool_t *ckp, sdata_t *sdata, json_t *val, const int idty
 		goto out;
 	ASPRINTF(&ret, "%s.%"PRIu64".json=%s", ckdb_ids[idtype], seqall, json_msg);
 	free(json_msg);
+	ckmsgq_add(sdata->ckdblogq, strdup(ret));
 out:
 	json_decref(val);
-	snprintf(logname, 511, "%s%s", ckp->logdir, ckp->ckdb_name);
-	rotating_log(logname, ret);
 	return ret;
 }
 
+/* Append a batch of ckdb messages to the ckdb log in one write. Unless the
+ * batch was full, give more messages time to queue up for the next write
+ * while producers add them to the queue without waking us. */
+static void ckdblog_process(ckpool_t *ckp, char **msgs, const int count)
+{
+	sdata_t *sdata = ckp->sdata;
+	time_t now_t = time(NULL);
+	int i;
+
+	for (i = 0; i < count; i++) {
+		rotating_file_add(sdata->ckdblog, msgs[i], now_t);
+		free(msgs[i]);
+	}
+	rotating_file_flush(sdata->ckdblog);
+	if (count < CKDBLOG_BATCH)
+		ckmsgq_wait_fill(sdata->ckdblogq, CKDBLOG_BATCH, CKDBLOG_INTERVAL);
+}
+
 static void _ckdbq_add(ckpool_t *ckp, const int idtype, json_t *val, const char *file,
 		       const char *func, const int line)
 {
@@ -784,29 +1281,14 @@ static void _ckdbq_add(ckpool_t *ckp, const int idtype, json_t *val, const char
 /* Append a bulk list already created to the ssends list */
 static void ssend_bulk_append(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
 {
-	ckmsgq_t *ssends = sdata->ssends;
-
-	mutex_lock(ssends->lock);
-	ssends->messages += messages;
-	DL_CONCAT(ssends->msgs, bulk_send);
-	pthread_cond_signal(ssends->cond);
-	mutex_unlock(ssends->lock);
+	ckmsgq_add_list(sdata->ssends, bulk_send, messages, false);
 }
 
 /* As ssend_bulk_append but for high priority messages to be put at the front
  * of the list. */
 static void ssend_bulk_prepend(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
 {
-	ckmsgq_t *ssends = sdata->ssends;
-	ckmsg_t *tmp;
-
-	mutex_lock(ssends->lock);
-	tmp = ssends->msgs;
-	ssends->msgs = bulk_send;
-	ssends->messages += messages;
-	DL_CONCAT(ssends->msgs, tmp);
-	pthread_cond_signal(ssends->cond);
-	mutex_unlock(ssends->lock);
+	ckmsgq_add_list(sdata->ssends, bulk_send, messages, true);
 }
 
 /* Strip fields that will be recreated upstream or won't be used to minimise
@@ -890,8 +1372,8 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 		json_t *json_msg = json_deep_copy(wb_val);
 
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(ckp->ckmsg_slab);
+		msg = slab_zalloc(sdata->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -904,8 +1386,8 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 		json_t *json_msg = json_deep_copy(wb_val);
 
 		json_set_string(json_msg, "method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(ckp->ckmsg_slab);
+		msg = slab_zalloc(sdata->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1045,6 +1527,8 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 			/* Drop lock to avoid recursive locks */
 			send_ageworkinfo(ckp, tmp->id);
 			age_share_hashtable(sdata, tmp->id);
+			if (ckp->logshares)
+				close_sharelog(sdata, tmp->id);
 			clear_workbase(tmp);
 
 			ck_wlock(&sdata->workbase_lock);
@@ -1077,52 +1561,90 @@ static void submit_transaction(ckpool_t *ckp, const char *hash)
 	free(buf);
 }
 
-/* Build a hashlist of all transactions, allowing us to compare with the list of
- * existing transactions to determine which need to be propagated */
+static void clear_txn(txntable_t *txn)
+{
+	free(txn->data);
+	free(txn);
+}
+
+/* Create a transaction from the hex that bitcoind and other pools use, to be
+ * stored in binary */
+static txntable_t *txn_from_hex(const char *hash, const char *data)
+{
+	txntable_t *txn = ckzalloc(sizeof(txntable_t));
+
+	memcpy(txn->hash, hash, 65);
+	txn->len = strlen(data) / 2;
+	txn->data = ckalloc(txn->len);
+	if (unlikely(!hex2bin(txn->data, data, txn->len))) {
+		LOGWARNING("Invalid transaction data for %s", hash);
+		clear_txn(txn);
+		txn = NULL;
+	}
+	return txn;
+}
+
+/* Only ever generated on demand for sending to other pools or bitcoind */
+static json_t *txn_json(const txntable_t *txn)
+{
+	char *data = bin2hex(txn->data, txn->len);
+	json_t *val;
+
+	JSON_CPACK(val, "{ss,ss}", "hash", txn->hash, "data", data);
+	free(data);
+	return val;
+}
+
+/* Add a transaction from another pool to the table if we don't already have
+ * it, adding it to the list of new transactions to be propagated */
 static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char *hash,
-		    const char *data, bool local)
+		    const char *data)
 {
-	bool found = false;
-	txntable_t *txn;
+	txntable_t *txn, *found;
+	char *localdata;
 
-	/* Look for transactions we already know about and increment their
-	 * refcount if we're still using them. */
 	ck_wlock(&sdata->txn_lock);
-	HASH_FIND_STR(sdata->txns, hash, txn);
-	if (txn) {
-		if (!local)
-			txn->refcount = REFCOUNT_REMOTE;
-		else if (txn->refcount < REFCOUNT_LOCAL)
-			txn->refcount = REFCOUNT_LOCAL;
-		txn->seen = found = true;
+	HASH_FIND_STR(sdata->txns, hash, found);
+	if (found) {
+		found->refcount = REFCOUNT_REMOTE;
+		found->seen = true;
 	}
 	ck_wunlock(&sdata->txn_lock);
 
 	if (found)
 		return false;
 
-	txn = ckzalloc(sizeof(txntable_t));
-	memcpy(txn->hash, hash, 65);
-	if (local)
-		txn->data = strdup(data);
-	else {
-		/* Get the data from our local bitcoind as a way of confirming it
-		 * already knows about this transaction. */
-		txn->data = generator_get_txn(ckp, hash);
-		if (!txn->data) {
-			/* If our local bitcoind hasn't seen this transaction,
-			 * submit it for mempools to be ~synchronised */
-			submit_transaction(ckp, data);
-			txn->data = strdup(data);
-		}
+	/* Get the data from our local bitcoind as a way of confirming it
+	 * already knows about this transaction. */
+	localdata = generator_get_txn(ckp, hash);
+	if (!localdata) {
+		/* If our local bitcoind hasn't seen this transaction,
+		 * submit it for mempools to be ~synchronised */
+		submit_transaction(ckp, data);
+		txn = txn_from_hex(hash, data);
+	} else {
+		txn = txn_from_hex(hash, localdata);
+		free(localdata);
 	}
+	if (unlikely(!txn))
+		return false;
+	txn->refcount = REFCOUNT_REMOTE;
+	txn->seen = true;
 
-	if (!local || ckp->node)
-		txn->refcount = REFCOUNT_REMOTE;
-	else
-		txn->refcount = REFCOUNT_LOCAL;
-	HASH_ADD_STR(*txns, hash, txn);
+	ck_wlock(&sdata->txn_lock);
+	/* One last check in case it got added while we dropped the lock */
+	HASH_FIND_STR(sdata->txns, hash, found);
+	if (likely(!found)) {
+		HASH_ADD_STR(sdata->txns, hash, txn);
+		sdata->txns_generated++;
+	}
+	ck_wunlock(&sdata->txn_lock);
 
+	if (unlikely(found)) {
+		clear_txn(txn);
+		return false;
+	}
+	LL_PREPEND(*txns, txn);
 	return true;
 }
 
@@ -1139,8 +1661,8 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 	DL_FOREACH(sdata->node_instances, client) {
 		json_msg = json_deep_copy(txn_val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_TRANSACTIONS]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(ckp->ckmsg_slab);
+		msg = slab_zalloc(sdata->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1150,8 +1672,8 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 	DL_FOREACH(sdata->remote_instances, client) {
 		json_msg = json_deep_copy(txn_val);
 		json_set_string(json_msg, "method", stratum_msgs[SM_TRANSACTIONS]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(ckp->ckmsg_slab);
+		msg = slab_zalloc(sdata->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1181,60 +1703,55 @@ static void submit_transaction_array(ckpool_t *ckp, const json_t *arr)
 
 static void check_incomplete_wbs(ckpool_t *ckp, sdata_t *sdata);
 
-static void clear_txn(txntable_t *txn)
+/* Whether there's anyone to propagate new transactions to */
+static bool txn_peers(const ckpool_t *ckp, sdata_t *sdata)
 {
-	free(txn->data);
-	free(txn);
+	bool ret;
+
+	ck_rlock(&sdata->instance_lock);
+	ret = sdata->node_instances || sdata->remote_instances;
+	ck_runlock(&sdata->instance_lock);
+
+	return ret || ckp->remote;
 }
 
+/* Purge transactions that have aged out of the table and propagate the list of
+ * newly added ones, which are already in it. */
 static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, bool local)
 {
 	json_t *val, *txn_array = json_array(), *purged_txns = json_array();
+	bool propagate = txn_peers(ckp, sdata);
 	int added = 0, purged = 0;
 	txntable_t *tmp, *tmpa;
 
 	/* Find which transactions have their refcount decremented to zero
-	 * and remove them. */
+	 * and are no longer part of any workbase, and remove them. */
 	ck_wlock(&sdata->txn_lock);
 	HASH_ITER(hh, sdata->txns, tmp, tmpa) {
-		json_t *txn_val;
+		char *data;
 
 		if (tmp->seen) {
 			tmp->seen = false;
 			continue;
 		}
-		if (tmp->refcount-- > 0)
+		if (tmp->refcount-- > 0 || tmp->wbrefs)
 			continue;
 		HASH_DEL(sdata->txns, tmp);
-		txn_val = json_string(tmp->data);
-		json_array_append_new(purged_txns, txn_val);
+		data = bin2hex(tmp->data, tmp->len);
+		json_array_append_new(purged_txns, json_string_nocheck(data));
+		free(data);
 		clear_txn(tmp);
 		purged++;
 	}
-	/* Add the new transactions to the transaction table */
-	HASH_ITER(hh, txns, tmp, tmpa) {
-		txntable_t *found;
-		json_t *txn_val;
-
-		HASH_DEL(txns, tmp);
-		/* Check one last time this txn hasn't already been added in the
-		 * interim. */
-		HASH_FIND_STR(sdata->txns, tmp->hash, found);
-		if (found) {
-			clear_txn(tmp);
-			continue;
-		}
-		/* Propagate transaction here */
-		JSON_CPACK(txn_val, "{ss,ss}", "hash", tmp->hash, "data", tmp->data);
-		json_array_append_new(txn_array, txn_val);
-		/* Move to the sdata transaction table */
-		HASH_ADD_STR(sdata->txns, hash, tmp);
-		sdata->txns_generated++;
+	/* Propagate the new transactions here */
+	LL_FOREACH(txns, tmp) {
+		if (propagate)
+			json_array_append_new(txn_array, txn_json(tmp));
 		added++;
 	}
 	ck_wunlock(&sdata->txn_lock);
 
-	if (added) {
+	if (added && propagate) {
 		JSON_CPACK(val, "{so}", "transaction", txn_array);
 		send_node_transactions(ckp, sdata, val);
 		json_decref(val);
@@ -1257,94 +1774,69 @@ static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, bool lo
 	}
 }
 
-/* Distill down a set of transactions into an efficient tree arrangement for
- * stratum messages and fast work assembly. */
-static txntable_t *wb_merkle_bin_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb,
-				      json_t *txn_array, bool local)
+/* Take references to all the transactions of a workbase generated locally,
+ * moving the data of those we don't already have into the transaction table.
+ * Returns a list of the newly added transactions. */
+static txntable_t *wb_txn_refs(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 {
-	int i, j, binleft, binlen;
-	txntable_t *txns = NULL;
-	json_t *arr_val;
-	uchar *hashbin;
+	txntable_t *txns = NULL, *txn;
+	int i;
 
-	wb->txns = json_array_size(txn_array);
-	wb->merkles = 0;
-	binlen = wb->txns * 32 + 32;
-	hashbin = alloca(binlen + 32);
-	memset(hashbin, 0, 32);
-	binleft = binlen / 32;
-	if (wb->txns) {
-		int len = 1, ofs = 0;
-		const char *txn;
+	if (!wb->txns)
+		return NULL;
+	wb->txn_refs = ckalloc(sizeof(txntable_t *) * wb->txns);
 
-		for (i = 0; i < wb->txns; i++) {
-			arr_val = json_array_get(txn_array, i);
-			txn = json_string_value(json_object_get(arr_val, "data"));
-			if (!txn) {
-				LOGWARNING("json_string_value fail - cannot find transaction data");
-				goto out;
-			}
-			len += strlen(txn);
-		}
+	ck_wlock(&sdata->txn_lock);
+	for (i = 0; i < wb->txns; i++) {
+		const char *hash = wb->txn_hashes + i * 65;
 
-		wb->txn_data = ckzalloc(len + 1);
-		wb->txn_hashes = ckzalloc(wb->txns * 65 + 1);
-		memset(wb->txn_hashes, 0x20, wb->txns * 65); // Spaces
+		HASH_FIND(hh, sdata->txns, hash, 64, txn);
+		if (!txn) {
+			txn = ckzalloc(sizeof(txntable_t));
+			memcpy(txn->hash, hash, 64);
+			txn->len = wb->txn_ofs[i + 1] - wb->txn_ofs[i];
+			txn->data = ckalloc(txn->len);
+			memcpy(txn->data, wb->txn_data + wb->txn_ofs[i], txn->len);
+			txn->refcount = ckp->node ? REFCOUNT_REMOTE : REFCOUNT_LOCAL;
+			HASH_ADD_STR(sdata->txns, hash, txn);
+			LL_PREPEND(txns, txn);
+			sdata->txns_generated++;
+		} else if (txn->refcount < REFCOUNT_LOCAL)
+			txn->refcount = REFCOUNT_LOCAL;
+		txn->seen = true;
+		__sync_add_and_fetch(&txn->wbrefs, 1);
+		wb->txn_refs[i] = txn;
+	}
+	ck_wunlock(&sdata->txn_lock);
 
-		for (i = 0; i < wb->txns; i++) {
-			const char *txid, *hash;
-			char binswap[32];
-
-			arr_val = json_array_get(txn_array, i);
-
-			// Post-segwit, txid returns the tx hash without witness data
-			txid = json_string_value(json_object_get(arr_val, "txid"));
-			hash = json_string_value(json_object_get(arr_val, "hash"));
-			if (!txid)
-				txid = hash;
-			if (unlikely(!txid)) {
-				LOGERR("Missing txid for transaction in wb_merkle_bins");
-				goto out;
-			}
-			txn = json_string_value(json_object_get(arr_val, "data"));
-			add_txn(ckp, sdata, &txns, hash, txn, local);
-			len = strlen(txn);
-			memcpy(wb->txn_data + ofs, txn, len);
-			ofs += len;
-			if (!hex2bin(binswap, txid, 32)) {
-				LOGERR("Failed to hex2bin hash in gbt_merkle_bins");
-				goto out;
-			}
-			memcpy(wb->txn_hashes + i * 65, txid, 64);
-			bswap_256(hashbin + 32 + 32 * i, binswap);
-		}
-	} else
-		wb->txn_hashes = ckzalloc(1);
+	/* The transaction table holds the only copy of the data now */
+	dealloc(wb->txn_data);
+	dealloc(wb->txn_ofs);
+	wb->txn_datasize = 0;
+
+	return txns;
+}
+
+/* Distill down a set of transactions into an efficient tree arrangement for
+ * stratum messages and fast work assembly. The branch is the right hand
+ * sibling of the coinbase's path at each level of tree. */
+static void wb_merkle_bins(workbase_t *wb, merkletree_t *tree, bool local)
+{
+	int lvl, rehashed;
+
+	rehashed = merkle_update(tree, wb->txidbin, wb->txns);
+	LOGDEBUG("Rehashed %d merkle tree nodes", rehashed);
+	wb->merkles = 0;
 	wb->merkle_array = json_array();
-	if (binleft > 1) {
-		while (42) {
-			if (binleft == 1)
-				break;
-			memcpy(&wb->merklebin[wb->merkles][0], hashbin + 32, 32);
-			__bin2hex(&wb->merklehash[wb->merkles][0], &wb->merklebin[wb->merkles][0], 32);
-			json_array_append_new(wb->merkle_array, json_string(&wb->merklehash[wb->merkles][0]));
-			LOGDEBUG("MerkleHash %d %s",wb->merkles, &wb->merklehash[wb->merkles][0]);
-			wb->merkles++;
-			if (binleft % 2) {
-				memcpy(hashbin + binlen, hashbin + binlen - 32, 32);
-				binlen += 32;
-				binleft++;
-			}
-			for (i = 32, j = 64; j < binlen; i += 32, j += 64)
-				gen_hash(hashbin + j, hashbin + i, 64);
-			binleft /= 2;
-			binlen = binleft * 32;
-		}
+	for (lvl = 0; tree->len[lvl] > 1; lvl++) {
+		memcpy(&wb->merklebin[wb->merkles][0], tree->level[lvl] + 32, 32);
+		__bin2hex(&wb->merklehash[wb->merkles][0], &wb->merklebin[wb->merkles][0], 32);
+		json_array_append_new(wb->merkle_array, json_string(&wb->merklehash[wb->merkles][0]));
+		LOGDEBUG("MerkleHash %d %s",wb->merkles, &wb->merklehash[wb->merkles][0]);
+		wb->merkles++;
 	}
 	LOGNOTICE("Stored %s workbase with %d transactions", local ? "local" : "remote",
 		  wb->txns);
-out:
-	return txns;
 }
 
 static const unsigned char witness_nonce[32] = {0};
@@ -1352,46 +1844,14 @@ static const int witness_nonce_size = sizeof(witness_nonce);
 static const unsigned char witness_header[] = {0xaa, 0x21, 0xa9, 0xed};
 static const int witness_header_size = sizeof(witness_header);
 
-static void gbt_witness_data(workbase_t *wb, json_t *txn_array)
+/* The witness commitment is the root of tree built from the wtxids with a
+ * zero coinbase wtxid, hashed with the witness nonce */
+static void gbt_witness_data(workbase_t *wb, merkletree_t *tree)
 {
-	int i, binlen, txncount = json_array_size(txn_array);
-	const char* hash;
-	json_t *arr_val;
-	uchar *hashbin;
-
-	binlen = txncount * 32 + 32;
-	hashbin = alloca(binlen + 32);
-	memset(hashbin, 0, 32);
-
-	for (i = 0; i < txncount; i++) {
-		char binswap[32];
-
-		arr_val = json_array_get(txn_array, i);
-		hash = json_string_value(json_object_get(arr_val, "hash"));
-		if (unlikely(!hash)) {
-			LOGERR("Hash missing for transaction");
-			return;
-		}
-		if (!hex2bin(binswap, hash, 32)) {
-			LOGERR("Failed to hex2bin hash in gbt_witness_data");
-			return;
-		}
-		bswap_256(hashbin + 32 + 32 * i, binswap);
-	}
-
-	// Build merkle root (copied from libblkmaker)
-	for (txncount++ ; txncount > 1 ; txncount /= 2) {
-		if (txncount % 2) {
-			// Odd number, duplicate the last
-			memcpy(hashbin + 32 * txncount, hashbin + 32 * (txncount - 1), 32);
-			txncount++;
-		}
-		for (i = 0; i < txncount; i += 2) {
-			// We overlap input and output here, on the first pair
-			gen_hash(hashbin + 32 * i, hashbin + 32 * (i / 2), 64);
-		}
-	}
+	uchar hashbin[32 + sizeof(witness_header) + sizeof(witness_nonce)];
 
+	merkle_update(tree, wb->wtxidbin, wb->txns);
+	memcpy(hashbin, tree->level[tree->levels - 1], 32);
 	memcpy(hashbin + 32, &witness_nonce, witness_nonce_size);
 	gen_hash(hashbin, hashbin + witness_header_size, 32 + witness_nonce_size);
 	memcpy(hashbin, witness_header, witness_header_size);
@@ -1399,32 +1859,63 @@ static void gbt_witness_data(workbase_t *wb, json_t *txn_array)
 	wb->insert_witness = true;
 }
 
+/* Account the time since start to step, restarting start for the next one */
+static void step_time(sdata_t *sdata, const int step, tv_t *start)
+{
+	steptime_t *st = &sdata->step_times[step];
+	tv_t now;
+
+	tv_time(&now);
+	st->last = tvdiff(&now, start) * 1000;
+	st->total += st->last;
+	if (st->last > st->max)
+		st->max = st->last;
+	st->count++;
+	*start = now;
+}
+
+/* A queued base template update, carrying the template itself when a long
+ * poll already returned it */
+struct update_req {
+	int prio;
+	workbase_t *wb;
+};
+
+typedef struct update_req update_req_t;
+
 /* This function assumes it will only receive a valid json gbt base template
  * since checking should have been done earlier, and creates the base template
  * for generating work templates. This is a ckmsgq so all uses of this function
  * are serialised. */
-static void block_update(ckpool_t *ckp, int *prio)
+static void block_update(ckpool_t *ckp, update_req_t *req)
 {
 	const char* witnessdata_check, *rule;
-	json_t *txn_array, *rules_array;
+	int i, retries = 0, stale = 0, empty_seq;
 	sdata_t *sdata = ckp->sdata;
 	bool new_block = false;
-	int i, retries = 0;
+	json_t *rules_array;
 	bool ret = false;
 	txntable_t *txns;
+	tv_t start;
 	workbase_t *wb;
 
 	/* Skip update if we're getting stacked low priority updates too close
 	 * together. */
-	if (*prio < GEN_PRIORITY && time(NULL) < sdata->update_time + (ckp->update_interval / 2) &&
+	if (req->prio < GEN_PRIORITY && time(NULL) < sdata->update_time + (ckp->update_interval / 2) &&
 	    sdata->current_workbase) {
 		ret = true;
 		goto out;
 	}
 retry:
-	wb = generator_getbase(ckp);
+	empty_seq = sdata->empty_published;
+	tv_time(&start);
+	if (req->wb) {
+		wb = req->wb;
+		req->wb = NULL;
+	} else
+		wb = generator_getbase(ckp);
 	if (unlikely(!wb)) {
-		if (retries++ < 5 || *prio == GEN_PRIORITY) {
+		if (retries++ < 5 || req->prio == GEN_PRIORITY) {
 			LOGWARNING("Generator returned failure in update_base, retry #%d", retries);
 			goto retry;
 		}
@@ -1433,11 +1924,13 @@ retry:
 	}
 	if (unlikely(retries))
 		LOGWARNING("Generator succeeded in update_base after retrying");
+	step_time(sdata, STEP_GETBASE, &start);
 
 	wb->ckp = ckp;
 
-	txn_array = json_object_get(wb->json, "transactions");
-	txns = wb_merkle_bin_txns(ckp, sdata, wb, txn_array, true);
+	txns = wb_txn_refs(ckp, sdata, wb);
+	step_time(sdata, STEP_TXNREFS, &start);
+	wb_merkle_bins(wb, &sdata->txid_tree, true);
 
 	wb->insert_witness = false;
 	rules_array = json_object_get(wb->json, "rules");
@@ -1453,7 +1946,7 @@ retry:
 				rule++;
 			if (safecmp(rule, "segwit")) {
 				witnessdata_check = json_string_value(json_object_get(wb->json, "default_witness_commitment"));
-				gbt_witness_data(wb, txn_array);
+				gbt_witness_data(wb, &sdata->wtxid_tree);
 				// Verify against the pre-calculated value if it exists. Skip the size/OP_RETURN bytes.
 				if (wb->insert_witness && witnessdata_check[0] && safecmp(witnessdata_check + 4, wb->witnessdata) != 0)
 					LOGERR("Witness from btcd: %s. Calculated Witness: %s", witnessdata_check + 4, wb->witnessdata);
@@ -1461,14 +1954,40 @@ retry:
 			}
 		}
 	}
+	/* Only needed for the merkle trees */
+	dealloc(wb->txidbin);
+	dealloc(wb->wtxidbin);
+	step_time(sdata, STEP_MERKLE, &start);
 
 	generate_coinbase(ckp, wb);
-
+	step_time(sdata, STEP_COINBASE, &start);
+
+	mutex_lock(&sdata->publish_lock);
+	/* An empty workbase for a new block was published while this template
+	 * was being generated on the block before it */
+	if (unlikely(sdata->empty_published != empty_seq && strncmp(wb->prevhash, sdata->lasthash, 64))) {
+		mutex_unlock(&sdata->publish_lock);
+		LOGINFO("Discarding template generated on the previous block");
+		if (txns)
+			update_txns(ckp, sdata, txns, true);
+		clear_workbase(wb);
+		if (stale++ < 5)
+			goto retry;
+		goto out;
+	}
 	add_base(ckp, sdata, wb, &new_block);
 
 	if (new_block)
 		LOGNOTICE("Block hash changed to %s", sdata->lastswaphash);
-	stratum_broadcast_update(sdata, wb, new_block);
+	/* Have miners switch straight to the full template from empty work */
+	stratum_broadcast_update(sdata, wb, new_block || sdata->empty_current);
+	if ((new_block || sdata->empty_current) && sdata->block_seen.tv_sec) {
+		step_time(sdata, STEP_FULL, &sdata->block_seen);
+		sdata->block_seen.tv_sec = 0;
+	}
+	sdata->empty_current = false;
+	mutex_unlock(&sdata->publish_lock);
+	step_time(sdata, STEP_PUBLISH, &start);
 	ret = true;
 	LOGINFO("Broadcast updated stratum base");
 	/* Update transactions after stratum broadcast to not delay
@@ -1490,7 +2009,141 @@ out:
 		LOGINFO("Broadcast ping due to failed stratum base update");
 		broadcast_ping(sdata);
 	}
-	free(prio);
+	if (req->wb)
+		clear_workbase(req->wb);
+	free(req);
+}
+
+/* Subsidy of a block at height on the network bitcoind is on, regtest halving
+ * every 150 blocks and the others every 210000 */
+static uint64_t block_subsidy(const ckpool_t *ckp, const int height)
+{
+	int halvings = height / (!strcmp(ckp->chain, "regtest") ? 150 : 210000);
+
+	if (halvings >= 64)
+		return 0;
+	return 5000000000ULL >> halvings;
+}
+
+/* Whether the bits of the next block are certain to be those of the current
+ * template. Testnets allow minimum difficulty blocks depending on the time so
+ * only main and signet, which change bits every 2016 blocks, and regtest, which
+ * never does, qualify. */
+static bool bits_inherited(const ckpool_t *ckp, const int height, const int current)
+{
+	if (!strcmp(ckp->chain, "regtest"))
+		return true;
+	if (strcmp(ckp->chain, "main") && strcmp(ckp->chain, "signet"))
+		return false;
+	return height / 2016 == current / 2016;
+}
+
+/* Generate a workbase with no transactions on top of the block hash at height
+ * from the current workbase so miners can move to the new block before its
+ * full template is ready. Returns NULL if its bits may differ from the current
+ * workbase's. Enter holding publish_lock. */
+static workbase_t *empty_workbase(ckpool_t *ckp, sdata_t *sdata, const char *hash,
+				  const int height)
+{
+	workbase_t *wb = NULL, *current;
+	merkletree_t tree = {};
+	char bin[32], swap[32];
+	uint32_t now;
+
+	ck_rlock(&sdata->workbase_lock);
+	current = sdata->current_workbase;
+	if (unlikely(!current || current->proxy))
+		goto out_unlock;
+	if (!bits_inherited(ckp, height + 1, current->height))
+		goto out_unlock;
+	wb = ckzalloc(sizeof(workbase_t));
+	wb->ckp = ckp;
+	strcpy(wb->target, current->target);
+	wb->diff = current->diff;
+	wb->version = current->version;
+	strcpy(wb->bbversion, current->bbversion);
+	strcpy(wb->nbit, current->nbit);
+	wb->flags = strdup(current->flags);
+	wb->insert_witness = current->insert_witness;
+	now = time(NULL);
+	wb->curtime = MAX(now, current->curtime);
+	/* Without the fees the only value certain not to be too much */
+	wb->coinbasevalue = MIN(block_subsidy(ckp, height + 1), current->coinbasevalue);
+out_unlock:
+	ck_runlock(&sdata->workbase_lock);
+
+	if (!wb)
+		goto out;
+	wb->height = height + 1;
+	hex2bin(bin, hash, 32);
+	swap_256(swap, bin);
+	__bin2hex(wb->prevhash, swap, 32);
+	snprintf(wb->ntime, 9, "%08x", wb->curtime);
+	wb->ntime32 = wb->curtime;
+	wb->txn_hashes = ckzalloc(1);
+	wb_merkle_bins(wb, &tree, true);
+	if (wb->insert_witness)
+		gbt_witness_data(wb, &tree);
+	clear_merkletree(&tree);
+	generate_coinbase(ckp, wb);
+out:
+	return wb;
+}
+
+/* Publish an empty workbase on a block change unless work on the new block
+ * has already been sent */
+static void empty_update(ckpool_t *ckp, blockseen_t *seen)
+{
+	sdata_t *sdata = ckp->sdata;
+	bool new_block = false;
+	workbase_t *wb;
+	int height;
+
+	height = generator_blockheight(ckp, seen->hash);
+	if (unlikely(height < 0)) {
+		LOGINFO("Failed to get block height for empty workbase");
+		goto out;
+	}
+
+	mutex_lock(&sdata->publish_lock);
+	if (!strcmp(seen->hash, sdata->lastswaphash))
+		goto out_unlock;
+	wb = empty_workbase(ckp, sdata, seen->hash, height);
+	if (!wb)
+		goto out_unlock;
+	if (!sdata->block_seen.tv_sec)
+		sdata->block_seen = seen->seen;
+	add_base(ckp, sdata, wb, &new_block);
+	stratum_broadcast_update(sdata, wb, true);
+	sdata->empty_published++;
+	sdata->empty_current = true;
+	step_time(sdata, STEP_EMPTY, &seen->seen);
+	LOGNOTICE("Block hash changed to %s, sent empty work", sdata->lastswaphash);
+out_unlock:
+	mutex_unlock(&sdata->publish_lock);
+out:
+	free(seen);
+}
+
+/* A block change has probably happened, with hash being the new block if it's
+ * known. Start timing it and queue an empty workbase on it if enabled. The
+ * full template is requested separately. */
+static void block_changed(sdata_t *sdata, const char *hash)
+{
+	blockseen_t *seen = ckalloc(sizeof(blockseen_t));
+
+	tv_time(&seen->seen);
+	snprintf(seen->hash, 68, "%s", hash);
+	if (*hash) {
+		mutex_lock(&sdata->publish_lock);
+		if (!sdata->block_seen.tv_sec && strcmp(hash, sdata->lastswaphash))
+			sdata->block_seen = seen->seen;
+		mutex_unlock(&sdata->publish_lock);
+	}
+	if (sdata->emptyq)
+		ckmsgq_add(sdata->emptyq, seen);
+	else
+		free(seen);
 }
 
 #define SSEND_PREPEND	0
@@ -1515,8 +2168,8 @@ static void downstream_json(sdata_t *sdata, const json_t *val, const int64_t cli
 		if (client->id == client_id)
 			continue;
 		json_msg = json_deep_copy(val);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(sdata->ckp->ckmsg_slab);
+		msg = slab_zalloc(sdata->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1562,10 +2215,11 @@ static void request_txns(ckpool_t *ckp, sdata_t *sdata, json_t *txns)
 static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 {
 	const char *hashes = wb->txn_hashes;
-	json_t *txn_array, *missing_txns;
+	merkletree_t tree = {};
+	txntable_t **refs, *txn;
+	json_t *missing_txns;
 	char hash[68] = {};
 	bool ret = false;
-	txntable_t *txns;
 	int i, len = 0;
 
 	/* We'll only see this on testnet now */
@@ -1583,12 +2237,11 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		goto out;
 	}
 	ret = true;
-	txn_array = json_array();
+	refs = ckzalloc(sizeof(txntable_t *) * wb->txns);
 	missing_txns = json_array();
 
 	for (i = 0; i < wb->txns; i++) {
-		json_t *txn_val = NULL;
-		txntable_t *txn;
+		txntable_t *found;
 		char *data;
 
 		memcpy(hash, hashes + i * 65, 64);
@@ -1598,19 +2251,23 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		if (likely(txn)) {
 			txn->refcount = REFCOUNT_REMOTE;
 			txn->seen = true;
-			JSON_CPACK(txn_val, "{ss,ss}",
-				   "hash", hash, "data", txn->data);
-			json_array_append_new(txn_array, txn_val);
+			__sync_add_and_fetch(&txn->wbrefs, 1);
+			refs[i] = txn;
 		}
 		ck_wunlock(&sdata->txn_lock);
 
-		if (likely(txn_val))
+		if (likely(txn))
 			continue;
 		/* See if we can find it in our local bitcoind */
 		data = generator_get_txn(ckp, hash);
 		if (!data) {
-			txn_val = json_string(hash);
-			json_array_append_new(missing_txns, txn_val);
+			json_array_append_new(missing_txns, json_string(hash));
+			ret = false;
+			continue;
+		}
+		txn = txn_from_hex(hash, data);
+		free(data);
+		if (unlikely(!txn)) {
 			ret = false;
 			continue;
 		}
@@ -1618,34 +2275,43 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		/* We've found it, let's add it to the table */
 		ck_wlock(&sdata->txn_lock);
 		/* One last check in case it got added while we dropped the lock */
-		HASH_FIND_STR(sdata->txns, hash, txn);
-		if (likely(!txn)) {
-			txn = ckzalloc(sizeof(txntable_t));
-			memcpy(txn->hash, hash, 65);
-			txn->data = data;
+		HASH_FIND_STR(sdata->txns, hash, found);
+		if (likely(!found)) {
 			HASH_ADD_STR(sdata->txns, hash, txn);
 			sdata->txns_generated++;
 		} else {
-			free(data);
+			clear_txn(txn);
+			txn = found;
 		}
 		txn->refcount = REFCOUNT_REMOTE;
 		txn->seen = true;
-		JSON_CPACK(txn_val, "{ss,ss}",
-			   "hash", hash, "data", txn->data);
-		json_array_append_new(txn_array, txn_val);
+		__sync_add_and_fetch(&txn->wbrefs, 1);
+		refs[i] = txn;
 		ck_wunlock(&sdata->txn_lock);
 	}
 
 	if (ret) {
 		wb->incomplete = false;
 		LOGINFO("Rebuilt txns into workbase with %d transactions", i);
-		/* These two structures are regenerated so free their ram */
+		wb->txn_refs = refs;
+		/* The merkle tree is regenerated so free its ram */
 		json_decref(wb->merkle_array);
-		dealloc(wb->txn_hashes);
-		txns = wb_merkle_bin_txns(ckp, sdata, wb, txn_array, false);
-		if (likely(txns))
-			update_txns(ckp, sdata, txns, false);
+		wb->txidbin = ckalloc(wb->txns * 32);
+		for (i = 0; i < wb->txns; i++) {
+			uchar binswap[32];
+
+			hex2bin(binswap, refs[i]->hash, 32);
+			bswap_256(wb->txidbin + i * 32, binswap);
+		}
+		wb_merkle_bins(wb, &tree, false);
+		clear_merkletree(&tree);
+		dealloc(wb->txidbin);
 	} else {
+		for (i = 0; i < wb->txns; i++) {
+			if (refs[i])
+				__sync_sub_and_fetch(&refs[i]->wbrefs, 1);
+		}
+		free(refs);
 		if (!sdata->wbincomplete) {
 			sdata->wbincomplete = true;
 			if (ckp->proxy)
@@ -1655,7 +2321,6 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		request_txns(ckp, sdata, missing_txns);
 	}
 
-	json_decref(txn_array);
 	json_decref(missing_txns);
 out:
 	return ret;
@@ -1742,6 +2407,8 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 
 			/* Drop lock to send this */
 			send_ageworkinfo(ckp, tmp->mapped_id);
+			if (ckp->logshares)
+				close_sharelog(sdata, tmp->id);
 			clear_workbase(tmp);
 
 			ck_wlock(&sdata->workbase_lock);
@@ -1780,8 +2447,8 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 			continue;
 		json_msg = json_deep_copy(wb_val);
 		json_set_string(json_msg, "method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(ckp->ckmsg_slab);
+		msg = slab_zalloc(sdata->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1798,8 +2465,8 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 			continue;
 		json_msg = json_deep_copy(wb_val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(ckp->ckmsg_slab);
+		msg = slab_zalloc(sdata->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1864,6 +2531,7 @@ static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t clie
 	json_intcpy(&wb->coinb1len, val, "coinb1len");
 	wb->coinb1bin = ckzalloc(wb->coinb1len);
 	hex2bin(wb->coinb1bin, wb->coinb1, wb->coinb1len);
+	sha256_midstate(&wb->coinb1ctx, wb->coinb1bin, wb->coinb1len);
 	json_strdup(&wb->coinb2, val, "coinb2");
 	json_intcpy(&wb->coinb2len, val, "coinb2len");
 	wb->coinb2bin = ckzalloc(wb->coinb2len);
@@ -1892,33 +2560,34 @@ static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t clie
 		LOGNOTICE("Block hash changed to %s", sdata->lastswaphash);
 }
 
-/* Calculate share diff and fill in hash and swap. Need to hold workbase read count */
-static double
-share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const char *nonce2,
-	   const uint32_t ntime32, const char *nonce, uchar *hash, uchar *swap, int *cblen)
+/* Build a share's coinbase returning its length. Need to hold workbase read
+ * count */
+static int build_coinbase(char *coinbase, const uchar *enonce1bin, const workbase_t *wb,
+			  const char *nonce2)
+{
+	int cblen;
+
+	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
+	cblen = wb->coinb1len;
+	memcpy(coinbase + cblen, enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
+	cblen += wb->enonce1constlen + wb->enonce1varlen;
+	hex2bin(coinbase + cblen, nonce2, wb->enonce2varlen);
+	cblen += wb->enonce2varlen;
+	memcpy(coinbase + cblen, wb->coinb2bin, wb->coinb2len);
+	cblen += wb->coinb2len;
+
+	return cblen;
+}
+
+/* Build the byte swapped header of a share to be hashed from its merkle root.
+ * Need to hold workbase read count */
+static void build_header(uchar *swap, const workbase_t *wb, const uchar *merkle_sha,
+			 const uint32_t ntime32, const char *nonce)
 {
-	unsigned char merkle_root[32], merkle_sha[64];
 	uint32_t *data32, *swap32, benonce32;
-	uchar hash1[32];
+	uchar merkle_root[32];
 	char data[80];
-	int i;
 
-	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
-	*cblen = wb->coinb1len;
-	memcpy(coinbase + *cblen, enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
-	*cblen += wb->enonce1constlen + wb->enonce1varlen;
-	hex2bin(coinbase + *cblen, nonce2, wb->enonce2varlen);
-	*cblen += wb->enonce2varlen;
-	memcpy(coinbase + *cblen, wb->coinb2bin, wb->coinb2len);
-	*cblen += wb->coinb2len;
-
-	gen_hash((uchar *)coinbase, merkle_root, *cblen);
-	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < wb->merkles; i++) {
-		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
 	data32 = (uint32_t *)merkle_sha;
 	swap32 = (uint32_t *)merkle_root;
 	flip_32(swap32, data32);
@@ -1936,12 +2605,43 @@ share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const
 	data32 = (uint32_t *)(data + 68);
 	*data32 = htobe32(ntime32);
 
-	/* Hash the share */
 	data32 = (uint32_t *)data;
 	swap32 = (uint32_t *)swap;
 	flip_80(swap32, data32);
-	sha256(swap, 80, hash1);
+}
+
+/* Double sha256 of a coinbase resuming from the midstate of its prefix */
+static void coinbase_hash(const sha256_ctx *midstate, const char *coinbase, const int cblen,
+			  uchar *hash)
+{
+	uchar hash1[32];
+
+	sha256_resume(midstate, (uchar *)coinbase + midstate->tot_len, cblen - midstate->tot_len, hash1);
 	sha256(hash1, 32, hash);
+}
+
+/* Calculate share diff and fill in hash and swap, resuming the coinbase hash
+ * from midstate. Need to hold workbase read count */
+static double
+share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const char *nonce2,
+	   const uint32_t ntime32, const char *nonce, uchar *hash, uchar *swap, int *cblen,
+	   const sha256_ctx *midstate)
+{
+	unsigned char merkle_root[32], merkle_sha[64];
+	int i;
+
+	*cblen = build_coinbase(coinbase, enonce1bin, wb, nonce2);
+	coinbase_hash(midstate, coinbase, *cblen, merkle_root);
+	memcpy(merkle_sha, merkle_root, 32);
+	for (i = 0; i < wb->merkles; i++) {
+		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
+		gen_hash(merkle_sha, merkle_root, 64);
+		memcpy(merkle_sha, merkle_root, 32);
+	}
+
+	/* Hash the share */
+	build_header(swap, wb, merkle_sha, ntime32, nonce);
+	gen_hash(swap, hash, 80);
 
 	/* Calculate the diff of the share here */
 	return diff_from_target(hash);
@@ -1985,8 +2685,8 @@ static void send_nodes_block(sdata_t *sdata, const json_t *block_val, const int6
 			continue;
 		json_msg = json_deep_copy(block_val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_BLOCK]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(sdata->ckp->ckmsg_slab);
+		msg = slab_zalloc(sdata->smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -2058,8 +2758,22 @@ process_block(const workbase_t *wb, const char *coinbase, const int cblen,
 	strcat(gbt_block, varint);
 	__bin2hex(hexcoinbase, coinbase, cblen);
 	strcat(gbt_block, hexcoinbase);
-	if (wb->txns)
-		realloc_strcat(&gbt_block, wb->txn_data);
+	if (wb->txn_refs) {
+		int i, len = strlen(gbt_block), size = len + 1;
+
+		/* Transactions are only converted to hex on block solves */
+		for (i = 0; i < wb->txns; i++)
+			size += wb->txn_refs[i]->len * 2;
+		gbt_block = realloc(gbt_block, size);
+		if (unlikely(!gbt_block))
+			quit(1, "Failed to realloc block of size %d", size);
+		for (i = 0; i < wb->txns; i++) {
+			const txntable_t *txn = wb->txn_refs[i];
+
+			__bin2hex(gbt_block + len, txn->data, txn->len);
+			len += txn->len * 2;
+		}
+	}
 	return gbt_block;
 }
 
@@ -2209,7 +2923,8 @@ static void submit_node_block(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 		hex2bin(enonce1bin, enonce1, enonce1len);
 		coinbase = alloca(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2len);
 		/* Fill in the hashes */
-		share_diff(coinbase, enonce1bin, wb, nonce2, ntime32, nonce, hash, swap, &cblen);
+		share_diff(coinbase, enonce1bin, wb, nonce2, ntime32, nonce, hash, swap, &cblen,
+			   &wb->coinb1ctx);
 	}
 
 	/* Now we have enough to assemble a block */
@@ -2244,9 +2959,10 @@ out:
 	free(enonce1);
 }
 
-static void update_base(sdata_t *sdata, const int prio)
+/* Queue an update of the base template, using wb if it is already known */
+static void queue_update_base(sdata_t *sdata, const int prio, workbase_t *wb)
 {
-	int *uprio;
+	update_req_t *req;
 
 	/* All uses of block_update are serialised so if we have more
 	 * update_base calls waiting there is no point servicing them unless
@@ -2256,14 +2972,22 @@ static void update_base(sdata_t *sdata, const int prio)
 		 * progress. */
 		if (cksem_trywait(&sdata->update_sem)) {
 			LOGINFO("Skipped lowprio update base");
+			if (wb)
+				clear_workbase(wb);
 			return;
 		}
 	} else
 		cksem_wait(&sdata->update_sem);
 
-	uprio = ckalloc(sizeof(int));
-	*uprio = prio;
-	ckmsgq_add(sdata->updateq, uprio);
+	req = ckalloc(sizeof(update_req_t));
+	req->prio = prio;
+	req->wb = wb;
+	ckmsgq_add(sdata->updateq, req);
+}
+
+static void update_base(sdata_t *sdata, const int prio)
+{
+	queue_update_base(sdata, prio, NULL);
 }
 
 /* Instead of removing the client instance, we add it to a list of recycled
@@ -2391,13 +3115,19 @@ static sdata_t *duplicate_sdata(const sdata_t *sdata)
 	/* Use the same work queues for all subproxies */
 	dsdata->ssends = sdata->ssends;
 	dsdata->srecvs = sdata->srecvs;
+	dsdata->srecv_shards = sdata->srecv_shards;
+	dsdata->smsg_slab = sdata->smsg_slab;
 	dsdata->ckdbq = sdata->ckdbq;
+	dsdata->ckdblogq = sdata->ckdblogq;
 	dsdata->sshareq = sdata->sshareq;
+	dsdata->jp_slab = sdata->jp_slab;
 	dsdata->sauthq = sdata->sauthq;
 	dsdata->stxnq = sdata->stxnq;
+	dsdata->sharelogq = sdata->sharelogq;
 
 	/* Give the sbuproxy its own workbase list and lock */
 	cklock_init(&dsdata->workbase_lock);
+	cklock_init(&dsdata->share_lock);
 	cksem_init(&dsdata->update_sem);
 	cksem_post(&dsdata->update_sem);
 	return dsdata;
@@ -2640,11 +3370,13 @@ static void generator_recruit(ckpool_t *ckp, const int proxyid, const int recrui
 /* Find how much headroom we have and connect up to that many clients that are
  * not currently on this pool, recruiting more slots to switch more clients
  * later on lazily. Only reconnect clients bound to global proxies. */
+static int move_clients(sdata_t *sdata, const int64_t *ids, const int moves, int64_t *headroom);
+
 static void reconnect_global_clients(sdata_t *sdata)
 {
 	stratum_instance_t *client, *tmpclient;
-	int reconnects = 0;
-	int64_t headroom;
+	int reconnects = 0, moves = 0;
+	int64_t headroom, *move_ids = NULL;
 	proxy_t *proxy;
 
 	headroom = current_headroom(sdata, &proxy);
@@ -2665,6 +3397,12 @@ static void reconnect_global_clients(sdata_t *sdata)
 			if (client->proxyid == proxy->id)
 				continue;
 		}
+		if (client->extranonce) {
+			if (!(moves % 64))
+				move_ids = realloc(move_ids, sizeof(int64_t) * (moves + 64));
+			move_ids[moves++] = client->id;
+			continue;
+		}
 		if (headroom-- < 1)
 			continue;
 		reconnects++;
@@ -2672,6 +3410,10 @@ static void reconnect_global_clients(sdata_t *sdata)
 	}
 	ck_runlock(&sdata->instance_lock);
 
+	if (moves) {
+		reconnects += move_clients(sdata, move_ids, moves, &headroom);
+		free(move_ids);
+	}
 	if (reconnects) {
 		LOGINFO("%d clients flagged for reconnect to global proxy %d",
 			reconnects, proxy->id);
@@ -2733,9 +3475,63 @@ static proxy_t *best_proxy(sdata_t *sdata)
 	return proxy;
 }
 
+/* Recruit enough subproxies of the standbyproxies alive global proxies
+ * following the current one for them to take all its clients should it fail.
+ * Global proxies are first in priority order. */
+static void recruit_standby(sdata_t *sdata)
+{
+	ckpool_t *ckp = sdata->ckp;
+	proxy_t *proxy, *subproxy, *tmp, *subtmp;
+	int i, standby = 0, *ids;
+	int64_t clients, *needs;
+	bool current = false;
+
+	ids = alloca(sizeof(int) * ckp->standbyproxies);
+	needs = alloca(sizeof(int64_t) * ckp->standbyproxies);
+
+	mutex_lock(&sdata->proxy_lock);
+	if (!sdata->proxy)
+		goto out_unlock;
+	clients = sdata->proxy->combined_clients;
+	HASH_ITER(hh, sdata->proxies, proxy, tmp) {
+		int64_t headroom = 0;
+
+		if (!proxy->global)
+			break;
+		if (proxy == sdata->proxy) {
+			current = true;
+			continue;
+		}
+		if (!current || !__subproxies_alive(proxy))
+			continue;
+		HASH_ITER(sh, proxy->subproxies, subproxy, subtmp) {
+			if (!subproxy->dead)
+				headroom += subproxy->max_clients - subproxy->clients;
+		}
+		/* Keep the same spare room as the current proxy keeps for new
+		 * clients */
+		if (headroom < clients + 2) {
+			ids[standby] = proxy->id;
+			needs[standby] = clients + 2 - headroom;
+		} else
+			needs[standby] = 0;
+		if (++standby >= ckp->standbyproxies)
+			break;
+	}
+out_unlock:
+	mutex_unlock(&sdata->proxy_lock);
+
+	for (i = 0; i < standby; i++) {
+		if (needs[i])
+			generator_recruit(ckp, ids[i], needs[i]);
+	}
+}
+
 static void check_globalproxies(sdata_t *sdata, proxy_t *proxy)
 {
 	check_bestproxy(sdata);
+	if (sdata->ckp->standbyproxies)
+		recruit_standby(sdata);
 	if (proxy->parent == best_proxy(sdata)->parent)
 		reconnect_global_clients(sdata);
 }
@@ -2748,11 +3544,12 @@ static void check_proxy(sdata_t *sdata, proxy_t *proxy)
 		check_userproxies(sdata, proxy, proxy->userid);
 }
 
+
 static void dead_proxyid(sdata_t *sdata, const int id, const int subid, const bool replaced, const bool deleted)
 {
+	int reconnects = 0, proxyid = 0, moves = 0;
 	stratum_instance_t *client, *tmp;
-	int reconnects = 0, proxyid = 0;
-	int64_t headroom;
+	int64_t headroom, *move_ids = NULL;
 	proxy_t *proxy;
 
 	proxy = existing_subproxy(sdata, id, subid);
@@ -2772,6 +3569,14 @@ static void dead_proxyid(sdata_t *sdata, const int id, const int subid, const bo
 	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
 		if (client->proxyid != id || client->subproxyid != subid)
 			continue;
+		/* Clients that take extranonce changes are moved in place
+		 * once we've dropped the instance_lock */
+		if (client->extranonce) {
+			if (!(moves % 64))
+				move_ids = realloc(move_ids, sizeof(int64_t) * (moves + 64));
+			move_ids[moves++] = client->id;
+			continue;
+		}
 		/* Clients could remain connected to a dead connection here
 		 * but should be picked up when we recruit enough slots after
 		 * another notify. */
@@ -2784,6 +3589,10 @@ static void dead_proxyid(sdata_t *sdata, const int id, const int subid, const bo
 	}
 	ck_runlock(&sdata->instance_lock);
 
+	if (moves) {
+		reconnects += move_clients(sdata, move_ids, moves, &headroom);
+		free(move_ids);
+	}
 	if (reconnects) {
 		LOGINFO("%d clients flagged to reconnect from dead proxy %d:%d", reconnects,
 			id, subid);
@@ -3009,6 +3818,7 @@ static void update_notify(ckpool_t *ckp, const char *cmd)
 	wb->coinb1 = ckalloc(wb->coinb1len * 2 + 1);
 	json_strcpy(wb->coinb1, val, "coinbase1");
 	hex2bin(wb->coinb1bin, wb->coinb1, wb->coinb1len);
+	sha256_midstate(&wb->coinb1ctx, wb->coinb1bin, wb->coinb1len);
 	wb->height = get_sernumber(wb->coinb1bin + 42);
 	json_strdup(&wb->coinb2, val, "coinbase2");
 	wb->coinb2len = strlen(wb->coinb2) / 2;
@@ -3152,20 +3962,22 @@ static void free_proxy(proxy_t *proxy)
 
 	/* Delete any shares in the proxy's hashtable. */
 	if (dsdata) {
-		share_t *share, *tmpshare;
+		share_table_t *table, *tmptable;
 		workbase_t *wb, *tmpwb;
 
-		mutex_lock(&dsdata->share_lock);
-		HASH_ITER(hh, dsdata->shares, share, tmpshare) {
-			HASH_DEL(dsdata->shares, share);
-			dealloc(share);
+		ck_wlock(&dsdata->share_lock);
+		HASH_ITER(hh, dsdata->share_tables, table, tmptable) {
+			HASH_DEL(dsdata->share_tables, table);
+			free_share_table(table);
 		}
-		mutex_unlock(&dsdata->share_lock);
+		ck_wunlock(&dsdata->share_lock);
 
 		/* Do we need to check readcount here if freeing the proxy? */
 		ck_wlock(&dsdata->workbase_lock);
 		HASH_ITER(hh, dsdata->workbases, wb, tmpwb) {
 			HASH_DEL(dsdata->workbases, wb);
+			if (dsdata->ckp->logshares)
+				close_sharelog(dsdata, wb->id);
 			clear_workbase(wb);
 		}
 		ck_wunlock(&dsdata->workbase_lock);
@@ -3359,6 +4171,7 @@ static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, con
 
 	client->start_time = time(NULL);
 	client->id = id;
+	client->midstate_id = -1;
 	client->session_id = ++sdata->session_id;
 	strcpy(client->address, address);
 	/* Sanity check to not overflow lookup in ckp->serverurl[] */
@@ -3446,14 +4259,18 @@ static void connector_test_client(ckpool_t *ckp, const int64_t id)
 
 /* For creating a list of sends without locking that can then be concatenated
  * to the stratum_sends list. Minimises locking and avoids taking recursive
- * locks. Sends only to sdata bound clients (everyone in ckpool) */
+ * locks. Sends only to sdata bound clients (everyone in ckpool). The message
+ * is serialised once for all directly connected clients while passthrough
+ * subclients get their own copy. */
 static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 {
 	ckpool_t *ckp = sdata->ckp;
 	sdata_t *ckp_sdata = ckp->sdata;
 	stratum_instance_t *client, *tmp;
+	int messages = 0, clients = 0;
 	ckmsg_t *bulk_send = NULL;
-	int messages = 0;
+	int64_t *client_ids;
+	char *buf;
 
 	if (unlikely(!val)) {
 		LOGERR("Sent null json to stratum_broadcast");
@@ -3465,7 +4282,10 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 		return;
 	}
 
+	buf = json_dumps(val, JSON_EOL | JSON_COMPACT);
+
 	ck_rlock(&ckp_sdata->instance_lock);
+	client_ids = ckalloc(sizeof(int64_t) * (HASH_COUNT(ckp_sdata->stratum_instances) + 1));
 	HASH_ITER(hh, ckp_sdata->stratum_instances, client, tmp) {
 		ckmsg_t *client_msg;
 		smsg_t *msg;
@@ -3480,10 +4300,14 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 		if (msg_type == SM_MSG && !client->messages)
 			continue;
 
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
-		if (subclient(client->id))
-			json_set_string(val, "node.method", stratum_msgs[msg_type]);
+		if (!subclient(client->id)) {
+			client_ids[clients++] = client->id;
+			continue;
+		}
+
+		client_msg = slab_alloc(ckp->ckmsg_slab);
+		msg = slab_zalloc(sdata->smsg_slab);
+		json_set_string(val, "node.method", stratum_msgs[msg_type]);
 		msg->json_msg = json_deep_copy(val);
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -3494,10 +4318,26 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 
 	json_decref(val);
 
+	if (likely(clients && buf)) {
+		ckmsg_t *client_msg = slab_alloc(ckp->ckmsg_slab);
+		smsg_t *msg = slab_zalloc(sdata->smsg_slab);
+
+		msg->buf = buf;
+		msg->client_ids = client_ids;
+		msg->clients = clients;
+		client_msg->data = msg;
+		DL_PREPEND(bulk_send, client_msg);
+		messages++;
+	} else {
+		free(buf);
+		free(client_ids);
+	}
+
 	if (likely(bulk_send))
 		ssend_bulk_append(sdata, bulk_send, messages);
 }
 
+/* Takes ownership of val, passing it on to the connector to free once sent */
 static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_id,
 			     const int msg_type)
 {
@@ -3526,13 +4366,13 @@ static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_i
 		dec_instance_ref(sdata, remote);
 	}
 	LOGDEBUG("Sending stratum message %s", stratum_msgs[msg_type]);
-	msg = ckzalloc(sizeof(smsg_t));
+	msg = slab_zalloc(sdata->smsg_slab);
 	msg->json_msg = val;
 	msg->client_id = client_id;
 	if (likely(ckmsgq_add(sdata->ssends, msg)))
 		return;
 	json_decref(msg->json_msg);
-	free(msg);
+	slab_free(sdata->smsg_slab, msg);
 }
 
 static void drop_client(ckpool_t *ckp, sdata_t *sdata, const int64_t id)
@@ -3724,8 +4564,10 @@ static void block_solve(ckpool_t *ckp, json_t *val)
 	int height = 0;
 	ts_t ts_now;
 
-	if (!ckp->node)
+	if (!ckp->node) {
+		block_changed(sdata, "");
 		update_base(sdata, GEN_PRIORITY);
+	}
 
 	ts_realtime(&ts_now);
 	sprintf(cdfield, "%lu,%lu", ts_now.tv_sec, ts_now.tv_nsec);
@@ -3803,25 +4645,33 @@ static void broadcast_ping(sdata_t *sdata)
 	stratum_broadcast(sdata, json_msg, SM_PING);
 }
 
-static void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val)
+/* Stats summed over all the shards of a sharded queue */
+static void ckmsgq_shards_stats(ckmsgq_t **ckmsgqs, const int shards, const int size, json_t **val)
 {
-	int objects, generated;
+	int objects = 0, generated = 0, i;
 	int64_t memsize;
-	ckmsg_t *msg;
 
-	mutex_lock(ckmsgq->lock);
-	DL_COUNT(ckmsgq->msgs, msg, objects);
-	generated = ckmsgq->messages;
-	mutex_unlock(ckmsgq->lock);
+	for (i = 0; i < shards; i++) {
+		objects += ckmsgq_count(ckmsgqs[i]);
+		generated += ckmsgqs[i]->messages;
+	}
 
-	memsize = (sizeof(ckmsg_t) + size) * objects;
+	memsize = sizeof(ckmsgq_cell_t) * CKMSGQ_RING * shards + size * objects;
 	JSON_CPACK(*val, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 }
 
+static void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val)
+{
+	ckmsgq_shards_stats(&ckmsgq, 1, size, val);
+}
+
 char *stratifier_stats(ckpool_t *ckp, void *data)
 {
 	json_t *val = json_object(), *subval;
-	int objects, generated;
+	share_table_t *table, *tmptable;
+	int objects, generated, i;
+	txntable_t *txn, *tmptxn;
+	workbase_t *wb, *tmpwb;
 	sdata_t *sdata = data;
 	int64_t memsize;
 	char *buf;
@@ -3829,6 +4679,9 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	ck_rlock(&sdata->workbase_lock);
 	objects = HASH_COUNT(sdata->workbases);
 	memsize = SAFE_HASH_OVERHEAD(sdata->workbases) + sizeof(workbase_t) * objects;
+	/* Transaction hashes and references to the transaction table */
+	HASH_ITER(hh, sdata->workbases, wb, tmpwb)
+		memsize += wb->txns * (65 + sizeof(txntable_t *));
 	generated = sdata->workbases_generated;
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_steal_object(val, "workbases", subval);
@@ -3839,6 +4692,26 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	JSON_CPACK(subval, "{si,si}", "count", objects, "memory", memsize);
 	json_steal_object(val, "remote_workbases", subval);
 
+	memsize = sdata->txid_tree.dirtysize + sdata->wtxid_tree.dirtysize;
+	for (i = 0; i < MERKLE_LEVELS; i++)
+		memsize += (sdata->txid_tree.size[i] + sdata->wtxid_tree.size[i]) * 32;
+	JSON_CPACK(subval, "{si,sI,sI}", "memory", memsize,
+		   "nodes", sdata->txid_tree.nodes + sdata->wtxid_tree.nodes,
+		   "rehashed", sdata->txid_tree.rehashed + sdata->wtxid_tree.rehashed);
+	json_steal_object(val, "merkle_trees", subval);
+
+	/* Times of each step of generating workbases in ms */
+	subval = json_object();
+	for (i = 0; i < (int)STEP_COUNT; i++) {
+		steptime_t *st = &sdata->step_times[i];
+		json_t *stepval;
+
+		JSON_CPACK(stepval, "{sI,sf,sf,sf}", "count", st->count, "last", st->last,
+			   "avg", st->count ? st->total / st->count : 0.0, "max", st->max);
+		json_steal_object(subval, step_names[i], stepval);
+	}
+	json_steal_object(val, "workbase_times", subval);
+
 	ck_rlock(&sdata->instance_lock);
 	objects = HASH_COUNT(sdata->user_instances);
 	memsize = SAFE_HASH_OVERHEAD(sdata->user_instances) + sizeof(stratum_instance_t) * objects;
@@ -3859,11 +4732,22 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	json_steal_object(val, "disconnected", subval);
 	ck_runlock(&sdata->instance_lock);
 
-	mutex_lock(&sdata->share_lock);
+	objects = 0;
+	ck_rlock(&sdata->share_lock);
 	generated = sdata->shares_generated;
-	objects = HASH_COUNT(sdata->shares);
-	memsize = SAFE_HASH_OVERHEAD(sdata->shares) + sizeof(share_t) * objects;
-	mutex_unlock(&sdata->share_lock);
+	memsize = SAFE_HASH_OVERHEAD(sdata->share_tables);
+	memsize += sizeof(share_table_t) * HASH_COUNT(sdata->share_tables);
+	HASH_ITER(hh, sdata->share_tables, table, tmptable) {
+		for (i = 0; i < SHARE_SHARDS; i++) {
+			share_shard_t *shard = &table->shards[i];
+
+			mutex_lock(&shard->lock);
+			objects += shard->count;
+			memsize += shard->size * 32;
+			mutex_unlock(&shard->lock);
+		}
+	}
+	ck_runlock(&sdata->share_lock);
 
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_steal_object(val, "shares", subval);
@@ -3871,6 +4755,8 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	ck_rlock(&sdata->txn_lock);
 	objects = HASH_COUNT(sdata->txns);
 	memsize = SAFE_HASH_OVERHEAD(sdata->txns) + sizeof(txntable_t) * objects;
+	HASH_ITER(hh, sdata->txns, txn, tmptxn)
+		memsize += txn->len;
 	generated = sdata->txns_generated;
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_steal_object(val, "transactions", subval);
@@ -3878,16 +4764,40 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 
 	ckmsgq_stats(sdata->ssends, sizeof(smsg_t), &subval);
 	json_steal_object(val, "ssends", subval);
-	/* Don't know exactly how big the string is so just count the pointer for now */
-	ckmsgq_stats(sdata->srecvs, sizeof(char *), &subval);
+	ckmsgq_shards_stats(sdata->srecvs, sdata->srecv_shards, sizeof(smsg_t), &subval);
 	json_steal_object(val, "srecvs", subval);
+	ckmsgq_stats(sdata->sshareq, sizeof(json_params_t), &subval);
+	json_set_int64(subval, "batches", sdata->share_batches);
+	json_set_int64(subval, "batched", sdata->batched_shares);
+	json_set_int64(subval, "midstate_blocks", sdata->midstate_blocks);
+	json_steal_object(val, "sshareq", subval);
+	if (ckp->logshares) {
+		ckmsgq_stats(sdata->sharelogq, sizeof(sharelog_msg_t), &subval);
+		json_steal_object(val, "sharelogq", subval);
+	}
 	if (!CKP_STANDALONE(ckp)) {
 		ckmsgq_stats(sdata->ckdbq, sizeof(char *), &subval);
+		mutex_lock(&sdata->ckdbchan_lock);
+		json_set_int64(subval, "frames", sdata->ckdb_frames_sent);
+		json_set_int64(subval, "resent", sdata->ckdb_frames_resent);
+		json_set_int64(subval, "batched", sdata->ckdb_batched);
+		json_set_int(subval, "inflight", sdata->ckdb_inflight);
+		mutex_unlock(&sdata->ckdbchan_lock);
 		json_steal_object(val, "ckdbq", subval);
+		ckmsgq_stats(sdata->ckdblogq, sizeof(char *), &subval);
+		json_steal_object(val, "ckdblogq", subval);
 	}
 	ckmsgq_stats(sdata->stxnq, sizeof(json_params_t), &subval);
 	json_steal_object(val, "stxnq", subval);
 
+	subval = json_object();
+	json_object_set_new_nocheck(subval, "jsonarena", json_arena_stats());
+	json_object_set_new_nocheck(subval, sdata->smsg_slab->name, slab_stats(sdata->smsg_slab));
+	json_object_set_new_nocheck(subval, sdata->jp_slab->name, slab_stats(sdata->jp_slab));
+	json_object_set_new_nocheck(subval, ckp->ckmsg_slab->name, slab_stats(ckp->ckmsg_slab));
+	json_object_set_new_nocheck(subval, ckp->submit_slab->name, slab_stats(ckp->submit_slab));
+	json_steal_object(val, "slabs", subval);
+
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
 	LOGNOTICE("Stratifier stats: %s", buf);
@@ -4465,18 +5375,13 @@ static void ckdbq_flush(sdata_t *sdata)
 {
 	ckmsgq_t *ckdbq = sdata->ckdbq;
 	int flushed = 0;
+	void *data;
 
-	mutex_lock(ckdbq->lock);
-	while (ckdbq->msgs) {
-		ckmsg_t *msg = ckdbq->msgs;
-
-		DL_DELETE(ckdbq->msgs, msg);
-		free(msg->data);
-		free(msg);
-		ckdbq->messages--;
+	while (ckmsgq_pop(ckdbq, &data, 1)) {
+		free(data);
+		__sync_sub_and_fetch(&ckdbq->messages, 1);
 		flushed++;
 	}
-	mutex_unlock(ckdbq->lock);
 
 	LOGWARNING("Flushed %d messages from ckdb queue", flushed);
 }
@@ -4520,7 +5425,7 @@ retry:
 
 		/* This is a message for a node */
 		if (likely(val))
-			ckmsgq_add(sdata->srecvs, val);
+			stratifier_add_recv(ckp, val);
 		goto retry;
 	}
 	if (cmdmatch(buf, "ping")) {
@@ -4600,6 +5505,7 @@ retry:
 
 	LOGDEBUG("Stratifier received request: %s", buf);
 	if (cmdmatch(buf, "update")) {
+		block_changed(sdata, "");
 		update_base(sdata, GEN_PRIORITY);
 	} else if (cmdmatch(buf, "subscribe")) {
 		/* Proxifier has a new subscription */
@@ -4642,28 +5548,69 @@ retry:
 	goto retry;
 }
 
+typedef struct blockwatch {
+	ckpool_t *ckp;
+	int server;
+} blockwatch_t;
+
+/* Keeps a getblocktemplate long poll outstanding on one server when enabled,
+ * falling back to polling getbestblockhash every blockpoll ms whenever a long
+ * poll fails. One runs per server and the first to see a new block wins. */
 static void *blockupdate(void *arg)
 {
-	ckpool_t *ckp = (ckpool_t *)arg;
+	blockwatch_t *bw = (blockwatch_t *)arg;
+	char hash[68], longpollid[LONGPOLLID_LEN];
+	ckpool_t *ckp = bw->ckp;
+	int server = bw->server;
 	sdata_t *sdata = ckp->sdata;
-	char hash[68];
+	char name[16];
 
 	pthread_detach(pthread_self());
-	rename_proc("blockupdate");
+	free(bw);
+	snprintf(name, 16, "blockupdate%d", server);
+	rename_proc(name);
 
+	longpollid[0] = '\0';
 	while (42) {
+		bool longpoll = ckp->longpoll, primed = longpollid[0];
+		workbase_t *wb = NULL;
+		tv_t start, end;
 		int ret;
 
-		ret = generator_getbest(ckp, hash);
+		tv_time(&start);
+		if (longpoll) {
+			ret = generator_longpoll(ckp, server, longpollid, hash, &wb);
+			if (ret == GETBEST_FAILED) {
+				longpollid[0] = '\0';
+				longpoll = false;
+				ret = generator_getbest(ckp, server, hash);
+			}
+		} else
+			ret = generator_getbest(ckp, server, hash);
 		switch (ret) {
 			case GETBEST_NOTIFY:
 				cksleep_ms(5000);
 				break;
 			case GETBEST_SUCCESS:
-				if (strcmp(hash, sdata->lastswaphash)) {
-					update_base(sdata, GEN_PRIORITY);
+				/* A long poll's template on a new block is used
+				 * as is instead of being requested again */
+				if (generator_blockrace(ckp, server, hash) &&
+				    strcmp(hash, sdata->lastswaphash)) {
+					block_changed(sdata, hash);
+					queue_update_base(sdata, GEN_PRIORITY, wb);
 					break;
 				}
+				if (wb)
+					clear_workbase(wb);
+				/* A long poll with no change only needs reissuing
+				 * unless it returned too soon to be a real one. The
+				 * first one without a longpollid always returns at
+				 * once with the id to wait on. */
+				if (longpoll) {
+					tv_time(&end);
+					if (!primed || ms_tvdiff(&end, &start) >= ckp->blockpoll)
+						break;
+				}
 			case GETBEST_FAILED:
 			default:
 				cksleep_ms(ckp->blockpoll);
@@ -4803,6 +5750,8 @@ static sdata_t *select_sdata(ckpool_t *ckp, sdata_t *ckp_sdata, const int userid
 	if (!userid) {
 		if (best->id != global->id || current_headroom(ckp_sdata, &proxy) < 2)
 			generator_recruit(ckp, global->id, 1);
+		if (ckp->standbyproxies)
+			recruit_standby(ckp_sdata);
 	} else {
 		if (best_userproxy_headroom(ckp_sdata, userid) < 2)
 			generator_recruit(ckp, best->id, 1);
@@ -4810,6 +5759,94 @@ static sdata_t *select_sdata(ckpool_t *ckp, sdata_t *ckp_sdata, const int userid
 	return best->sdata;
 }
 
+static void stratum_send_update(sdata_t *sdata, const int64_t client_id, const bool clean);
+
+/* Move a client that subscribed to extranonce changes off a dead proxy to the
+ * best alive one in place, giving it a new enonce1 and the new proxy's work
+ * instead of asking it to reconnect. Only done where the new proxy leaves it
+ * the same nonce2 length. Needs to be entered with client holding a ref
+ * count. */
+static bool move_client(sdata_t *ckp_sdata, stratum_instance_t *client)
+{
+	proxy_t *old = client->proxy, *proxy;
+	ckpool_t *ckp = client->ckp;
+	uint64_t enonce1;
+	json_t *json_msg;
+	sdata_t *sdata;
+	int n2len;
+
+	if (unlikely(!old))
+		return false;
+	sdata = select_sdata(ckp, ckp_sdata, old->userid);
+	if (!sdata || !sdata->current_workbase)
+		return false;
+	proxy = sdata->subproxy;
+	if (proxy == old || proxy->enonce2varlen != old->enonce2varlen)
+		return false;
+
+	ck_wlock(&ckp_sdata->instance_lock);
+	if (unlikely(proxy->clients >= proxy->max_clients)) {
+		ck_wunlock(&ckp_sdata->instance_lock);
+		return false;
+	}
+	enonce1 = le64toh(ckp_sdata->enonce1_64);
+	enonce1++;
+	client->enonce1_64 = ckp_sdata->enonce1_64 = htole64(enonce1);
+	old->bound_clients--;
+	old->parent->combined_clients--;
+	client->proxy = proxy;
+	client->proxyid = proxy->id;
+	client->subproxyid = proxy->subid;
+	proxy->clients++;
+	proxy->bound_clients++;
+	proxy->parent->combined_clients++;
+	client->sdata = sdata;
+	client->midstate_id = -1;
+	client->reconnect = false;
+	ck_wunlock(&ckp_sdata->instance_lock);
+
+	ck_rlock(&sdata->workbase_lock);
+	__fill_enonce1data(sdata->current_workbase, client);
+	n2len = sdata->current_workbase->enonce2varlen;
+	ck_runlock(&sdata->workbase_lock);
+
+	LOGINFO("Moved client %s to proxy %d:%d with enonce1 %s", client->identity,
+		proxy->id, proxy->subid, client->enonce1);
+	JSON_CPACK(json_msg, "{sosss[si]}", "id", json_null(), "method", "mining.set_extranonce",
+		   "params", client->enonce1, n2len);
+	stratum_add_send(sdata, json_msg, client->id, SM_UPDATE);
+	stratum_send_update(sdata, client->id, true);
+	return true;
+}
+
+/* Move the clients of a dead proxy that subscribed to extranonce changes,
+ * reconnecting those that can't be moved within the headroom available.
+ * Returns the number of clients asked to reconnect. */
+static int move_clients(sdata_t *sdata, const int64_t *ids, const int moves, int64_t *headroom)
+{
+	stratum_instance_t *client;
+	int i, moved = 0, reconnects = 0;
+
+	for (i = 0; i < moves; i++) {
+		client = ref_instance_by_id(sdata, ids[i]);
+		if (!client)
+			continue;
+		if (move_client(sdata, client)) {
+			moved++;
+			(*headroom)--;
+		} else if ((*headroom)-- < 1)
+			client->reconnect = true;
+		else {
+			reconnects++;
+			reconnect_client(sdata, client);
+		}
+		dec_instance_ref(sdata, client);
+	}
+	if (moved)
+		LOGNOTICE("Moved %d clients to another proxy without reconnecting", moved);
+	return reconnects;
+}
+
 static int int_from_sessionid(const char *sessionid)
 {
 	int ret = 0, slen;
@@ -5938,9 +6975,33 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 
 }
 
+/* The sha256 state after the complete blocks of a client's coinb1 and enonce1
+ * for this workbase, resumed from the workbase's coinb1 midstate and cached on
+ * the client for its last workbase. Only shares starting from the cached state
+ * count towards the blocks skipped. Need to hold workbase read count */
+static const sha256_ctx *client_midstate(stratum_instance_t *client, const workbase_t *wb)
+{
+	int len = wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen;
+	sdata_t *sdata = client->sdata;
+	uchar *prefix;
+
+	if (client->midstate_id != wb->id) {
+		prefix = alloca(len);
+		memcpy(prefix, wb->coinb1bin, wb->coinb1len);
+		memcpy(prefix + wb->coinb1len, client->enonce1bin, len - wb->coinb1len);
+		client->midstate = wb->coinb1ctx;
+		sha256_update(&client->midstate, prefix + wb->coinb1ctx.tot_len,
+			      (len & ~(SHA256_BLOCK_SIZE - 1)) - wb->coinb1ctx.tot_len);
+		client->midstate_id = wb->id;
+	} else
+		sdata->midstate_blocks += client->midstate.tot_len / SHA256_BLOCK_SIZE;
+	return &client->midstate;
+}
+
 /* Needs to be entered with workbase readcount and client holding a ref count. */
-static double submission_diff(const stratum_instance_t *client, const workbase_t *wb, const char *nonce2,
-			      const uint32_t ntime32, const char *nonce, uchar *hash, const bool stale)
+static double submission_diff(stratum_instance_t *client, const workbase_t *wb, const char *nonce2,
+			      const uint32_t ntime32, const char *nonce, uchar *hash, const bool stale,
+			      const submit_t *req)
 {
 	char *coinbase;
 	uchar swap[80];
@@ -5949,8 +7010,16 @@ static double submission_diff(const stratum_instance_t *client, const workbase_t
 
 	coinbase = ckalloc(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2len);
 
-	/* Calculate the diff of the share here */
-	ret = share_diff(coinbase, client->enonce1bin, wb, nonce2, ntime32, nonce, hash, swap, &cblen);
+	/* Calculate the diff of the share here unless it was already hashed
+	 * as part of a batch */
+	if (req->hashed && req->wb_id == wb->id) {
+		cblen = build_coinbase(coinbase, client->enonce1bin, wb, nonce2);
+		memcpy(hash, req->hash, 32);
+		memcpy(swap, req->swap, 80);
+		ret = diff_from_target(hash);
+	} else
+		ret = share_diff(coinbase, client->enonce1bin, wb, nonce2, ntime32, nonce, hash, swap,
+				 &cblen, client_midstate(client, wb));
 
 	/* Test we haven't solved a block regardless of share status */
 	test_blocksolve(client, wb, swap, hash, ret, coinbase, cblen, nonce2, nonce, ntime32, stale);
@@ -5960,26 +7029,80 @@ static double submission_diff(const stratum_instance_t *client, const workbase_t
 	return ret;
 }
 
-/* Optimised for the common case where shares are new */
-static bool new_share(sdata_t *sdata, const uchar *hash, const int64_t wb_id)
+static const uchar share_empty[32];
+
+/* Double the size of a shard, rehashing its existing hashes */
+static void __grow_share_shard(share_shard_t *shard)
 {
-	share_t *share = ckzalloc(sizeof(share_t)), *match = NULL;
-	bool ret = true;
+	int i, size = shard->size ? shard->size * 2 : SHARE_SHARD_SIZE;
+	uchar (*hashes)[32] = ckzalloc(size * 32);
+	const uint32_t mask = size - 1;
 
-	memcpy(share->hash, hash, 32);
-	share->workbase_id = wb_id;
+	for (i = 0; i < shard->size; i++) {
+		uint32_t slot;
+
+		if (!memcmp(shard->hashes[i], share_empty, 32))
+			continue;
+		memcpy(&slot, shard->hashes[i], 4);
+		slot &= mask;
+		while (memcmp(hashes[slot], share_empty, 32))
+			slot = (slot + 1) & mask;
+		memcpy(hashes[slot], shard->hashes[i], 32);
+	}
+	free(shard->hashes);
+	shard->hashes = hashes;
+	shard->size = size;
+}
+
+/* Returns false if the hash is already in the shard */
+static bool __add_share_hash(share_shard_t *shard, const uchar *hash)
+{
+	uint32_t slot, mask;
+
+	if (unlikely(shard->count * 2 >= shard->size))
+		__grow_share_shard(shard);
+	mask = shard->size - 1;
+	/* The low bytes of a share hash are effectively random */
+	memcpy(&slot, hash, 4);
+	slot &= mask;
+	while (memcmp(shard->hashes[slot], share_empty, 32)) {
+		if (!memcmp(shard->hashes[slot], hash, 32))
+			return false;
+		slot = (slot + 1) & mask;
+	}
+	memcpy(shard->hashes[slot], hash, 32);
+	shard->count++;
+	return true;
+}
 
-	mutex_lock(&sdata->share_lock);
-	sdata->shares_generated++;
-	HASH_FIND(hh, sdata->shares, hash, 32, match);
-	if (likely(!match))
-		HASH_ADD(hh, sdata->shares, hash, 32, share);
-	mutex_unlock(&sdata->share_lock);
+/* Optimised for the common case where shares are new and the workbase
+ * already has a share table */
+static bool new_share(sdata_t *sdata, const uchar *hash, const int64_t wb_id)
+{
+	share_table_t *table;
+	share_shard_t *shard;
+	bool ret;
 
-	if (unlikely(match)) {
-		dealloc(share);
-		ret = false;
+	__sync_add_and_fetch(&sdata->shares_generated, 1);
+
+	ck_rlock(&sdata->share_lock);
+	HASH_FIND_I64(sdata->share_tables, &wb_id, table);
+	if (unlikely(!table)) {
+		ck_runlock(&sdata->share_lock);
+		ck_wlock(&sdata->share_lock);
+		HASH_FIND_I64(sdata->share_tables, &wb_id, table);
+		if (!table) {
+			table = new_share_table(wb_id);
+			HASH_ADD_I64(sdata->share_tables, workbase_id, table);
+		}
+		ck_dwlock(&sdata->share_lock);
 	}
+	shard = &table->shards[hash[4] % SHARE_SHARDS];
+	mutex_lock(&shard->lock);
+	ret = __add_share_hash(shard, hash);
+	mutex_unlock(&shard->lock);
+	ck_runlock(&sdata->share_lock);
+
 	return ret;
 }
 
@@ -6025,67 +7148,79 @@ static void check_best_diff(ckpool_t *ckp, sdata_t *sdata, user_instance_t *user
 
 /* Needs to be entered with client holding a ref count. */
 static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
-			    const json_t *params_val, json_t **err_val)
+			    const json_t *params_val, const submit_t *req, json_t **err_val)
 {
 	bool share = false, result = false, invalid = true, submit = false, stale = false;
 	double diff = client->diff, wdiff = 0, sdiff = -1;
 	char hexhash[68] = {}, sharehash[32], cdfield[64];
 	const char *workername, *job_id, *ntime, *nonce;
 	user_instance_t *user = client->user_instance;
-	char *fname = NULL, *s, *nonce2;
+	char *fname = NULL, *nonce2;
 	sdata_t *sdata = client->sdata;
 	enum share_err err = SE_NONE;
 	ckpool_t *ckp = client->ckp;
 	char idstring[20] = {};
 	workbase_t *wb = NULL;
 	uint32_t ntime32;
+	submit_t jreq;
 	uchar hash[32];
 	int nlen, len;
 	time_t now_t;
 	json_t *val;
 	int64_t id;
 	ts_t now;
-	FILE *fp;
 
 	ts_realtime(&now);
 	now_t = now.tv_sec;
 	sprintf(cdfield, "%lu,%lu", now.tv_sec, now.tv_nsec);
 
-	if (unlikely(!json_is_array(params_val))) {
-		err = SE_NOT_ARRAY;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	if (unlikely(json_array_size(params_val) < 5)) {
-		err = SE_INVALID_SIZE;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	workername = json_string_value(json_array_get(params_val, 0));
+	/* Submits not scanned by the connector have their fields extracted
+	 * from the json params */
+	if (!req) {
+		if (unlikely(!json_is_array(params_val))) {
+			err = SE_NOT_ARRAY;
+			*err_val = JSON_ERR(err);
+			goto out;
+		}
+		if (unlikely(json_array_size(params_val) < 5)) {
+			err = SE_INVALID_SIZE;
+			*err_val = JSON_ERR(err);
+			goto out;
+		}
+		jreq.workername = json_string_value(json_array_get(params_val, 0));
+		jreq.job_id = json_string_value(json_array_get(params_val, 1));
+		jreq.nonce2 = json_string_value(json_array_get(params_val, 2));
+		jreq.ntime = json_string_value(json_array_get(params_val, 3));
+		jreq.nonce = json_string_value(json_array_get(params_val, 4));
+		jreq.version_mask = json_string_value(json_array_get(params_val, 5));
+		jreq.hashed = false;
+		req = &jreq;
+	}
+	workername = req->workername;
 	if (unlikely(!workername || !strlen(workername))) {
 		err = SE_NO_USERNAME;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	job_id = json_string_value(json_array_get(params_val, 1));
+	job_id = req->job_id;
 	if (unlikely(!job_id || !strlen(job_id))) {
 		err = SE_NO_JOBID;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	nonce2 = (char *)json_string_value(json_array_get(params_val, 2));
+	nonce2 = (char *)req->nonce2;
 	if (unlikely(!nonce2 || !strlen(nonce2) || !validhex(nonce2))) {
 		err = SE_NO_NONCE2;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	ntime = json_string_value(json_array_get(params_val, 3));
+	ntime = req->ntime;
 	if (unlikely(!ntime || !strlen(ntime) || !validhex(ntime))) {
 		err = SE_NO_NTIME;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	nonce = json_string_value(json_array_get(params_val, 4));
+	nonce = req->nonce;
 	if (unlikely(!nonce || !strlen(nonce) || !validhex(nonce))) {
 		err = SE_NO_NONCE;
 		*err_val = JSON_ERR(err);
@@ -6110,14 +7245,15 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 		err = SE_INVALID_JOBID;
 		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
 		strncpy(idstring, job_id, 19);
-		ASPRINTF(&fname, "%s.sharelog", sdata->current_workbase->logdir);
+		ASPRINTF(&fname, "%s.%s", sdata->current_workbase->logdir,
+			 ckp->sharelogbinary ? "sharebin" : "sharelog");
 		goto out_nowb;
 	}
 	wdiff = wb->diff;
 	strncpy(idstring, wb->idstring, 19);
-	ASPRINTF(&fname, "%s.sharelog", wb->logdir);
+	ASPRINTF(&fname, "%s.%s", wb->logdir, ckp->sharelogbinary ? "sharebin" : "sharelog");
 	/* Fix broken clients sending too many chars. Nonce2 is part of the
-	 * read only json so use a temporary variable and modify it. */
+	 * read only submit so use a temporary variable and modify it. */
 	len = wb->enonce2varlen * 2;
 	nlen = strlen(nonce2);
 	if (nlen > len) {
@@ -6132,7 +7268,7 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 	}
 	if (id < sdata->blockchange_id)
 		stale = true;
-	sdiff = submission_diff(client, wb, nonce2, ntime32, nonce, hash, stale);
+	sdiff = submission_diff(client, wb, nonce2, ntime32, nonce, hash, stale, req);
 	if (sdiff > client->best_diff) {
 		worker_instance_t *worker = client->worker_instance;
 
@@ -6246,17 +7382,16 @@ out_nowb:
         json_set_string(val, "agent", client->useragent);
 
 	if (ckp->logshares) {
-		fp = fopen(fname, "ae");
-		if (likely(fp)) {
-			s = json_dumps(val, JSON_EOL);
-			len = strlen(s);
-			len = fprintf(fp, "%s", s);
-			free(s);
-			fclose(fp);
-			if (unlikely(len < 0))
-				LOGERR("Failed to fwrite to %s", fname);
-		} else
-			LOGERR("Failed to fopen %s", fname);
+		char *buf;
+
+		if (ckp->sharelogbinary)
+			buf = sharelog_bin(val, &now, &len);
+		else {
+			buf = json_dumps(val, JSON_EOL);
+			len = strlen(buf);
+		}
+		add_sharelog(sdata, id, fname, buf, len);
+		fname = NULL;
 	}
 	if (ckp->remote)
 		upstream_json_msgtype(ckp, val, SM_SHARE);
@@ -6390,10 +7525,10 @@ static void update_client(const stratum_instance_t *client, const int64_t client
 }
 
 static json_params_t
-*create_json_params(const int64_t client_id, const json_t *method, const json_t *params,
-		    const json_t *id_val)
+*create_json_params(sdata_t *sdata, const int64_t client_id, const json_t *method,
+		    const json_t *params, const json_t *id_val)
 {
-	json_params_t *jp = ckalloc(sizeof(json_params_t));
+	json_params_t *jp = slab_zalloc(sdata->jp_slab);
 
 	jp->method = json_deep_copy(method);
 	jp->params = json_deep_copy(params);
@@ -6448,17 +7583,15 @@ static void init_client(const stratum_instance_t *client, const int64_t client_i
  * current ones to it. */
 static void send_node_all_txns(sdata_t *sdata, const stratum_instance_t *client)
 {
-	json_t *txn_array, *val, *txn_val;
+	json_t *txn_array, *val;
 	txntable_t *txn, *tmp;
 	smsg_t *msg;
 
 	txn_array = json_array();
 
 	ck_rlock(&sdata->txn_lock);
-	HASH_ITER(hh, sdata->txns, txn, tmp) {
-		JSON_CPACK(txn_val, "{ss,ss}", "hash", txn->hash, "data", txn->data);
-		json_array_append_new(txn_array, txn_val);
-	}
+	HASH_ITER(hh, sdata->txns, txn, tmp)
+		json_array_append_new(txn_array, txn_json(txn));
 	ck_runlock(&sdata->txn_lock);
 
 	if (client->trusted) {
@@ -6468,7 +7601,7 @@ static void send_node_all_txns(sdata_t *sdata, const stratum_instance_t *client)
 		JSON_CPACK(val, "{ss,so}", "node.method", stratum_msgs[SM_TRANSACTIONS],
 			   "transaction", txn_array);
 	}
-	msg = ckzalloc(sizeof(smsg_t));
+	msg = slab_zalloc(sdata->smsg_slab);
 	msg->json_msg = val;
 	msg->client_id = client->id;
 	ckmsgq_add(sdata->ssends, msg);
@@ -6533,7 +7666,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	 * most common messages will be shares so look for those first */
 	method = json_string_value(method_val);
 	if (likely(cmdmatch(method, "mining.submit") && client->authorised)) {
-		json_params_t *jp = create_json_params(client_id, method_val, params_val, id_val);
+		json_params_t *jp = create_json_params(sdata, client_id, method_val, params_val, id_val);
 
 		ckmsgq_add(sdata->sshareq, jp);
 		return;
@@ -6637,7 +7770,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 				  client->identity, client->address);
 			return;
 		}
-		jp = create_json_params(client_id, method_val, params_val, id_val);
+		jp = create_json_params(sdata, client_id, method_val, params_val, id_val);
 		ckmsgq_add(sdata->sauthq, jp);
 		return;
 	}
@@ -6651,6 +7784,18 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 		return;
 	}
 
+	/* Usually sent before authorising. Only proxy mode ever changes a
+	 * client's enonce1 */
+	if (cmdmatch(method, "mining.extranonce.subscribe")) {
+		json_t *val;
+
+		client->extranonce = ckp->proxy && !ckp->passthrough;
+		JSON_CPACK(val, "{sbsOso}", "result", client->extranonce,
+			   "id", id_val, "error", json_null());
+		stratum_add_send(sdata, val, client_id, SM_SUBSCRIBERESULT);
+		return;
+	}
+
 	/* We should only accept authorised requests from here on */
 	if (!client->authorised) {
 		LOGINFO("Dropping %s from unauthorised client %s %s", method,
@@ -6665,7 +7810,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 
 	/* Covers both get_transactions and get_txnhashes */
 	if (cmdmatch(method, "mining.get")) {
-		json_params_t *jp = create_json_params(client_id, method_val, params_val, id_val);
+		json_params_t *jp = create_json_params(sdata, client_id, method_val, params_val, id_val);
 
 		ckmsgq_add(sdata->stxnq, jp);
 		return;
@@ -6676,10 +7821,12 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	return;
 }
 
-static void free_smsg(smsg_t *msg)
+static void free_smsg(sdata_t *sdata, smsg_t *msg)
 {
 	json_decref(msg->json_msg);
-	free(msg);
+	if (msg->submit)
+		slab_free(sdata->ckp->submit_slab, msg->submit);
+	slab_free(sdata->smsg_slab, msg);
 }
 
 /* Even though we check the results locally in node mode, check the upstream
@@ -7009,7 +8156,7 @@ static void parse_remote_auth(ckpool_t *ckp, sdata_t *sdata, json_t *val, stratu
 	id_val = json_object_get(val, "id");
 	method = json_object_get(val, "method");
 	params = json_object_get(val, "params");
-	jp = create_json_params(client_id, method, params, id_val);
+	jp = create_json_params(sdata, client_id, method, params, id_val);
 
 	/* This is almost certainly the first time we'll see this client_id so
 	 * create a new stratum instance temporarily just for auth with a plan
@@ -7168,7 +8315,7 @@ static void add_node_txns(ckpool_t *ckp, sdata_t *sdata, const json_t *val)
 			continue;
 		}
 
-		if (add_txn(ckp, sdata, &txns, hash, data, false))
+		if (add_txn(ckp, sdata, &txns, hash, data))
 			added++;
 	}
 
@@ -7190,15 +8337,12 @@ static json_t *get_hash_transactions(sdata_t *sdata, const json_t *hashes)
 	ck_rlock(&sdata->txn_lock);
 	json_array_foreach(hashes, index, arr_val) {
 		const char *hash = json_string_value(arr_val);
-		json_t *txn_val;
 		txntable_t *txn;
 
 		HASH_FIND_STR(sdata->txns, hash, txn);
 		if (!txn)
 			continue;
-		JSON_CPACK(txn_val, "{ss,ss}",
-			   "hash", hash, "data", txn->data);
-		json_array_append_new(txn_array, txn_val);
+		json_array_append_new(txn_array, txn_json(txn));
 		found++;
 	}
 	ck_runlock(&sdata->txn_lock);
@@ -7317,7 +8461,7 @@ static void node_client_msg(ckpool_t *ckp, json_t *val, stratum_instance_t *clie
 	res_val = json_object_get(val, "result");
 	switch (msg_type) {
 		case SM_SHARE:
-			jp = create_json_params(client->id, method, params, id_val);
+			jp = create_json_params(sdata, client->id, method, params, id_val);
 			ckmsgq_add(sdata->sshareq, jp);
 			break;
 		case SM_SHARERESULT:
@@ -7432,22 +8576,68 @@ static void parse_instance_msg(ckpool_t *ckp, sdata_t *sdata, smsg_t *msg, strat
 	parse_method(ckp, sdata, client, client_id, id_val, method, params);
 }
 
-static void srecv_process(ckpool_t *ckp, json_t *val)
+static json_t *submit_id(const submit_t *submit)
+{
+	if (submit->id)
+		return json_string(submit->id);
+	if (submit->id_null)
+		return json_null();
+	return json_integer(submit->id_int);
+}
+
+/* The equivalent of parse_instance_msg and parse_method for a mining.submit
+ * that was scanned by the connector without being converted to json. */
+static void srecv_submit(ckpool_t *ckp, sdata_t *sdata, smsg_t *msg)
+{
+	int64_t client_id = msg->client_id;
+	stratum_instance_t *client;
+
+	/* Unknown or dropped clients can't have subscribed */
+	client = ref_instance_by_id(sdata, client_id);
+	if (unlikely(!client)) {
+		LOGINFO("Dropping mining.submit from unsubscribed client %"PRId64, client_id);
+		connector_drop_client(ckp, client_id);
+		return;
+	}
+	if (client->reject == 3) {
+		LOGINFO("Dropping client %s %s tagged for lazy invalidation",
+			client->identity, client->address);
+		connector_drop_client(ckp, client_id);
+	} else if (likely(client->authorised)) {
+		json_params_t *jp = slab_zalloc(sdata->jp_slab);
+
+		jp->client_id = client_id;
+		jp->id_val = submit_id(msg->submit);
+		jp->submit = msg->submit;
+		msg->submit = NULL;
+		ckmsgq_add(sdata->sshareq, jp);
+	} else if (!client->subscribed) {
+		LOGINFO("Dropping mining.submit from unsubscribed client %s %s",
+			client->identity, client->address);
+		connector_drop_client(ckp, client_id);
+	} else {
+		LOGINFO("Dropping mining.submit from unauthorised client %s %s",
+			client->identity, client->address);
+	}
+	dec_instance_ref(sdata, client);
+}
+
+static void srecv_process(ckpool_t *ckp, smsg_t *msg)
 {
 	char address[INET6_ADDRSTRLEN], *buf = NULL;
 	bool noid = false, dropped = false;
 	sdata_t *sdata = ckp->sdata;
 	stratum_instance_t *client;
-	smsg_t *msg;
+	json_t *val;
 	int server;
 
-	if (unlikely(!val)) {
-		LOGWARNING("srecv_process received NULL val!");
-		return;
+	if (msg->submit) {
+		json_arena_begin();
+		srecv_submit(ckp, sdata, msg);
+		json_arena_end();
+		goto out;
 	}
 
-	msg = ckzalloc(sizeof(smsg_t));
-	msg->json_msg = val;
 	val = json_object_get(msg->json_msg, "client_id");
 	if (unlikely(!val)) {
 		if (ckp->node)
@@ -7507,49 +8697,92 @@ static void srecv_process(ckpool_t *ckp, json_t *val)
 		parse_trusted_msg(ckp, sdata, msg->json_msg, client);
 	else if (ckp->node)
 		node_client_msg(ckp, msg->json_msg, client);
-	else
+	else {
+		/* Replies and queued json params for miners come from this
+		 * thread's json arena, as does msg->json_msg from the
+		 * connector's, so none of it can be kept once handled. */
+		json_arena_begin();
 		parse_instance_msg(ckp, sdata, msg, client);
+		json_arena_end();
+	}
 	dec_instance_ref(sdata, client);
 out:
-	free_smsg(msg);
+	free_smsg(sdata, msg);
 	free(buf);
 }
 
+/* Every message from one client goes to the same srecvs shard, whose single
+ * thread then handles them in the order they arrived. */
+static void srecv_add(sdata_t *sdata, smsg_t *msg)
+{
+	ckmsgq_add(sdata->srecvs[(uint64_t)msg->client_id % sdata->srecv_shards], msg);
+}
+
+/* Takes ownership of val, which is freed by srecv_process once handled */
 void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const char *func, const int line)
 {
 	sdata_t *sdata;
+	smsg_t *msg;
 
 	if (unlikely(!val)) {
 		LOGWARNING("_stratifier_add_recv received NULL val from %s %s:%d", file, func, line);
 		return;
 	}
 	sdata = ckp->sdata;
-	ckmsgq_add(sdata->srecvs, val);
+	msg = slab_zalloc(sdata->smsg_slab);
+	msg->json_msg = val;
+	json_get_int64(&msg->client_id, val, "client_id");
+	srecv_add(sdata, msg);
+}
+
+/* Submits go through the same queue as all other received messages to keep
+ * them ordered with respect to each client's other requests. */
+void stratifier_add_submit(ckpool_t *ckp, submit_t *submit)
+{
+	sdata_t *sdata = ckp->sdata;
+	smsg_t *msg;
+
+	msg = slab_zalloc(sdata->smsg_slab);
+	msg->client_id = submit->client_id;
+	msg->submit = submit;
+	srecv_add(sdata, msg);
 }
 
 static void ssend_process(ckpool_t *ckp, smsg_t *msg)
 {
+	sdata_t *sdata = ckp->sdata;
+
+	if (msg->buf) {
+		/* The connector will free msg->buf and msg->client_ids */
+		connector_add_broadcast(ckp, msg->buf, msg->client_ids, msg->clients);
+		slab_free(sdata->smsg_slab, msg);
+		return;
+	}
 	if (unlikely(!msg->json_msg)) {
 		LOGERR("Sent null json msg to stratum_sender");
-		free(msg);
+		slab_free(sdata->smsg_slab, msg);
 		return;
 	}
 
 	/* Add client_id to the json message and send it to the
 	 * connector process to be delivered */
+	json_arena_begin();
 	json_object_set_new_nocheck(msg->json_msg, "client_id", json_integer(msg->client_id));
+	json_arena_end();
 	connector_add_message(ckp, msg->json_msg);
 	/* The connector will free msg->json_msg */
-	free(msg);
+	slab_free(sdata->smsg_slab, msg);
 }
 
 /* json_decref on NULL is safe */
-static void discard_json_params(json_params_t *jp)
+static void discard_json_params(sdata_t *sdata, json_params_t *jp)
 {
 	json_decref(jp->method);
 	json_decref(jp->params);
 	json_decref(jp->id_val);
-	free(jp);
+	if (jp->submit)
+		slab_free(sdata->ckp->submit_slab, jp->submit);
+	slab_free(sdata->jp_slab, jp);
 }
 
 static void steal_json_id(json_t *val, json_params_t *jp)
@@ -7559,6 +8792,166 @@ static void steal_json_id(json_t *val, json_params_t *jp)
 	jp->id_val = NULL;
 }
 
+/* Maximum number of shares taken off the queue to be hashed together */
+#define SHARE_BATCH 64
+
+/* Maximum number of share log lines written out at once */
+#define SHARELOG_BATCH 256
+
+/* Per share state while hashing a batch of submits */
+struct batch_share {
+	submit_t *req;
+	workbase_t *wb;
+	char nonce2[20];
+	uint32_t ntime32;
+	sha256_ctx midstate;
+	char *coinbase;
+	int cblen;
+	uchar hash1[32];
+	uchar merkle_sha[64];
+	uchar merkle_root[32];
+};
+
+typedef struct batch_share batch_share_t;
+
+/* Hash the shares of a batch of scanned submits together with multi-buffer
+ * sha256 leaving the results in each submit for parse_submit. Messages of
+ * equal length are hashed together at each stage: the coinbases of each
+ * workbase, every merkle branch level and the headers. Anything that does not
+ * pass basic validation is left for parse_submit to reject. */
+static void hash_submits(sdata_t *sdata, json_params_t **jps, const int count)
+{
+	batch_share_t shares[count], *share;
+	const sha256_ctx *midstate[count];
+	uchar *data[count], *hash[count];
+	int i, j, level, hashes, n = 0;
+	bool done[count];
+
+	for (i = 0; i < count; i++) {
+		submit_t *req = jps[i]->submit;
+		stratum_instance_t *client;
+		workbase_t *wb = NULL;
+		int len, nlen;
+		int64_t id;
+
+		if (!req)
+			continue;
+		req->hashed = false;
+		client = ref_instance_by_id(sdata, jps[i]->client_id);
+		if (unlikely(!client))
+			continue;
+		if (unlikely(!client->authorised || !*req->job_id || !validhex(req->nonce2) ||
+			     !validhex(req->ntime) || !validhex(req->nonce)))
+			goto out_decref;
+		sscanf(req->job_id, "%lx", &id);
+		wb = get_workbase(sdata, id);
+		if (unlikely(!wb))
+			goto out_decref;
+		/* Pad or truncate nonce2 the same way parse_submit does */
+		len = wb->enonce2varlen * 2;
+		if (unlikely(len > 16)) {
+			put_workbase(sdata, wb);
+			goto out_decref;
+		}
+		share = &shares[n++];
+		nlen = strlen(req->nonce2);
+		memset(share->nonce2, '0', 16);
+		memcpy(share->nonce2, req->nonce2, nlen < len ? nlen : len);
+		share->nonce2[len] = '\0';
+		sscanf(req->ntime, "%x", &share->ntime32);
+		share->req = req;
+		share->wb = wb;
+		share->coinbase = ckalloc(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen +
+					  wb->enonce2varlen + wb->coinb2len);
+		share->cblen = build_coinbase(share->coinbase, client->enonce1bin, wb, share->nonce2);
+		share->midstate = *client_midstate(client, wb);
+out_decref:
+		dec_instance_ref(sdata, client);
+	}
+	if (!n)
+		return;
+
+	/* Coinbases and their midstates are only the same length for the same
+	 * workbase */
+	memset(done, 0, sizeof(done));
+	for (i = 0; i < n; i++) {
+		int ofs = shares[i].midstate.tot_len;
+
+		if (done[i])
+			continue;
+		for (hashes = 0, j = i; j < n; j++) {
+			share = &shares[j];
+			if (done[j] || share->cblen != shares[i].cblen || (int)share->midstate.tot_len != ofs)
+				continue;
+			done[j] = true;
+			midstate[hashes] = &share->midstate;
+			data[hashes] = (uchar *)share->coinbase + ofs;
+			hash[hashes++] = share->hash1;
+		}
+		sha256_multi_resume(midstate, (const uchar **)data, shares[i].cblen - ofs, hash, hashes);
+		for (hashes = 0, j = i; j < n; j++) {
+			share = &shares[j];
+			if (share->cblen != shares[i].cblen || (int)share->midstate.tot_len != ofs)
+				continue;
+			data[hashes] = share->hash1;
+			hash[hashes++] = share->merkle_sha;
+		}
+		sha256_multi((const uchar **)data, 32, hash, hashes);
+	}
+
+	for (level = 0; ; level++) {
+		for (hashes = 0, i = 0; i < n; i++) {
+			share = &shares[i];
+			if (level >= share->wb->merkles)
+				continue;
+			memcpy(share->merkle_sha + 32, &share->wb->merklebin[level], 32);
+			data[hashes] = share->merkle_sha;
+			hash[hashes++] = share->merkle_root;
+		}
+		if (!hashes)
+			break;
+		gen_hash_multi(data, hash, 64, hashes);
+		for (i = 0; i < n; i++) {
+			share = &shares[i];
+			if (level < share->wb->merkles)
+				memcpy(share->merkle_sha, share->merkle_root, 32);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		share = &shares[i];
+		build_header(share->req->swap, share->wb, share->merkle_sha, share->ntime32,
+			     share->req->nonce);
+		data[i] = share->req->swap;
+		hash[i] = share->req->hash;
+	}
+	gen_hash_multi(data, hash, 80, n);
+
+	for (i = 0; i < n; i++) {
+		share = &shares[i];
+		share->req->wb_id = share->wb->id;
+		share->req->hashed = true;
+		put_workbase(sdata, share->wb);
+		free(share->coinbase);
+	}
+	sdata->share_batches++;
+	sdata->batched_shares += n;
+}
+
+static void sshare_process(ckpool_t *ckp, json_params_t *jp);
+
+/* Shares are taken off the queue in batches of whatever is waiting so they
+ * can be hashed together before being processed in order */
+static void sshare_batch(ckpool_t *ckp, json_params_t **jps, const int count)
+{
+	int i;
+
+	if (count > 1)
+		hash_submits(ckp->sdata, jps, count);
+	for (i = 0; i < count; i++)
+		sshare_process(ckp, jps[i]);
+}
+
 static void sshare_process(ckpool_t *ckp, json_params_t *jp)
 {
 	json_t *result_val, *json_msg, *err_val = NULL;
@@ -7568,6 +8961,9 @@ static void sshare_process(ckpool_t *ckp, json_params_t *jp)
 
 	client_id = jp->client_id;
 
+	/* The share result and anything queued while processing the share
+	 * come from this thread's json arena */
+	json_arena_begin();
 	client = ref_instance_by_id(sdata, client_id);
 	if (unlikely(!client)) {
 		LOGINFO("Share processor failed to find client id %"PRId64" in hashtable!", client_id);
@@ -7578,7 +8974,7 @@ static void sshare_process(ckpool_t *ckp, json_params_t *jp)
 		goto out_decref;
 	}
 	json_msg = json_object();
-	result_val = parse_submit(client, json_msg, jp->params, &err_val);
+	result_val = parse_submit(client, json_msg, jp->params, jp->submit, &err_val);
 	json_object_set_new_nocheck(json_msg, "result", result_val);
 	json_object_set_new_nocheck(json_msg, "error", err_val ? err_val : json_null());
 	steal_json_id(json_msg, jp);
@@ -7586,7 +8982,8 @@ static void sshare_process(ckpool_t *ckp, json_params_t *jp)
 out_decref:
 	dec_instance_ref(sdata, client);
 out:
-	discard_json_params(jp);
+	json_arena_end();
+	discard_json_params(sdata, jp);
 }
 
 /* As ref_instance_by_id but only returns clients not authorising or authorised,
@@ -7696,7 +9093,7 @@ static void sauth_process(ckpool_t *ckp, json_params_t *jp)
 out:
 	dec_instance_ref(sdata, client);
 out_noclient:
-	discard_json_params(jp);
+	discard_json_params(sdata, jp);
 
 }
 
@@ -7751,30 +9148,12 @@ static bool test_and_clear(bool *val, mutex_t *lock)
 	return ret;
 }
 
-static void ckdbq_process(ckpool_t *ckp, char *msg)
+/* Process any requests from ckdb that are heartbeat responses with specific
+ * requests. */
+static void ckdb_response(ckpool_t *ckp, const char *buf)
 {
-	sdata_t *sdata = ckp->sdata;
-	size_t responselen;
-	char *buf = NULL;
+	size_t responselen = strlen(buf);
 
-	while (!buf) {
-		mutex_lock(&sdata->ckdb_lock);
-		buf = ckdb_msg_call(ckp, msg);
-		mutex_unlock(&sdata->ckdb_lock);
-
-		if (unlikely(!buf)) {
-			if (!test_and_set(&sdata->ckdb_offline, &sdata->ckdb_lock))
-				LOGWARNING("Failed to talk to ckdb, queueing messages");
-			sleep(5);
-		}
-	}
-	free(msg);
-	if (test_and_clear(&sdata->ckdb_offline, &sdata->ckdb_lock))
-		LOGWARNING("Successfully resumed talking to ckdb");
-
-	/* Process any requests from ckdb that are heartbeat responses with
-	 * specific requests. */
-	responselen = strlen(buf);
 	if (likely(responselen > 1)) {
 		char *response = alloca(responselen);
 		int offset = 0;
@@ -7797,7 +9176,184 @@ static void ckdbq_process(ckpool_t *ckp, char *msg)
 		} else
 			LOGWARNING("Got bad ckdb response: %s", buf);
 	}
-	free(buf);
+}
+
+/* Up to CKDB_BATCH_MSGS queued messages are sent to ckdb per frame, with up to
+ * CKDB_INFLIGHT frames awaiting replies at once. Once that many are waiting,
+ * ckdbq_process blocks and further messages queue unbounded in ckdbq, the same
+ * as when ckdb is unreachable. If ckdb has not replied for CKDB_STALL seconds
+ * it is treated as offline so workerstats stop being queued until it catches
+ * up. */
+#define CKDB_BATCH_MSGS 256
+#define CKDB_INFLIGHT 16
+#define CKDB_STALL 5
+
+/* Mark the connection to ckdb as failed, leaving the frames awaiting replies
+ * to be resent on the next connection. Only the ckdb_replies thread closes a
+ * connection it is reading from. Entered with ckdbchan_lock */
+static void __ckdbchan_drop(sdata_t *sdata)
+{
+	shutdown(sdata->ckdbchan_fd, SHUT_RDWR);
+	sdata->ckdbchan_dead = true;
+	pthread_cond_broadcast(&sdata->ckdbchan_cond);
+}
+
+/* Connect to ckdb and resend all frames that were still awaiting replies
+ * when the last connection failed. Entered with ckdbchan_lock */
+static void __ckdbchan_connect(ckpool_t *ckp, sdata_t *sdata)
+{
+	ckdb_frame_t *frame;
+	int fd;
+
+	while (42) {
+		fd = open_unix_client(ckp->ckdb_sockname);
+		if (likely(fd >= 0)) {
+			sdata->ckdb_inflight = 0;
+			DL_FOREACH(sdata->ckdb_frames, frame) {
+				if (unlikely(!send_unix_frame(fd, frame->buf)))
+					break;
+				/* The last frame is the one being sent */
+				if (frame->next)
+					sdata->ckdb_frames_resent++;
+				sdata->ckdb_inflight++;
+			}
+			if (likely(!frame))
+				break;
+			Close(fd);
+		}
+		if (!test_and_set(&sdata->ckdb_offline, &sdata->ckdb_lock))
+			LOGWARNING("Failed to talk to ckdb, queueing messages");
+		mutex_unlock(&sdata->ckdbchan_lock);
+		sleep(5);
+		mutex_lock(&sdata->ckdbchan_lock);
+	}
+	sdata->ckdbchan_fd = fd;
+	sdata->ckdbchan_dead = false;
+	pthread_cond_broadcast(&sdata->ckdbchan_cond);
+}
+
+/* Send a batch of queued ckdb messages as one frame over the persistent
+ * connection without waiting for its reply. */
+static void ckdbq_process(ckpool_t *ckp, char **msgs, const int count)
+{
+	sdata_t *sdata = ckp->sdata;
+	ckdb_frame_t *frame;
+	int i, len, ofs;
+
+	frame = ckalloc(sizeof(ckdb_frame_t));
+	for (i = 0, len = 32 + strlen(ckp->name); i < count; i++)
+		len += strlen(msgs[i]) + 1;
+	frame->buf = ckalloc(len);
+
+	mutex_lock(&sdata->ckdbchan_lock);
+	/* ckdb drops frames with a sequence it has already seen from a pool of
+	 * this name, such as ones resent after their reply was lost */
+	frame->seq = sdata->ckdbchan_seq++;
+	ofs = sprintf(frame->buf, CKDB_BATCH "%"PRId64".%s", frame->seq, ckp->name);
+	for (i = 0; i < count; i++) {
+		ofs += sprintf(frame->buf + ofs, "\n%s", msgs[i]);
+		free(msgs[i]);
+	}
+	DL_APPEND(sdata->ckdb_frames, frame);
+	sdata->ckdb_batched += count;
+
+	while (42) {
+		/* Wait for a failed connection to be closed */
+		if (sdata->ckdbchan_fd >= 0 && sdata->ckdbchan_dead) {
+			cond_wait(&sdata->ckdbchan_cond, &sdata->ckdbchan_lock);
+			continue;
+		}
+		/* Connecting sends this frame along with any unreplied ones */
+		if (sdata->ckdbchan_fd < 0) {
+			__ckdbchan_connect(ckp, sdata);
+			break;
+		}
+		if (sdata->ckdb_inflight >= CKDB_INFLIGHT) {
+			ts_t abstime;
+
+			ts_realtime(&abstime);
+			abstime.tv_sec += CKDB_STALL;
+			if (cond_timedwait(&sdata->ckdbchan_cond, &sdata->ckdbchan_lock, &abstime) &&
+			    !test_and_set(&sdata->ckdb_offline, &sdata->ckdb_lock)) {
+				LOGWARNING("No reply from ckdb to %d batches for %ds, %d messages queued",
+					   sdata->ckdb_inflight, CKDB_STALL, ckmsgq_count(sdata->ckdbq));
+			}
+			continue;
+		}
+		if (likely(send_unix_frame(sdata->ckdbchan_fd, frame->buf))) {
+			sdata->ckdb_inflight++;
+			break;
+		}
+		__ckdbchan_drop(sdata);
+	}
+	sdata->ckdb_frames_sent++;
+	mutex_unlock(&sdata->ckdbchan_lock);
+}
+
+/* Reads the replies to frames sent to ckdb, retiring the frames and
+ * processing the reply to each message they contained */
+static void *ckdb_replies(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	sdata_t *sdata = ckp->sdata;
+
+	pthread_detach(pthread_self());
+	rename_proc("ckdbreplies");
+
+	while (42) {
+		ckdb_frame_t *frame, *tmp;
+		char *buf, *line, *next;
+		int64_t seq;
+		int fd;
+
+		mutex_lock(&sdata->ckdbchan_lock);
+		while (sdata->ckdbchan_fd < 0)
+			cond_wait(&sdata->ckdbchan_cond, &sdata->ckdbchan_lock);
+		fd = sdata->ckdbchan_fd;
+		mutex_unlock(&sdata->ckdbchan_lock);
+
+		if (!wait_read_select(fd, 5))
+			continue;
+		buf = recv_unix_frame(fd);
+		if (unlikely(!buf || sscanf(buf, CKDB_BATCH "%"SCNd64, &seq) != 1)) {
+			if (buf)
+				LOGWARNING("Invalid reply frame from ckdb: %s", buf);
+			mutex_lock(&sdata->ckdbchan_lock);
+			Close(sdata->ckdbchan_fd);
+			sdata->ckdbchan_fd = -1;
+			pthread_cond_broadcast(&sdata->ckdbchan_cond);
+			mutex_unlock(&sdata->ckdbchan_lock);
+			free(buf);
+			continue;
+		}
+
+		mutex_lock(&sdata->ckdbchan_lock);
+		DL_FOREACH_SAFE(sdata->ckdb_frames, frame, tmp) {
+			if (frame->seq != seq)
+				continue;
+			DL_DELETE(sdata->ckdb_frames, frame);
+			free(frame->buf);
+			free(frame);
+			if (likely(sdata->ckdb_inflight))
+				sdata->ckdb_inflight--;
+			pthread_cond_broadcast(&sdata->ckdbchan_cond);
+			break;
+		}
+		mutex_unlock(&sdata->ckdbchan_lock);
+
+		if (test_and_clear(&sdata->ckdb_offline, &sdata->ckdb_lock))
+			LOGWARNING("Successfully resumed talking to ckdb");
+		next = strchr(buf, '\n');
+		while (next) {
+			line = next + 1;
+			next = strchr(line, '\n');
+			if (next)
+				*next = '\0';
+			ckdb_response(ckp, line);
+		}
+		free(buf);
+	}
+	return NULL;
 }
 
 static int transactions_by_jobid(sdata_t *sdata, const int64_t id)
@@ -7899,7 +9455,7 @@ out_send:
 out:
 	if (client)
 		dec_instance_ref(sdata, client);
-	discard_json_params(jp);
+	discard_json_params(sdata, jp);
 }
 
 /* Called 32 times per min, we send the updated stats to ckdb of those users
@@ -8570,8 +10126,8 @@ static bool script_address(const char *btcaddress)
 void *stratifier(void *arg)
 {
 	proc_instance_t *pi = (proc_instance_t *)arg;
-	pthread_t pth_blockupdate, pth_statsupdate, pth_heartbeat;
-	int threads, tvsec_diff = 0;
+	pthread_t pth_blockupdate, pth_statsupdate, pth_heartbeat, pth_ckdbreplies;
+	int threads, tvsec_diff = 0, i;
 	ckpool_t *ckp = pi->ckp;
 	int64_t randomiser;
 	sdata_t *sdata;
@@ -8632,17 +10188,38 @@ void *stratifier(void *arg)
 
 	mutex_init(&sdata->ckdb_lock);
 	mutex_init(&sdata->ckdb_msg_lock);
-	/* Create half as many share processing and receiving threads as there
-	 * are CPUs */
+	/* Create half as many receiving threads as there are CPUs */
 	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
 	sdata->updateq = create_ckmsgq(ckp, "updater", &block_update);
-	sdata->sshareq = create_ckmsgqs(ckp, "sprocessor", &sshare_process, threads);
-	sdata->ssends = create_ckmsgqs(ckp, "ssender", &ssend_process, threads);
+	mutex_init(&sdata->publish_lock);
+	if (!ckp->proxy && ckp->emptywork)
+		sdata->emptyq = create_ckmsgq(ckp, "emptier", &empty_update);
+	sdata->smsg_slab = create_slab("smsg", sizeof(smsg_t));
+	sdata->jp_slab = create_slab("jsonparams", sizeof(json_params_t));
+	sdata->sshareq = create_ckmsgq_batch(ckp, "sprocessor", &sshare_batch, SHARE_BATCH);
+	/* A single sending thread keeps every client's messages in the order
+	 * they were queued */
+	sdata->ssends = create_ckmsgq(ckp, "ssender", &ssend_process);
 	sdata->sauthq = create_ckmsgq(ckp, "authoriser", &sauth_process);
 	sdata->stxnq = create_ckmsgq(ckp, "stxnq", &send_transactions);
-	sdata->srecvs = create_ckmsgqs(ckp, "sreceiver", &srecv_process, threads);
+	sdata->srecvs = create_ckmsgq_shards(ckp, "sreceiver", &srecv_process, threads);
+	sdata->srecv_shards = threads;
+	if (ckp->logshares)
+		sdata->sharelogq = create_ckmsgq_batch(ckp, "sharelogger", &sharelog_process, SHARELOG_BATCH);
 	if (!CKP_STANDALONE(ckp)) {
-		sdata->ckdbq = create_ckmsgqs(ckp, "ckdbqueue", &ckdbq_process, threads);
+		char logname[512];
+
+		snprintf(logname, 511, "%s%s", ckp->logdir, ckp->ckdb_name);
+		sdata->ckdblog = create_rotating_file(logname, true);
+		sdata->ckdblogq = create_ckmsgq_batch(ckp, "ckdblogger", &ckdblog_process, CKDBLOG_BATCH);
+		mutex_init(&sdata->ckdbchan_lock);
+		cond_init(&sdata->ckdbchan_cond);
+		sdata->ckdbchan_fd = -1;
+		/* Start frame sequences from the start time so they keep rising
+		 * across restarts for ckdb to spot resent frames */
+		sdata->ckdbchan_seq = (int64_t)time(NULL) * 1000000;
+		sdata->ckdbq = create_ckmsgq_batch(ckp, "ckdbqueue", &ckdbq_process, CKDB_BATCH_MSGS);
+		create_pthread(&pth_ckdbreplies, ckdb_replies, ckp);
 		create_pthread(&pth_heartbeat, ckdb_heartbeat, ckp);
 	}
 	read_poolstats(ckp, &tvsec_diff);
@@ -8650,9 +10227,15 @@ void *stratifier(void *arg)
 
 	cklock_init(&sdata->txn_lock);
 	cklock_init(&sdata->workbase_lock);
-	if (!ckp->proxy)
-		create_pthread(&pth_blockupdate, blockupdate, ckp);
-	else {
+	if (!ckp->proxy) {
+		for (i = 0; i < ckp->btcds; i++) {
+			blockwatch_t *bw = ckalloc(sizeof(blockwatch_t));
+
+			bw->ckp = ckp;
+			bw->server = i;
+			create_pthread(&pth_blockupdate, blockupdate, bw);
+		}
+	} else {
 		mutex_init(&sdata->proxy_lock);
 	}
 
@@ -8661,7 +10244,7 @@ void *stratifier(void *arg)
 	if (!ckp->passthrough || ckp->node)
 		create_pthread(&pth_statsupdate, statsupdate, ckp);
 
-	mutex_init(&sdata->share_lock);
+	cklock_init(&sdata->share_lock);
 
 	ckp->stratifier_ready = true;
 	LOGWARNING("%s stratifier ready", ckp->name);
@@ -10,6 +10,8 @@
 #ifndef STRATIFIER_H
 #define STRATIFIER_H
 
+#include "sha2.h"
+
 /* Generic structure for both workbase in stratifier and gbtbase in generator */
 struct genwork {
 	/* Hash table data */
@@ -48,8 +50,18 @@ struct genwork {
 	int height;
 	char *flags;
 	int txns;
-	char *txn_data;
 	char *txn_hashes;
+	/* Transactions decoded from a template, with their txids and wtxids in
+	 * byte swapped binary ready for merkle trees, and the offset of each
+	 * transaction's binary data in txn_data. The stratifier moves the data
+	 * into its transaction table and keeps references to it instead. */
+	uchar *txn_data;
+	uchar *txidbin;
+	uchar *wtxidbin;
+	int *txn_ofs;
+	int txn_slots; // Transactions allocated for in the above
+	int txn_datasize; // Allocated size of txn_data
+	struct txntable **txn_refs;
 	char witnessdata[80]; //null-terminated ascii
 	bool insert_witness;
 	int merkles;
@@ -61,6 +73,7 @@ struct genwork {
 	char *coinb1; // coinbase1
 	uchar *coinb1bin;
 	int coinb1len; // length of above
+	sha256_ctx coinb1ctx; // sha256 state after the complete blocks of above
 
 	char enonce1const[32]; // extranonce1 section that is constant
 	uchar enonce1constbin[16];
@@ -86,6 +99,38 @@ struct genwork {
 	json_t *json; /* getblocktemplate json */
 };
 
+#define SUBMIT_BUFLEN 512
+
+/* A mining.submit request reduced to its fields. The strings point into buf
+ * when the request was scanned directly from a client line by the connector,
+ * or into the json params they were extracted from otherwise. */
+struct stratum_submit {
+	int64_t client_id;
+
+	/* The request id is either a string, an integer or null */
+	const char *id;
+	int64_t id_int;
+	bool id_null;
+
+	const char *workername;
+	const char *job_id;
+	const char *nonce2;
+	const char *ntime;
+	const char *nonce;
+	/* Optional version rolling mask, NULL if not sent */
+	const char *version_mask;
+
+	/* Set when the share was already hashed as part of a batch */
+	bool hashed;
+	int64_t wb_id;
+	uchar hash[32];
+	uchar swap[80];
+
+	char buf[SUBMIT_BUFLEN];
+};
+
+typedef struct stratum_submit submit_t;
+
 void parse_remote_txns(ckpool_t *ckp, const json_t *val);
 #define parse_upstream_txns(ckp, val) parse_remote_txns(ckp, val)
 void parse_upstream_auth(ckpool_t *ckp, json_t *val);
@@ -95,6 +140,7 @@ void parse_upstream_reqtxns(ckpool_t *ckp, json_t *val);
 char *stratifier_stats(ckpool_t *ckp, void *data);
 void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const char *func, const int line);
 #define stratifier_add_recv(ckp, val) _stratifier_add_recv(ckp, val, __FILE__, __func__, __LINE__)
+void stratifier_add_submit(ckpool_t *ckp, submit_t *submit);
 void *stratifier(void *arg);
 
 #endif /* STRATIFIER_H */
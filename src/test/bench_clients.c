@@ -0,0 +1,165 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Measures lookup throughput of the connector's sharded client table as
+ * threads are added. Every thread takes and drops references to random client
+ * ids with ref_client_by_id as the receivers and senders do. The same lookups
+ * serialised on the cdata write lock, the way the single client hashtable
+ * used to be searched, are timed alongside for comparison. */
+
+#include "../connector.c"
+
+#include <time.h>
+
+struct bench_thread {
+	pthread_t pth;
+	cdata_t *cdata;
+	bool global;
+	int clients;
+	int msecs;
+	int64_t lookups;
+	int64_t misses;
+};
+
+typedef struct bench_thread bench_thread_t;
+
+static double bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static client_instance_t *global_ref_client_by_id(cdata_t *cdata, int64_t id)
+{
+	client_shard_t *shard = client_shard(cdata, id);
+	client_instance_t *client;
+
+	ck_wlock(&cdata->lock);
+	HASH_FIND_I64(shard->clients, &id, client);
+	if (client)
+		inc_instance_ref(client);
+	ck_wunlock(&cdata->lock);
+
+	return client;
+}
+
+static void *bench_lookups(void *arg)
+{
+	bench_thread_t *bt = (bench_thread_t *)arg;
+	uint32_t seed = (uintptr_t)bt | 1;
+	double end = bench_time() + bt->msecs / 1000.0;
+
+	do {
+		int i;
+
+		/* Check the time every batch of lookups only */
+		for (i = 0; i < 1024; i++) {
+			client_instance_t *client;
+			int64_t id;
+
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			id = seed % bt->clients;
+			if (bt->global)
+				client = global_ref_client_by_id(bt->cdata, id);
+			else
+				client = ref_client_by_id(bt->cdata, id);
+			if (unlikely(!client)) {
+				bt->misses++;
+				continue;
+			}
+			dec_instance_ref(client);
+		}
+		bt->lookups += i;
+	} while (bench_time() < end);
+
+	return NULL;
+}
+
+static int64_t bench_run(cdata_t *cdata, const int threads, const bool global,
+			 const int clients, const int msecs, int64_t *misses)
+{
+	bench_thread_t *bts = ckzalloc(sizeof(bench_thread_t) * threads);
+	int64_t lookups = 0;
+	int i;
+
+	for (i = 0; i < threads; i++) {
+		bts[i].cdata = cdata;
+		bts[i].global = global;
+		bts[i].clients = clients;
+		bts[i].msecs = msecs;
+		create_pthread(&bts[i].pth, bench_lookups, &bts[i]);
+	}
+	for (i = 0; i < threads; i++) {
+		join_pthread(bts[i].pth);
+		lookups += bts[i].lookups;
+		*misses += bts[i].misses;
+	}
+	free(bts);
+
+	return lookups;
+}
+
+int main(int argc, char **argv)
+{
+	int clients = 10000, maxthreads = 8, msecs = 200, threads, c;
+	cdata_t *cdata = ckzalloc(sizeof(cdata_t));
+	int64_t misses = 0, id;
+
+	while ((c = getopt(argc, argv, "c:m:t:")) != -1) {
+		switch (c) {
+			case 'c':
+				clients = atoi(optarg);
+				break;
+			case 'm':
+				msecs = atoi(optarg);
+				break;
+			case 't':
+				maxthreads = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-c clients] [-m msecs per run] [-t max threads]\n",
+					argv[0]);
+				exit(1);
+		}
+	}
+	if (clients < 1 || msecs < 1 || maxthreads < 1) {
+		fprintf(stderr, "Invalid arguments\n");
+		exit(1);
+	}
+
+	cklock_init(&cdata->lock);
+	for (c = 0; c < CLIENT_SHARDS; c++)
+		rwlock_init(&cdata->shards[c].lock);
+	for (id = 0; id < clients; id++) {
+		client_instance_t *client = ckzalloc(sizeof(client_instance_t));
+
+		client->id = id;
+		add_client_shard(cdata, client);
+	}
+
+	printf("%d clients, %d ms per run, lookups per second\n", clients, msecs);
+	printf("threads %14s %14s\n", "sharded", "global wlock");
+	for (threads = 1; threads <= maxthreads; threads *= 2) {
+		int64_t sharded, global;
+
+		sharded = bench_run(cdata, threads, false, clients, msecs, &misses);
+		global = bench_run(cdata, threads, true, clients, msecs, &misses);
+		printf("%7d %14.0f %14.0f\n", threads, sharded * 1000.0 / msecs,
+		       global * 1000.0 / msecs);
+	}
+
+	/* Every id exists so any failed lookup is a bug in the table */
+	if (misses) {
+		fprintf(stderr, "%"PRId64" lookups failed to find their client\n", misses);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Compares decoding the transactions of a getblocktemplate response while it
+ * streams in with loading the whole response with jansson and walking its
+ * transactions array. It first checks the streamed decode gives the same
+ * binary txids, wtxids and data as the json walk for responses split into
+ * reads of many sizes, then times both on a synthetic template of mempool
+ * size arriving in recv sized reads. Throughput counts all the work done on a
+ * response while latency counts only what is left after its last byte
+ * arrives, which is what delays the template reaching miners. */
+
+#include "../bitcoin.c"
+
+#include <time.h>
+
+#define READ_SIZE 65536
+
+static const char *template_head =
+	"{\"result\": {\"capabilities\": [\"proposal\"], \"version\": 536870912, "
+	"\"rules\": [\"csv\", \"!segwit\"], \"vbavailable\": {}, \"vbrequired\": 0, "
+	"\"previousblockhash\": \"0000000000000000000a1b2c3d4e5f60718293a4b5c6d7e8f90a1b2c3d4e5f60\", "
+	"\"transactions\": [";
+
+static const char *template_tail =
+	"], \"coinbaseaux\": {\"flags\": \"\"}, \"coinbasevalue\": 1250000000, "
+	"\"longpollid\": \"0000000000000000000a1b2c3d4e5f60718293a4b5c6d7e8f90a1b2c3d4e5f60123\", "
+	"\"target\": \"0000000000000000003a6b000000000000000000000000000000000000000000\", "
+	"\"mintime\": 1600000000, \"mutable\": [\"time\", \"transactions\", \"prevblock\"], "
+	"\"noncerange\": \"00000000ffffffff\", \"sigoplimit\": 80000, \"sizelimit\": 4000000, "
+	"\"weightlimit\": 4000000, \"curtime\": 1600000600, \"bits\": \"17103a6b\", "
+	"\"height\": 650000, \"default_witness_commitment\": \"6a24aa21a9ed\"}, "
+	"\"error\": null, \"id\": 0}";
+
+static double bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void random_hex(char *s, const int len)
+{
+	static const char *hex = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < len * 2; i++)
+		s[i] = hex[random() & 15];
+	s[len * 2] = '\0';
+}
+
+/* A response with txns transactions laid out as bitcoind writes them, with
+ * data from a plain payment to a large consolidation and the odd transaction
+ * without a hash as older bitcoinds send */
+static char *build_template(const int txns, int *len)
+{
+	int size = strlen(template_head) + strlen(template_tail) + 1, ofs, i;
+	char *body, txid[65], hash[65];
+
+	size += txns * (2 * 4000 + 512);
+	body = ckalloc(size);
+	ofs = sprintf(body, "%s", template_head);
+	for (i = 0; i < txns; i++) {
+		int datalen = 150 + random() % (i % 50 ? 600 : 4000);
+
+		random_hex(txid, 32);
+		random_hex(hash, 32);
+		ofs += sprintf(body + ofs, "%s{\"data\": \"", i ? ", " : "");
+		random_hex(body + ofs, datalen);
+		ofs += datalen * 2;
+		if (i % 97)
+			ofs += sprintf(body + ofs, "\", \"txid\": \"%s\", \"hash\": \"%s\"", txid, hash);
+		else
+			ofs += sprintf(body + ofs, "\", \"txid\": \"%s\"", txid);
+		ofs += sprintf(body + ofs, ", \"depends\": [%s], \"fee\": %d, \"sigops\": %d, \"weight\": %d}",
+			       i > 2 && i % 5 ? "1, 2" : "", 200 + i, 4, datalen * 4);
+	}
+	ofs += sprintf(body + ofs, "%s", template_tail);
+	*len = ofs;
+	return body;
+}
+
+/* Decode a copy of body handed over in reads of chunk bytes the way
+ * read_http_body does, returning the json left once the transactions are cut
+ * out. *last is set to the time taken once the last read arrived. */
+static json_t *stream_decode(const char *body, const int len, const int chunk, gbtbase_t *gbt,
+			     double *last)
+{
+	char *buf = ckalloc(len + 1);
+	gbt_stream_t gs = {};
+	json_t *val = NULL;
+	double start;
+	int ofs;
+
+	gs.gbt = gbt;
+	for (ofs = 0; ofs < len; ) {
+		int rd = MIN(chunk, len - ofs);
+
+		memcpy(buf + ofs, body + ofs, rd);
+		ofs += rd;
+		buf[ofs] = '\0';
+		gbt_stream(&gs, buf, ofs, false);
+	}
+	start = bench_time();
+	gbt_stream(&gs, buf, len, true);
+	if (gs.done && !gs.failed)
+		val = json_loads(buf, 0, NULL);
+	*last = bench_time() - start;
+	free(buf);
+	return val;
+}
+
+/* Load the whole response with jansson and walk its transactions into the
+ * same binary forms */
+static json_t *json_decode(const char *body, gbtbase_t *gbt)
+{
+	json_t *val, *txn_array;
+	int i, txns;
+
+	val = json_loads(body, 0, NULL);
+	if (!val)
+		return NULL;
+	txn_array = json_object_get(json_object_get(val, "result"), "transactions");
+	txns = json_array_size(txn_array);
+	for (i = 0; i < txns; i++) {
+		json_t *txn = json_array_get(txn_array, i);
+		const char *data = json_string_value(json_object_get(txn, "data"));
+
+		if (!add_gbt_txn(gbt, data, data ? strlen(data) : 0,
+				 json_string_value(json_object_get(txn, "txid")),
+				 json_string_value(json_object_get(txn, "hash"))))
+			break;
+	}
+	return val;
+}
+
+static bool same_txns(const gbtbase_t *a, const gbtbase_t *b)
+{
+	int n = a->txns;
+
+	if (a->txns != b->txns || !n)
+		return a->txns == b->txns;
+	return !memcmp(a->txidbin, b->txidbin, n * 32) &&
+		!memcmp(a->wtxidbin, b->wtxidbin, n * 32) &&
+		!memcmp(a->txn_ofs, b->txn_ofs, (n + 1) * sizeof(int)) &&
+		!memcmp(a->txn_data, b->txn_data, a->txn_ofs[n]) &&
+		!strcmp(a->txn_hashes, b->txn_hashes);
+}
+
+/* The streamed decode must give the jansson walk's transactions, and leave
+ * the rest of the template intact with an empty transactions array */
+static int check_template(const int txns, const int chunk)
+{
+	gbtbase_t streamed = {}, walked = {};
+	json_t *val, *ref, *res_val;
+	int len, bad = 0;
+	double last;
+	char *body;
+
+	body = build_template(txns, &len);
+	val = stream_decode(body, len, chunk, &streamed, &last);
+	ref = json_decode(body, &walked);
+	if (!val || !ref || walked.txns != txns || !same_txns(&streamed, &walked))
+		bad++;
+	else {
+		res_val = json_object_get(val, "result");
+		json_object_set(json_object_get(ref, "result"), "transactions", json_array());
+		if (json_array_size(json_object_get(res_val, "transactions")) ||
+		    !json_equal(val, ref))
+			bad++;
+	}
+	if (val)
+		json_decref(val);
+	if (ref)
+		json_decref(ref);
+	clear_gbt_txns(&streamed);
+	clear_gbt_txns(&walked);
+	free(body);
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	int chunks[] = { 1, 2, 7, 14, 15, 64, 1000, 4096, READ_SIZE };
+	double start, last, stream_total = 0, stream_last = 0, json_total = 0;
+	int txns = 4000, reps = 20, bad = 0, len, i, r, c;
+	char *body;
+
+	while ((c = getopt(argc, argv, "n:r:")) != -1) {
+		switch (c) {
+			case 'n':
+				txns = atoi(optarg);
+				break;
+			case 'r':
+				reps = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n transactions] [-r reps]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (txns < 0 || reps < 1) {
+		fprintf(stderr, "Invalid arguments\n");
+		exit(1);
+	}
+
+	srandom(1);
+	for (i = 0; i < (int)(sizeof(chunks) / sizeof(chunks[0])); i++) {
+		bad += check_template(0, chunks[i]);
+		bad += check_template(1, chunks[i]);
+		bad += check_template(chunks[i] < 64 ? 30 : 500, chunks[i]);
+	}
+	printf("%d streamed templates mismatched the jansson decode\n", bad);
+
+	body = build_template(txns, &len);
+	for (r = 0; r < reps; r++) {
+		gbtbase_t gbt = {};
+		json_t *val;
+
+		start = bench_time();
+		val = stream_decode(body, len, READ_SIZE, &gbt, &last);
+		stream_total += bench_time() - start;
+		stream_last += last;
+		bad += !val || gbt.txns != txns;
+		if (val)
+			json_decref(val);
+		clear_gbt_txns(&gbt);
+
+		start = bench_time();
+		val = json_decode(body, &gbt);
+		json_total += bench_time() - start;
+		bad += !val || gbt.txns != txns;
+		if (val)
+			json_decref(val);
+		clear_gbt_txns(&gbt);
+	}
+
+	printf("%d transactions, %.2f MB template in %d byte reads\n", txns, len / 1e6, READ_SIZE);
+	printf("%-8s %12s %12s %14s\n", "decode", "MB/s", "total ms", "after last ms");
+	printf("%-8s %12.1f %12.3f %14.3f\n", "stream", len / 1e6 * reps / stream_total,
+	       stream_total * 1e3 / reps, stream_last * 1e3 / reps);
+	printf("%-8s %12.1f %12.3f %14.3f\n", "jansson", len / 1e6 * reps / json_total,
+	       json_total * 1e3 / reps, json_total * 1e3 / reps);
+	free(body);
+
+	return bad != 0;
+}
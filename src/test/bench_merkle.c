@@ -0,0 +1,219 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Fuzzes incremental merkle tree updates with random appends, truncations,
+ * replacements, insertions and deletions, checking the root and coinbase
+ * branch after every update against the full recomputation ckpool used to
+ * do. Then times that full recomputation, a full rebuild of a merkle tree and
+ * incremental updates of it at mempool sized templates. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+
+#define MAX_TXNS 20000
+
+static double bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void random_hashes(uchar *hashes, const int count)
+{
+	int i;
+
+	for (i = 0; i < count * 32; i++)
+		hashes[i] = random();
+}
+
+/* The merkle root and coinbase branch of count hashes computed in full the
+ * way wb_merkle_bins always did before, returning the branch length */
+static int full_merkle(const uchar *hashes, const int count, uchar *root, uchar *branch)
+{
+	uchar *hashbin = ckalloc((count + 2) * 32);
+	int txns = count + 1, branches = 0, i;
+
+	memset(hashbin, 0, 32);
+	memcpy(hashbin + 32, hashes, count * 32);
+	while (txns > 1) {
+		memcpy(branch + branches++ * 32, hashbin + 32, 32);
+		if (txns % 2) {
+			memcpy(hashbin + txns * 32, hashbin + (txns - 1) * 32, 32);
+			txns++;
+		}
+		for (i = 0; i < txns; i += 2)
+			gen_hash(hashbin + i * 32, hashbin + i / 2 * 32, 64);
+		txns /= 2;
+	}
+	memcpy(root, hashbin, 32);
+	free(hashbin);
+	return branches;
+}
+
+static bool check_update(merkletree_t *tree, const uchar *hashes, const int count)
+{
+	uchar root[32], branch[MERKLE_LEVELS * 32];
+	int branches, lvl;
+
+	merkle_update(tree, hashes, count);
+	branches = full_merkle(hashes, count, root, branch);
+	if (memcmp(root, tree->level[tree->levels - 1], 32))
+		return false;
+	for (lvl = 0; tree->len[lvl] > 1; lvl++) {
+		if (memcmp(branch + lvl * 32, tree->level[lvl] + 32, 32))
+			return false;
+	}
+	return lvl == branches;
+}
+
+/* Apply a random change to the count hashes, returning the new count */
+static int mutate(uchar *hashes, int count)
+{
+	int change = random() % 50 + 1, pos, i;
+
+	switch (random() % 6) {
+		case 0: /* Transactions added at the tail */
+			if (count + change < MAX_TXNS) {
+				random_hashes(hashes + count * 32, change);
+				count += change;
+			}
+			break;
+		case 1: /* Tail truncated */
+			count = count > change ? count - change : random() % 3;
+			break;
+		case 2: /* Transactions replaced in place */
+			for (i = 0; count && i < change; i++)
+				random_hashes(hashes + random() % count * 32, 1);
+			break;
+		case 3: /* One inserted, moving everything after it */
+			if (count + 1 < MAX_TXNS) {
+				pos = count ? random() % count : 0;
+				memmove(hashes + (pos + 1) * 32, hashes + pos * 32, (count - pos) * 32);
+				random_hashes(hashes + pos * 32, 1);
+				count++;
+			}
+			break;
+		case 4: /* One deleted */
+			if (count) {
+				pos = random() % count;
+				memmove(hashes + pos * 32, hashes + (pos + 1) * 32, (count - pos - 1) * 32);
+				count--;
+			}
+			break;
+		default: /* An entirely new template */
+			count = random() % 3000;
+			random_hashes(hashes, count);
+			break;
+	}
+	return count;
+}
+
+static void bench(uchar *hashes, const int txns, const int reps)
+{
+	double start, full = 0, rebuild = 0, tail = 0, replaced = 0;
+	uchar root[32], branch[MERKLE_LEVELS * 32];
+	merkletree_t tree = {};
+	int count = txns, i, j;
+
+	random_hashes(hashes, count);
+	merkle_update(&tree, hashes, count);
+	for (i = 0; i < reps; i++) {
+		merkletree_t scratch = {};
+
+		start = bench_time();
+		full_merkle(hashes, count, root, branch);
+		full += bench_time() - start;
+
+		start = bench_time();
+		merkle_update(&scratch, hashes, count);
+		rebuild += bench_time() - start;
+		clear_merkletree(&scratch);
+	}
+	/* 20 new transactions at the tail of each update */
+	for (i = 0; i < reps; i++) {
+		if (count + 20 > MAX_TXNS)
+			count = txns;
+		random_hashes(hashes + count * 32, 20);
+		count += 20;
+		start = bench_time();
+		merkle_update(&tree, hashes, count);
+		tail += bench_time() - start;
+	}
+	/* 5 transactions replaced by others in each update */
+	for (i = 0; i < reps; i++) {
+		for (j = 0; j < 5; j++)
+			random_hashes(hashes + random() % count * 32, 1);
+		start = bench_time();
+		merkle_update(&tree, hashes, count);
+		replaced += bench_time() - start;
+	}
+	clear_merkletree(&tree);
+
+	printf("%5d %12.3f %12.3f %12.3f %12.3f\n", txns, full * 1e3 / reps, rebuild * 1e3 / reps,
+	       tail * 1e3 / reps, replaced * 1e3 / reps);
+}
+
+int main(int argc, char **argv)
+{
+	int sizes[] = { 2000, 4000, 8000 };
+	int updates = 3000, reps = 100, count = 0, bad = 0, i, c;
+	uchar *hashes = ckalloc(MAX_TXNS * 32);
+	merkletree_t tree = {};
+
+	while ((c = getopt(argc, argv, "r:u:")) != -1) {
+		switch (c) {
+			case 'r':
+				reps = atoi(optarg);
+				break;
+			case 'u':
+				updates = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-r benchmark reps] [-u fuzzed updates]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (reps < 1) {
+		fprintf(stderr, "Invalid arguments\n");
+		exit(1);
+	}
+
+	srandom(1);
+	for (i = 0; i < updates; i++) {
+		count = mutate(hashes, count);
+		if (!check_update(&tree, hashes, count))
+			bad++;
+	}
+	/* Every small tree, both fresh and updated from the last one */
+	for (count = 0; count < 40; count++) {
+		merkletree_t fresh = {};
+
+		random_hashes(hashes, count);
+		if (!check_update(&fresh, hashes, count) || !check_update(&tree, hashes, count))
+			bad++;
+		clear_merkletree(&fresh);
+	}
+	clear_merkletree(&tree);
+	printf("%d fuzzed updates, %d mismatched the full computation\n", updates + 40, bad);
+
+	printf("ms per update\n");
+	printf("%5s %12s %12s %12s %12s\n", "txns", "full", "tree rebuild", "tail +20", "5 replaced");
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+		bench(hashes, sizes[i], reps);
+	free(hashes);
+
+	return bad != 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Compares hashing share coinbases from the clients' cached coinb1 and
+ * enonce1 midstates with hashing every coinbase in full, over coinbases with
+ * coinb1 and coinb2 lengths spread across sha256 block boundaries. It first
+ * checks the resumed hashes match the full ones as clients move between
+ * workbases, then reports the time per share and the compression rounds each
+ * share skips, as counted by the sshareq midstate_blocks stat. */
+
+#include "../stratifier.c"
+
+#include <time.h>
+
+#define WORKBASES 64
+#define CLIENTS 16
+
+static double bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void random_bytes(uchar *buf, const int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = random();
+}
+
+/* A workbase with random coinbase halves of the given lengths laid out as
+ * generate_coinbase does, with an 8 byte enonce1 and nonce2 */
+static void init_workbase(workbase_t *wb, const int64_t id, const int coinb1len,
+			  const int coinb2len)
+{
+	wb->id = id;
+	wb->coinb1len = coinb1len;
+	wb->coinb1bin = ckalloc(coinb1len);
+	random_bytes(wb->coinb1bin, coinb1len);
+	sha256_midstate(&wb->coinb1ctx, wb->coinb1bin, coinb1len);
+	wb->enonce1constlen = 0;
+	wb->enonce1varlen = 8;
+	wb->enonce2varlen = 8;
+	wb->coinb2len = coinb2len;
+	wb->coinb2bin = ckalloc(coinb2len);
+	random_bytes(wb->coinb2bin, coinb2len);
+}
+
+static void random_nonce2(char *nonce2)
+{
+	uchar bin[8];
+
+	random_bytes(bin, 8);
+	__bin2hex(nonce2, bin, 8);
+}
+
+static int check_midstates(workbase_t *wbs, stratum_instance_t *clients, const int shares)
+{
+	char coinbase[1024], nonce2[17];
+	uchar full[32], resumed[32];
+	int i, cblen, bad = 0;
+
+	for (i = 0; i < shares; i++) {
+		stratum_instance_t *client = &clients[random() % CLIENTS];
+		workbase_t *wb = &wbs[random() % WORKBASES];
+
+		random_nonce2(nonce2);
+		cblen = build_coinbase(coinbase, client->enonce1bin, wb, nonce2);
+		gen_hash((uchar *)coinbase, full, cblen);
+		coinbase_hash(client_midstate(client, wb), coinbase, cblen, resumed);
+		bad += !!memcmp(full, resumed, 32);
+	}
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	double start, full = 0, resumed = 0, full_blocks = 0, skipped;
+	int shares = 200000, bad, i, c, cblen;
+	stratum_instance_t clients[CLIENTS];
+	workbase_t wbs[WORKBASES];
+	char coinbase[1024], nonce2[17];
+	sdata_t sdata = {};
+	uchar hash[32];
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+			case 'n':
+				shares = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n shares]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (shares < 1) {
+		fprintf(stderr, "Invalid arguments\n");
+		exit(1);
+	}
+
+	srandom(1);
+	memset(wbs, 0, sizeof(wbs));
+	memset(clients, 0, sizeof(clients));
+	/* A coinb1 from just under one block to three, and from a pool
+	 * payout alone to many user payouts in coinb2 */
+	for (i = 0; i < WORKBASES; i++)
+		init_workbase(&wbs[i], i, 50 + random() % 150, 60 + random() % 700);
+	for (i = 0; i < CLIENTS; i++) {
+		clients[i].sdata = &sdata;
+		clients[i].midstate_id = -1;
+		random_bytes(clients[i].enonce1bin, 8);
+	}
+
+	bad = check_midstates(wbs, clients, 20000);
+	printf("%d resumed coinbase hashes mismatched the full hash\n", bad);
+
+	/* Each client submits a run of shares on one workbase at a time the
+	 * way miners do between block changes */
+	sdata.midstate_blocks = 0;
+	for (i = 0; i < shares; i++) {
+		stratum_instance_t *client = &clients[i % CLIENTS];
+		workbase_t *wb = &wbs[i / 1000 % WORKBASES];
+
+		random_nonce2(nonce2);
+		cblen = build_coinbase(coinbase, client->enonce1bin, wb, nonce2);
+		full_blocks += (cblen + 9 + SHA256_BLOCK_SIZE - 1) / SHA256_BLOCK_SIZE;
+
+		start = bench_time();
+		gen_hash((uchar *)coinbase, hash, cblen);
+		full += bench_time() - start;
+
+		start = bench_time();
+		coinbase_hash(client_midstate(client, wb), coinbase, cblen, hash);
+		resumed += bench_time() - start;
+	}
+	skipped = (double)sdata.midstate_blocks;
+
+	printf("%d shares, coinbases of %.1f blocks on average\n", shares, full_blocks / shares);
+	printf("full     %8.1f ns per share\n", full * 1e9 / shares);
+	printf("midstate %8.1f ns per share, %.2f blocks skipped per share\n",
+	       resumed * 1e9 / shares, skipped / shares);
+
+	for (i = 0; i < WORKBASES; i++) {
+		free(wbs[i].coinb1bin);
+		free(wbs[i].coinb2bin);
+	}
+
+	return bad != 0;
+}
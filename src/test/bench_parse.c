@@ -0,0 +1,167 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Compares the connector's mining.submit scanner with parsing the same lines
+ * with jansson and walking the params as the stratifier does, both from malloc
+ * and from a json arena. Before timing anything it checks the scanner
+ * extracts the same fields jansson does and leaves anything it should not
+ * handle to jansson. */
+
+#include "../connector.c"
+
+#include <time.h>
+
+static const char *submit_lines[] = {
+	"{\"params\": [\"worker.1\", \"5a1\", \"0000000a\", \"5f5e1000\", \"1d2a3b4c\"], \"id\": 42, \"method\": \"mining.submit\"}\n",
+	"{\"id\":\"abc\",\"method\":\"mining.submit\",\"params\":[\"w\",\"5a1\",\"0000000000000001\",\"5f5e1000\",\"1d2a3b4c\",\"1fffe000\"]}\n",
+	"{\"id\": null, \"method\": \"mining.submit\", \"jsonrpc\": \"2.0\", \"params\": [\"w\", \"1\", \"00\", \"5f5e1000\", \"00000000\"]}\n",
+};
+
+/* Lines the scanner must leave to jansson */
+static const char *fallback_lines[] = {
+	"{\"id\": 1.5, \"method\": \"mining.submit\", \"params\": [\"w\", \"1\", \"00\", \"5f5e1000\", \"00000000\"]}\n",
+	"{\"id\": 1, \"method\": \"mining.submit\", \"params\": [\"w\\u0041\", \"1\", \"00\", \"5f5e1000\", \"00000000\"]}\n",
+	"{\"id\": 1, \"method\": \"mining.submit\", \"params\": [\"w\", \"1\", \"00\", \"5f5e1000\"]}\n",
+	"{\"id\": 1, \"method\": \"mining.submit\", \"params\": [\"w\", \"1\", \"00\", \"5f5e1000\", \"00000000\"], \"x\": [1]}\n",
+	"{\"id\": 1, \"method\": \"mining.subscribe\", \"params\": [\"mining.submit\"]}\n",
+	"{\"id\": 1, \"method\": \"mining.submit\", \"params\": [\"w\", \"1\", \"00\", \"5f5e1000\", \"00000000\"]\n",
+};
+
+static double bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool field_matches(const char *field, json_t *params, const size_t index)
+{
+	json_t *val = json_array_get(params, index);
+
+	if (!val)
+		return field == NULL;
+	return field && !strcmp(field, json_string_value(val));
+}
+
+static bool check_line(ckpool_t *ckp, const char *line)
+{
+	submit_t *submit = scan_submit(ckp, line, strlen(line));
+	json_t *val, *params, *id_val;
+	bool ret = false;
+
+	val = json_loads(line, JSON_DISABLE_EOF_CHECK, NULL);
+	if (!submit || !val)
+		goto out;
+	params = json_object_get(val, "params");
+	id_val = json_object_get(val, "id");
+	if (json_is_string(id_val))
+		ret = submit->id && !strcmp(submit->id, json_string_value(id_val));
+	else if (json_is_integer(id_val))
+		ret = !submit->id && !submit->id_null && submit->id_int == json_integer_value(id_val);
+	else
+		ret = submit->id_null;
+	ret = ret && field_matches(submit->workername, params, 0) &&
+	      field_matches(submit->job_id, params, 1) && field_matches(submit->nonce2, params, 2) &&
+	      field_matches(submit->ntime, params, 3) && field_matches(submit->nonce, params, 4) &&
+	      field_matches(submit->version_mask, params, 5);
+out:
+	if (submit)
+		slab_free(ckp->submit_slab, submit);
+	json_decref(val);
+	return ret;
+}
+
+/* What parse_client_msg and then parse_submit did with every submit line */
+static void json_submit(const char *line, const bool arena)
+{
+	const char *fields[6];
+	json_t *val, *params;
+	size_t i;
+
+	if (arena)
+		json_arena_begin();
+	val = json_loads(line, JSON_DISABLE_EOF_CHECK, NULL);
+	json_object_set_new_nocheck(val, "client_id", json_integer(1));
+	json_object_set_new_nocheck(val, "address", json_string("127.0.0.1"));
+	json_object_set_new_nocheck(val, "server", json_integer(0));
+	if (arena)
+		json_arena_end();
+	params = json_object_get(val, "params");
+	for (i = 0; i < json_array_size(params) && i < 6; i++)
+		fields[i] = json_string_value(json_array_get(params, i));
+	if (unlikely(!fields[0]))
+		quit(1, "Failed to parse %s", line);
+	json_decref(val);
+}
+
+int main(int argc, char **argv)
+{
+	int i, iterations = 200000, lines = sizeof(submit_lines) / sizeof(submit_lines[0]);
+	double start, scanned, parsed, arena;
+	ckpool_t ckp;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	json_arena_init();
+	json_set_alloc_funcs(json_ckalloc, json_ckfree);
+	memset(&ckp, 0, sizeof(ckp));
+	ckp.submit_slab = create_slab("submit", sizeof(submit_t));
+
+	for (i = 0; i < lines; i++) {
+		if (!check_line(&ckp, submit_lines[i])) {
+			fprintf(stderr, "Scanner disagrees with jansson on %s", submit_lines[i]);
+			return 1;
+		}
+	}
+	for (i = 0; i < (int)(sizeof(fallback_lines) / sizeof(fallback_lines[0])); i++) {
+		const char *line = fallback_lines[i];
+		submit_t *submit = scan_submit(&ckp, line, strlen(line));
+
+		if (submit) {
+			fprintf(stderr, "Scanner did not fall back on %s", line);
+			return 1;
+		}
+	}
+
+	start = bench_time();
+	for (i = 0; i < iterations; i++) {
+		const char *line = submit_lines[i % lines];
+		submit_t *submit = scan_submit(&ckp, line, strlen(line));
+
+		if (unlikely(!submit))
+			quit(1, "Failed to scan %s", line);
+		slab_free(ckp.submit_slab, submit);
+	}
+	scanned = bench_time() - start;
+
+	start = bench_time();
+	for (i = 0; i < iterations; i++)
+		json_submit(submit_lines[i % lines], false);
+	parsed = bench_time() - start;
+
+	start = bench_time();
+	for (i = 0; i < iterations; i++)
+		json_submit(submit_lines[i % lines], true);
+	arena = bench_time() - start;
+
+	printf("%d submits, ns per submit\n", iterations);
+	printf("scanned %10.0f\n", scanned * 1e9 / iterations);
+	printf("json    %10.0f\n", parsed * 1e9 / iterations);
+	printf("arena   %10.0f\n", arena * 1e9 / iterations);
+	return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Checks multi-buffer sha256 against the single buffer code on known answers
+ * and random messages of every length and batch size the share hashing uses,
+ * then times the stages hash_submits batches: coinbases resumed from their
+ * midstates, merkle branch steps with gen_hash_multi and block headers with
+ * sha256_multi and gen_hash_multi, each against the scalar call per share. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "sha2.h"
+
+/* As the most shares sshareq hands hash_submits at once */
+#define BATCH 64
+#define MAX_LEN 512
+
+static const char *abc_digest = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+
+static const char *genesis_header =
+	"0100000000000000000000000000000000000000000000000000000000000000"
+	"000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa"
+	"4b1e5e4a29ab5f49ffff001d1dac2b7c";
+static const char *genesis_hash = "6fe28c0ab6f1b372c1a6a246ae63f74f931e8365e15a089c68d6190000000000";
+
+static double bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void random_bytes(uchar *buf, const int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = random();
+}
+
+static bool digest_is(const uchar *digest, const char *hex)
+{
+	char s[65];
+
+	__bin2hex(s, digest, 32);
+	return !strcmp(s, hex);
+}
+
+/* Every lane of a batch of identical known messages must give the known
+ * digest, including the lone message fallback */
+static int check_known(void)
+{
+	uchar msg[BATCH][80], digest[BATCH][32], *data[BATCH], *hash[BATCH];
+	int count, i, bad = 0;
+
+	for (i = 0; i < BATCH; i++) {
+		data[i] = msg[i];
+		hash[i] = digest[i];
+	}
+	for (count = 1; count <= SHA256_LANES + 1; count++) {
+		for (i = 0; i < count; i++)
+			memcpy(msg[i], "abc", 3);
+		memset(digest, 0, sizeof(digest));
+		sha256_multi((const uchar **)data, 3, hash, count);
+		for (i = 0; i < count; i++)
+			bad += !digest_is(digest[i], abc_digest);
+
+		for (i = 0; i < count; i++)
+			hex2bin(msg[i], genesis_header, 80);
+		memset(digest, 0, sizeof(digest));
+		gen_hash_multi(data, hash, 80, count);
+		for (i = 0; i < count; i++)
+			bad += !digest_is(digest[i], genesis_hash);
+	}
+	return bad;
+}
+
+/* Random messages of length len in batches of every size up to BATCH,
+ * hashed whole, double hashed and resumed from a midstate of a random
+ * prefix, must all match the single buffer code */
+static int check_random(const int len)
+{
+	uchar msg[BATCH][MAX_LEN], digest[BATCH][32], expect[32], *data[BATCH], *hash[BATCH];
+	const sha256_ctx *midstates[BATCH];
+	sha256_ctx ctx[BATCH];
+	int count, i, ofs, bad = 0;
+
+	for (i = 0; i < BATCH; i++)
+		hash[i] = digest[i];
+	for (count = 1; count <= BATCH; count++) {
+		random_bytes(msg[0], sizeof(msg));
+		for (i = 0; i < count; i++)
+			data[i] = msg[i];
+		sha256_multi((const uchar **)data, len, hash, count);
+		for (i = 0; i < count; i++) {
+			sha256(msg[i], len, expect);
+			bad += !!memcmp(expect, digest[i], 32);
+		}
+
+		gen_hash_multi(data, hash, len, count);
+		for (i = 0; i < count; i++) {
+			gen_hash(msg[i], expect, len);
+			bad += !!memcmp(expect, digest[i], 32);
+		}
+
+		ofs = len ? random() % (len + 1) : 0;
+		for (i = 0; i < count; i++) {
+			sha256_midstate(&ctx[i], msg[i], ofs);
+			midstates[i] = &ctx[i];
+			data[i] = msg[i] + ctx[i].tot_len;
+		}
+		sha256_multi_resume(midstates, (const uchar **)data, len - ctx[0].tot_len, hash, count);
+		for (i = 0; i < count; i++) {
+			sha256(msg[i], len, expect);
+			bad += !!memcmp(expect, digest[i], 32);
+		}
+	}
+	return bad;
+}
+
+/* Time hashing reps batches of len byte messages one at a time and all
+ * together, returning the ratio of the two */
+static double bench(const char *what, const int len, const bool resume, const bool dbl,
+		    const int reps)
+{
+	uchar msg[BATCH][MAX_LEN], digest[BATCH][32], *data[BATCH], *hash[BATCH];
+	const sha256_ctx *midstates[BATCH];
+	double start, scalar, multi;
+	sha256_ctx ctx[BATCH];
+	int i, r, ofs = 0;
+
+	random_bytes(msg[0], sizeof(msg));
+	for (i = 0; i < BATCH; i++) {
+		if (resume) {
+			sha256_midstate(&ctx[i], msg[i], len);
+			midstates[i] = &ctx[i];
+			ofs = ctx[i].tot_len;
+		}
+		data[i] = msg[i] + ofs;
+		hash[i] = digest[i];
+	}
+
+	start = bench_time();
+	for (r = 0; r < reps; r++) {
+		for (i = 0; i < BATCH; i++) {
+			if (resume)
+				sha256_resume(midstates[i], data[i], len - ofs, hash[i]);
+			else if (dbl)
+				gen_hash(data[i], hash[i], len);
+			else
+				sha256(data[i], len, hash[i]);
+		}
+	}
+	scalar = bench_time() - start;
+
+	start = bench_time();
+	for (r = 0; r < reps; r++) {
+		if (resume)
+			sha256_multi_resume(midstates, (const uchar **)data, len - ofs, hash, BATCH);
+		else if (dbl)
+			gen_hash_multi(data, hash, len, BATCH);
+		else
+			sha256_multi((const uchar **)data, len, hash, BATCH);
+	}
+	multi = bench_time() - start;
+
+	printf("%-22s %4d %10.1f %10.1f %8.2fx\n", what, len, scalar * 1e9 / reps / BATCH,
+	       multi * 1e9 / reps / BATCH, scalar / multi);
+	return scalar / multi;
+}
+
+int main(int argc, char **argv)
+{
+	int lens[] = { 0, 1, 32, 55, 56, 63, 64, 80, 119, 120, 128, 250, MAX_LEN };
+	int reps = 2000, bad, i, c;
+
+	while ((c = getopt(argc, argv, "r:")) != -1) {
+		switch (c) {
+			case 'r':
+				reps = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-r benchmark reps]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (reps < 1) {
+		fprintf(stderr, "Invalid arguments\n");
+		exit(1);
+	}
+
+	srandom(1);
+	bad = check_known();
+	for (i = 0; i < (int)(sizeof(lens) / sizeof(lens[0])); i++)
+		bad += check_random(lens[i]);
+	printf("%d lanes, %d digests mismatched the single buffer code\n", SHA256_LANES, bad);
+
+	printf("ns per share in batches of %d\n", BATCH);
+	printf("%-22s %4s %10s %10s %9s\n", "stage", "len", "scalar", "multi", "speedup");
+	bench("coinbase from midstate", 250, true, false, reps);
+	bench("coinbase hash1", 32, false, false, reps);
+	bench("merkle branch step", 64, false, true, reps);
+	bench("header sha256", 80, false, false, reps);
+	bench("header gen_hash", 80, false, true, reps);
+
+	return bad != 0;
+}
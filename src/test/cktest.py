@@ -0,0 +1,158 @@
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 3 of the License, or (at your option)
+# any later version.  See COPYING for more details.
+
+# Helpers for tests that run a real ckpool against mock servers: picking free
+# ports, starting and stopping ckpool with a generated config in a scratch
+# directory, and a stratum miner that records the work it is sent.
+
+import json
+import os
+import queue
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+CKPOOL = os.environ.get("CKPOOL", "./ckpool")
+BTCADDRESS = "14BMjogz69qe8hk9thyzbmR5pg34mVKB1e"
+
+# Exit code automake's test harness treats as a skipped test
+SKIP = 77
+
+
+def free_port():
+	sock = socket.socket()
+	sock.bind(("127.0.0.1", 0))
+	port = sock.getsockname()[1]
+	sock.close()
+	return port
+
+
+def median(values):
+	values = sorted(values)
+	return values[len(values) // 2]
+
+
+class Ckpool:
+	def __init__(self, conf, args=(), name="cktest"):
+		self.dir = tempfile.mkdtemp(prefix="cktest")
+		self.port = free_port()
+		self.conf = {"btcaddress": BTCADDRESS, "serverurl": ["127.0.0.1:%d" % self.port],
+			     "logdir": os.path.join(self.dir, "logs"), "startdiff": 1, "mindiff": 1}
+		self.conf.update(conf)
+		self.args = list(args)
+		self.name = name
+		self.proc = None
+
+	def start(self, timeout=15):
+		if not os.access(CKPOOL, os.X_OK):
+			print("No ckpool binary at %s" % CKPOOL)
+			sys.exit(SKIP)
+		conffile = os.path.join(self.dir, "ckpool.conf")
+		with open(conffile, "w") as f:
+			json.dump(self.conf, f)
+		args = [CKPOOL, "-c", conffile, "-s", os.path.join(self.dir, "sock"), "-n", self.name,
+			"-l", "6"] + self.args
+		# Builds with ckdb need to be told to run without it
+		if "--standalone" in subprocess.run([CKPOOL, "-h"], capture_output=True, text=True).stdout:
+			args.append("-A")
+		self.log = open(os.path.join(self.dir, "ckpool.out"), "w")
+		self.proc = subprocess.Popen(args, stdout=self.log, stderr=subprocess.STDOUT)
+		end = time.time() + timeout
+		while time.time() < end:
+			if self.proc.poll() is not None:
+				self.fail("ckpool exited with %d" % self.proc.returncode)
+			try:
+				socket.create_connection(("127.0.0.1", self.port), 0.5).close()
+				return self
+			except OSError:
+				time.sleep(0.1)
+		self.fail("ckpool did not start listening")
+
+	def stop(self):
+		if self.proc and self.proc.poll() is None:
+			self.proc.send_signal(signal.SIGTERM)
+			try:
+				self.proc.wait(5)
+			except subprocess.TimeoutExpired:
+				self.proc.kill()
+				self.proc.wait()
+		shutil.rmtree(self.dir, ignore_errors=True)
+
+	def message(self, proc, msg, reply=True):
+		"""Send msg to one of ckpool's unix sockets, eg generator, and return
+		its reply if one is expected"""
+		sock = socket.socket(socket.AF_UNIX)
+		sock.settimeout(10)
+		sock.connect(os.path.join(self.dir, "sock", proc))
+		sock.sendall(struct.pack("<I", len(msg)) + msg.encode())
+		ret = None
+		if reply:
+			length = struct.unpack("<I", sock.recv(4, socket.MSG_WAITALL))[0]
+			ret = sock.recv(length, socket.MSG_WAITALL).decode()
+		sock.close()
+		return ret
+
+	def output(self):
+		with open(os.path.join(self.dir, "ckpool.out")) as f:
+			return f.read()
+
+	def fail(self, why):
+		sys.stdout.write(self.output())
+		self.stop()
+		raise SystemExit("FAIL: " + why)
+
+
+class Miner:
+	def __init__(self, port):
+		self.sock = socket.create_connection(("127.0.0.1", port))
+		self.file = self.sock.makefile("rb")
+		self.notifies = queue.Queue()
+		self.replies = queue.Queue()
+		self.msgid = 0
+		threading.Thread(target=self.reader, daemon=True).start()
+
+	def reader(self):
+		for line in self.file:
+			msg = json.loads(line)
+			if msg.get("method") == "mining.notify":
+				self.notifies.put((time.time(), msg["params"]))
+			elif msg.get("method") is None:
+				self.replies.put(msg)
+
+	def request(self, method, params, timeout=10):
+		self.msgid += 1
+		line = json.dumps({"id": self.msgid, "method": method, "params": params}) + "\n"
+		self.sock.sendall(line.encode())
+		while True:
+			reply = self.replies.get(timeout=timeout)
+			if reply.get("id") == self.msgid:
+				return reply
+
+	def authorise(self, worker=BTCADDRESS):
+		reply = self.request("mining.subscribe", [])
+		self.enonce1, self.nonce2len = reply["result"][1], reply["result"][2]
+		return self.request("mining.authorize", [worker, "x"])
+
+	def drain(self):
+		while not self.notifies.empty():
+			self.notifies.get()
+
+	def clean_notify(self, timeout=10):
+		"""Wait for the next notify that tells miners to drop old work"""
+		end = time.time() + timeout
+		while True:
+			when, params = self.notifies.get(timeout=max(end - time.time(), 0.01))
+			if params[8]:
+				return when, params
+
+	def close(self):
+		self.sock.close()
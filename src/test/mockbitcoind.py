@@ -0,0 +1,245 @@
+#!/usr/bin/env python3
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 3 of the License, or (at your option)
+# any later version.  See COPYING for more details.
+
+# A mock bitcoind JSON-RPC server with just enough of the RPC interface for
+# ckpool to generate work and submit blocks. Tests control it directly, eg
+# with newblock() to move the chain on, and it records the calls it saw and
+# checks every block submitted against the templates it handed out.
+#
+# Run standalone with: mockbitcoind.py PORT
+
+import hashlib
+import json
+import os
+import socket
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+def dsha(data):
+	return hashlib.sha256(hashlib.sha256(data).digest()).digest()
+
+
+def make_txns(count):
+	txns = []
+	for i in range(count):
+		data = os.urandom(100 + i % 300)
+		txid = dsha(data)[::-1].hex()
+		txns.append({"data": data.hex(), "txid": txid, "hash": txid, "depends": [],
+			     "fee": 1000, "sigops": 4, "weight": 4 * len(data)})
+	return txns
+
+
+def witness_commitment(txns):
+	level = [bytes(32)] + [bytes.fromhex(t["hash"])[::-1] for t in txns]
+	while len(level) > 1:
+		if len(level) % 2:
+			level.append(level[-1])
+		level = [dsha(level[i] + level[i + 1]) for i in range(0, len(level), 2)]
+	return "6a24aa21a9ed" + dsha(level[0] + bytes(32)).hex()
+
+
+def coinbase_value(coinbase):
+	"""Total value of the outputs of a coinbase transaction, given its
+	1 byte script and output lengths as ckpool generates"""
+	pos = 42 + coinbase[41] + 4
+	outputs = coinbase[pos]
+	pos += 1
+	value = 0
+	for i in range(outputs):
+		value += int.from_bytes(coinbase[pos:pos + 8], "little")
+		pos += 8 + 1 + coinbase[pos + 8]
+	return value
+
+
+class MockBitcoind:
+	def __init__(self, port, txns=20, chain="main", bits="1d00ffff", halving=210000, height=100):
+		self.port = port
+		self.ntxns = txns
+		self.chain = chain
+		self.bits = bits
+		self.halving = halving
+		# Seconds to take over templates that are not long polls
+		self.delay = 0
+		# Calls of each method to fail with an error, -1 for all of them
+		self.failing = {}
+		self.lock = threading.Condition()
+		self.calls = {}
+		self.blocks = {"good": 0, "bad": 0}
+		self.submitted = []
+		self.height = height
+		self.prevhash = os.urandom(32).hex()
+		self.heights = {self.prevhash: self.height}
+		self.txns = make_txns(txns)
+		self.recent = [self.txns]
+		self.server = None
+
+	def start(self):
+		mock = self
+
+		class Handler(BaseHTTPRequestHandler):
+			protocol_version = "HTTP/1.1"
+
+			def log_message(self, *args):
+				pass
+
+			# Headers and body are written separately so without this
+			# the body waits on the client's delayed ack
+			def setup(self):
+				BaseHTTPRequestHandler.setup(self)
+				self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+			def do_POST(self):
+				length = int(self.headers.get("Content-Length", 0))
+				req = json.loads(self.rfile.read(length))
+				result, error = None, None
+				if mock.fail(req.get("method")):
+					error = {"code": -1, "message": "mock failure"}
+				else:
+					result = mock.rpc(req.get("method"), req.get("params", []))
+				body = json.dumps({"result": result, "error": error, "id": req.get("id")}).encode() + b"\n"
+				self.send_response(200)
+				self.send_header("Content-Type", "application/json")
+				self.send_header("Content-Length", str(len(body)))
+				self.end_headers()
+				self.wfile.write(body)
+
+		ThreadingHTTPServer.daemon_threads = True
+		ThreadingHTTPServer.allow_reuse_address = True
+		self.server = ThreadingHTTPServer(("127.0.0.1", self.port), Handler)
+		threading.Thread(target=self.server.serve_forever, daemon=True).start()
+		return self
+
+	def stop(self):
+		if self.server:
+			self.server.shutdown()
+			self.server.server_close()
+
+	def longpollid(self):
+		return self.prevhash + str(self.height)
+
+	def newblock(self, txns=None):
+		"""Move the chain on a block, returning the time it happened"""
+		txns = make_txns(self.ntxns if txns is None else txns)
+		with self.lock:
+			self.height += 1
+			self.prevhash = os.urandom(32).hex()
+			self.heights[self.prevhash] = self.height
+			self.settxns(txns)
+			self.lock.notify_all()
+			return time.time()
+
+	def settxns(self, txns):
+		self.txns = txns
+		self.recent = (self.recent + [txns])[-5:]
+
+	def getstate(self):
+		with self.lock:
+			return {"height": self.height, "prevhash": self.prevhash, "txns": self.txns}
+
+	def setstate(self, state):
+		"""Adopt the chain tip of another mock, returning the time it happened"""
+		with self.lock:
+			self.height = state["height"]
+			self.prevhash = state["prevhash"]
+			self.heights[self.prevhash] = self.height
+			self.settxns(state["txns"])
+			self.lock.notify_all()
+			return time.time()
+
+	def getblocktemplate(self, params):
+		lpid = params[0].get("longpollid") if params else None
+		with self.lock:
+			if lpid:
+				self.lock.wait_for(lambda: lpid != self.longpollid(), timeout=60)
+			elif self.delay:
+				self.lock.wait(self.delay)
+			return {"version": 0x20000000, "rules": ["csv", "!segwit"],
+				"previousblockhash": self.prevhash, "transactions": self.txns,
+				"default_witness_commitment": witness_commitment(self.txns),
+				"coinbaseaux": {"flags": ""}, "coinbasevalue": self.subsidy(self.height + 1),
+				"target": "00000000ffff0000000000000000000000000000000000000000000000000000",
+				"mintime": 1, "mutable": ["time"], "noncerange": "00000000ffffffff",
+				"sigoplimit": 80000, "sizelimit": 4000000, "weightlimit": 4000000,
+				"curtime": int(time.time()), "bits": self.bits, "height": self.height + 1,
+				"longpollid": self.longpollid()}
+
+	def getblockheader(self, blockhash):
+		with self.lock:
+			height = self.heights.get(blockhash)
+			if height is None:
+				return None
+			return {"hash": blockhash, "height": height, "bits": self.bits,
+				"time": int(time.time()), "previousblockhash": "00" * 32}
+
+	def subsidy(self, height):
+		return 5000000000 >> (height // self.halving)
+
+	def submitblock(self, block):
+		"""Check a block builds on a known block at the height in its coinbase
+		and has the transactions of a recent template, or if it has none,
+		that its coinbase pays no more than the subsidy"""
+		header = bytes.fromhex(block[:160])
+		prevhash = header[4:36][::-1].hex()
+		txns = bytes.fromhex(block[160:162])[0]
+		coinbase = bytes.fromhex(block[162:162 + 400])
+		heightlen = coinbase[42]
+		height = int.from_bytes(coinbase[43:43 + heightlen], "little")
+		with self.lock:
+			good = self.heights.get(prevhash) == height - 1
+			if txns == 1:
+				coinbase = bytes.fromhex(block[162:])
+				good = (good and dsha(coinbase) == header[36:68] and
+					coinbase_value(coinbase) <= self.subsidy(height))
+			else:
+				good = good and any(block.endswith("".join(t["data"] for t in recent))
+						    for recent in self.recent)
+			self.blocks["good" if good else "bad"] += 1
+			self.submitted.append((time.time(), block[:160]))
+		return None if good else "rejected"
+
+	def fail(self, method):
+		with self.lock:
+			fails = self.failing.get(method, 0)
+			if fails:
+				self.failing[method] = fails - 1 if fails > 0 else fails
+				self.calls["failed " + method] = self.calls.get("failed " + method, 0) + 1
+			return fails != 0
+
+	def rpc(self, method, params):
+		# Long polls are counted apart from plain template requests
+		if method == "getblocktemplate" and params and "longpoll" in params[0].get("capabilities", []):
+			method = "getblocktemplate longpoll"
+		with self.lock:
+			self.calls[method] = self.calls.get(method, 0) + 1
+		if method == "getblocktemplate longpoll":
+			return self.getblocktemplate(params)
+		if method == "getblocktemplate":
+			return self.getblocktemplate(params)
+		if method == "validateaddress":
+			return {"isvalid": True, "isscript": False, "iswitness": False}
+		if method == "getbestblockhash" or method == "getblockhash":
+			return self.prevhash
+		if method == "getblockcount":
+			return self.height
+		if method == "getblockheader":
+			return self.getblockheader(params[0])
+		if method == "getblockchaininfo":
+			return {"chain": self.chain, "blocks": self.height, "bestblockhash": self.prevhash}
+		if method == "submitblock":
+			return self.submitblock(params[0])
+		if method == "preciousblock":
+			return None
+		return None
+
+
+if __name__ == "__main__":
+	MockBitcoind(int(sys.argv[1])).start()
+	while True:
+		time.sleep(3600)
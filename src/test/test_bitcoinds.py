@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 3 of the License, or (at your option)
+# any later version.  See COPYING for more details.
+
+# Races two mock bitcoinds on one chain where every new block reaches one of
+# them LAG seconds before the other. Miners must get clean work on each block
+# well within LAG of it reaching either one. Then checks solved blocks go to
+# both of them, that a server is only marked dead after repeated
+# getbestblockhash failures, and that blocks still go to the other one.
+
+import json
+import os
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from cktest import Ckpool, Miner, free_port, median
+from mockbitcoind import MockBitcoind
+
+BLOCKS = 6
+LAG = 0.5
+# As GETBEST_FAILS in generator.c
+GETBEST_FAILS = 3
+
+
+def btcds(mocks, longpoll):
+	return {"btcd": [{"url": "127.0.0.1:%d" % mock.port, "auth": "user", "pass": "pass",
+			  "notify": False} for mock in mocks],
+		"longpoll": longpoll, "blockpoll": 100, "emptywork": False}
+
+
+def race():
+	mocks = [MockBitcoind(free_port()).start() for i in range(2)]
+	mocks[1].setstate(mocks[0].getstate())
+	pool = Ckpool(btcds(mocks, True)).start()
+	try:
+		miner = Miner(pool.port)
+		miner.authorise()
+		miner.clean_notify()
+		time.sleep(0.5)
+		latencies = []
+		for i in range(BLOCKS):
+			first, second = mocks[i % 2], mocks[1 - i % 2]
+			miner.drain()
+			found = first.newblock()
+			state = first.getstate()
+			time.sleep(LAG)
+			second.setstate(state)
+			when, params = miner.clean_notify(0)
+			latencies.append((when - found) * 1000)
+			time.sleep(0.3)
+		miner.close()
+	finally:
+		pool.stop()
+		for mock in mocks:
+			mock.stop()
+	print("race     median %6.1fms max %6.1fms with %dms lag" %
+	      (median(latencies), max(latencies), LAG * 1000))
+	if max(latencies) > LAG * 1000 / 2:
+		raise SystemExit("FAIL: new blocks not raced across bitcoinds")
+
+
+def submit(pool, mocks, expected):
+	"""Hand the generator a block to submit and return which mocks got it"""
+	before = [len(mock.submitted) for mock in mocks]
+	block = "00" * 80 + "01" + "00" * 100
+	pool.message("generator", "submitblock:%s %s" % ("00" * 32, block), False)
+	end = time.time() + 5
+	while time.time() < end:
+		got = [len(mock.submitted) > before[i] for i, mock in enumerate(mocks)]
+		if got == expected:
+			break
+		time.sleep(0.05)
+	return got
+
+
+def alive(pool):
+	stats = json.loads(pool.message("generator", "stats"))
+	return [server["alive"] for server in stats["servers"]]
+
+
+def failover():
+	mocks = [MockBitcoind(free_port()).start() for i in range(2)]
+	mocks[1].setstate(mocks[0].getstate())
+	pool = Ckpool(btcds(mocks, False)).start()
+	try:
+		time.sleep(0.5)
+		got = submit(pool, mocks, [True, True])
+		if got != [True, True]:
+			pool.fail("block submitted to %s of both bitcoinds" % got)
+
+		# Fewer failures than it takes to be marked dead
+		calls = mocks[0].calls["getbestblockhash"]
+		mocks[0].failing["getbestblockhash"] = GETBEST_FAILS - 1
+		end = time.time() + 5
+		while mocks[0].calls["getbestblockhash"] <= calls + GETBEST_FAILS and time.time() < end:
+			if not alive(pool)[0]:
+				pool.fail("bitcoind marked dead after %d getbestblockhash failures" %
+					  (GETBEST_FAILS - 1))
+			time.sleep(0.02)
+		got = submit(pool, mocks, [True, True])
+		if got != [True, True]:
+			pool.fail("block submitted to %s after transient failures" % got)
+
+		# The second one fails for good
+		mocks[1].failing["getbestblockhash"] = -1
+		end = time.time() + 5
+		while alive(pool)[1] and time.time() < end:
+			time.sleep(0.02)
+		if alive(pool)[1]:
+			pool.fail("failing bitcoind not marked dead")
+		got = submit(pool, mocks, [True, False])
+		if not got[0]:
+			pool.fail("block not submitted to the live bitcoind")
+		calls = mocks[1].calls.get("failed getbestblockhash", 0)
+	finally:
+		pool.stop()
+		for mock in mocks:
+			mock.stop()
+	print("failover blocks submitted to both, dead after %d getbestblockhash failures" % calls)
+
+
+def main():
+	race()
+	failover()
+
+
+if __name__ == "__main__":
+	main()
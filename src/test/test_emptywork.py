@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 3 of the License, or (at your option)
+# any later version.  See COPYING for more details.
+
+# Checks empty work is only sent on a block change on networks where the next
+# block's bits are known, and that empty work on the first block after a
+# halving, at 150 blocks on regtest, pays no more than the new subsidy.
+
+import os
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from cktest import Ckpool, Miner, free_port
+from mockbitcoind import MockBitcoind, coinbase_value
+
+
+def empty_sent(chain, bits, halving):
+	# The first template is for the last block before a halving
+	mock = MockBitcoind(free_port(), chain=chain, bits=bits, halving=halving,
+			    height=halving - 2).start()
+	# Poll for blocks since a long poll hands over the full template at once
+	pool = Ckpool({"btcd": [{"url": "127.0.0.1:%d" % mock.port, "auth": "user", "pass": "pass",
+				 "notify": False}], "emptywork": True, "longpoll": False}).start()
+	try:
+		miner = Miner(pool.port)
+		miner.authorise()
+		miner.clean_notify()
+		# Hold the full template back so any empty work arrives first
+		mock.delay = 1
+		miner.drain()
+		mock.newblock()
+		when, params = miner.clean_notify()
+		empty = not params[4]
+		if empty:
+			coinbase = bytes.fromhex(params[2] + miner.enonce1 + "00" * miner.nonce2len + params[3])
+			height = int.from_bytes(coinbase[43:43 + coinbase[42]], "little")
+			if coinbase_value(coinbase) > mock.subsidy(height):
+				pool.fail("empty work on %s pays more than the subsidy at height %d" %
+					  (chain, height))
+		miner.close()
+	finally:
+		pool.stop()
+		mock.stop()
+	print("%-8s empty work %s" % (chain, "sent" if empty else "not sent"))
+	return empty
+
+
+def main():
+	if not empty_sent("main", "1d00ffff", 210000):
+		raise SystemExit("FAIL: no empty work on main")
+	if not empty_sent("regtest", "207fffff", 150):
+		raise SystemExit("FAIL: no empty work on regtest")
+	if empty_sent("test", "1d00ffff", 210000):
+		raise SystemExit("FAIL: empty work on a testnet with minimum difficulty blocks")
+
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 3 of the License, or (at your option)
+# any later version.  See COPYING for more details.
+
+# Measures how long after a new block appears on a mock bitcoind miners get
+# clean work for it, with getblocktemplate long polls and with them disabled
+# so only blockpoll polling finds the block. Long polls must find every block
+# within a quarter of the poll interval without calling getbestblockhash, and
+# their templates must be used without requesting them again.
+
+import os
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from cktest import Ckpool, Miner, free_port, median
+from mockbitcoind import MockBitcoind
+
+BLOCKS = 8
+BLOCKPOLL = 1000
+
+
+def measure(longpoll):
+	mock = MockBitcoind(free_port()).start()
+	pool = Ckpool({"btcd": [{"url": "127.0.0.1:%d" % mock.port, "auth": "user", "pass": "pass",
+				 "notify": False}],
+		       "blockpoll": BLOCKPOLL, "longpoll": longpoll, "emptywork": False}).start()
+	try:
+		miner = Miner(pool.port)
+		miner.authorise()
+		miner.clean_notify()
+		time.sleep(0.5)
+		polls = mock.calls.get("getbestblockhash", 0)
+		templates = mock.calls.get("getblocktemplate", 0)
+		latencies = []
+		for i in range(BLOCKS):
+			miner.drain()
+			found = mock.newblock()
+			when, params = miner.clean_notify()
+			latencies.append((when - found) * 1000)
+			# Land blocks at different points of the poll interval
+			time.sleep(0.3 + 0.17 * i)
+		polls = mock.calls.get("getbestblockhash", 0) - polls
+		templates = mock.calls.get("getblocktemplate", 0) - templates
+		miner.close()
+	finally:
+		pool.stop()
+		mock.stop()
+	print("%-9s median %6.1fms max %6.1fms getbestblockhash calls %d getblocktemplate calls %d" %
+	      ("longpoll" if longpoll else "blockpoll", median(latencies), max(latencies), polls,
+	       templates))
+	return latencies, polls, templates
+
+
+def main():
+	latencies, polls, templates = measure(True)
+	measure(False)
+	if max(latencies) > BLOCKPOLL / 4:
+		raise SystemExit("FAIL: long poll block detection slower than a quarter of blockpoll")
+	if polls:
+		raise SystemExit("FAIL: getbestblockhash polled while long polls work")
+	if templates:
+		raise SystemExit("FAIL: long poll templates requested again on new blocks")
+
+
+if __name__ == "__main__":
+	main()